@@ -0,0 +1,48 @@
+#ifndef __BENCH
+#define __BENCH
+
+// Helpers shared by the benchmarks. Results go to stdout as one JSON object per line
+//  so runs can be collected and compared with e.g. jq. Pass --quick for a short smoke run
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BENCH_LINE(NAME, FMT, ...) printf("{\"bench\":\"%s\"," FMT "}\n", NAME, __VA_ARGS__)
+
+static inline uint64_t benchNowNs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Cycle counter where the host has one, nanoseconds otherwise
+static inline uint64_t benchCycles(){
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return benchNowNs();
+#endif
+}
+
+// full, or a small fraction of it with --quick
+static inline uint32_t benchIterations(int argc, char** argv, uint32_t full){
+    int i;
+    for(i = 1; i < argc; i++){
+        if(strcmp(argv[i], "--quick") == 0){
+            return full / 100 ? full / 100 : 1;
+        }
+    }
+    return full;
+}
+
+// Stops the compiler from optimising away work whose result isn't used
+static inline void benchKeep(const void* p){
+    __asm__ volatile("" : : "g"(p) : "memory");
+}
+
+#endif
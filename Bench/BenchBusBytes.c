@@ -0,0 +1,69 @@
+// SPI bytes and bus time per sample for length-aware FIFO reads, against the fixed size reads they replaced
+#include "IMU.h"
+#include "Bmi088Sim.h"
+#include "Bench.h"
+
+#define ACCEL_FULL_READ 1024
+#define GYRO_FULL_READ 600
+
+static SPI_HandleTypeDef hspi;
+static uint8_t tx[ACCEL_FULL_READ + 2];
+static uint8_t rx[ACCEL_FULL_READ + 2];
+static Vector3Raw raw[ACCEL_FIFO_MAX_FRAMES];
+
+// What the old ACCEL_READ_FIFO/GYRO_READ_FIFO did. Returns the samples it got
+static uint16_t fullRead(uint8_t accel){
+    uint16_t samples = accel ? simAccelFIFOBytes(0) / 7 : simGyroFIFOFrames(0);
+    GPIO_TypeDef* port = accel ? CSA_GPIO_Port : CSG_GPIO_Port;
+    uint16_t pin = accel ? CSA_Pin : CSG_Pin;
+    tx[0] = accel ? 0x80 | 0x26 : 0x80 | 0x3F;
+    HAL_GPIO_WritePin(port, pin, GPIO_PIN_RESET);
+    HAL_SPI_TransmitReceive(&hspi, tx, rx, accel ? ACCEL_FULL_READ + 2 : GYRO_FULL_READ + 1, 100);
+    HAL_GPIO_WritePin(port, pin, GPIO_PIN_SET);
+    return samples;
+}
+
+static uint16_t queuedRead(uint8_t accel){
+    return accel ? ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES).len : GYRO_READ_FIFO_RAW(raw, GYRO_FIFO_MAX_FRAMES).len;
+}
+
+static void run(uint8_t accel, uint8_t queued, uint32_t periodUs, uint32_t reads){
+    uint32_t i;
+    uint64_t samples = 0;
+    uint64_t start;
+    SimBusStats bus;
+    simReset();
+    hspi.State = HAL_SPI_STATE_READY;
+    IMU_INIT(&hspi);
+    IMU_ENABLE_ALL();
+    IMU_SETUP_FOR_LOGGING();
+    queuedRead(accel);
+    simResetBusStats();
+    start = simNowNs();
+    for(i = 0; i < reads; i++){
+        simAdvanceUs(periodUs);
+        samples += queued ? queuedRead(accel) : fullRead(accel);
+    }
+    bus = simBusStats();
+    BENCH_LINE("bus_bytes", "\"sensor\":\"%s\",\"read\":\"%s\",\"period_us\":%u,\"samples\":%llu,"
+               "\"bytes_per_sample\":%.2f,\"bus_ns_per_sample\":%.1f,\"bus_utilisation\":%.4f",
+               accel ? "accel" : "gyro", queued ? "queued" : "full", periodUs, (unsigned long long)samples,
+               (double)bus.bytes / samples, (double)bus.selectedNs / samples,
+               (double)bus.selectedNs / (simNowNs() - start));
+}
+
+int main(int argc, char** argv){
+    // Accel at 400Hz, gyro at 1kHz. Gyro can't wait longer than its 100 frame FIFO
+    static const uint32_t periods[] = {2500, 10000, 50000, 90000};
+    uint32_t reads = benchIterations(argc, argv, 200);
+    int p;
+    uint8_t accel, queued;
+    for(accel = 0; accel < 2; accel++){
+        for(p = 0; p < 4; p++){
+            for(queued = 0; queued < 2; queued++){
+                run(accel, queued, periods[p], reads);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,92 @@
+// Bus time a register read holds chip select low without clocking anything, one full-duplex call against
+//  the address/dummy/payload calls the driver used to make. Idle is select time minus SCK time,
+//  which is what the per-call HAL overhead turns into on a logic analyser
+#include "IMU.h"
+#include "Bmi088Sim.h"
+#include "Bench.h"
+
+#define ACCEL_ADDR_ID 0x00
+#define ACCEL_ADDR_DATA 0x12
+#define ACCEL_ADDR_SENSORTIME 0x18
+#define GYRO_ADDR_ID 0x00
+#define GYRO_ADDR_RATES 0x02
+
+typedef struct regRead
+{
+    const char* name;
+    uint8_t accel;
+    uint8_t addr;
+    uint8_t len;
+    void (*driver)(); // The same read through the driver
+} RegRead;
+
+static SPI_HandleTypeDef hspi;
+
+static void accelId(){ ACCEL_READ_ID(); }
+static void accelData(){ ACCEL_READ_ACCELERATION(); }
+static void accelTime(){ ACCEL_READ_SENSORTIME(); }
+static void gyroId(){ GYRO_READ_ID(); }
+static void gyroRates(){ GYRO_READ_RATES(); }
+
+static const RegRead reads[] = {
+    {"accel_id", 1, ACCEL_ADDR_ID, 1, accelId},
+    {"accel_data", 1, ACCEL_ADDR_DATA, 6, accelData},
+    {"accel_sensortime", 1, ACCEL_ADDR_SENSORTIME, 3, accelTime},
+    {"gyro_id", 0, GYRO_ADDR_ID, 1, gyroId},
+    {"gyro_rates", 0, GYRO_ADDR_RATES, 6, gyroRates},
+};
+
+// The old readAddr: address, then the accel dummy byte, then the payload, each its own call
+static void splitRead(const RegRead* r){
+    uint8_t addr = 0x80 | r->addr;
+    uint8_t dummy, data[8];
+    GPIO_TypeDef* port = r->accel ? CSA_GPIO_Port : CSG_GPIO_Port;
+    uint16_t pin = r->accel ? CSA_Pin : CSG_Pin;
+    HAL_GPIO_WritePin(port, pin, GPIO_PIN_RESET);
+    HAL_SPI_Transmit(&hspi, &addr, 1, 100);
+    if(r->accel){
+        HAL_SPI_Receive(&hspi, &dummy, 1, 100);
+    }
+    HAL_SPI_Receive(&hspi, data, r->len, 100);
+    HAL_GPIO_WritePin(port, pin, GPIO_PIN_SET);
+}
+
+static void run(const RegRead* r, uint8_t split, uint32_t halCallNs, uint32_t repeats){
+    uint32_t i;
+    SimBusStats bus;
+    simReset();
+    hspi.State = HAL_SPI_STATE_READY;
+    IMU_INIT(&hspi);
+    simSetTiming(10000000, halCallNs);
+    simResetBusStats();
+    for(i = 0; i < repeats; i++){
+        if(split){
+            splitRead(r);
+        } else {
+            r->driver();
+        }
+    }
+    bus = simBusStats();
+    BENCH_LINE("bus_idle", "\"read\":\"%s\",\"calls\":\"%s\",\"hal_call_ns\":%u,\"hal_calls_per_read\":%.2f,"
+               "\"bytes_per_read\":%.2f,\"selected_ns_per_read\":%.1f,\"idle_ns_per_read\":%.1f,\"idle_fraction\":%.3f",
+               r->name, split ? "split" : "full_duplex", halCallNs, (double)bus.halCalls / repeats,
+               (double)bus.bytes / repeats, (double)bus.selectedNs / repeats,
+               (double)(bus.selectedNs - bus.clockNs) / repeats, (double)(bus.selectedNs - bus.clockNs) / bus.selectedNs);
+}
+
+int main(int argc, char** argv){
+    // HAL overhead per call, from a fast -O2 build up to a debug build on a slow core
+    static const uint32_t halCallNs[] = {500, 1500, 5000};
+    uint32_t repeats = benchIterations(argc, argv, 1000);
+    size_t r;
+    int c;
+    uint8_t split;
+    for(r = 0; r < sizeof(reads) / sizeof(reads[0]); r++){
+        for(c = 0; c < 3; c++){
+            for(split = 0; split < 2; split++){
+                run(&reads[r], !split, halCallNs[c], repeats);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,138 @@
+// Cost of turning one FIFO readout of bytes into samples, per sample representation
+//  The host FPU does doubles natively. On a Cortex-M4/M7 the double variants run in software, so
+//  compare the numbers against each other rather than across machines
+#include "Vectors.h"
+#include "Bench.h"
+#include <stdlib.h>
+
+#define SAMPLES 146 // A full accel FIFO
+#define REPEATS 20000
+#define SCALE (24.0 * 9.80665 / 32768.0)
+
+static uint8_t bytes[SAMPLES * 6];
+static Vector3Raw raw[SAMPLES];
+static Vector3 outD[SAMPLES];
+static Vector3f outF[SAMPLES];
+static Vector3Q outQ[SAMPLES];
+static VectorCal calDiagonal, calCross;
+static uint8_t maxRangeBits = 3;
+
+// The per-sample conversion the driver used to do, integer multiply then double divides
+static Vector3 legacy(uint8_t* rawVals){
+    int32_t x, y, z;
+    Vector3 out;
+    x = ((int16_t)(rawVals[1]*256 + rawVals[0])) * (2 << maxRangeBits);
+    y = ((int16_t)(rawVals[3]*256 + rawVals[2])) * (2 << maxRangeBits);
+    z = ((int16_t)(rawVals[5]*256 + rawVals[4])) * (2 << maxRangeBits);
+    out.x = (x / 32768.0) * 1.5 * 9.80665;
+    out.z = (z / 32768.0) * 1.5 * 9.80665;
+    out.y = (y / 32768.0) * 1.5 * 9.80665;
+    return out;
+}
+
+static void decode(){
+    int i;
+    for(i = 0; i < SAMPLES; i++){
+        raw[i] = vRawFromBytes(bytes + i * 6);
+    }
+}
+
+static void runLegacy(){
+    int i;
+    for(i = 0; i < SAMPLES; i++){
+        outD[i] = legacy(bytes + i * 6);
+    }
+    benchKeep(outD);
+}
+
+static void runRaw(){
+    decode();
+    benchKeep(raw);
+}
+
+static void runDouble(){
+    decode();
+    vRawToD(raw, outD, SAMPLES, SCALE);
+    benchKeep(outD);
+}
+
+static void runFloat(){
+    decode();
+    vRawToF(raw, outF, SAMPLES, (float)SCALE);
+    benchKeep(outF);
+}
+
+static void runQ(){
+    decode();
+    vRawToQ(raw, outQ, SAMPLES, (float)SCALE);
+    benchKeep(outQ);
+}
+
+// Conversion alone, from already decoded counts
+static void convertDouble(){
+    vRawToD(raw, outD, SAMPLES, SCALE);
+    benchKeep(outD);
+}
+
+// With a calibration folded in, as the driver's Vector3 readouts do it
+static void convertCal(){
+    vRawToDCal(raw, outD, SAMPLES, &calDiagonal);
+    benchKeep(outD);
+}
+
+static void convertCalCross(){
+    vRawToDCal(raw, outD, SAMPLES, &calCross);
+    benchKeep(outD);
+}
+
+static void convertFloat(){
+    vRawToF(raw, outF, SAMPLES, (float)SCALE);
+    benchKeep(outF);
+}
+
+static void convertQ(){
+    vRawToQ(raw, outQ, SAMPLES, (float)SCALE);
+    benchKeep(outQ);
+}
+
+static void measure(const char* stage, const char* variant, void (*run)(), uint32_t repeats){
+    uint32_t i;
+    uint64_t cycles, ns;
+    run(); // Warm up
+    ns = benchNowNs();
+    cycles = benchCycles();
+    for(i = 0; i < repeats; i++){
+        run();
+    }
+    cycles = benchCycles() - cycles;
+    ns = benchNowNs() - ns;
+    BENCH_LINE("convert", "\"stage\":\"%s\",\"variant\":\"%s\",\"samples\":%d,\"cycles_per_sample\":%.2f,\"ns_per_sample\":%.3f",
+               stage, variant, SAMPLES, (double)cycles / repeats / SAMPLES, (double)ns / repeats / SAMPLES);
+}
+
+int main(int argc, char** argv){
+    uint32_t repeats = benchIterations(argc, argv, REPEATS);
+    SensorCal cal;
+    size_t i;
+    srand(1);
+    for(i = 0; i < sizeof(bytes); i++){
+        bytes[i] = rand();
+    }
+    measure("bytes_to_samples", "legacy_double", runLegacy, repeats);
+    measure("bytes_to_samples", "raw_int16", runRaw, repeats);
+    measure("bytes_to_samples", "double", runDouble, repeats);
+    measure("bytes_to_samples", "float", runFloat, repeats);
+    measure("bytes_to_samples", "q16", runQ, repeats);
+    vCalIdentity(&cal);
+    cal.offset[0] = 0.1f;
+    vCalFold(&cal, SCALE, &calDiagonal);
+    cal.matrix[0][1] = 0.01f;
+    vCalFold(&cal, SCALE, &calCross);
+    decode();
+    measure("raw_to_units", "double", convertDouble, repeats);
+    measure("raw_to_units", "double_cal", convertCal, repeats);
+    measure("raw_to_units", "double_cal_misaligned", convertCalCross, repeats);
+    measure("raw_to_units", "float", convertFloat, repeats);
+    measure("raw_to_units", "q16", convertQ, repeats);
+    return 0;
+}
@@ -0,0 +1,66 @@
+// Cost of an orientation update with the gyro at 2kHz, from one sample per update up to a 100ms FIFO batch
+//  Built twice, BenchOrientation with the float filter and BenchOrientationFixed with ORIENTATION_FIXED_POINT
+#include "Orientation.h"
+#include "Bench.h"
+#include <stdlib.h>
+
+#define GYRO_HZ 2000
+#define ACCEL_HZ 1600
+#define MAX_BATCH 200
+#define WORK 2000000 // Gyro samples per result, whatever the batch size
+#define GYRO_SCALE (2000.0f * 3.14159265f / 180.0f / 32767.0f)
+
+#ifdef ORIENTATION_FIXED_POINT
+#define VARIANT "fixed"
+#else
+#define VARIANT "float"
+#endif
+
+static Vector3Raw gyro[MAX_BATCH];
+static Vector3Raw accel[MAX_BATCH];
+
+static void measure(uint16_t batch, uint32_t work){
+    Orientation o;
+    uint32_t i, updates = work / batch;
+    uint16_t accelLen = batch * ACCEL_HZ / GYRO_HZ;
+    uint64_t cycles, ns;
+    float q[4];
+    orientInit(&o, GYRO_SCALE, GYRO_HZ, 0.5f, 0.01f);
+    orientUpdate(&o, gyro, batch, accel, accelLen); // Warm up
+    ns = benchNowNs();
+    cycles = benchCycles();
+    for(i = 0; i < updates; i++){
+        // One sample batches can't carry a whole accel sample every time, every fifth one gets none
+        orientUpdate(&o, gyro, batch, accel, accelLen ? accelLen : i % 5 != 0);
+        benchKeep(&o);
+    }
+    cycles = benchCycles() - cycles;
+    ns = benchNowNs() - ns;
+    orientGetQuaternion(&o, q);
+    BENCH_LINE("orientation", "\"variant\":\"%s\",\"gyro_hz\":%d,\"gyro_per_update\":%u,\"accel_per_update\":%u,"
+               "\"ns_per_update\":%.1f,\"cycles_per_update\":%.1f,\"ns_per_gyro_sample\":%.2f,\"cpu_load_at_2khz\":%.6f,\"q_norm\":%.6f",
+               VARIANT, GYRO_HZ, batch, accelLen, (double)ns / updates, (double)cycles / updates,
+               (double)ns / updates / batch, (double)ns / updates / batch * GYRO_HZ / 1e9,
+               sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]));
+}
+
+int main(int argc, char** argv){
+    // Per sample, a 5ms and 10ms interrupt drain, a full gyro FIFO at 2kHz is 50ms
+    static const uint16_t batches[] = {1, 10, 20, 100, MAX_BATCH};
+    uint32_t work = benchIterations(argc, argv, WORK);
+    size_t b;
+    srand(1);
+    // Slow rotation and a little noise around 1g, in counts at 2000dps and 24g
+    for(b = 0; b < MAX_BATCH; b++){
+        gyro[b].x = 160 + rand() % 21 - 10;
+        gyro[b].y = -80 + rand() % 21 - 10;
+        gyro[b].z = 40 + rand() % 21 - 10;
+        accel[b].x = rand() % 41 - 20;
+        accel[b].y = rand() % 41 - 20;
+        accel[b].z = 1365 + rand() % 41 - 20;
+    }
+    for(b = 0; b < sizeof(batches) / sizeof(batches[0]); b++){
+        measure(batches[b], work);
+    }
+    return 0;
+}
@@ -0,0 +1,251 @@
+// FIFO decode throughput of the accel and gyro parsers, and what a readout costs end to end
+//  Streams are synthetic (full, sparse, drop-heavy, config-change) or recorded off the simulated sensor
+//  Linked with malloc/realloc wrapped, so allocations per call are counted
+#include "IMU.h"
+#include "Bmi088Sim.h"
+#include "Bench.h"
+#include <stdlib.h>
+
+#define STREAM_MAX 1100
+#define REPEATS 20000
+#define CHUNK 64 // Readout size for the incremental parser runs
+
+typedef struct stream
+{
+    const char* name;
+    uint8_t bytes[STREAM_MAX];
+    uint16_t len;
+    uint16_t frames; // Data frames in it, for the gyro the frame count from FIFO_STATUS
+} Stream;
+
+static Stream accelStreams[5];
+static Stream gyroStreams[3];
+static Vector3Raw samples[ACCEL_FIFO_MAX_FRAMES];
+static SPI_HandleTypeDef hspi;
+static uint32_t allocs;
+
+void* __real_malloc(size_t size);
+void* __real_realloc(void* p, size_t size);
+
+void* __wrap_malloc(size_t size){
+    allocs++;
+    return __real_malloc(size);
+}
+
+void* __wrap_realloc(void* p, size_t size){
+    allocs++;
+    return __real_realloc(p, size);
+}
+
+static void putData(Stream* s, int16_t v){
+    uint8_t* p = s->bytes + s->len;
+    p[0] = 0x84;
+    p[1] = v; p[2] = v >> 8;
+    p[3] = -v; p[4] = (-v) >> 8;
+    p[5] = 0x00; p[6] = 0x08;
+    s->len += 7;
+    s->frames++;
+}
+
+static void putControl(Stream* s, uint8_t header, uint8_t value){
+    s->bytes[s->len++] = header;
+    s->bytes[s->len++] = value;
+}
+
+static void putEnd(Stream* s){
+    s->bytes[s->len++] = 0x44;
+    s->bytes[s->len++] = 0x10;
+    s->bytes[s->len++] = 0x20;
+    s->bytes[s->len++] = 0x00;
+    putControl(s, 0x80, 0x00);
+}
+
+static void buildSynthetic(){
+    int i;
+    Stream* s;
+    s = &accelStreams[0];
+    s->name = "full";
+    for(i = 0; i < ACCEL_FIFO_MAX_FRAMES; i++){
+        putData(s, i);
+    }
+    putEnd(s);
+
+    s = &accelStreams[1];
+    s->name = "sparse";
+    for(i = 0; i < 4; i++){
+        putData(s, i);
+    }
+    putEnd(s);
+
+    s = &accelStreams[2];
+    s->name = "drop_heavy";
+    while(s->len < 1000){
+        putData(s, s->len);
+        putControl(s, 0x50, 0x00);
+        s->frames++; // Drops come out as null samples
+    }
+    putEnd(s);
+
+    s = &accelStreams[3];
+    s->name = "config_change";
+    for(i = 0; i < 140; i++){
+        if(i % 35 == 0){
+            putControl(s, 0x48, 0x01);
+        }
+        putData(s, i);
+    }
+    putEnd(s);
+
+    for(i = 0; i < 3; i++){
+        gyroStreams[i].name = i == 0 ? "full" : i == 1 ? "sparse" : "recorded";
+    }
+    gyroStreams[0].frames = GYRO_FIFO_MAX_FRAMES;
+    gyroStreams[1].frames = 4;
+    for(i = 0; i < GYRO_FIFO_MAX_FRAMES * 6; i++){
+        gyroStreams[0].bytes[i] = gyroStreams[1].bytes[i] = i * 7;
+    }
+    gyroStreams[0].len = GYRO_FIFO_MAX_FRAMES * 6;
+    gyroStreams[1].len = 4 * 6;
+}
+
+// Fills the simulated FIFOs and clocks them out whole, the way a logic analyser capture would look
+static void record(){
+    uint8_t tx[STREAM_MAX] = {0};
+    uint8_t rx[STREAM_MAX];
+    Stream* s = &accelStreams[4];
+    AccelRawBuffer parsed;
+    simReset();
+    hspi.State = HAL_SPI_STATE_READY;
+    IMU_INIT(&hspi);
+    IMU_ENABLE_ALL();
+    IMU_SETUP_FOR_LOGGING();
+    simAccelDrop(0, 2);
+    simAdvanceUs(90000);
+
+    s->name = "recorded";
+    s->len = simAccelFIFOBytes(0) + 4;
+    tx[0] = 0x80 | 0x26;
+    HAL_GPIO_WritePin(CSA_GPIO_Port, CSA_Pin, GPIO_PIN_RESET);
+    HAL_SPI_TransmitReceive(&hspi, tx, rx, s->len + 2, 100);
+    HAL_GPIO_WritePin(CSA_GPIO_Port, CSA_Pin, GPIO_PIN_SET);
+    memcpy(s->bytes, rx + 2, s->len);
+    parsed = ACCEL_PARSE_FIFO(s->bytes, s->len, samples, ACCEL_FIFO_MAX_FRAMES);
+    s->frames = parsed.len;
+
+    s = &gyroStreams[2];
+    s->frames = simGyroFIFOFrames(0);
+    s->len = s->frames * 6;
+    tx[0] = 0x80 | 0x3F;
+    HAL_GPIO_WritePin(CSG_GPIO_Port, CSG_Pin, GPIO_PIN_RESET);
+    HAL_SPI_TransmitReceive(&hspi, tx, rx, s->len + 1, 100);
+    HAL_GPIO_WritePin(CSG_GPIO_Port, CSG_Pin, GPIO_PIN_SET);
+    memcpy(s->bytes, rx + 1, s->len);
+}
+
+static void report(const char* parser, const Stream* s, uint32_t repeats, uint64_t ns, uint32_t allocCount){
+    BENCH_LINE("parse", "\"parser\":\"%s\",\"stream\":\"%s\",\"frames\":%u,\"stream_bytes\":%u,"
+               "\"ns_per_frame\":%.3f,\"allocs_per_call\":%.2f,\"bytes_per_sample\":%.2f",
+               parser, s->name, s->frames, s->len, (double)ns / repeats / (s->frames ? s->frames : 1),
+               (double)allocCount / repeats, s->frames ? (double)s->len / s->frames : 0.0);
+}
+
+static void benchAccel(const Stream* s, uint32_t repeats){
+    uint32_t i;
+    uint16_t pos, chunk;
+    uint64_t ns;
+    AccelFIFOParser parser;
+    AccelRawBuffer out;
+
+    allocs = 0;
+    ns = benchNowNs();
+    for(i = 0; i < repeats; i++){
+        out = ACCEL_PARSE_FIFO(s->bytes, s->len, samples, ACCEL_FIFO_MAX_FRAMES);
+        benchKeep(&out);
+    }
+    report("accel", s, repeats, benchNowNs() - ns, allocs);
+
+    // Same bytes arriving as several short readouts, frames split across them
+    memset(&parser, 0, sizeof(parser));
+    allocs = 0;
+    ns = benchNowNs();
+    for(i = 0; i < repeats; i++){
+        for(pos = 0; pos < s->len; pos += chunk){
+            chunk = s->len - pos < CHUNK ? s->len - pos : CHUNK;
+            out = ACCEL_PARSE_FIFO_STREAM(&parser, s->bytes + pos, chunk, samples, ACCEL_FIFO_MAX_FRAMES);
+            benchKeep(&out);
+        }
+    }
+    report("accel_chunked", s, repeats, benchNowNs() - ns, allocs);
+}
+
+static void benchGyro(const Stream* s, uint32_t repeats){
+    uint32_t i;
+    uint64_t ns;
+    GyroRawBuffer out;
+    allocs = 0;
+    ns = benchNowNs();
+    for(i = 0; i < repeats; i++){
+        out = GYRO_PARSE_FIFO(s->bytes, s->frames, samples);
+        benchKeep(&out);
+    }
+    report("gyro", s, repeats, benchNowNs() - ns, allocs);
+}
+
+// Whole readouts through the driver: bus, parse and conversion. Time includes the simulator
+static void benchReadout(const char* name, uint8_t accel, uint8_t allocating, uint32_t reads){
+    static Vector3 array[ACCEL_FIFO_MAX_FRAMES];
+    uint32_t i, count = 0;
+    uint64_t ns = 0, start;
+    AccelDataBuffer a;
+    GyroDataBuffer g;
+    SimBusStats bus;
+    simReset();
+    hspi.State = HAL_SPI_STATE_READY;
+    IMU_INIT(&hspi);
+    IMU_ENABLE_ALL();
+    IMU_SETUP_FOR_LOGGING();
+    ACCEL_READ_FIFO_INTO(array, ACCEL_FIFO_MAX_FRAMES);
+    GYRO_READ_FIFO_INTO(array, GYRO_FIFO_MAX_FRAMES);
+    simResetBusStats();
+    allocs = 0;
+    for(i = 0; i < reads; i++){
+        simAdvanceUs(20000);
+        start = benchNowNs();
+        if(accel){
+            a = allocating ? ACCEL_READ_FIFO() : ACCEL_READ_FIFO_INTO(array, ACCEL_FIFO_MAX_FRAMES);
+            count += a.len;
+            if(allocating){
+                free(a.array);
+            }
+        } else {
+            g = allocating ? GYRO_READ_FIFO() : GYRO_READ_FIFO_INTO(array, GYRO_FIFO_MAX_FRAMES);
+            count += g.len;
+            if(allocating){
+                free(g.array);
+            }
+        }
+        ns += benchNowNs() - start;
+    }
+    bus = simBusStats();
+    BENCH_LINE("readout", "\"call\":\"%s\",\"samples\":%u,\"ns_per_frame\":%.1f,\"allocs_per_call\":%.2f,\"bytes_per_sample\":%.2f",
+               name, count, (double)ns / count, (double)allocs / reads, (double)bus.bytes / count);
+}
+
+int main(int argc, char** argv){
+    uint32_t repeats = benchIterations(argc, argv, REPEATS);
+    uint32_t reads = benchIterations(argc, argv, 500);
+    int i;
+    buildSynthetic();
+    record();
+    for(i = 0; i < 5; i++){
+        benchAccel(&accelStreams[i], repeats);
+    }
+    for(i = 0; i < 3; i++){
+        benchGyro(&gyroStreams[i], repeats);
+    }
+    benchReadout("ACCEL_READ_FIFO", 1, 1, reads);
+    benchReadout("ACCEL_READ_FIFO_INTO", 1, 0, reads);
+    benchReadout("GYRO_READ_FIFO", 0, 1, reads);
+    benchReadout("GYRO_READ_FIFO_INTO", 0, 0, reads);
+    return 0;
+}
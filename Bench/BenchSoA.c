@@ -0,0 +1,132 @@
+// Batch conversion into structure-of-arrays floats against the interleaved Vector3f layout, alone and followed
+//  by a per-axis DSP pass: an element-wise bias removal, which vectorises on flat arrays, and a low pass, which
+//  is a serial chain either way. scalar_soa is the same split done without the wide scale, so the SIMD
+//  gain shows separately from the layout change. Build with -march=native to get the AVX path on the host
+#include "Vectors.h"
+#include "Bench.h"
+#include <stdlib.h>
+
+#define MAX_SAMPLES 1024
+#define GYRO_BATCH 100 // GYRO_FIFO_MAX_FRAMES
+#define ACCEL_BATCH 146 // A full accel FIFO
+#define WORK 4000000 // Samples converted per result, whatever the batch size
+#define SCALE (2000.0f * 3.14159265f / 180.0f / 32767.0f)
+
+static Vector3Raw raw[MAX_SAMPLES];
+static Vector3f aos[MAX_SAMPLES];
+static float x[MAX_SAMPLES], y[MAX_SAMPLES], z[MAX_SAMPLES];
+static const Vector3SoA soa = {x, y, z};
+static float filtered[3];
+
+#if defined(BMI088_USE_CMSIS_DSP)
+#define SIMD_PATH "cmsis_dsp"
+#elif defined(__AVX__)
+#define SIMD_PATH "avx"
+#elif defined(__SSE__)
+#define SIMD_PATH "sse"
+#else
+#define SIMD_PATH "scalar"
+#endif
+
+static void convertAoS(uint16_t len){
+    vRawToF(raw, aos, len, SCALE);
+}
+
+static void convertSoA(uint16_t len){
+    vRawToSoA(raw, soa, len, SCALE);
+}
+
+static void convertScalarSoA(uint16_t len){
+    uint16_t i;
+    for(i = 0; i < len; i++){
+        x[i] = raw[i].x * SCALE;
+        y[i] = raw[i].y * SCALE;
+        z[i] = raw[i].z * SCALE;
+    }
+}
+
+// Stand-in for a DSP stage that works one axis at a time, a first order low pass over the batch
+static float lowPass(const float* v, uint16_t len, uint16_t stride, float state){
+    uint16_t i;
+    for(i = 0; i < len; i++){
+        state += 0.1f * (v[i * stride] - state);
+    }
+    return state;
+}
+
+// Stand-in for an element-wise stage like arm_offset_f32, in place
+static void unbias(float* v, uint16_t len, uint16_t stride, float bias){
+    uint16_t i;
+    for(i = 0; i < len; i++){
+        v[i * stride] -= bias;
+    }
+}
+
+static void unbiasAoS(uint16_t len){
+    convertAoS(len);
+    unbias(&aos[0].x, len, 3, 0.01f);
+    unbias(&aos[0].y, len, 3, -0.02f);
+    unbias(&aos[0].z, len, 3, 0.03f);
+}
+
+static void unbiasSoA(uint16_t len){
+    convertSoA(len);
+    unbias(x, len, 1, 0.01f);
+    unbias(y, len, 1, -0.02f);
+    unbias(z, len, 1, 0.03f);
+}
+
+static void filterAoS(uint16_t len){
+    convertAoS(len);
+    filtered[0] = lowPass(&aos[0].x, len, 3, filtered[0]);
+    filtered[1] = lowPass(&aos[0].y, len, 3, filtered[1]);
+    filtered[2] = lowPass(&aos[0].z, len, 3, filtered[2]);
+}
+
+static void filterSoA(uint16_t len){
+    convertSoA(len);
+    filtered[0] = lowPass(x, len, 1, filtered[0]);
+    filtered[1] = lowPass(y, len, 1, filtered[1]);
+    filtered[2] = lowPass(z, len, 1, filtered[2]);
+}
+
+static void measure(const char* stage, const char* layout, void (*run)(uint16_t), uint16_t len, uint32_t work){
+    uint32_t i, repeats = work / len;
+    uint64_t cycles, ns;
+    run(len); // Warm up
+    ns = benchNowNs();
+    cycles = benchCycles();
+    for(i = 0; i < repeats; i++){
+        run(len);
+        benchKeep(aos);
+        benchKeep(x);
+        benchKeep(filtered);
+    }
+    cycles = benchCycles() - cycles;
+    ns = benchNowNs() - ns;
+    BENCH_LINE("soa", "\"stage\":\"%s\",\"layout\":\"%s\",\"simd\":\"%s\",\"batch\":%u,\"cycles_per_sample\":%.3f,\"ns_per_sample\":%.3f",
+               stage, layout, SIMD_PATH, len, (double)cycles / repeats / len, (double)ns / repeats / len);
+}
+
+int main(int argc, char** argv){
+    // Short interrupt drains, a full gyro FIFO, a full accel FIFO and a replayed log
+    static const uint16_t batches[] = {16, GYRO_BATCH, ACCEL_BATCH, MAX_SAMPLES};
+    uint32_t work = benchIterations(argc, argv, WORK);
+    size_t b;
+    srand(1);
+    for(b = 0; b < MAX_SAMPLES; b++){
+        raw[b].x = rand();
+        raw[b].y = rand();
+        raw[b].z = rand();
+    }
+    for(b = 0; b < sizeof(batches) / sizeof(batches[0]); b++){
+        measure("convert", "aos", convertAoS, batches[b], work);
+        measure("convert", "scalar_soa", convertScalarSoA, batches[b], work);
+        measure("convert", "soa", convertSoA, batches[b], work);
+        measure("convert_unbias", "aos", unbiasAoS, batches[b], work);
+        measure("convert_unbias", "soa", unbiasSoA, batches[b], work);
+        measure("convert_lowpass", "aos", filterAoS, batches[b], work);
+        measure("convert_lowpass", "soa", filterSoA, batches[b], work);
+    }
+    return 0;
+}
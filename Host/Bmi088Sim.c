@@ -0,0 +1,1065 @@
+#include "Bmi088Sim.h"
+#include <math.h>
+#include <string.h>
+
+GPIO_TypeDef simPortA = {0};
+GPIO_TypeDef simPortB = {1};
+
+#define GRAV_SIM 9.80665
+#define DEG_TO_RAD (M_PI / 180.0)
+#define TICK_READ_NS 50
+
+// Accel registers
+#define A_CHIP_ID 0x00
+#define A_STATUS 0x03
+#define A_DATA 0x12
+#define A_SENSORTIME 0x18
+#define A_INT_STAT_1 0x1D
+#define A_GP_4 0x1E
+#define A_TEMP_MSB 0x22
+#define A_FIFO_LENGTH_0 0x24
+#define A_FIFO_LENGTH_1 0x25
+#define A_FIFO_DATA 0x26
+#define A_GP_0 0x27
+#define A_INTERNAL_STATUS 0x2A
+#define A_CONF 0x40
+#define A_RANGE 0x41
+#define A_FIFO_DOWNS 0x45
+#define A_FIFO_WTM_0 0x46
+#define A_FIFO_WTM_1 0x47
+#define A_FIFO_CONFIG_0 0x48
+#define A_FIFO_CONFIG_1 0x49
+#define A_INT1_IO_CTRL 0x53
+#define A_INT2_IO_CTRL 0x54
+#define A_INT2_MAP 0x57
+#define A_INT_MAP_DATA 0x58
+#define A_INIT_CTRL 0x59
+#define A_INIT_ADDR_0 0x5B
+#define A_INIT_ADDR_1 0x5C
+#define A_FEATURE_CFG 0x5E
+#define A_SELF_TEST 0x6D
+#define A_PWR_CONF 0x7C
+#define A_PWR_CTRL 0x7D
+#define A_SOFTRESET 0x7E
+
+// Gyro registers
+#define G_CHIP_ID 0x00
+#define G_DATA 0x02
+#define G_INT_STAT_1 0x0A
+#define G_FIFO_STATUS 0x0E
+#define G_RANGE 0x0F
+#define G_BANDWIDTH 0x10
+#define G_LPM1 0x11
+#define G_SOFTRESET 0x14
+#define G_INT_CTRL 0x15
+#define G_IO_CONF 0x16
+#define G_IO_MAP 0x18
+#define G_FIFO_WM_EN 0x1E
+#define G_SELF_TEST 0x3C
+#define G_FIFO_CONFIG_0 0x3D
+#define G_FIFO_CONFIG_1 0x3E
+#define G_FIFO_DATA 0x3F
+
+// FIFO frames
+#define F_DATA 0x84
+#define F_SKIP 0x40
+#define F_SENSORTIME 0x44
+#define F_CONFIG 0x48
+#define F_DROP 0x50
+#define F_END 0x80
+
+#define ACCEL_FIFO_BYTES 1024
+#define GYRO_FIFO_FRAMES 100
+#define FEATURE_BYTES 8192
+#define GYRO_BIST_NS 30000000ull
+#define RESET_VALUE 0xB6
+
+#define MAX_IRQS 64
+#define IRQ_EXTI 0
+#define IRQ_DMA 1
+#define MAX_DMA 4
+
+#define SENSOR_ACCEL 0
+#define SENSOR_GYRO 1
+#define EVENT_BIST 2
+#define EVENT_DMA 3
+#define NO_CHIP -1
+
+typedef struct simChip
+{
+    GPIO_TypeDef* csPort[2];
+    uint16_t csPin[2];
+    uint16_t intPin[4];
+    uint8_t intLevel[4]; // Level-triggered sources (watermark, full, FIFO) currently asserting each line
+    uint8_t acc[128];
+    uint8_t gyr[64];
+    SimSignal signal[2];
+    void* ctx[2];
+    uint64_t nextNs[2]; // Next sample, 0 while the sensor is off
+    uint8_t failTest[2];
+    // Accel FIFO is a byte ring holding whole frames. headLeft is what is left of a frame half read out
+    uint8_t fifo[ACCEL_FIFO_BYTES];
+    uint16_t fifoHead;
+    uint16_t fifoLen;
+    uint8_t headLeft;
+    uint16_t skipped; // Frames lost to a full FIFO since the last readout
+    uint8_t dropNext;
+    uint32_t downsCount;
+    uint8_t feature[FEATURE_BYTES];
+    uint16_t featureLen;
+    int16_t synced[3];
+    // Gyro FIFO, frames of raw counts
+    int16_t gfifo[GYRO_FIFO_FRAMES][3];
+    uint8_t gHead;
+    uint8_t gLen;
+    uint8_t gOverrun;
+    uint64_t bistDoneNs;
+} SimChip;
+
+typedef struct simIrq
+{
+    uint8_t type;
+    uint16_t pin;
+    SPI_HandleTypeDef* hspi;
+} SimIrq;
+
+typedef struct simDma
+{
+    SPI_HandleTypeDef* hspi;
+    uint64_t doneNs;
+} SimDma;
+
+// One SPI transaction, from chip select low to high
+typedef struct simTxn
+{
+    int chip;
+    uint8_t sensor;
+    int addr; // -1 until the address byte is in
+    int startAddr;
+    uint8_t read;
+    uint8_t dummy;
+    uint8_t stage[8]; // Frame being clocked out of a FIFO
+    uint8_t stageLen;
+    uint8_t stagePos;
+    uint8_t timeSent;
+    uint16_t featurePos;
+} SimTxn;
+
+static SimChip sim_chips[SIM_MAX_CHIPS];
+static int sim_chipCount;
+static uint64_t sim_now;
+static SimTxn sim_txn;
+static uint8_t sim_selected; // Chip selects currently low
+static uint64_t sim_selectedSince;
+static SimBusStats sim_stats;
+static uint32_t sim_byteNs = 800;
+static uint32_t sim_callNs = 1500;
+static uint8_t sim_preempt = 1;
+static uint8_t sim_inIsr;
+static SimIrq sim_irqs[MAX_IRQS];
+static int sim_irqCount;
+static SimDma sim_dma[MAX_DMA];
+static int sim_dmaCount;
+
+static void chipDefaults(SimChip*);
+static void runUntil(uint64_t, uint8_t);
+static void deliver();
+static void queueIrq(uint8_t, uint16_t, SPI_HandleTypeDef*);
+static uint8_t exchange(uint8_t);
+static void spend(uint64_t);
+
+// Signals
+
+static void gravity(uint64_t ns, double* out, void* ctx){
+    (void)ns;
+    (void)ctx;
+    out[0] = 0;
+    out[1] = 0;
+    out[2] = GRAV_SIM;
+}
+
+static void still(uint64_t ns, double* out, void* ctx){
+    (void)ns;
+    (void)ctx;
+    out[0] = out[1] = out[2] = 0;
+}
+
+static int16_t saturate(double counts){
+    counts = round(counts);
+    if(counts > 32767){
+        return 32767;
+    }
+    if(counts < -32768){
+        return -32768;
+    }
+    return (int16_t)counts;
+}
+
+static uint64_t tickNs(uint64_t ticks){
+    return ticks * 78125 / 2; // 39.0625us per sensortime tick
+}
+
+static uint64_t nsTick(uint64_t ns){
+    return ns * 2 / 78125;
+}
+
+// Sensor models
+
+static uint8_t accelOn(SimChip* c){
+    return c->acc[A_PWR_CTRL] == 0x04 && c->acc[A_PWR_CONF] == 0x00;
+}
+
+static uint32_t accelSampleTicks(SimChip* c){
+    uint8_t odr = c->acc[A_CONF] & 0x0F;
+    if(odr < 0x05 || odr > 0x0C){
+        odr = 0x08;
+    }
+    return 2048 >> (odr - 0x05);
+}
+
+static uint64_t gyroPeriodNs(SimChip* c){
+    static const uint64_t periods[] = {500000, 500000, 1000000, 2500000, 5000000, 10000000, 5000000, 10000000};
+    return periods[c->gyr[G_BANDWIDTH] & 0x07];
+}
+
+// Samples sit on a grid, like the real chip's ODR grid on sensortime
+static void schedule(SimChip* c){
+    uint64_t period;
+    if(accelOn(c)){
+        period = accelSampleTicks(c);
+        c->nextNs[SENSOR_ACCEL] = tickNs((nsTick(sim_now) / period + 1) * period);
+    } else {
+        c->nextNs[SENSOR_ACCEL] = 0;
+    }
+    if(c->gyr[G_LPM1] == 0x00){
+        period = gyroPeriodNs(c);
+        c->nextNs[SENSOR_GYRO] = (sim_now / period + 1) * period;
+    } else {
+        c->nextNs[SENSOR_GYRO] = 0;
+    }
+}
+
+static void accelCounts(SimChip* c, int16_t* out){
+    double a[3];
+    double fullScale = 3.0 * (1 << (c->acc[A_RANGE] & 0x03)) * GRAV_SIM;
+    double testX = c->failTest[SENSOR_ACCEL] ? 0.2 : 0.7;
+    int i;
+    c->signal[SENSOR_ACCEL](sim_now, a, c->ctx[SENSOR_ACCEL]);
+    // Self-test excitation, enough (or not) to clear the 1g/1g/0.5g thresholds
+    if(c->acc[A_SELF_TEST] == 0x0D || c->acc[A_SELF_TEST] == 0x09){
+        double sign = c->acc[A_SELF_TEST] == 0x0D ? 1 : -1;
+        a[0] += sign * testX * GRAV_SIM;
+        a[1] += sign * testX * GRAV_SIM;
+        a[2] += sign * testX / 2 * GRAV_SIM;
+    }
+    for(i = 0; i < 3; i++){
+        out[i] = saturate(a[i] / fullScale * 32768.0);
+    }
+}
+
+static void gyroCounts(SimChip* c, int16_t* out){
+    double w[3];
+    double fullScale = (2000 >> (c->gyr[G_RANGE] & 0x07)) * DEG_TO_RAD;
+    int i;
+    c->signal[SENSOR_GYRO](sim_now, w, c->ctx[SENSOR_GYRO]);
+    for(i = 0; i < 3; i++){
+        out[i] = saturate(w[i] / fullScale * 32767.0);
+    }
+}
+
+static void putCounts(uint8_t* regs, const int16_t* v){
+    int i;
+    for(i = 0; i < 3; i++){
+        regs[2 * i] = (uint16_t)v[i] & 0xFF;
+        regs[2 * i + 1] = (uint16_t)v[i] >> 8;
+    }
+}
+
+static uint8_t frameSize(uint8_t header){
+    switch (header & 0xFC)
+    {
+    case F_DATA:
+        return 7;
+    case F_SKIP:
+    case F_CONFIG:
+    case F_DROP:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+static uint8_t fifoPeek(SimChip* c, uint16_t i){
+    return c->fifo[(c->fifoHead + i) % ACCEL_FIFO_BYTES];
+}
+
+static void fifoDiscardOldest(SimChip* c){
+    uint8_t size = c->headLeft ? c->headLeft : frameSize(fifoPeek(c, 0));
+    if(!c->headLeft && (fifoPeek(c, 0) & 0xFC) == F_DATA){
+        c->skipped++;
+    }
+    c->fifoHead = (c->fifoHead + size) % ACCEL_FIFO_BYTES;
+    c->fifoLen -= size;
+    c->headLeft = 0;
+}
+
+static void fifoPush(SimChip* c, const uint8_t* frame, uint8_t len){
+    int i;
+    if(c->fifoLen + len > ACCEL_FIFO_BYTES){
+        if(c->acc[A_FIFO_CONFIG_0] & 0x01){
+            c->skipped++; // FIFO mode keeps the old data
+            return;
+        }
+        while(c->fifoLen + len > ACCEL_FIFO_BYTES){
+            fifoDiscardOldest(c);
+        }
+    }
+    for(i = 0; i < len; i++){
+        c->fifo[(c->fifoHead + c->fifoLen + i) % ACCEL_FIFO_BYTES] = frame[i];
+    }
+    c->fifoLen += len;
+}
+
+static uint8_t fifoPop(SimChip* c){
+    uint8_t b = fifoPeek(c, 0);
+    if(c->headLeft){
+        c->headLeft--;
+    } else {
+        c->headLeft = frameSize(b) - 1;
+    }
+    c->fifoHead = (c->fifoHead + 1) % ACCEL_FIFO_BYTES;
+    c->fifoLen--;
+    return b;
+}
+
+static void fifoFlush(SimChip* c){
+    c->fifoHead = 0;
+    c->fifoLen = 0;
+    c->headLeft = 0;
+    c->skipped = 0;
+}
+
+static void configFrame(SimChip* c){
+    uint8_t frame[2] = {F_CONFIG, 0x01};
+    if(c->acc[A_FIFO_CONFIG_1] & 0x40){
+        fifoPush(c, frame, 2);
+    }
+}
+
+// Edge on an interrupt line, if it is wired to anything
+static void pulse(SimChip* c, int line){
+    if(c->intPin[line]){
+        queueIrq(IRQ_EXTI, c->intPin[line], NULL);
+    }
+}
+
+// Recomputes the level-triggered interrupt sources and raises any line that just went active
+static void updateLevels(SimChip* c){
+    uint8_t level[4] = {0, 0, 0, 0};
+    uint16_t wtm = c->acc[A_FIFO_WTM_0] | ((c->acc[A_FIFO_WTM_1] & 0x1F) << 8);
+    uint8_t fwm = wtm > 0 && c->fifoLen >= wtm;
+    uint8_t full = c->fifoLen + 7 > ACCEL_FIFO_BYTES;
+    uint8_t map = c->acc[A_INT_MAP_DATA];
+    uint8_t gwm = c->gyr[G_FIFO_CONFIG_0] & 0x7F;
+    uint8_t gfifo = (c->gyr[G_INT_CTRL] & 0x40) && (c->gyr[G_FIFO_WM_EN] & 0x80) && gwm > 0 && c->gLen >= gwm;
+    int i;
+    if(c->acc[A_INT1_IO_CTRL] & 0x08){
+        level[0] = ((map & 0x01) && fwm) || ((map & 0x02) && full);
+    }
+    if(c->acc[A_INT2_IO_CTRL] & 0x08){
+        level[1] = ((map & 0x10) && fwm) || ((map & 0x20) && full);
+    }
+    level[2] = (c->gyr[G_IO_MAP] & 0x04) && gfifo;
+    level[3] = (c->gyr[G_IO_MAP] & 0x20) && gfifo;
+    for(i = 0; i < 4; i++){
+        if(level[i] && !c->intLevel[i]){
+            pulse(c, i);
+        }
+        c->intLevel[i] = level[i];
+    }
+}
+
+static void accelSample(SimChip* c){
+    int16_t v[3];
+    uint8_t frame[7];
+    uint8_t map = c->acc[A_INT_MAP_DATA];
+    accelCounts(c, v);
+    putCounts(c->acc + A_DATA, v);
+    c->acc[A_STATUS] |= 0x80;
+    c->acc[A_INT_STAT_1] |= 0x80;
+
+    if((c->acc[A_FIFO_CONFIG_1] & 0x40) && c->downsCount++ % (1u << ((c->acc[A_FIFO_DOWNS] >> 4) & 0x07)) == 0){
+        if(c->dropNext){
+            c->dropNext--;
+            frame[0] = F_DROP;
+            frame[1] = 0;
+            fifoPush(c, frame, 2);
+        } else {
+            frame[0] = F_DATA;
+            putCounts(frame + 1, v);
+            fifoPush(c, frame, 7);
+        }
+    }
+    // Data ready is a pulse on each sample
+    if((c->acc[A_INT1_IO_CTRL] & 0x08) && (map & 0x04) && !c->intLevel[0]){
+        pulse(c, 0);
+    }
+    if((c->acc[A_INT2_IO_CTRL] & 0x08) && (map & 0x40) && !c->intLevel[1]){
+        pulse(c, 1);
+    }
+}
+
+static void gyroSample(SimChip* c){
+    int16_t v[3];
+    uint8_t mode = c->gyr[G_FIFO_CONFIG_1] & 0xC0;
+    gyroCounts(c, v);
+    putCounts(c->gyr + G_DATA, v);
+    c->gyr[G_INT_STAT_1] |= 0x80;
+
+    if(mode){
+        if(c->gLen == GYRO_FIFO_FRAMES){
+            c->gOverrun = 1;
+            if(mode == 0x40){
+                mode = 0; // Stop at full
+            } else {
+                c->gHead = (c->gHead + 1) % GYRO_FIFO_FRAMES;
+                c->gLen--;
+            }
+        }
+        if(mode){
+            memcpy(c->gfifo[(c->gHead + c->gLen) % GYRO_FIFO_FRAMES], v, sizeof(v));
+            c->gLen++;
+        }
+    }
+    if(c->gyr[G_INT_CTRL] & 0x80){
+        if((c->gyr[G_IO_MAP] & 0x01) && !c->intLevel[2]){
+            pulse(c, 2);
+        }
+        if((c->gyr[G_IO_MAP] & 0x80) && !c->intLevel[3]){
+            pulse(c, 3);
+        }
+    }
+    // Data sync: the gyro data ready (INT3 to INT1 on the board) latches an accel sample into GP_0/GP_4
+    if(c->acc[A_INTERNAL_STATUS] == 0x01 && c->feature[4] != 0 && accelOn(c)){
+        accelCounts(c, c->synced);
+        if((c->acc[A_INT2_MAP] & 0x01) && (c->acc[A_INT2_IO_CTRL] & 0x08)){
+            pulse(c, 1);
+        }
+    }
+}
+
+static void accelWrite(SimChip* c, uint8_t addr, uint8_t value){
+    uint8_t old = c->acc[addr];
+    switch (addr)
+    {
+    case A_CONF:
+    case A_RANGE:
+        c->acc[addr] = value;
+        if(value != old){
+            configFrame(c);
+            schedule(c);
+        }
+        break;
+    case A_PWR_CONF:
+    case A_PWR_CTRL:
+        c->acc[addr] = value;
+        schedule(c);
+        break;
+    case A_FIFO_DOWNS:
+        c->acc[addr] = value | 0x80;
+        break;
+    case A_FIFO_CONFIG_1:
+        c->acc[addr] = value | 0x10;
+        break;
+    case A_INIT_CTRL:
+        c->acc[addr] = value;
+        c->acc[A_INTERNAL_STATUS] = value == 0x01 && c->featureLen > 0 ? 0x01 : 0x00;
+        break;
+    case A_SOFTRESET:
+        if(value == RESET_VALUE){
+            memset(c->acc, 0, sizeof(c->acc));
+            chipDefaults(c);
+        } else if(value == 0xB0){
+            fifoFlush(c);
+        }
+        break;
+    case A_CHIP_ID:
+    case A_STATUS:
+    case A_INT_STAT_1:
+    case A_FIFO_LENGTH_0:
+    case A_FIFO_LENGTH_1:
+    case A_INTERNAL_STATUS:
+        break; // Read only
+    default:
+        c->acc[addr & 0x7F] = value;
+        break;
+    }
+}
+
+static void gyroWrite(SimChip* c, uint8_t addr, uint8_t value){
+    switch (addr)
+    {
+    case G_RANGE:
+        c->gyr[addr] = value;
+        break;
+    case G_BANDWIDTH:
+    case G_LPM1:
+        c->gyr[addr] = addr == G_BANDWIDTH ? value | 0x80 : value;
+        schedule(c);
+        break;
+    case G_FIFO_CONFIG_1:
+        // Any write clears the FIFO and the overrun flag
+        c->gyr[addr] = value;
+        c->gHead = 0;
+        c->gLen = 0;
+        c->gOverrun = 0;
+        break;
+    case G_SELF_TEST:
+        if(value & 0x01){
+            c->gyr[addr] = 0x00;
+            c->bistDoneNs = sim_now + GYRO_BIST_NS;
+        }
+        break;
+    case G_SOFTRESET:
+        if(value == RESET_VALUE){
+            chipDefaults(c);
+        }
+        break;
+    case G_CHIP_ID:
+    case G_INT_STAT_1:
+    case G_FIFO_STATUS:
+        break;
+    default:
+        if(addr < sizeof(c->gyr)){
+            c->gyr[addr] = value;
+        }
+        break;
+    }
+}
+
+// Next byte of an accel FIFO burst: whole frames, then one sensortime frame, then the empty marker
+static uint8_t accelFIFOByte(SimChip* c){
+    uint32_t ticks;
+    if(sim_txn.stagePos < sim_txn.stageLen){
+        return sim_txn.stage[sim_txn.stagePos++];
+    }
+    if(c->skipped && !c->headLeft){
+        sim_txn.stage[0] = F_SKIP;
+        sim_txn.stage[1] = c->skipped > 0xFF ? 0xFF : c->skipped;
+        c->skipped = 0;
+        sim_txn.stageLen = 2;
+        sim_txn.stagePos = 1;
+        return sim_txn.stage[0];
+    }
+    if(c->fifoLen > 0){
+        return fifoPop(c);
+    }
+    if(!sim_txn.timeSent){
+        ticks = nsTick(sim_now) & 0xFFFFFF;
+        sim_txn.timeSent = 1;
+        sim_txn.stage[0] = F_SENSORTIME;
+        sim_txn.stage[1] = ticks & 0xFF;
+        sim_txn.stage[2] = (ticks >> 8) & 0xFF;
+        sim_txn.stage[3] = (ticks >> 16) & 0xFF;
+        sim_txn.stageLen = 4;
+        sim_txn.stagePos = 1;
+        return sim_txn.stage[0];
+    }
+    return F_END;
+}
+
+static uint8_t accelRead(SimChip* c, uint8_t addr){
+    uint16_t len;
+    uint32_t ticks;
+    uint8_t v;
+    switch (addr)
+    {
+    case A_FIFO_DATA:
+        return accelFIFOByte(c);
+    case A_FEATURE_CFG:
+        return c->feature[sim_txn.featurePos++ % FEATURE_BYTES];
+    case A_FIFO_LENGTH_0:
+    case A_FIFO_LENGTH_1:
+        len = c->fifoLen + (c->skipped ? 2 : 0); // Includes the skip frame the next read starts with
+        return addr == A_FIFO_LENGTH_0 ? len & 0xFF : len >> 8;
+    case A_SENSORTIME:
+    case A_SENSORTIME + 1:
+    case A_SENSORTIME + 2:
+        ticks = nsTick(sim_now);
+        return (ticks >> (8 * (addr - A_SENSORTIME))) & 0xFF;
+    case A_INT_STAT_1:
+        v = c->acc[addr];
+        c->acc[addr] &= ~0x80; // Cleared by reading
+        return v;
+    case A_GP_4:
+    case A_GP_4 + 1:
+        return ((uint16_t)c->synced[2] >> (8 * (addr - A_GP_4))) & 0xFF;
+    case A_GP_0:
+    case A_GP_0 + 1:
+    case A_GP_0 + 2:
+    case A_GP_0 + 3:
+        // INTERNAL_STATUS shares an address with the top of GP_0, a read starting there gets the status
+        if(addr == A_INTERNAL_STATUS && sim_txn.startAddr == A_INTERNAL_STATUS){
+            return c->acc[A_INTERNAL_STATUS];
+        }
+        return ((uint16_t)c->synced[(addr - A_GP_0) / 2] >> (8 * ((addr - A_GP_0) % 2))) & 0xFF;
+    case A_DATA + 5:
+        c->acc[A_STATUS] &= ~0x80;
+        return c->acc[addr];
+    default:
+        return c->acc[addr & 0x7F];
+    }
+}
+
+static uint8_t gyroRead(SimChip* c, uint8_t addr){
+    int16_t* f;
+    uint8_t v;
+    switch (addr)
+    {
+    case G_FIFO_DATA:
+        if(sim_txn.stagePos >= sim_txn.stageLen){
+            if(c->gLen == 0){
+                // Empty FIFO reads back as 0x8000 on every axis
+                memset(sim_txn.stage, 0, 6);
+                sim_txn.stage[1] = sim_txn.stage[3] = sim_txn.stage[5] = 0x80;
+            } else {
+                f = c->gfifo[c->gHead];
+                putCounts(sim_txn.stage, f);
+                c->gHead = (c->gHead + 1) % GYRO_FIFO_FRAMES;
+                c->gLen--;
+            }
+            sim_txn.stageLen = 6;
+            sim_txn.stagePos = 0;
+        }
+        return sim_txn.stage[sim_txn.stagePos++];
+    case G_FIFO_STATUS:
+        return (c->gOverrun << 7) | c->gLen;
+    case G_INT_STAT_1:
+        v = (c->gyr[addr] & 0x80) | (c->intLevel[2] || c->intLevel[3] ? 0x10 : 0);
+        c->gyr[addr] &= ~0x80;
+        return v;
+    default:
+        return addr < sizeof(c->gyr) ? c->gyr[addr] : 0;
+    }
+}
+
+static void chipDefaults(SimChip* c){
+    memset(c->acc, 0, sizeof(c->acc));
+    memset(c->gyr, 0, sizeof(c->gyr));
+    c->acc[A_CHIP_ID] = 0x1E;
+    c->acc[A_TEMP_MSB] = 0x02; // 25C
+    c->acc[A_CONF] = 0xA8;
+    c->acc[A_RANGE] = 0x01;
+    c->acc[A_FIFO_DOWNS] = 0x80;
+    c->acc[A_FIFO_WTM_0] = 0x88;
+    c->acc[A_FIFO_WTM_1] = 0x02;
+    c->acc[A_FIFO_CONFIG_0] = 0x02;
+    c->acc[A_FIFO_CONFIG_1] = 0x10;
+    c->acc[A_PWR_CONF] = 0x03;
+    c->gyr[G_CHIP_ID] = 0x0F;
+    c->gyr[G_BANDWIDTH] = 0x80;
+    c->gyr[G_IO_CONF] = 0x0F;
+    c->gyr[G_FIFO_WM_EN] = 0x08;
+    memset(c->intLevel, 0, sizeof(c->intLevel));
+    fifoFlush(c);
+    c->gHead = 0;
+    c->gLen = 0;
+    c->gOverrun = 0;
+    c->bistDoneNs = 0;
+    c->downsCount = 0;
+    c->dropNext = 0;
+    c->acc[A_INTERNAL_STATUS] = 0;
+    schedule(c);
+}
+
+// Clock
+
+static void queueIrq(uint8_t type, uint16_t pin, SPI_HandleTypeDef* hspi){
+    if(sim_irqCount < MAX_IRQS){
+        sim_irqs[sim_irqCount].type = type;
+        sim_irqs[sim_irqCount].pin = pin;
+        sim_irqs[sim_irqCount].hspi = hspi;
+        sim_irqCount++;
+    }
+}
+
+// Runs every event up to t in time order. With deliverEach, interrupts run as soon as they are raised
+static void runUntil(uint64_t t, uint8_t deliverEach){
+    SimChip* c;
+    uint64_t next;
+    int i, k, which, index;
+    while(1){
+        next = t + 1;
+        which = -1;
+        index = 0;
+        for(i = 0; i < sim_chipCount; i++){
+            c = &sim_chips[i];
+            for(k = 0; k < 2; k++){
+                if(c->nextNs[k] && c->nextNs[k] < next){
+                    next = c->nextNs[k];
+                    which = k;
+                    index = i;
+                }
+            }
+            if(c->bistDoneNs && c->bistDoneNs < next){
+                next = c->bistDoneNs;
+                which = EVENT_BIST;
+                index = i;
+            }
+        }
+        for(i = 0; i < sim_dmaCount; i++){
+            if(sim_dma[i].doneNs < next){
+                next = sim_dma[i].doneNs;
+                which = EVENT_DMA;
+                index = i;
+            }
+        }
+        if(which < 0){
+            break;
+        }
+        if(next > sim_now){
+            sim_now = next;
+        }
+        if(which == EVENT_DMA){
+            queueIrq(IRQ_DMA, 0, sim_dma[index].hspi);
+            sim_dma[index] = sim_dma[--sim_dmaCount];
+        } else {
+            c = &sim_chips[index];
+            if(which == SENSOR_ACCEL){
+                accelSample(c);
+                c->nextNs[SENSOR_ACCEL] = tickNs(nsTick(sim_now) + accelSampleTicks(c));
+            } else if(which == SENSOR_GYRO){
+                gyroSample(c);
+                c->nextNs[SENSOR_GYRO] += gyroPeriodNs(c);
+            } else {
+                c->gyr[G_SELF_TEST] = 0x12 | (c->failTest[SENSOR_GYRO] ? 0x04 : 0); // Ready, rate ok, maybe failed
+                c->bistDoneNs = 0;
+            }
+            updateLevels(c);
+        }
+        if(deliverEach){
+            deliver();
+        }
+    }
+    if(t > sim_now){
+        sim_now = t;
+    }
+}
+
+// Runs pending interrupts. They share one priority, so they never nest
+static void deliver(){
+    SimIrq irq;
+    if(sim_inIsr){
+        return;
+    }
+    sim_inIsr = 1;
+    while(sim_irqCount > 0){
+        irq = sim_irqs[0];
+        memmove(sim_irqs, sim_irqs + 1, (sim_irqCount - 1) * sizeof(SimIrq));
+        sim_irqCount--;
+        if(irq.type == IRQ_DMA){
+            irq.hspi->State = HAL_SPI_STATE_READY;
+            HAL_SPI_TxRxCpltCallback(irq.hspi);
+        } else {
+            HAL_GPIO_EXTI_Callback(irq.pin);
+        }
+    }
+    sim_inIsr = 0;
+}
+
+static void spend(uint64_t ns){
+    runUntil(sim_now + ns, 0);
+}
+
+// A HAL call is a point where an interrupt can get in
+static void preempt(){
+    runUntil(sim_now, 0);
+    if(sim_preempt){
+        deliver();
+    }
+}
+
+// Bus
+
+static uint8_t exchange(uint8_t mosi){
+    SimChip* c;
+    uint8_t miso;
+    if(sim_txn.chip == NO_CHIP){
+        return 0xFF;
+    }
+    c = &sim_chips[sim_txn.chip];
+    if(sim_txn.addr < 0){
+        sim_txn.addr = mosi & 0x7F;
+        sim_txn.startAddr = sim_txn.addr;
+        sim_txn.read = mosi & 0x80;
+        sim_txn.dummy = sim_txn.read && sim_txn.sensor == SENSOR_ACCEL;
+        if(sim_txn.addr == A_FEATURE_CFG && sim_txn.sensor == SENSOR_ACCEL){
+            sim_txn.featurePos = (c->acc[A_INIT_ADDR_0] & 0x0F) * 2 + c->acc[A_INIT_ADDR_1] * 32;
+        }
+        return 0xFF;
+    }
+    if(sim_txn.read){
+        if(sim_txn.dummy){
+            sim_txn.dummy = 0;
+            return 0xFF; // Accel sends one byte of garbage first
+        }
+        if(sim_txn.sensor == SENSOR_ACCEL){
+            miso = accelRead(c, sim_txn.addr);
+            if(sim_txn.addr != A_FIFO_DATA && sim_txn.addr != A_FEATURE_CFG){
+                sim_txn.addr++;
+            }
+        } else {
+            miso = gyroRead(c, sim_txn.addr);
+            if(sim_txn.addr != G_FIFO_DATA){
+                sim_txn.addr++;
+            }
+        }
+        // Draining a FIFO drops its watermark and full levels straight away, like the chip does
+        if(sim_txn.addr == (sim_txn.sensor == SENSOR_ACCEL ? A_FIFO_DATA : G_FIFO_DATA)){
+            updateLevels(c);
+        }
+        return miso;
+    }
+    if(sim_txn.sensor == SENSOR_ACCEL){
+        if(sim_txn.addr == A_FEATURE_CFG){
+            c->feature[sim_txn.featurePos % FEATURE_BYTES] = mosi;
+            sim_txn.featurePos++;
+            if(sim_txn.featurePos > c->featureLen){
+                c->featureLen = sim_txn.featurePos;
+            }
+        } else {
+            accelWrite(c, sim_txn.addr++, mosi);
+        }
+    } else {
+        gyroWrite(c, sim_txn.addr++, mosi);
+    }
+    updateLevels(c);
+    return 0xFF;
+}
+
+// Clocks size bytes through the selected chip. tx or rx may be NULL
+static void clockBytes(const uint8_t* tx, uint8_t* rx, uint16_t size){
+    uint16_t i;
+    uint8_t b;
+    for(i = 0; i < size; i++){
+        b = exchange(tx ? tx[i] : 0x00);
+        if(rx){
+            rx[i] = b;
+        }
+    }
+    sim_stats.bytes += size;
+    sim_stats.clockNs += (uint64_t)size * sim_byteNs;
+}
+
+static HAL_StatusTypeDef blocking(SPI_HandleTypeDef* hspi, const uint8_t* tx, uint8_t* rx, uint16_t size){
+    preempt();
+    sim_stats.halCalls++;
+    spend(sim_callNs);
+    if(hspi->State != HAL_SPI_STATE_READY){
+        sim_stats.busyRejects++;
+        return HAL_BUSY;
+    }
+    clockBytes(tx, rx, size);
+    spend((uint64_t)size * sim_byteNs);
+    return HAL_OK;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef* port, uint16_t pin, GPIO_PinState state){
+    int i, k;
+    uint8_t bit;
+    for(i = 0; i < sim_chipCount; i++){
+        for(k = 0; k < 2; k++){
+            if(sim_chips[i].csPort[k] != port || sim_chips[i].csPin[k] != pin){
+                continue;
+            }
+            bit = 1 << (2 * i + k);
+            if(state == GPIO_PIN_RESET && !(sim_selected & bit)){
+                if(sim_selected){
+                    sim_stats.collisions++;
+                } else {
+                    sim_selectedSince = sim_now;
+                }
+                sim_selected |= bit;
+                sim_stats.transactions++;
+                memset(&sim_txn, 0, sizeof(sim_txn));
+                sim_txn.chip = i;
+                sim_txn.sensor = k;
+                sim_txn.addr = -1;
+            } else if(state == GPIO_PIN_SET && (sim_selected & bit)){
+                sim_selected &= ~bit;
+                if(!sim_selected){
+                    sim_stats.selectedNs += sim_now - sim_selectedSince;
+                }
+                if(sim_txn.chip == i && sim_txn.sensor == k){
+                    sim_txn.chip = NO_CHIP;
+                }
+            }
+        }
+    }
+    spend(100);
+    preempt();
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef* hspi, uint8_t* data, uint16_t size, uint32_t timeout){
+    (void)timeout;
+    return blocking(hspi, data, NULL, size);
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef* hspi, uint8_t* data, uint16_t size, uint32_t timeout){
+    (void)timeout;
+    return blocking(hspi, NULL, data, size);
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef* hspi, uint8_t* tx, uint8_t* rx, uint16_t size, uint32_t timeout){
+    (void)timeout;
+    return blocking(hspi, tx, rx, size);
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef* hspi, uint8_t* tx, uint8_t* rx, uint16_t size){
+    preempt();
+    sim_stats.halCalls++;
+    spend(sim_callNs);
+    if(hspi->State != HAL_SPI_STATE_READY || sim_dmaCount == MAX_DMA){
+        return HAL_BUSY;
+    }
+    // Data moves now, the completion interrupt comes once the bytes would have been clocked
+    clockBytes(tx, rx, size);
+    hspi->State = HAL_SPI_STATE_BUSY_TX_RX;
+    sim_dma[sim_dmaCount].hspi = hspi;
+    sim_dma[sim_dmaCount].doneNs = sim_now + (uint64_t)size * sim_byteNs;
+    sim_dmaCount++;
+    return HAL_OK;
+}
+
+void HAL_Delay(uint32_t ms){
+    simAdvanceUs(ms * 1000);
+}
+
+// Reading the tick takes a little time and lets interrupts in, so wait loops polling it make progress
+uint32_t HAL_GetTick(void){
+    spend(TICK_READ_NS);
+    preempt();
+    return sim_now / 1000000;
+}
+
+__attribute__((weak)) void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef* hspi){
+    (void)hspi;
+}
+
+__attribute__((weak)) void HAL_GPIO_EXTI_Callback(uint16_t pin){
+    (void)pin;
+}
+
+// Test interface
+
+void simReset(){
+    memset(sim_chips, 0, sizeof(sim_chips));
+    memset(&sim_stats, 0, sizeof(sim_stats));
+    sim_chipCount = 0;
+    sim_now = 0;
+    sim_selected = 0;
+    sim_irqCount = 0;
+    sim_dmaCount = 0;
+    sim_inIsr = 0;
+    sim_preempt = 1;
+    sim_byteNs = 800;
+    sim_callNs = 1500;
+    sim_txn.chip = NO_CHIP;
+    simAddChip(CSA_GPIO_Port, CSA_Pin, CSG_GPIO_Port, CSG_Pin);
+    simSetIntPins(0, INT1_Pin, INT2_Pin, INT3_Pin, INT4_Pin);
+}
+
+int simAddChip(GPIO_TypeDef* accelPort, uint16_t accelPin, GPIO_TypeDef* gyroPort, uint16_t gyroPin){
+    SimChip* c = &sim_chips[sim_chipCount];
+    memset(c, 0, sizeof(*c));
+    c->csPort[SENSOR_ACCEL] = accelPort;
+    c->csPin[SENSOR_ACCEL] = accelPin;
+    c->csPort[SENSOR_GYRO] = gyroPort;
+    c->csPin[SENSOR_GYRO] = gyroPin;
+    c->signal[SENSOR_ACCEL] = gravity;
+    c->signal[SENSOR_GYRO] = still;
+    chipDefaults(c);
+    return sim_chipCount++;
+}
+
+void simSetIntPins(int chip, uint16_t int1, uint16_t int2, uint16_t int3, uint16_t int4){
+    sim_chips[chip].intPin[0] = int1;
+    sim_chips[chip].intPin[1] = int2;
+    sim_chips[chip].intPin[2] = int3;
+    sim_chips[chip].intPin[3] = int4;
+}
+
+void simSetAccelSignal(int chip, SimSignal signal, void* ctx){
+    sim_chips[chip].signal[SENSOR_ACCEL] = signal ? signal : gravity;
+    sim_chips[chip].ctx[SENSOR_ACCEL] = ctx;
+}
+
+void simSetGyroSignal(int chip, SimSignal signal, void* ctx){
+    sim_chips[chip].signal[SENSOR_GYRO] = signal ? signal : still;
+    sim_chips[chip].ctx[SENSOR_GYRO] = ctx;
+}
+
+void simAccelDrop(int chip, uint8_t frames){
+    sim_chips[chip].dropNext = frames;
+}
+
+void simFailSelfTests(int chip, uint8_t accel, uint8_t gyro){
+    sim_chips[chip].failTest[SENSOR_ACCEL] = accel;
+    sim_chips[chip].failTest[SENSOR_GYRO] = gyro;
+}
+
+void simPowerCycle(int chip){
+    chipDefaults(&sim_chips[chip]);
+}
+
+void simAdvanceUs(uint32_t us){
+    uint64_t end = sim_now + (uint64_t)us * 1000;
+    deliver();
+    runUntil(end, 1);
+}
+
+uint64_t simNowNs(){
+    return sim_now;
+}
+
+void simSetPreemption(uint8_t on){
+    sim_preempt = on;
+}
+
+void simRaiseExti(uint16_t pin){
+    queueIrq(IRQ_EXTI, pin, NULL);
+    preempt();
+}
+
+void simSetTiming(uint32_t sckHz, uint32_t halCallNs){
+    sim_byteNs = 8000000000ull / sckHz;
+    sim_callNs = halCallNs;
+}
+
+SimBusStats simBusStats(){
+    return sim_stats;
+}
+
+void simResetBusStats(){
+    memset(&sim_stats, 0, sizeof(sim_stats));
+    sim_selectedSince = sim_now;
+}
+
+uint8_t simAccelReg(int chip, uint8_t addr){
+    return sim_chips[chip].acc[addr & 0x7F];
+}
+
+uint8_t simGyroReg(int chip, uint8_t addr){
+    if(addr == G_FIFO_STATUS){
+        return (sim_chips[chip].gOverrun << 7) | sim_chips[chip].gLen;
+    }
+    return addr < sizeof(sim_chips[chip].gyr) ? sim_chips[chip].gyr[addr] : 0;
+}
+
+uint16_t simAccelFIFOBytes(int chip){
+    return sim_chips[chip].fifoLen;
+}
+
+uint8_t simGyroFIFOFrames(int chip){
+    return sim_chips[chip].gLen;
+}
@@ -0,0 +1,64 @@
+#ifndef __BMI088_SIM
+#define __BMI088_SIM
+
+#include "main.h"
+
+// Register-level BMI088 behind the fake HAL in main.h
+//  Models the accel dummy byte, both register maps, FIFOs filling at the configured ODR (downsampling,
+//  skip, drop, config and sensortime frames on the accel side, the 0x8000 empty sentinel and overrun on
+//  the gyro side), self-tests, data sync and the INT1-INT4 lines. SPI costs virtual time, so bus
+//  usage can be measured. Interrupts run as callbacks between HAL calls, like a real ISR would
+
+#define SIM_MAX_CHIPS 2
+
+// Signal a sensor sees at time ns, in m/s^2 or rad/s. Converted to counts at the chip's range, saturating
+typedef void (*SimSignal)(uint64_t ns, double* out, void* ctx);
+
+// Bus use since simReset or simResetBusStats
+typedef struct simBusStats
+{
+    uint32_t transactions; // Chip select cycles
+    uint32_t halCalls; // SPI calls, blocking and DMA
+    uint32_t bytes; // Bytes clocked
+    uint64_t clockNs; // Time SCK was running
+    uint64_t selectedNs; // Time any chip select was low
+    uint32_t collisions; // A chip select went low while another one already was
+    uint32_t busyRejects; // Blocking calls that got HAL_BUSY because DMA had the handle
+} SimBusStats;
+
+// One BMI088 on CSA/CSG with INT1-INT4 on INT1_Pin-INT4_Pin, at power-on. Clock restarts at 0
+void simReset();
+// Another BMI088 with its own chip selects. Returns its index for the calls below
+int simAddChip(GPIO_TypeDef* accelPort, uint16_t accelPin, GPIO_TypeDef* gyroPort, uint16_t gyroPin);
+// EXTI pin each interrupt line is wired to, 0 for none
+void simSetIntPins(int chip, uint16_t int1, uint16_t int2, uint16_t int3, uint16_t int4);
+// Default is 1g on z for the accel and no rotation
+void simSetAccelSignal(int chip, SimSignal signal, void* ctx);
+void simSetGyroSignal(int chip, SimSignal signal, void* ctx);
+// The next frames samples into the accel FIFO become drop frames
+void simAccelDrop(int chip, uint8_t frames);
+// Makes the self-tests fail
+void simFailSelfTests(int chip, uint8_t accel, uint8_t gyro);
+// Puts both sensors back to their power-on state without the driver knowing, like a brown-out
+void simPowerCycle(int chip);
+
+// Runs the clock, delivering any interrupts that come due
+void simAdvanceUs(uint32_t us);
+uint64_t simNowNs();
+// 1 (default) lets interrupts in at the start of any HAL call, like a real ISR preempting the main loop
+//  0 only delivers them from simAdvanceUs and HAL_Delay
+void simSetPreemption(uint8_t on);
+// Raises an EXTI line from the outside, e.g. a pin not wired to the simulated chip
+void simRaiseExti(uint16_t pin);
+// SPI clock and the fixed cost of each HAL call. Defaults are 10MHz and 1.5us
+void simSetTiming(uint32_t sckHz, uint32_t halCallNs);
+
+SimBusStats simBusStats();
+void simResetBusStats();
+// Direct register access, no bus time
+uint8_t simAccelReg(int chip, uint8_t addr);
+uint8_t simGyroReg(int chip, uint8_t addr);
+uint16_t simAccelFIFOBytes(int chip);
+uint8_t simGyroFIFOFrames(int chip);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef __HOST_MAIN_H
+#define __HOST_MAIN_H
+
+// Stand-in for the CubeMX main.h on a host build. Provides the part of the STM32 HAL the driver uses,
+//  backed by the simulated BMI088 in Bmi088Sim.c. Time only moves when the HAL is used or the test
+//  calls simAdvanceUs, so runs are repeatable
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum
+{
+    HAL_OK = 0,
+    HAL_ERROR,
+    HAL_BUSY,
+    HAL_TIMEOUT
+} HAL_StatusTypeDef;
+
+typedef enum
+{
+    GPIO_PIN_RESET = 0,
+    GPIO_PIN_SET
+} GPIO_PinState;
+
+typedef enum
+{
+    HAL_SPI_STATE_READY = 1,
+    HAL_SPI_STATE_BUSY_TX_RX = 5
+} HAL_SPI_StateTypeDef;
+
+typedef struct
+{
+    uint8_t id;
+} GPIO_TypeDef;
+
+typedef struct
+{
+    volatile HAL_SPI_StateTypeDef State; // Busy while a DMA transfer runs, blocking calls get HAL_BUSY meanwhile
+} SPI_HandleTypeDef;
+
+// Two ports are enough for a board with two BMI088s
+extern GPIO_TypeDef simPortA;
+extern GPIO_TypeDef simPortB;
+
+// Chip selects of the first BMI088, as CubeMX would name them
+#define CSA_GPIO_Port (&simPortA)
+#define CSA_Pin 0x0001
+#define CSG_GPIO_Port (&simPortA)
+#define CSG_Pin 0x0002
+// EXTI lines the simulator raises for INT1-INT4 of the first BMI088
+#define INT1_Pin 0x0010
+#define INT2_Pin 0x0020
+#define INT3_Pin 0x0040
+#define INT4_Pin 0x0080
+
+void HAL_GPIO_WritePin(GPIO_TypeDef* port, uint16_t pin, GPIO_PinState state);
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef* hspi, uint8_t* data, uint16_t size, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef* hspi, uint8_t* data, uint16_t size, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef* hspi, uint8_t* tx, uint8_t* rx, uint16_t size, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef* hspi, uint8_t* tx, uint8_t* rx, uint16_t size);
+void HAL_Delay(uint32_t ms);
+uint32_t HAL_GetTick(void);
+
+// Weak, like in the HAL. Define them in the test to get the interrupts
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef* hspi);
+void HAL_GPIO_EXTI_Callback(uint16_t pin);
+
+#endif
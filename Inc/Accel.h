@@ -3,6 +3,7 @@
 
 #include "main.h"
 #include "Vectors.h"
+#include "Stats.h"
 
 
 // Set port and pin for accelerometer here
@@ -18,10 +19,107 @@ typedef struct accelErrors
 typedef struct accelDataBuffer
 {
     uint8_t skipped; // Number of frames skipped between end of last FIFO access and start of this one
-    uint8_t len; // How many data frames there are
-    Vector3* array; // Acceleration data in m/s^2
+    uint16_t len; // How many data frames there are
+    Vector3* array; // Acceleration data in m/s^2. Points into the buffer passed to the read
+    uint8_t hasTime; // 1 if the readout ended with a sensortime frame
+    uint32_t sensortime; // Sensortime from that frame, in ACCEL_SENSORTIME_TICK_US ticks
+    uint16_t overflowed; // Frames after the last sample that didn't fit in the array, the timestamps allow for them
+    uint32_t* times; // Sensortime of each sample, if requested with ACCEL_READ_FIFO_TIMED. Otherwise NULL
 } AccelDataBuffer;
 
+typedef struct accelRawBuffer
+{
+    uint8_t skipped; // Number of frames skipped between end of last FIFO access and start of this one
+    uint16_t len; // How many data frames there are
+    Vector3Raw* array; // Raw counts, multiply by scale for m/s^2. Drops are VECTOR_RAW_NULL
+    uint16_t drops; // How many of them are drops. The converters don't look for them, use vMarkDrops if this isn't 0
+    uint8_t hasTime; // 1 if the readout ended with a sensortime frame
+    uint32_t sensortime; // Sensortime from that frame, in ACCEL_SENSORTIME_TICK_US ticks
+    uint16_t overflowed; // Frames after the last sample that didn't fit in the array, the timestamps allow for them
+    uint16_t configAt; // Samples from here on came after a config change frame (e.g. new range). len if there wasn't one. See ACCEL_PARSE_FIFO_STREAM
+    float scale; // m/s^2 per LSB for the samples before configAt. Later ones use ACCEL_GET_SCALE
+} AccelRawBuffer;
+
+typedef struct accelSoABuffer
+{
+    uint8_t skipped; // Number of frames skipped between end of last FIFO access and start of this one
+    uint16_t len; // How many data frames there are
+    Vector3SoA data; // Acceleration in m/s^2, one array per axis. Drops are NAN
+    uint8_t hasTime; // 1 if the readout ended with a sensortime frame
+    uint32_t sensortime; // Sensortime from that frame, in ACCEL_SENSORTIME_TICK_US ticks
+    uint16_t overflowed; // Frames after the last sample that didn't fit in the array, the timestamps allow for them
+    uint32_t* times; // Sensortime of each sample if times was passed to the read. Otherwise NULL
+} AccelSoABuffer;
+
+#define ACCEL_FIFO_FRAME_MAX_BYTES 7
+
+// FIFO data that never made it to the caller, counted since ACCEL_INIT_DEVICE or ACCEL_RESET_FIFO_STATS
+typedef struct accelFIFOStats
+{
+    uint32_t skipped; // Frames the chip threw away while its FIFO was full, from skip frames
+    uint32_t dropped; // Drop frames
+    uint32_t overflowed; // Frames read out that didn't fit in the caller's array
+    uint32_t resyncs; // Times the parser hit garbage and had to search for the next frame
+    uint32_t discardedBytes; // Bytes of garbage skipped over
+} AccelFIFOStats;
+
+// FIFO parser state kept from one readout to the next
+typedef struct accelFIFOParser
+{
+    uint8_t partial[ACCEL_FIFO_FRAME_MAX_BYTES]; // Start of a frame cut off by the end of the last readout
+    uint8_t partialLen;
+    uint8_t resyncing;
+    uint8_t configFrames; // Config change frames since the device readouts last switched scale
+    uint8_t configPending; // Last call ended with a config frame after its last sample
+    double scale; // m/s^2 per LSB of the data queued ahead of the next config frame, reported as the buffer's scale
+    AccelFIFOStats stats;
+} AccelFIFOParser;
+
+#define ACCEL_SHADOW_REGS 13 // Config registers mirrored in memory
+
+// Everything needed to talk to one accelerometer. Filled in by ACCEL_INIT_DEVICE, don't touch the fields
+typedef struct accelState
+{
+    SPI_HandleTypeDef* hspi;
+    GPIO_TypeDef* csPort;
+    uint16_t csPin;
+    uint8_t maxRangeBits;
+    double maxRangeReal;
+    double scale; // m/s^2 per LSB
+    uint8_t bwp;
+    uint8_t odr;
+    uint8_t fifoDowns; // Power of two the FIFO is downsampled by
+    uint8_t shadow[ACCEL_SHADOW_REGS]; // Last value written to or read from each config register
+    uint16_t shadowValid; // Bit per shadow entry, set once its value is known
+    SensorCal calib;
+    VectorCal folded; // calib folded into scale, used for every Vector3 output
+    AccelFIFOParser fifo; // Its scale catches up with scale at the config frame after a range change
+#ifdef BMI088_STATS
+    SensorStats stats;
+#endif
+} AccelState;
+
+// Everything ACCEL_READ_SNAPSHOT gets in one transaction
+typedef struct accelSnapshot
+{
+    Vector3 acceleration; // m/s^2
+    uint32_t sensortime; // In ACCEL_SENSORTIME_TICK_US ticks
+    uint8_t dataReady; // 1 if new data arrived since the last snapshot. Reading clears it
+} AccelSnapshot;
+
+// Progress of a non-blocking self-test, see ACCEL_SELF_TEST_BEGIN
+typedef struct accelSelfTest
+{
+    uint8_t state;
+    uint8_t result; // ACCEL_TEST_RUNNING until it finishes, then 1 for pass, 0 for fail
+    uint32_t wakeAt; // Next step is due at this time, in the caller's milliseconds
+    Vector3 positive;
+    Vector3 negative;
+} AccelSelfTest;
+
+// Called once a DMA FIFO readout has been parsed
+typedef void (*AccelFIFOCallback)(AccelDataBuffer);
+
 // Constants
 // Power modes for entire chip
 #define ACCEL_PWR_SUSPEND 0x03
@@ -47,7 +145,10 @@ typedef struct accelDataBuffer
 #define ACCEL_RANGE_6G 0x01
 #define ACCEL_RANGE_12G 0x02
 #define ACCEL_RANGE_24G 0x03
+// Self-test
+#define ACCEL_TEST_RUNNING 0xFF
 // FIFO
+#define ACCEL_FIFO_MAX_FRAMES 146 // Most data frames that fit in the 1024 byte FIFO
 #define ACCEL_FIFO_ENABLED 0b01010000
 #define ACCEL_FIFO_DISABLED 0b00010000
 #define ACCEL_FIFO_MODE_STREAM 0x2
@@ -60,6 +161,32 @@ typedef struct accelDataBuffer
 #define ACCEL_FIFO_DOWNSAMP_32x  0xD0
 #define ACCEL_FIFO_DOWNSAMP_64x  0xE0
 #define ACCEL_FIFO_DOWNSAMP_128x 0xF0
+// Interrupt pin behaviour, OR together for INT1/INT2 config
+#define ACCEL_INT_OUTPUT 0x08
+#define ACCEL_INT_INPUT 0x10
+#define ACCEL_INT_OPEN_DRAIN 0x04
+#define ACCEL_INT_PUSH_PULL 0x00
+#define ACCEL_INT_ACTIVE_HIGH 0x02
+#define ACCEL_INT_ACTIVE_LOW 0x00
+// Interrupt sources, OR together for the interrupt map
+#define ACCEL_INT1_FIFO_WATERMARK 0x01
+#define ACCEL_INT1_FIFO_FULL 0x02
+#define ACCEL_INT1_DATA_READY 0x04
+#define ACCEL_INT2_FIFO_WATERMARK 0x10
+#define ACCEL_INT2_FIFO_FULL 0x20
+#define ACCEL_INT2_DATA_READY 0x40
+// Feature interrupt sources, for INT1/INT2 feature maps. Needs the config file loaded
+#define ACCEL_INT_DATA_SYNC 0x01
+
+// Data sync modes. Accel samples are taken on the gyro data ready at this rate
+#define ACCEL_DATA_SYNC_OFF 0x00
+#define ACCEL_DATA_SYNC_400 0x01
+#define ACCEL_DATA_SYNC_1K 0x02
+#define ACCEL_DATA_SYNC_2K 0x03
+
+// Sensortime is a 24 bit counter at 25.6kHz
+#define ACCEL_SENSORTIME_TICK_US 39.0625
+#define ACCEL_SENSORTIME_MASK 0xFFFFFF
 
 // Swap for units to be m/s^2 or ft/s^2
 #define GRAV 9.80665
@@ -69,29 +196,59 @@ typedef struct accelDataBuffer
 
 // Basic initialization. Performs nescesarry dummy read
 void ACCEL_INIT(SPI_HandleTypeDef* spiHandler);
+// Same as ACCEL_INIT for an accelerometer on any bus and chip select. Makes it the current device
+void ACCEL_INIT_DEVICE(AccelState* dev, SPI_HandleTypeDef* spiHandler, GPIO_TypeDef* csPort, uint16_t csPin);
+// Every other ACCEL_ call goes to the current device. Switch from the main loop only
+void ACCEL_USE_DEVICE(AccelState* dev);
+AccelState* ACCEL_CURRENT_DEVICE();
 void ACCEL_GOOD_SETTINGS();
 // Performs the self-test procedure. Takes > 150ms
 //  returns 1 for sucess, 0, for failure
 uint8_t ACCEL_SELF_TEST();
+// Same test without blocking. nowMs is any millisecond clock, e.g. HAL_GetTick()
+//  Keep calling ACCEL_SELF_TEST_STEP (it is a no-op until wakeAt) until it stops returning ACCEL_TEST_RUNNING
+void ACCEL_SELF_TEST_BEGIN(AccelSelfTest* test, uint32_t nowMs);
+uint8_t ACCEL_SELF_TEST_STEP(AccelSelfTest* test, uint32_t nowMs);
 
-// Reads all settings from accelerometer into memory
+// Reads all settings from accelerometer into memory. Setters skip writes that wouldn't change anything,
+//  so call this if the chip may have been changed behind the driver's back (e.g. reset)
 void ACCEL_RELOAD_SETTINGS();
+// Compares the chip's config registers against memory. Returns the number that differ, 0 if all good
+uint8_t ACCEL_VERIFY_SETTINGS();
+// Writes every setting held in memory back to the chip, e.g. after an unexpected reset
+void ACCEL_RESTORE_SETTINGS();
 
 //    Read functions
 uint8_t ACCEL_READ_ID();
 
 Vector3 ACCEL_READ_ACCELERATION();
+// Acceleration, sensortime and data-ready status in a single burst
+AccelSnapshot ACCEL_READ_SNAPSHOT();
 
 float ACCEL_READ_TEMPERATURE();
 uint32_t ACCEL_READ_SENSORTIME();
 
 AccelError ACCEL_READ_ERROR_STATUS();
 
+// 1 if a new sample is waiting in the data registers
 uint8_t ACCEL_READ_DATA_READY();
 
+// Served from memory
 uint8_t ACCEL_READ_PWR_MODE();
 uint8_t ACCEL_READ_ACCEL_ENABLED();
 
+// m/s^2 per LSB of raw data at the current range
+float ACCEL_GET_SCALE();
+// Calibration for ACCEL_READ_ACCELERATION, ACCEL_READ_SNAPSHOT and the Vector3 FIFO reads (blocking, timed and DMA)
+//  Not applied to ACCEL_READ_FIFO_RAW, ACCEL_READ_FIFO_SOA, ACCEL_PARSE_FIFO_STREAM or vRawToF/vRawToQ conversions
+//  Folded into the range scale. Scale and offset only cost the same as none, misalignment makes every sample
+//  a full 3x3 multiply. NULL removes it
+void ACCEL_SET_CALIBRATION(const SensorCal* cal);
+SensorCal ACCEL_GET_CALIBRATION();
+// Output data rate, and the rate frames enter the FIFO after downsampling
+float ACCEL_GET_ODR_HZ();
+float ACCEL_GET_FIFO_RATE_HZ();
+
 
 //     Write functions
 
@@ -106,11 +263,87 @@ void ACCEL_WRITE_ACCEL_DISABLE();
 
 // First In First Out
 
+// Number of bytes waiting in the FIFO
 uint16_t ACCEL_READ_FIFO_LEN();
+// Only transfers the bytes reported by ACCEL_READ_FIFO_LEN
+//  array is malloc'd and must be freed by the caller. NULL if the FIFO was empty
 AccelDataBuffer ACCEL_READ_FIFO();
+// Same as ACCEL_READ_FIFO but writes up to capacity samples into array. Does not allocate
+//  ACCEL_FIFO_MAX_FRAMES is always enough to hold a full FIFO
+AccelDataBuffer ACCEL_READ_FIFO_INTO(Vector3* array, uint16_t capacity);
+// Same as ACCEL_READ_FIFO_INTO but also fills times with the sensortime of each sample
+//  Times are reconstructed from the sensortime frame at the end of the FIFO, so no extra transaction is needed
+AccelDataBuffer ACCEL_READ_FIFO_TIMED(Vector3* array, uint32_t* times, uint16_t capacity);
+// Same as ACCEL_READ_FIFO_INTO but leaves unit conversion to the caller
+//  e.g. vRawToF(raw.array, out, raw.len, ACCEL_GET_SCALE()) for single precision. Check raw.drops for drop frames
+AccelRawBuffer ACCEL_READ_FIFO_RAW(Vector3Raw* array, uint16_t capacity);
+// Same as ACCEL_READ_FIFO_TIMED but as float with a separate array per axis, for DSP filters
+//  out.x/y/z need room for capacity samples. times may be NULL
+AccelSoABuffer ACCEL_READ_FIFO_SOA(Vector3SoA out, uint32_t* times, uint16_t capacity);
+// Parses len bytes of FIFO data that has already been read out (or recorded) into array
+//  Does not touch the bus. Starts from scratch, so a frame cut off at the end is lost. Reports the current device's scale
+AccelRawBuffer ACCEL_PARSE_FIFO(const uint8_t* rawBuff, uint16_t len, Vector3Raw* array, uint16_t capacity);
+// Same, but carries a cut off frame over to the next call and skips over garbage to the next valid frame
+//  Every readout above goes through the device's own parser. Zero parser before the first call, then set its scale
+//  to the range the data was recorded at. The buffer's scale is the parser's, whatever the current device is
+//  configAt only indexes this call's output. A config frame with no samples after it in this call, whole or
+//  finished from carried over bytes, shows up as configAt 0 in the next call, so no boundary is lost between readouts
+AccelRawBuffer ACCEL_PARSE_FIFO_STREAM(AccelFIFOParser* parser, const uint8_t* rawBuff, uint16_t len, Vector3Raw* array, uint16_t capacity);
+// What the current device's FIFO readouts have lost so far
+AccelFIFOStats ACCEL_GET_FIFO_STATS();
+void ACCEL_RESET_FIFO_STATS();
+#ifdef BMI088_STATS
+// Copy of the current device's instrumentation, see Stats.h. Fields written from interrupts may be one update apart
+SensorStats ACCEL_GET_STATS();
+void ACCEL_RESET_STATS();
+#endif
+// Works back from the sensortime at the end of a readout to the time of each of its len samples
+//  Uses the cached ODR and FIFO downsampling. Drop frames hold a slot so they are accounted for
+//  Pass the buffer's overflowed, the sensortime frame came after those frames rather than after the last sample
+void ACCEL_FILL_TIMESTAMPS(uint32_t sensortime, uint16_t len, uint32_t* times, uint16_t overflowed);
+void ACCEL_FILL_DEVICE_TIMESTAMPS(AccelState* dev, uint32_t sensortime, uint16_t len, uint32_t* times, uint16_t overflowed);
+
+// Starts a non-blocking FIFO readout over DMA into array. Returns 1 if the transfer was started
+//  The fill level and the data are two DMA transfers back to back, nothing blocks
+//  callback runs from ACCEL_DMA_COMPLETE (interrupt context) with the parsed data, len 0 if the FIFO was empty
+//  Returns 0 if another driver transfer owns the bus. Blocking calls wait for the readout to finish
+uint8_t ACCEL_READ_FIFO_DMA(Vector3* array, uint16_t capacity, AccelFIFOCallback callback);
+// Same but for a specific device, so it can be chained from a DMA callback. Only one accel transfer runs at a time across all devices
+uint8_t ACCEL_READ_DEVICE_FIFO_DMA(AccelState* dev, Vector3* array, uint16_t capacity, AccelFIFOCallback callback);
+uint8_t ACCEL_DMA_BUSY();
+// Call from HAL_SPI_TxRxCpltCallback. Returns 1 if the finished transfer belonged to the accelerometer
+uint8_t ACCEL_DMA_COMPLETE(SPI_HandleTypeDef* hspi);
 
 void ACCEL_WRITE_FIFO_ENABLED(uint8_t enabled);
 void ACCEL_WRITE_FIFO_MODE(uint8_t modeFIFO);
 void ACCEL_WRITE_FIFO_DOWNSAMP(uint8_t downsampFIFO);
+// Watermark interrupt fires once this many bytes are queued
+void ACCEL_WRITE_FIFO_WATERMARK(uint16_t bytes);
+// Same, in data frames or in milliseconds at the current ODR and downsampling
+//  Set these after ACCEL_SET_CONFIG/ACCEL_WRITE_FIFO_DOWNSAMP
+void ACCEL_WRITE_FIFO_WATERMARK_SAMPLES(uint16_t samples);
+void ACCEL_WRITE_FIFO_WATERMARK_MS(uint16_t ms);
+
+// Interrupts
+
+void ACCEL_WRITE_INT1_CONFIG(uint8_t intConfig);
+void ACCEL_WRITE_INT2_CONFIG(uint8_t intConfig);
+// Selects which events drive INT1/INT2. 0 unmaps everything
+void ACCEL_WRITE_INT_MAP(uint8_t intMap);
+// Same for the config file features, e.g. ACCEL_INT_DATA_SYNC
+void ACCEL_WRITE_INT1_FEATURE_MAP(uint8_t intMap);
+void ACCEL_WRITE_INT2_FEATURE_MAP(uint8_t intMap);
+
+// Data sync
+
+// Uploads Bosch's feature config file (bmi08x_config_file in their sensor API), which data sync needs
+//  Has to be redone after every power up or reset. Returns 1 if the chip accepted it. Takes > 150ms
+uint8_t ACCEL_LOAD_CONFIG_FILE(const uint8_t* config, uint16_t len);
+// Sets the data sync mode in the loaded feature config. Also needs ACCEL_ODR_1600 and the gyro at the matching rate
+void ACCEL_WRITE_DATA_SYNC(uint8_t syncMode);
+// Sample taken at the last sync trigger, plus sensortime at the time of reading. Only valid in data sync mode
+AccelSnapshot ACCEL_READ_SYNCED_SNAPSHOT();
+// Same but for a specific device, without changing the current one
+AccelSnapshot ACCEL_READ_DEVICE_SYNCED_SNAPSHOT(AccelState* dev);
 
 #endif
\ No newline at end of file
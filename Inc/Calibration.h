@@ -0,0 +1,37 @@
+#ifndef __CALIBRATION
+#define __CALIBRATION
+
+#include <stdint.h>
+#include "Accel.h"
+#include "Gyro.h"
+
+// Estimates SensorCal values for ACCEL_SET_CALIBRATION/GYRO_SET_CALIBRATION, and packs them for storage
+
+// Order of the six accel positions in calAccelSixPosition. Named axis pointing straight up
+#define CAL_POS_X_UP 0
+#define CAL_POS_X_DOWN 1
+#define CAL_POS_Y_UP 2
+#define CAL_POS_Y_DOWN 3
+#define CAL_POS_Z_UP 4
+#define CAL_POS_Z_DOWN 5
+
+// Size of a serialized accel + gyro calibration
+#define CAL_BLOB_BYTES 102
+
+// Averages samples readings (about 1ms apart) with calibration switched off, then puts it back. Keep the sensor still
+//  Blocking, uses the current device
+Vector3 calCollectAccel(uint16_t samples);
+Vector3 calCollectGyro(uint16_t samples);
+
+// Sets the bias in cal from the mean rate over a still period. The rest of cal is left alone
+void calGyroBias(Vector3 stillMean, SensorCal* cal);
+// Works out offset and per-axis scale from the mean reading in each of the six positions (see CAL_POS_*)
+//  With misalignment set the cross-axis terms are solved for as well. Returns 0 if the readings don't make sense
+uint8_t calAccelSixPosition(const Vector3* means, uint8_t misalignment, SensorCal* cal);
+
+// Packs both calibrations into CAL_BLOB_BYTES bytes with a CRC, e.g. for flash. Returns the length
+uint16_t calSerialize(const SensorCal* accel, const SensorCal* gyro, uint8_t* blob);
+// Returns 1 and fills accel/gyro if blob is intact, 0 otherwise
+uint8_t calDeserialize(const uint8_t* blob, uint16_t len, SensorCal* accel, SensorCal* gyro);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "main.h"
 #include "Vectors.h"
+#include "Stats.h"
 #include <stdlib.h>
 
 // Set port and pin for gyro here
@@ -11,10 +12,64 @@
 
 typedef struct gyroDataBuffer
 {
+    uint8_t overrun; // 1 if the FIFO overflowed and frames were lost. Stays set until GYRO_CLEAR_FIFO_OVERRUN
     uint8_t len; // How many data frames there are
-    Vector3* array; // Rate data in rad/s
+    Vector3* array; // Rate data in rad/s. Points into the buffer passed to the read
 } GyroDataBuffer;
 
+typedef struct gyroRawBuffer
+{
+    uint8_t overrun; // 1 if the FIFO overflowed and frames were lost. Stays set until GYRO_CLEAR_FIFO_OVERRUN
+    uint8_t len; // How many data frames there are
+    Vector3Raw* array; // Raw counts, multiply by GYRO_GET_SCALE for rad/s
+} GyroRawBuffer;
+
+typedef struct gyroSoABuffer
+{
+    uint8_t overrun; // 1 if the FIFO overflowed and frames were lost. Stays set until GYRO_CLEAR_FIFO_OVERRUN
+    uint8_t len; // How many data frames there are
+    Vector3SoA data; // Rates in rad/s, one array per axis
+} GyroSoABuffer;
+
+#define GYRO_SHADOW_REGS 9 // Config registers mirrored in memory
+
+// Everything needed to talk to one gyroscope. Filled in by GYRO_INIT_DEVICE, don't touch the fields
+typedef struct gyroState
+{
+    SPI_HandleTypeDef* hspi;
+    GPIO_TypeDef* csPort;
+    uint16_t csPin;
+    uint8_t range;
+    double scale; // rad/s per LSB
+    uint8_t odr;
+    uint8_t shadow[GYRO_SHADOW_REGS]; // Last value written to or read from each config register
+    uint16_t shadowValid; // Bit per shadow entry, set once its value is known
+    SensorCal calib;
+    VectorCal folded; // calib folded into scale, used for every Vector3 output
+#ifdef BMI088_STATS
+    SensorStats stats;
+#endif
+} GyroState;
+
+// Everything GYRO_READ_SNAPSHOT gets in one transaction
+typedef struct gyroSnapshot
+{
+    Vector3 rates; // rad/s
+    uint8_t dataReady; // 1 if new data arrived since the last snapshot
+    uint8_t fifoInt; // 1 if the FIFO interrupt is raised
+} GyroSnapshot;
+
+// Progress of a non-blocking self-test, see GYRO_SELF_TEST_BEGIN
+typedef struct gyroSelfTest
+{
+    uint8_t result; // GYRO_TEST_RUNNING until it finishes, then 1 for pass, 0 for fail
+    uint8_t polls;
+    uint32_t wakeAt; // Next poll is due at this time, in the caller's milliseconds
+} GyroSelfTest;
+
+// Called once a DMA FIFO readout has been parsed
+typedef void (*GyroFIFOCallback)(GyroDataBuffer);
+
 // Constants
 // Power mode for gyro
 #define GYRO_PWR_DEEP_SUSPND 0x20
@@ -36,32 +91,118 @@ typedef struct gyroDataBuffer
 #define GYRO_ODR_100__BW_12 0x05
 #define GYRO_ODR_200__BW_64 0x06
 #define GYRO_ODR_100__BW_32 0x07
+// Self-test
+#define GYRO_TEST_RUNNING 0xFF
 // FIFO
+#define GYRO_FIFO_MAX_FRAMES 100
 #define GYRO_FIFO_DISABLED 0x00
 #define GYRO_FIFO_STOP_AT_FULL 0x40
 #define GYRO_FIFO_STREAM 0x80
+// Interrupt enables, OR together
+#define GYRO_INT_DATA_READY_EN 0x80
+#define GYRO_INT_FIFO_EN 0x40
+// Interrupt pin behaviour, OR together. Default is push-pull, active low
+#define GYRO_INT3_ACTIVE_HIGH 0x01
+#define GYRO_INT3_OPEN_DRAIN 0x02
+#define GYRO_INT4_ACTIVE_HIGH 0x04
+#define GYRO_INT4_OPEN_DRAIN 0x08
+// Interrupt sources, OR together for the interrupt map
+#define GYRO_INT3_DATA_READY 0x01
+#define GYRO_INT3_FIFO 0x04
+#define GYRO_INT4_FIFO 0x20
+#define GYRO_INT4_DATA_READY 0x80
 
 void GYRO_INIT(SPI_HandleTypeDef* spiHandler);
+// Same as GYRO_INIT for a gyroscope on any bus and chip select. Makes it the current device
+void GYRO_INIT_DEVICE(GyroState* dev, SPI_HandleTypeDef* spiHandler, GPIO_TypeDef* csPort, uint16_t csPin);
+// Every other GYRO_ call goes to the current device. Switch from the main loop only
+void GYRO_USE_DEVICE(GyroState* dev);
+GyroState* GYRO_CURRENT_DEVICE();
 void GYRO_GOOD_SETTINGS();
-// Performs the self-test procedure. Takes > 150ms
+// Performs the self-test procedure. Blocks until it finishes, up to 1s
 //  returns 1 for sucess, 0, for failure
 uint8_t GYRO_SELF_TEST();
+// Same test without blocking. nowMs is any millisecond clock, e.g. HAL_GetTick()
+//  Keep calling GYRO_SELF_TEST_STEP (it is a no-op until wakeAt) until it stops returning GYRO_TEST_RUNNING
+void GYRO_SELF_TEST_BEGIN(GyroSelfTest* test, uint32_t nowMs);
+uint8_t GYRO_SELF_TEST_STEP(GyroSelfTest* test, uint32_t nowMs);
 
-// Reads all settings from gyroscope into memory
+// Reads all settings from gyroscope into memory. Setters skip writes that wouldn't change anything,
+//  so call this if the chip may have been changed behind the driver's back (e.g. reset)
 void GYRO_RELOAD_SETTINGS();
+// Compares the chip's config registers against memory. Returns the number that differ, 0 if all good
+uint8_t GYRO_VERIFY_SETTINGS();
+// Writes every setting held in memory back to the chip, e.g. after an unexpected reset
+void GYRO_RESTORE_SETTINGS();
 
 //    Read functions
 uint8_t GYRO_READ_ID();
 
 Vector3 GYRO_READ_RATES();
+// Same but for a specific device, without changing the current one
+Vector3 GYRO_READ_DEVICE_RATES(GyroState* dev);
+// Rates and interrupt status in a single burst
+GyroSnapshot GYRO_READ_SNAPSHOT();
 
+// rad/s per LSB of raw data at the current range
+float GYRO_GET_SCALE();
+// Calibration for GYRO_READ_RATES, GYRO_READ_SNAPSHOT and the Vector3 FIFO reads (blocking and DMA)
+//  Not applied to GYRO_READ_FIFO_RAW, GYRO_READ_FIFO_SOA or vRawToF/vRawToQ conversions
+//  Folded into the range scale. Scale and offset only cost the same as none, misalignment makes every sample
+//  a full 3x3 multiply. NULL removes it
+void GYRO_SET_CALIBRATION(const SensorCal* cal);
+SensorCal GYRO_GET_CALIBRATION();
+float GYRO_GET_ODR_HZ();
+
+// Number of frames waiting in the FIFO
+uint8_t GYRO_READ_FIFO_LEN();
+// array is malloc'd and must be freed by the caller. NULL if the FIFO was empty
 GyroDataBuffer GYRO_READ_FIFO();
+// Same as GYRO_READ_FIFO but writes up to capacity samples into array. Does not allocate
+//  Frames that don't fit are left in the FIFO
+GyroDataBuffer GYRO_READ_FIFO_INTO(Vector3* array, uint8_t capacity);
+// Same as GYRO_READ_FIFO_INTO but leaves unit conversion to the caller
+//  e.g. vRawToF(raw.array, out, raw.len, GYRO_GET_SCALE()) for single precision
+GyroRawBuffer GYRO_READ_FIFO_RAW(Vector3Raw* array, uint8_t capacity);
+// Same as GYRO_READ_FIFO_INTO but as float with a separate array per axis, for DSP filters
+//  out.x/y/z need room for capacity samples
+GyroSoABuffer GYRO_READ_FIFO_SOA(Vector3SoA out, uint8_t capacity);
+// Parses the given number of FIFO frames that have already been read out (or recorded) into array
+//  Does not touch the bus. Used by all the readouts above
+GyroRawBuffer GYRO_PARSE_FIFO(const uint8_t* rawBuff, uint8_t frames, Vector3Raw* array);
+#ifdef BMI088_STATS
+// Copy of the current device's instrumentation, see Stats.h. Fields written from interrupts may be one update apart
+SensorStats GYRO_GET_STATS();
+void GYRO_RESET_STATS();
+#endif
+
+// Starts a non-blocking FIFO readout over DMA into array. Returns 1 if the transfer was started
+//  The frame count and the data are two DMA transfers back to back, nothing blocks
+//  callback runs from GYRO_DMA_COMPLETE (interrupt context) with the parsed data, len 0 if the FIFO was empty
+//  Returns 0 if another driver transfer owns the bus. Blocking calls wait for the readout to finish
+uint8_t GYRO_READ_FIFO_DMA(Vector3* array, uint8_t capacity, GyroFIFOCallback callback);
+// Same but for a specific device, so it can be chained from a DMA callback. Only one gyro transfer runs at a time across all devices
+uint8_t GYRO_READ_DEVICE_FIFO_DMA(GyroState* dev, Vector3* array, uint8_t capacity, GyroFIFOCallback callback);
+uint8_t GYRO_DMA_BUSY();
+// Call from HAL_SPI_TxRxCpltCallback. Returns 1 if the finished transfer belonged to the gyro
+uint8_t GYRO_DMA_COMPLETE(SPI_HandleTypeDef* hspi);
 
 //     Write functions
 
 void GYRO_SET_POWERMODE(uint8_t gyroPowermode);
 void GYRO_SET_RANGE(uint8_t gyroRange);
 void GYRO_SET_OUPUT_DATA_RATE(uint8_t gyroODR);
+// Always written, even with the mode unchanged. Empties the FIFO and clears overrun
 void GYRO_SET_FIFO_MODE(uint8_t gyroFIFOMode);
+// Same as setting the current FIFO mode again. Queued frames are thrown away with the flag
+void GYRO_CLEAR_FIFO_OVERRUN();
+// Watermark interrupt fires once this many frames are queued. 0 disables it
+void GYRO_SET_FIFO_WATERMARK(uint8_t frames);
+// Same, in milliseconds at the current ODR. Set after GYRO_SET_OUPUT_DATA_RATE
+void GYRO_SET_FIFO_WATERMARK_MS(uint16_t ms);
+void GYRO_SET_INT_ENABLE(uint8_t gyroIntEnable);
+void GYRO_SET_INT_PIN_CONFIG(uint8_t gyroIntConfig);
+// Selects which events drive INT3/INT4. 0 unmaps everything
+void GYRO_SET_INT_MAP(uint8_t gyroIntMap);
 
 #endif
\ No newline at end of file
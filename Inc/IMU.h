@@ -5,11 +5,106 @@
 
 #include "Accel.h"
 #include "Gyro.h"
+#include "SampleRing.h"
+#include "SensorLog.h"
+
+// One BMI088. Keep one of these per chip when running several
+typedef struct bmi088
+{
+    AccelState accel;
+    GyroState gyro;
+} Bmi088;
+
+// Where one device's FIFO data goes during IMU_READ_ALL_FIFO_DMA
+typedef struct imuDrainTarget
+{
+    Vector3* accelArray;
+    uint16_t accelCapacity;
+    Vector3* gyroArray;
+    uint8_t gyroCapacity;
+} IMUDrainTarget;
+
+// Accel and gyro captured at the same instant in data sync mode
+typedef struct imuSample
+{
+    Vector3 accel; // m/s^2
+    Vector3 gyro; // rad/s
+    uint32_t sensortime; // When the pair was read, within one sample of capture. ACCEL_SENSORTIME_TICK_US ticks
+} ImuSample;
+
+// Called when IMU_START finishes. ready is what IMU_READY would have returned
+typedef void (*IMUStartCallback)(int ready);
+
+// Called once per device as IMU_READ_ALL_FIFO_DMA works through them. device is the index into the array
+//  If the bus refuses a transfer part way, that device and the ones after it are called back straight away
+//  with len 0 for every readout that didn't run
+typedef void (*IMUDrainCallback)(uint8_t device, AccelDataBuffer accel, GyroDataBuffer gyro);
 
 void IMU_INIT(SPI_HandleTypeDef* spiHandler);
+// Same as IMU_INIT for a chip on any bus and chip selects. Makes it the current device
+void IMU_INIT_DEVICE(Bmi088* imu, SPI_HandleTypeDef* spiHandler, GPIO_TypeDef* accelPort, uint16_t accelPin,
+                     GPIO_TypeDef* gyroPort, uint16_t gyroPin);
+// Points every ACCEL_, GYRO_ and IMU_ call at imu. Switch from the main loop only
+void IMU_USE_DEVICE(Bmi088* imu);
 
 void IMU_SETUP_FOR_LOGGING();
+// Scales and rates for logConfig, from the settings held in memory. No bus traffic
+LogConfig IMU_GET_LOG_CONFIG();
+// Logs an accel readout from the current device, with config records as needed. A readout with a range change
+//  part way (configAt < len) is split into two records, each logged under the range its samples were taken at
+//  Returns 0 and leaves enc as it was if it doesn't all fit, flush and call again
+//  Records are timed on the same grid as ACCEL_FILL_TIMESTAMPS, and untimed if the readout had no sensortime
+uint8_t IMU_LOG_ACCEL(LogEncoder* enc, AccelRawBuffer buffer);
+// Logs a gyro readout from the current device, after a config record if the settings changed. Same return as IMU_LOG_ACCEL
+uint8_t IMU_LOG_GYRO(LogEncoder* enc, GyroRawBuffer buffer);
 void IMU_ENABLE_ALL();
+// Runs both self-tests side by side. Blocking
+//  1 if both pass, -1 accel failed, -2 gyro failed, -3 both failed
 int IMU_READY();
+// IMU_ENABLE_ALL followed by IMU_READY without blocking, both sensors at once. Uses the current devices
+//  Drive it with IMU_START_TICK. Leave the chip alone until callback has run
+void IMU_START(IMUStartCallback callback, uint32_t nowMs);
+// Call from the main loop with any millisecond clock, e.g. HAL_GetTick(). Returns 1 while startup is still running
+uint8_t IMU_START_TICK(uint32_t nowMs);
+
+// Drains both FIFOs over DMA. The gyro transfer is started once the accelerometer one finishes
+//  so the two can share a bus. Returns 1 if the transfers were started
+//  If the bus is taken by then, gyroCallback gets len 0 and the gyro data stays in the FIFO for next time
+//  Arrays must stay valid until the callbacks have run
+uint8_t IMU_READ_FIFO_DMA(Vector3* accelArray, uint16_t accelCapacity, AccelFIFOCallback accelCallback,
+                          Vector3* gyroArray, uint8_t gyroCapacity, GyroFIFOCallback gyroCallback);
+// Drains every device in imus back to back over DMA, accel then gyro for each, into the matching targets
+//  Only one transfer runs at a time, so devices may share a bus. Returns 1 if the drain was started, 0 if
+//  the bus refused the first transfer, in which case callback won't run
+//  imus and targets must stay valid until callback has run for the last device
+uint8_t IMU_READ_ALL_FIFO_DMA(Bmi088* imus, IMUDrainTarget* targets, uint8_t count, IMUDrainCallback callback);
+// Call from HAL_SPI_TxRxCpltCallback
+void IMU_DMA_COMPLETE(SPI_HandleTypeDef* hspi);
+
+// Drain a sensor's FIFO over DMA whenever its interrupt line (wired to gpioPin) fires
+//  Map the interrupt with ACCEL_WRITE_INT_MAP/GYRO_SET_INT_MAP first. Applies to the current device
+void IMU_ATTACH_ACCEL_INTERRUPT(uint16_t gpioPin, Vector3* array, uint16_t capacity, AccelFIFOCallback callback);
+void IMU_ATTACH_GYRO_INTERRUPT(uint16_t gpioPin, Vector3* array, uint8_t capacity, GyroFIFOCallback callback);
+// Call from HAL_GPIO_EXTI_Callback. Only flags the drain, it never touches the bus
+void IMU_EXTI_CALLBACK(uint16_t GPIO_Pin);
+// Call from the main loop. Starts the drains and synced reads flagged by IMU_EXTI_CALLBACK, one DMA readout at a time
+//  Returns 1 if work is still queued behind a transfer in progress, so the caller knows to poll again soon
+uint8_t IMU_POLL();
+// Interrupt driven drains also push every sample into ring. Pass NULL to stop
+//  Only the driver may push to it, the application pops with ringPop/ringPopMany
+void IMU_ATTACH_RING(SampleRing* ring);
+
+
+// Hardware data sync. Gyro INT3 must be wired to accel INT1 on the board, synced data ready comes out on accel INT2
+//  config is Bosch's feature config file, see ACCEL_LOAD_CONFIG_FILE. mode is one of ACCEL_DATA_SYNC_*
+//  Sets accel ODR to 1600Hz and the gyro to the sync rate. Returns 1 on success
+uint8_t IMU_SETUP_DATA_SYNC(const uint8_t* config, uint16_t len, uint8_t mode);
+// Reads the latest synced pair. Blocking
+ImuSample IMU_READ_SYNCED();
+// Reads a pair every time accel INT2 (wired to gpioPin) fires and queues it in buffer. Holds capacity - 1 pairs
+//  Goes through IMU_EXTI_CALLBACK and IMU_POLL, reads wait for any DMA transfer in progress
+void IMU_ATTACH_SYNC_INTERRUPT(uint16_t gpioPin, ImuSample* buffer, uint16_t capacity);
+// Moves up to capacity queued pairs into out, oldest first. Returns how many. Call from the main loop
+uint16_t IMU_DRAIN_SYNCED(ImuSample* out, uint16_t capacity);
 
 #endif
\ No newline at end of file
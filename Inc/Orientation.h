@@ -0,0 +1,42 @@
+#ifndef __ORIENTATION
+#define __ORIENTATION
+
+#include <stdint.h>
+#include "Vectors.h"
+
+// Mahony attitude filter that runs straight off raw FIFO batches
+//  Gyro samples are integrated one by one, the accelerometer correction is worked out once per batch
+//  from the batch's average. That keeps the per-sample cost down to a handful of multiplies, enough for 2kHz gyro
+
+// Uncomment for a fixed point build. The per-sample path is then integer only (Q30 quaternion),
+//  only the once-per-batch correction uses float
+// #define ORIENTATION_FIXED_POINT
+
+#ifdef ORIENTATION_FIXED_POINT
+typedef int32_t OrientScalar; // Q30
+#else
+typedef float OrientScalar;
+#endif
+
+typedef struct orientation
+{
+    OrientScalar q[4]; // w, x, y, z
+    OrientScalar halfStep; // gyro LSB to half the rotation per sample. Q46 in fixed point
+    float dt; // Seconds per gyro sample
+    float kp; // Proportional gain on the accelerometer error
+    float ki; // Integral gain, for gyro bias
+    Vector3f integral; // Accumulated ki * error, in rad/s
+} Orientation;
+
+// gyroScale and gyroRateHz come from GYRO_GET_SCALE and GYRO_GET_ODR_HZ. Starts out level
+//  Re-init whenever the gyro range or rate changes
+void orientInit(Orientation* o, float gyroScale, float gyroRateHz, float kp, float ki);
+
+// Advances the filter by one FIFO batch. accel may be empty, drops (VECTOR_RAW_NULL) are skipped
+//  Pass the arrays from ACCEL_READ_FIFO_RAW/GYRO_READ_FIFO_RAW as they are, no unit conversion needed
+void orientUpdate(Orientation* o, const Vector3Raw* gyro, uint16_t gyroLen, const Vector3Raw* accel, uint16_t accelLen);
+
+// Current attitude as a float quaternion (w, x, y, z), sensor frame to world frame
+void orientGetQuaternion(const Orientation* o, float* out);
+
+#endif
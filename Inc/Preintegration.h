@@ -0,0 +1,47 @@
+#ifndef __PREINTEGRATION
+#define __PREINTEGRATION
+
+#include <stdint.h>
+#include "Vectors.h"
+
+// Integrates FIFO batches into delta-angle and delta-velocity increments over a fixed interval,
+//  so downstream code can run at 100-200Hz instead of the sensor rate
+//  Uses coning and sculling corrections, so nothing is lost by integrating in the body frame first
+
+// Increment over one interval, in the body frame at the start of the interval
+typedef struct preintDelta
+{
+    Vector3f dAngle; // rad, coning corrected
+    Vector3f dVelocity; // m/s, rotation and sculling corrected. Gravity is not removed
+    float dt; // Seconds covered
+    uint16_t samples; // Gyro samples that went into it
+} PreintDelta;
+
+typedef struct preintegrator
+{
+    float dt; // Seconds per gyro sample
+    uint16_t interval; // Gyro samples per increment
+    uint16_t count; // Gyro samples in the current increment
+    Vector3f alpha; // Summed angle increments this interval
+    Vector3f beta; // Coning correction so far
+    Vector3f nu; // Summed velocity increments this interval
+    Vector3f scul; // Sculling correction so far
+    Vector3f lastAngle; // Last sample's increments, for the second order terms. Carry across intervals
+    Vector3f lastVel;
+    Vector3f lastRate; // Stands in for dropped samples
+    Vector3f lastAccel;
+    uint32_t merged; // Intervals that ran on into the next one because out was full
+} Preintegrator;
+
+// gyroRateHz comes from GYRO_GET_ODR_HZ. intervalS is rounded to a whole number of gyro samples
+//  Re-init whenever the gyro rate changes
+void preintInit(Preintegrator* p, float gyroRateHz, float intervalS);
+
+// Feeds one pair of batches, e.g. from GYRO_READ_FIFO and ACCEL_READ_FIFO read at the same time
+//  Accel samples are spread evenly over the gyro batch, so the rates don't have to match. Drops (NAN) hold the previous value
+//  Writes one PreintDelta per interval completed, returns how many. If out fills up the increment carries on
+//  into the next interval instead, so give room for gyroLen / interval + 1
+uint16_t preintUpdate(Preintegrator* p, const Vector3* gyro, uint16_t gyroLen, const Vector3* accel, uint16_t accelLen,
+                      PreintDelta* out, uint16_t maxOut);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef __SAMPLE_RING
+#define __SAMPLE_RING
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "Vectors.h"
+
+// Single-producer/single-consumer ring of decoded samples
+//  Producer is the driver (interrupt/DMA context), consumer is the main loop or a task.
+//  Neither side needs to disable interrupts. Only plain atomic loads/stores are used, so this is lock-free on every Cortex-M
+
+// Must be a power of two
+#define SAMPLE_RING_CAPACITY 256
+
+#define RING_SENSOR_ACCEL 0
+#define RING_SENSOR_GYRO 1
+
+typedef struct ringSample
+{
+    uint8_t sensor; // RING_SENSOR_ACCEL or RING_SENSOR_GYRO
+    uint32_t time; // Accel sensortime in ticks if known, otherwise 0
+    Vector3f value; // m/s^2 or rad/s
+} RingSample;
+
+typedef struct sampleRing
+{
+    RingSample samples[SAMPLE_RING_CAPACITY];
+    atomic_uint_least32_t head; // Only written by producer
+    atomic_uint_least32_t tail; // Only written by consumer
+    atomic_uint_least32_t overflows; // Samples dropped because the ring was full. Only written by producer
+} SampleRing;
+
+void ringInit(SampleRing* ring);
+
+// Producer side. Returns 0 and counts an overflow if the ring is full
+uint8_t ringPush(SampleRing* ring, const RingSample* sample);
+
+// Consumer side. Returns 0 if the ring is empty
+uint8_t ringPop(SampleRing* ring, RingSample* sample);
+// Pops up to maxSamples at once, returns how many were popped
+uint16_t ringPopMany(SampleRing* ring, RingSample* samples, uint16_t maxSamples);
+
+// Safe from either side
+uint16_t ringCount(SampleRing* ring);
+uint32_t ringOverflows(SampleRing* ring);
+
+#endif
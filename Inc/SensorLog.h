@@ -0,0 +1,88 @@
+#ifndef __SENSOR_LOG
+#define __SENSOR_LOG
+
+#include <stdint.h>
+#include "Vectors.h"
+
+// Compact binary log of raw FIFO batches, for flash/SD logging
+//  Samples are stored as zigzag varint deltas from the previous sample of the same sensor,
+//  usually 3-6 bytes per sample instead of the 24 of a Vector3. Doesn't touch the hardware,
+//  so the decoder half builds on a host too (see Tools/bmi088log.c)
+
+// Stream layout: 'B' 'L' version, then records. Each record starts with a tag byte
+//  LOG_REC_CONFIG: 4 little-endian floats, the LogConfig fields in order. Resets the deltas
+//  LOG_REC_ACCEL/LOG_REC_GYRO: sample count, then per sample x, y, z as varint(zigzag(delta))
+//  Accel records with LOG_TAG_TIMED set carry the 24-bit sensortime of their last sample (3 bytes LE) after the count
+//  An accel sample whose x is LOG_NULL_SAMPLE is a drop (VECTOR_RAW_NULL), it has no y or z
+#define LOG_VERSION 1
+#define LOG_HEADER_BYTES 3
+
+#define LOG_END 0 // No more complete records
+#define LOG_REC_CONFIG 1
+#define LOG_REC_ACCEL 2
+#define LOG_REC_GYRO 3
+#define LOG_ERROR 0xFF // Stream is corrupt or not a log
+
+#define LOG_TAG_TIMED 0x80
+#define LOG_NULL_SAMPLE 0x1FFFF // Zigzag deltas of int16s never get this high
+#define LOG_MAX_BATCH 255
+// Worst case size of a record holding len samples
+#define LOG_RECORD_MAX_BYTES(len) (5 + 9 * (len))
+
+// Everything the decoder needs to turn raw counts back into units. IMU_GET_LOG_CONFIG fills it from the cached settings
+typedef struct logConfig
+{
+    float accelScale; // m/s^2 per LSB
+    float gyroScale; // rad/s per LSB
+    float accelRateHz; // Rate samples come out of the accel FIFO
+    float gyroRateHz;
+} LogConfig;
+
+typedef struct logEncoder
+{
+    uint8_t* buf; // Encoded bytes go here, write out buf[0..len) and call logClear when it fills up
+    uint16_t capacity;
+    uint16_t len;
+    LogConfig config; // Last config written
+    uint8_t haveConfig;
+    Vector3Raw prev[2]; // Last sample per sensor, the deltas are against these
+} LogEncoder;
+
+typedef struct logDecoder
+{
+    const uint8_t* data;
+    uint32_t len;
+    uint32_t pos;
+    LogConfig config; // Latest config seen in the stream
+    Vector3Raw prev[2];
+} LogDecoder;
+
+typedef struct logRecord
+{
+    uint8_t type; // LOG_REC_*
+    uint8_t timed; // 1 if sensortime is set
+    uint32_t sensortime; // Of the last sample, ACCEL_SENSORTIME_TICK_US ticks
+    uint16_t len;
+    uint16_t drops; // Accel drops among the samples, see vMarkDrops
+    Vector3Raw samples[LOG_MAX_BATCH]; // Drops are VECTOR_RAW_NULL
+} LogRecord;
+
+// Writes the stream header into buf. capacity should hold at least one full batch, LOG_RECORD_MAX_BYTES(ACCEL_FIFO_MAX_FRAMES)
+void logInit(LogEncoder* enc, uint8_t* buf, uint16_t capacity);
+// Empties the buffer once it has been written out. The stream carries on, so keep appending to the same file
+void logClear(LogEncoder* enc);
+// Records the config if it differs from the last one written. Cheap enough to call before every batch
+//  Returns 0 if there wasn't room, flush and call again
+uint8_t logConfig(LogEncoder* enc, const LogConfig* config);
+// Appends one FIFO batch, e.g. from ACCEL_READ_FIFO_RAW/GYRO_READ_FIFO_RAW. sensortime is the time of the last sample
+//  The record is only tagged LOG_TAG_TIMED if hasTime is set, e.g. from the buffer's hasTime
+//  Returns 0 and writes nothing if the batch doesn't fit (flush and call again) or is longer than LOG_MAX_BATCH
+uint8_t logAccel(LogEncoder* enc, const Vector3Raw* samples, uint16_t len, uint8_t hasTime, uint32_t sensortime);
+uint8_t logGyro(LogEncoder* enc, const Vector3Raw* samples, uint16_t len);
+
+// Returns 0 if data doesn't start with a log header
+uint8_t logDecoderInit(LogDecoder* dec, const uint8_t* data, uint32_t len);
+// Decodes the next record into rec, returns its type. LOG_END at the end of the data (or a cut off record), LOG_ERROR if corrupt
+uint8_t logDecode(LogDecoder* dec, LogRecord* rec);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef __SPI_BUS
+#define __SPI_BUS
+
+#include "main.h"
+#include <stdatomic.h>
+
+// Which SPI buses a driver DMA transfer currently owns. Shared by the accel and gyro drivers
+//  A transfer claims its bus before selecting the chip and releases it in the completion interrupt
+//  Blocking transactions wait for the bus to be released before they select anything
+
+// Most transfers that can be in flight at once, one accel and one gyro
+#define SPI_BUS_MAX_OWNERS 2
+// Longest a blocking transaction waits for a transfer to finish
+#define SPI_BUS_WAIT_MS 100
+
+// Returns 1 if hspi was free and is now owned by the caller
+uint8_t busClaim(SPI_HandleTypeDef* hspi);
+void busRelease(SPI_HandleTypeDef* hspi);
+uint8_t busOwned(SPI_HandleTypeDef* hspi);
+// Blocks until no transfer owns hspi. Returns 0 on timeout. Main loop only, it relies on the
+//  completion interrupt to release the bus
+uint8_t busWaitFree(SPI_HandleTypeDef* hspi);
+
+#endif
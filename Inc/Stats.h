@@ -0,0 +1,55 @@
+#ifndef __BMI088_STATS
+#define __BMI088_STATS
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Optional driver instrumentation. Uncomment (or pass -DBMI088_STATS) to give every accel and gyro device
+//  a SensorStats block, read with ACCEL_GET_STATS/GYRO_GET_STATS. Compiled out completely otherwise
+// #define BMI088_STATS
+
+// Bucket n counts durations of 2^n up to 2^(n+1) - 1 ticks
+#define STATS_HIST_BUCKETS 32
+
+// Counters are bumped from DMA completions and EXTI handlers as well as the main loop, so every update is an
+//  atomic add and none can be lost to an interrupt landing in the middle of another. Lock-free on Cortex-M3 and up
+//  Every field is one of these counters, statsCopy and statsReset rely on that
+
+typedef struct sensorStats
+{
+    atomic_uint_least32_t transactions; // SPI transactions (chip select cycles)
+    atomic_uint_least32_t bytes; // Bytes clocked over SPI, address and dummy bytes included
+    atomic_uint_least32_t halErrors; // HAL SPI calls that didn't return HAL_OK, e.g. timeouts
+    atomic_uint_least32_t allocFailures; // mallocs in *_READ_FIFO that returned NULL
+    atomic_uint_least32_t drains; // FIFO readouts, blocking or DMA
+    atomic_uint_least32_t frames; // Samples decoded from the FIFO
+    atomic_uint_least32_t skipped; // Accel only: frames the chip reported lost to a full FIFO
+    atomic_uint_least32_t dropped; // Accel only: drop frames
+    atomic_uint_least32_t configs; // Accel only: config change frames
+    // Ticks are CPU cycles on target (DWT) and nanoseconds on a host
+    atomic_uint_least32_t transferHist[STATS_HIST_BUCKETS]; // FIFO data transfer, from start of the read to the data being in memory
+    atomic_uint_least32_t decodeHist[STATS_HIST_BUCKETS]; // Parsing frames into raw samples
+    atomic_uint_least32_t convertHist[STATS_HIST_BUCKETS]; // Raw samples into units
+} SensorStats;
+
+#ifdef BMI088_STATS
+#define STATS_ADD(DEV, FIELD, N) atomic_fetch_add_explicit(&(DEV)->stats.FIELD, (N), memory_order_relaxed)
+#define STATS_START(T) (T = statsNow())
+#define STATS_RECORD(DEV, HIST, T) statsRecord((DEV)->stats.HIST, statsNow() - (T))
+#else
+// DEV and N are still evaluated so a device only used for stats doesn't warn
+#define STATS_ADD(DEV, FIELD, N) ((void)(DEV), (void)(N))
+#define STATS_START(T) (T = 0)
+#define STATS_RECORD(DEV, HIST, T) ((void)(DEV), (void)(T))
+#endif
+
+// Starts the cycle counter on target. Called by the device init functions
+void statsInitClock();
+uint32_t statsNow();
+// Adds a duration to a histogram
+void statsRecord(atomic_uint_least32_t* hist, uint32_t ticks);
+// Field by field copy for *_GET_STATS. Each field is read atomically, but fields may be one update apart
+void statsCopy(SensorStats* to, const SensorStats* from);
+void statsReset(SensorStats* stats);
+
+#endif
@@ -2,6 +2,7 @@
 #define __VECTORS 
 
 #include <math.h>
+#include <stdint.h>
 
 typedef struct Vector3 {
     double x;
@@ -9,10 +10,78 @@ typedef struct Vector3 {
     double z;
 } Vector3;
 
+// Single precision, for the hardware FPU on Cortex-M4/M7
+typedef struct Vector3f {
+    float x;
+    float y;
+    float z;
+} Vector3f;
+
+// Raw sensor counts, as they come out of the data registers
+typedef struct Vector3Raw {
+    int16_t x;
+    int16_t y;
+    int16_t z;
+} Vector3Raw;
+
+// Fixed point with VECTOR_Q_FRAC_BITS fractional bits
+typedef struct Vector3Q {
+    int32_t x;
+    int32_t y;
+    int32_t z;
+} Vector3Q;
+
+// Structure of arrays, for DSP filters and SIMD. Each array needs room for the whole batch
+typedef struct Vector3SoA {
+    float* x;
+    float* y;
+    float* z;
+} Vector3SoA;
+
+// Sensor calibration in physical units: corrected = matrix * (measured - offset)
+typedef struct SensorCal {
+    float offset[3]; // Bias, m/s^2 or rad/s
+    float matrix[3][3]; // Scale on the diagonal, misalignment off it. Identity when uncalibrated
+} SensorCal;
+
+// SensorCal folded together with the per-LSB scale so raw counts convert in one step: out = m * raw + bias
+typedef struct VectorCal {
+    double m[3][3];
+    double bias[3]; // -matrix * offset, so conversion is multiply-adds only
+    uint8_t cross; // 0 if m is diagonal, which takes the cheaper path
+} VectorCal;
+
+#define VECTOR_Q_FRAC_BITS 16
+
 #define VECTOR_NULL {.x = NAN, .y = NAN, .z = NAN}
+#define VECTOR_RAW_NULL {.x = INT16_MIN, .y = INT16_MIN, .z = INT16_MIN}
+#define VECTOR_Q_NULL {.x = INT32_MIN, .y = INT32_MIN, .z = INT32_MIN}
 
 #define V_MUL(VEC, A) VEC.x*=A;VEC.y*=A;VEC.z*=A;
 
 Vector3 vSub(Vector3 a, Vector3 b);
 
-#endif
\ No newline at end of file
+// Decodes three little-endian int16s
+Vector3Raw vRawFromBytes(const uint8_t* bytes);
+
+// Batch unit conversion. scale is units per LSB. Every entry is treated as data, see vMarkDrops for accel drops
+void vRawToD(const Vector3Raw* in, Vector3* out, uint16_t len, double scale);
+void vRawToF(const Vector3Raw* in, Vector3f* out, uint16_t len, float scale);
+void vRawToQ(const Vector3Raw* in, Vector3Q* out, uint16_t len, float scale);
+// Batch conversion with calibration folded in, see vCalFold. A diagonal matrix costs the same as vRawToD
+//  With misalignment (cross set) each sample is a full 3x3 multiply, three times the multiplies
+void vRawToDCal(const Vector3Raw* in, Vector3* out, uint16_t len, const VectorCal* cal);
+// Single sample version of vRawToDCal
+Vector3 vRawToDCalOne(Vector3Raw in, const VectorCal* cal);
+// Folds cal (or no calibration if NULL) into the scale of the current range
+void vCalFold(const SensorCal* cal, double scale, VectorCal* out);
+void vCalIdentity(SensorCal* cal);
+// Splits the batch into out.x/y/z and scales it. Uses SSE/AVX on the host and CMSIS-DSP on target
+//  when built with BMI088_USE_CMSIS_DSP
+void vRawToSoA(const Vector3Raw* in, Vector3SoA out, uint16_t len, float scale);
+// Sets out to NULL (NAN) wherever in is VECTOR_RAW_NULL, after converting. Only accel FIFO data has drops,
+//  so only call these when the raw buffer's drops count is non-zero
+void vMarkDrops(const Vector3Raw* in, Vector3* out, uint16_t len);
+void vMarkDropsSoA(const Vector3Raw* in, Vector3SoA out, uint16_t len);
+
+#endif
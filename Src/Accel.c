@@ -1,6 +1,8 @@
 
 #include "Accel.h"
+#include "SpiBus.h"
 #include <stdlib.h>
+#include <string.h>
 
 // GPIO connectivity
 #define PORT ACCEL_CS_PORT
@@ -23,11 +25,14 @@
 #define ADDR_SENSORTIME_1 0x19
 #define ADDR_SENSORTIME_2 0x1A
 #define ADDR_INT_STAT_1 0x1D
+#define ADDR_GP_4 0x1E
 #define ADDR_TEMP_MSB 0x22
 #define ADDR_TEMP_LSB 0x23
 #define ADDR_FIFO_LENGTH_0 0x24
 #define ADDR_FIFO_LENGTH_1 0x25
 #define ADDR_FIFO_DATA 0x26
+#define ADDR_GP_0 0x27
+#define ADDR_INTERNAL_STATUS 0x2A
 #define ADDR_ACC_CONF 0x40
 #define ADDR_ACC_RANGE 0x41
 #define ADDR_FIFO_DOWNS 0x45
@@ -37,7 +42,13 @@
 #define ADDR_FIFO_CONFIG_1 0x49
 #define ADDR_INT1_IO_CTRL 0x53
 #define ADDR_INT2_IO_CTRL 0x54
+#define ADDR_INT1_MAP 0x56
+#define ADDR_INT2_MAP 0x57
 #define ADDR_INT_MAP_DATA 0x58
+#define ADDR_INIT_CTRL 0x59
+#define ADDR_INIT_ADDR_0 0x5B
+#define ADDR_INIT_ADDR_1 0x5C
+#define ADDR_FEATURE_CFG 0x5E
 #define ADDR_ACC_SELF_TEST 0x6D
 #define ADDR_ACC_PWR_CONF 0x7C
 #define ADDR_ACC_PWR_CTRL 0x7D
@@ -46,16 +57,69 @@
 // Sensor attributes
 #define FIFO_MAX_BUFFER_BYTES 1024
 #define FIFO_DATA_FRAME_SIZE_BYTES 7
+#define FIFO_SENSORTIME_FRAME_BYTES 4
+#define FIFO_CONTROL_FRAME_BYTES 2 // Skip, config and drop frames
+#define CONFIG_NOT_SEEN 0xFFFF
+#define FIFO_ACC_EN 0x40 // FIFO_CONFIG_1 bit for queuing accel data, config frames only go in while it's set
+// Reading one frame past the fill level returns the sensortime frame
+#define FIFO_READ_BYTES(LEN) ((LEN) + FIFO_SENSORTIME_FRAME_BYTES)
+#define CONFIG_CHUNK_BYTES 32 // Config file is streamed in pieces this big
+#define FEATURE_DATA_SYNC_WORD 0x02 // Position of the data sync setting in the feature config, in 16 bit words
+#define INTERNAL_STATUS_INIT_OK 0x01
+#define TEST_SETTLE_MS 5 // After switching to 24g, 1600Hz
+#define TEST_SWITCH_MS 55 // After each change of self-test polarity
+
+// Self-test steps
+#define TEST_POSITIVE 0
+#define TEST_NEGATIVE 1
+#define TEST_RESET 2
+#define TEST_FINISH 3
 
 // Other logic
 #define READ 0x80
 #define WRITE 0x00
+#define READ_HEADER_BYTES 2 // Address and dummy byte ahead of the data on every read
+// DMA readout reads FIFO_LENGTH first, then that many bytes of FIFO_DATA
+#define DMA_STAGE_LENGTH 0
+#define DMA_STAGE_DATA 1
+#define REG_BURST_MAX 16 // Longest read readAddr handles. FIFO reads use readBurst directly
+
+// Device used by ACCEL_INIT, and the one every call currently goes to
+static AccelState a_default;
+static AccelState* a_dev = &a_default;
+
+// DMA transfer state. Buffers hold the address and dummy byte ahead of the FIFO data
+static uint8_t a_dmaTx[FIFO_READ_BYTES(FIFO_MAX_BUFFER_BYTES) + READ_HEADER_BYTES];
+static uint8_t a_dmaRx[FIFO_READ_BYTES(FIFO_MAX_BUFFER_BYTES) + READ_HEADER_BYTES];
+static volatile uint8_t a_dmaBusy;
+static AccelState* a_dmaDev;
+static uint16_t a_dmaLen;
+static AccelFIFOCallback a_dmaCallback;
+static Vector3* a_dmaArray;
+static uint16_t a_dmaCapacity;
+static uint32_t a_dmaStart; // For the transfer time histogram
+static uint8_t a_dmaStage;
+// Completion decodes here rather than in a_rawSamples, it can interrupt a blocking readout that is still converting
+static Vector3Raw a_dmaRawSamples[ACCEL_FIFO_MAX_FRAMES];
+
+// Config registers mirrored in AccelState.shadow, in address order. mask covers the bits that mean something
+typedef struct shadowReg
+{
+    uint8_t addr;
+    uint8_t mask;
+} ShadowReg;
 
-static SPI_HandleTypeDef* a_hspi;
-static uint8_t a_maxRangeBits;
-static double a_maxRangeReal;
-static uint8_t a_bwp;
-static uint8_t a_odr;
+static const ShadowReg a_shadowRegs[ACCEL_SHADOW_REGS] = {
+    {ADDR_ACC_CONF, 0xFF}, {ADDR_ACC_RANGE, 0x03},
+    {ADDR_FIFO_DOWNS, 0x70}, {ADDR_FIFO_WTM_0, 0xFF}, {ADDR_FIFO_WTM_1, 0x1F}, {ADDR_FIFO_CONFIG_0, 0x01}, {ADDR_FIFO_CONFIG_1, 0x4C},
+    {ADDR_INT1_IO_CTRL, 0x1E}, {ADDR_INT2_IO_CTRL, 0x1E},
+    {ADDR_INT_MAP_DATA, 0x77},
+    {ADDR_ACC_SELF_TEST, 0x0D},
+    {ADDR_ACC_PWR_CONF, 0xFF}, {ADDR_ACC_PWR_CTRL, 0xFF},
+};
+
+// FIFO frames from blocking readouts are decoded here before unit conversion
+static Vector3Raw a_rawSamples[ACCEL_FIFO_MAX_FRAMES];
 
 // Infrastructure
 
@@ -69,23 +133,57 @@ static uint8_t a_odr;
 //     uint16_t noSign;
 //     int16_t sign;
 // } unionInt16;
-static void select();
-static void unselect();
-static void readAddr(uint8_t, uint8_t*, int);
-static void writeAddr(uint8_t, uint8_t);
+static void chipSelect(AccelState*);
+static void chipUnselect(AccelState*);
+static void readAddr(AccelState*, uint8_t, uint8_t*, int);
+static void readBurst(AccelState*, uint8_t, uint8_t*, int);
+static void writeAddr(AccelState*, uint8_t, uint8_t);
+static void writeReg(AccelState*, uint8_t, uint8_t);
+static void writeBurst(AccelState*, uint8_t, const uint8_t*, uint16_t);
+static void setFeatureAddr(AccelState*, uint16_t);
+static int shadowIndex(uint8_t);
+static void readShadowRegs(AccelState*, uint8_t*);
+static uint16_t readFIFOLen(AccelState*);
+static uint8_t startDMA(AccelState*, uint16_t);
 static void setRangeMem(uint8_t);
+static void syncFIFOScale(AccelState*);
+static uint8_t frameBytes(uint8_t);
+static void parseFrame(AccelFIFOParser*, const uint8_t*, AccelRawBuffer*, uint16_t);
+static AccelRawBuffer parseDeviceFIFO(AccelState*, const uint8_t*, uint16_t, Vector3Raw*, uint16_t);
 
-static Vector3 parseRawUInts(uint8_t*);
+static Vector3 parseRawUInts(AccelState*, uint8_t*);
+static AccelDataBuffer toDataBuffer(AccelState*, AccelRawBuffer, Vector3*);
 
 // Forward-facing logic
 
 void ACCEL_INIT(SPI_HandleTypeDef* spiHandler){
-    unselect();
-    a_hspi = spiHandler;
+    ACCEL_INIT_DEVICE(&a_default, spiHandler, PORT, PIN);
+}
+
+void ACCEL_INIT_DEVICE(AccelState* dev, SPI_HandleTypeDef* spiHandler, GPIO_TypeDef* csPort, uint16_t csPin){
+    dev->hspi = spiHandler;
+    dev->csPort = csPort;
+    dev->csPin = csPin;
+    vCalIdentity(&dev->calib);
+    memset(&dev->fifo, 0, sizeof(dev->fifo));
+#ifdef BMI088_STATS
+    statsReset(&dev->stats);
+    statsInitClock();
+#endif
+    a_dev = dev;
+    chipUnselect(dev);
     ACCEL_READ_ID(); // Dummy read to make sure everything else works
     ACCEL_RELOAD_SETTINGS();
 }
 
+void ACCEL_USE_DEVICE(AccelState* dev){
+    a_dev = dev;
+}
+
+AccelState* ACCEL_CURRENT_DEVICE(){
+    return a_dev;
+}
+
 void ACCEL_GOOD_SETTINGS(){
     ACCEL_SET_RANGE(ACCEL_RANGE_24G);
     ACCEL_SET_CONFIG(ACCEL_OSR_NORMAL, ACCEL_ODR_400);
@@ -95,82 +193,143 @@ void ACCEL_GOOD_SETTINGS(){
 }
 
 uint8_t ACCEL_SELF_TEST(){
-    Vector3 positive;
-    Vector3 negative;
-    Vector3 difference;
-    uint8_t isGood = 1;
+    AccelSelfTest test;
+    uint32_t now = 0;
+    uint8_t result;
+    ACCEL_SELF_TEST_BEGIN(&test, now);
+    while((result = ACCEL_SELF_TEST_STEP(&test, now)) == ACCEL_TEST_RUNNING){
+        HAL_Delay(test.wakeAt - now);
+        now = test.wakeAt;
+    }
+    return result;
+}
 
-    // Setup
+void ACCEL_SELF_TEST_BEGIN(AccelSelfTest* test, uint32_t nowMs){
     ACCEL_SET_RANGE(ACCEL_RANGE_24G);
     ACCEL_SET_CONFIG(ACCEL_OSR_NORMAL, ACCEL_ODR_1600);
-    // ACCEL_RELOAD_SETTINGS();
-    // positive = ACCEL_READ_ACCELERATION();
-    HAL_Delay(5);
-    // Positive
-    select();
-    writeAddr(ADDR_ACC_SELF_TEST, 0x0D);
-    unselect();
-    HAL_Delay(55);
-    positive = ACCEL_READ_ACCELERATION();
-    // Negative
-    select();
-    writeAddr(ADDR_ACC_SELF_TEST, 0x09);
-    unselect();
-    HAL_Delay(55);
-    negative = ACCEL_READ_ACCELERATION();
-    // Reset
-    select();
-    writeAddr(ADDR_ACC_SELF_TEST, 0x00);
-    unselect();
-    HAL_Delay(55);
-    // Calculate results
-    difference = vSub(positive, negative);
-    isGood = (difference.x >= GRAV) &&
-                (difference.y >= GRAV) &&
-                (difference.z >= GRAV/2);
-
-    return isGood;
+    test->state = TEST_POSITIVE;
+    test->result = ACCEL_TEST_RUNNING;
+    test->wakeAt = nowMs + TEST_SETTLE_MS;
+}
+
+uint8_t ACCEL_SELF_TEST_STEP(AccelSelfTest* test, uint32_t nowMs){
+    Vector3 difference;
+    if(test->result != ACCEL_TEST_RUNNING || (int32_t)(nowMs - test->wakeAt) < 0){
+        return test->result;
+    }
+    switch (test->state)
+    {
+    case TEST_POSITIVE:
+        writeReg(a_dev, ADDR_ACC_SELF_TEST, 0x0D);
+        test->state = TEST_NEGATIVE;
+        break;
+    case TEST_NEGATIVE:
+        test->positive = ACCEL_READ_ACCELERATION();
+        writeReg(a_dev, ADDR_ACC_SELF_TEST, 0x09);
+        test->state = TEST_RESET;
+        break;
+    case TEST_RESET:
+        test->negative = ACCEL_READ_ACCELERATION();
+        writeReg(a_dev, ADDR_ACC_SELF_TEST, 0x00);
+        test->state = TEST_FINISH;
+        break;
+    default:
+        // Reset has settled, so the sensor is usable again
+        difference = vSub(test->positive, test->negative);
+        test->result = (difference.x >= GRAV) &&
+                        (difference.y >= GRAV) &&
+                        (difference.z >= GRAV/2);
+        return test->result;
+    }
+    test->wakeAt = nowMs + TEST_SWITCH_MS;
+    return ACCEL_TEST_RUNNING;
 }
 
 void ACCEL_RELOAD_SETTINGS(){
-    uint8_t rawData[2];
-    select();
-    readAddr(ADDR_ACC_CONF, rawData, 2);
-    unselect();
+    uint8_t conf;
+    readShadowRegs(a_dev, a_dev->shadow);
+    a_dev->shadowValid = (1 << ACCEL_SHADOW_REGS) - 1;
 
-    a_bwp = rawData[0] >> 4; // First 4
-    a_odr = rawData[0] & 0b00001111; // Last 4
+    conf = a_dev->shadow[shadowIndex(ADDR_ACC_CONF)];
+    a_dev->bwp = conf >> 4; // First 4
+    a_dev->odr = conf & 0b00001111; // Last 4
+    setRangeMem(a_dev->shadow[shadowIndex(ADDR_ACC_RANGE)] & 0b00000011); // Last 2
+    syncFIFOScale(a_dev); // Can't know what range older FIFO data was taken at, assume this one
+    a_dev->fifoDowns = (a_dev->shadow[shadowIndex(ADDR_FIFO_DOWNS)] >> 4) & 0b00000111;
+}
 
-    rawData[1] = rawData[1] & 0b00000011; // Last 2
+uint8_t ACCEL_VERIFY_SETTINGS(){
+    uint8_t chip[ACCEL_SHADOW_REGS];
+    uint8_t mismatches = 0;
+    int i;
+    readShadowRegs(a_dev, chip);
+    for(i = 0; i < ACCEL_SHADOW_REGS; i++){
+        if((a_dev->shadowValid & (1 << i)) && ((chip[i] ^ a_dev->shadow[i]) & a_shadowRegs[i].mask)){
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
 
-    setRangeMem(rawData[1]);
+void ACCEL_RESTORE_SETTINGS(){
+    int i;
+    for(i = 0; i < ACCEL_SHADOW_REGS; i++){
+        if(a_dev->shadowValid & (1 << i)){
+            chipSelect(a_dev);
+            writeAddr(a_dev, a_shadowRegs[i].addr, a_dev->shadow[i]);
+            chipUnselect(a_dev);
+        }
+    }
 }
 
 uint8_t ACCEL_READ_ID(){
     uint8_t id = 0;
-    select();
+    chipSelect(a_dev);
 
-    readAddr(ADDR_CHIP_ID, &id, 1);
+    readAddr(a_dev, ADDR_CHIP_ID, &id, 1);
 
-    unselect();
+    chipUnselect(a_dev);
     return id;
 }
 
 Vector3 ACCEL_READ_ACCELERATION(){
     uint8_t rawVals[6];
-    select();
-    readAddr(ADDR_ACC_X_LSB, rawVals, 6);
-    unselect();
+    chipSelect(a_dev);
+    readAddr(a_dev, ADDR_ACC_X_LSB, rawVals, 6);
+    chipUnselect(a_dev);
 
-    return parseRawUInts(rawVals);
+    return parseRawUInts(a_dev, rawVals);
+}
+
+AccelSnapshot ACCEL_READ_SNAPSHOT(){
+    // Data, sensortime and INT_STAT_1 are one run of registers, the two between are reserved
+    uint8_t rawVals[ADDR_INT_STAT_1 - ADDR_ACC_X_LSB + 1];
+    AccelSnapshot out;
+    chipSelect(a_dev);
+    readAddr(a_dev, ADDR_ACC_X_LSB, rawVals, sizeof(rawVals));
+    chipUnselect(a_dev);
+
+    out.acceleration = parseRawUInts(a_dev, rawVals);
+    out.sensortime = rawVals[6] | (rawVals[7] << 8) | ((uint32_t)rawVals[8] << 16);
+    out.dataReady = rawVals[ADDR_INT_STAT_1 - ADDR_ACC_X_LSB] >> 7;
+    return out;
+}
+
+uint8_t ACCEL_READ_DATA_READY(){
+    uint8_t status;
+    chipSelect(a_dev);
+    readAddr(a_dev, ADDR_STATUS, &status, 1);
+    chipUnselect(a_dev);
+
+    return status >> 7;
 }
 
 float ACCEL_READ_TEMPERATURE(){
     uint8_t rawVals[2];
     int16_t rawVal;
-    select();
-    readAddr(ADDR_TEMP_MSB, rawVals, 2);
-    unselect();
+    chipSelect(a_dev);
+    readAddr(a_dev, ADDR_TEMP_MSB, rawVals, 2);
+    chipUnselect(a_dev);
     rawVal = (rawVals[0] << 3) | (rawVals[1] >> 5);
     // since it's an 11 bit number first bit is the negative twos compliment one
     rawVal = rawVal > 1023 ? rawVal - 2048 : rawVal;
@@ -181,9 +340,9 @@ uint32_t ACCEL_READ_SENSORTIME(){
     uint8_t vals[3];
     uint32_t val1, val2, val3;
     uint32_t val;
-    select();
-    readAddr(ADDR_SENSORTIME_0, vals, 3);
-    unselect();
+    chipSelect(a_dev);
+    readAddr(a_dev, ADDR_SENSORTIME_0, vals, 3);
+    chipUnselect(a_dev);
     val1 = vals[0];
     val2 = vals[1]<<8;
     val3 = vals[2]<<16;
@@ -194,9 +353,9 @@ uint32_t ACCEL_READ_SENSORTIME(){
 AccelError ACCEL_READ_ERROR(){
     uint8_t val;
     AccelError out;
-    select();
-    readAddr(ADDR_ERR_REG, &val, 1);
-    unselect();
+    chipSelect(a_dev);
+    readAddr(a_dev, ADDR_ERR_REG, &val, 1);
+    chipUnselect(a_dev);
     
     out.isFatal = (val & 1);
     out.errorCode = (val & 0b00011100) >> 2;
@@ -205,71 +364,96 @@ AccelError ACCEL_READ_ERROR(){
 }
 
 uint8_t ACCEL_READ_PWR_MODE(){
-    uint8_t mode;
-    select();
-    readAddr(ADDR_ACC_PWR_CONF, &mode, 1);
-    unselect();
-
-    return mode;
+    return a_dev->shadow[shadowIndex(ADDR_ACC_PWR_CONF)];
 }
 
 uint8_t ACCEL_READ_ACCEL_ENABLED(){
-    uint8_t enabled;
-    select();
-    readAddr(ADDR_ACC_PWR_CTRL, &enabled, 1);
-    unselect();
-    
-    return enabled;
+    return a_dev->shadow[shadowIndex(ADDR_ACC_PWR_CTRL)];
+}
+
+void ACCEL_SET_CALIBRATION(const SensorCal* cal){
+    if(cal){
+        a_dev->calib = *cal;
+    } else {
+        vCalIdentity(&a_dev->calib);
+    }
+    vCalFold(&a_dev->calib, a_dev->scale, &a_dev->folded);
+}
+
+SensorCal ACCEL_GET_CALIBRATION(){
+    return a_dev->calib;
+}
+
+float ACCEL_GET_SCALE(){
+    return a_dev->scale;
+}
+
+float ACCEL_GET_ODR_HZ(){
+    // ODR codes double the rate each step starting from 12.5Hz
+    if(a_dev->odr < ACCEL_ODR_12p5 || a_dev->odr > ACCEL_ODR_1600){
+        return 0;
+    }
+    return 12.5f * (1 << (a_dev->odr - ACCEL_ODR_12p5));
+}
+
+float ACCEL_GET_FIFO_RATE_HZ(){
+    return ACCEL_GET_ODR_HZ() / (1 << a_dev->fifoDowns);
+}
+
+void ACCEL_FILL_TIMESTAMPS(uint32_t sensortime, uint16_t len, uint32_t* times, uint16_t overflowed){
+    ACCEL_FILL_DEVICE_TIMESTAMPS(a_dev, sensortime, len, times, overflowed);
+}
+
+void ACCEL_FILL_DEVICE_TIMESTAMPS(AccelState* dev, uint32_t sensortime, uint16_t len, uint32_t* times, uint16_t overflowed){
+    uint32_t sampleTicks, frameTicks, last;
+    uint16_t i;
+    if(dev->odr < ACCEL_ODR_12p5 || dev->odr > ACCEL_ODR_1600){
+        return;
+    }
+    // 2048 ticks per sample at 12.5Hz, halving with each ODR step
+    sampleTicks = 2048 >> (dev->odr - ACCEL_ODR_12p5);
+    frameTicks = sampleTicks << dev->fifoDowns;
+    // Samples are taken on the ODR grid of the sensortime counter, so the newest one read out is the last grid point.
+    //  Frames that didn't fit in the array came after the last one kept
+    last = (sensortime & ~(sampleTicks - 1)) - (uint32_t)overflowed * frameTicks;
+    for(i = 0; i < len; i++){
+        times[i] = (last - (uint32_t)(len - 1 - i) * frameTicks) & ACCEL_SENSORTIME_MASK;
+    }
 }
 
 // Write functions
 void ACCEL_SET_CONFIG(uint8_t oversamplingRate, uint8_t outputDataRate){
     uint8_t message = (oversamplingRate << 4) | outputDataRate;
-    select();
-    writeAddr(ADDR_ACC_CONF, message);
-    unselect();
-    a_bwp = oversamplingRate;
-    a_odr = outputDataRate;
+    writeReg(a_dev, ADDR_ACC_CONF, message);
+    a_dev->bwp = oversamplingRate;
+    a_dev->odr = outputDataRate;
 }
 void ACCEL_SET_RANGE(uint8_t range){
-    select();
-    writeAddr(ADDR_ACC_RANGE, range);
-    unselect();
+    writeReg(a_dev, ADDR_ACC_RANGE, range);
     setRangeMem(range);
+    // No config frame marks the change unless the FIFO is collecting, so the parser switches scale now
+    if(!(a_dev->shadow[shadowIndex(ADDR_FIFO_CONFIG_1)] & FIFO_ACC_EN)){
+        syncFIFOScale(a_dev);
+    }
 }
 
 void ACCEL_WRITE_PWR_ACTIVATE(){
-    select();
-    writeAddr(ADDR_ACC_PWR_CONF, ACCEL_PWR_ACTIVE);
-    unselect();
+    writeReg(a_dev, ADDR_ACC_PWR_CONF, ACCEL_PWR_ACTIVE);
 }
 void ACCEL_WRITE_PWR_SUSPEND(){
-    select();
-    writeAddr(ADDR_ACC_PWR_CONF, ACCEL_PWR_SUSPEND);
-    unselect();
+    writeReg(a_dev, ADDR_ACC_PWR_CONF, ACCEL_PWR_SUSPEND);
 }
 void ACCEL_WRITE_ACCEL_ENABLE(){
-    select();
-    writeAddr(ADDR_ACC_PWR_CTRL, ACCEL_ACCEL_ENABLED);
-    unselect();
+    writeReg(a_dev, ADDR_ACC_PWR_CTRL, ACCEL_ACCEL_ENABLED);
 }
 void ACCEL_WRITE_ACCEL_DISABLE(){
-    select();
-    writeAddr(ADDR_ACC_PWR_CTRL, ACCEL_ACCEL_DISABLED);
-    unselect();
+    writeReg(a_dev, ADDR_ACC_PWR_CTRL, ACCEL_ACCEL_DISABLED);
 }
 
 // FIFO
 
 uint16_t ACCEL_READ_FIFO_LEN(){
-    uint8_t rawData[2];
-    select();
-    readAddr(ADDR_FIFO_LENGTH_0, rawData, 2);
-    unselect();
-
-    rawData[1] &= 00111111;
-
-    return (rawData[1]<<8) | rawData[0];
+    return readFIFOLen(a_dev);
 }
 
 
@@ -280,144 +464,623 @@ uint16_t ACCEL_READ_FIFO_LEN(){
 #define FIFO_FRAME_H_CONFIG 0x48
 #define FIFO_FRAME_H_DROP 0x50
 AccelDataBuffer ACCEL_READ_FIFO(){
-    uint8_t rawBuff[FIFO_MAX_BUFFER_BYTES] = {0};
-    uint8_t frameType;
-    int i;
+    Vector3* array = malloc(sizeof(Vector3) * ACCEL_FIFO_MAX_FRAMES);
+    Vector3* shrunk;
     AccelDataBuffer out;
-    out.len = 0;
-    out.array = malloc(sizeof(Vector3)*(FIFO_MAX_BUFFER_BYTES/FIFO_DATA_FRAME_SIZE_BYTES));
-    
-    select();
-    readAddr(ADDR_FIFO_DATA, rawBuff, FIFO_MAX_BUFFER_BYTES);
-    unselect();
-
-    i = 0;
-    frameType = rawBuff[0] & 0xFC; // Ignore last 2 bits
-
-    // A skip frame should only be presented at the begining of the data, so we can check for it here
-    if(frameType == FIFO_FRAME_H_SKIP){
-        out.skipped = rawBuff[i+1];
-        i += 2;
-        frameType = rawBuff[i];
+    if(!array){
+        STATS_ADD(a_dev, allocFailures, 1);
+    }
+    out = ACCEL_READ_FIFO_INTO(array, array ? ACCEL_FIFO_MAX_FRAMES : 0);
+
+    if(out.len == 0){
+        free(array);
+        out.array = NULL;
     } else {
-        out.skipped = 0;
+        shrunk = realloc(array, out.len * sizeof(Vector3)); // Scale down to only nescessary memory
+        out.array = shrunk ? shrunk : array;
     }
+    return out;
+}
 
-    while(frameType != FIFO_FRAME_H_END){
-        switch (frameType)
-        {
-        case FIFO_FRAME_H_DATA:
-            out.array[out.len] = parseRawUInts(rawBuff + i + 1);
-            out.len++;
-            i += 7;
-            break;
-        case FIFO_FRAME_H_SENSORTIME:
-            i += 4; // We don't really care.
-            // This should be at the end of the data so we could technically break out of the while loop here but I don't want to.
-            break;
-        case FIFO_FRAME_H_CONFIG:
-            i += 2; 
-            // If this happens we are kinda screwed because we were using the new config to parse all the old data before this frame.
-            // I would love to raise some sort of error here but I don't really know how
-            break;
-        case FIFO_FRAME_H_DROP:
-            i += 2;
-            // We have dropped a frame, so this could throw off timings
-            // Need to communicate this to logic so that it can interpolate
-            // Solution: Vector3 struct of NANs.
-            out.array[out.len] = (Vector3) VECTOR_NULL;
-            out.len++;
-            break;
-        default:
-            // We are fucked...
-            // Again I would love to raise an error but idk how.
-            goto endLoop;
+AccelDataBuffer ACCEL_READ_FIFO_INTO(Vector3* array, uint16_t capacity){
+    AccelRawBuffer raw = ACCEL_READ_FIFO_RAW(a_rawSamples, capacity < ACCEL_FIFO_MAX_FRAMES ? capacity : ACCEL_FIFO_MAX_FRAMES);
+    return toDataBuffer(a_dev, raw, array);
+}
+
+AccelDataBuffer ACCEL_READ_FIFO_TIMED(Vector3* array, uint32_t* times, uint16_t capacity){
+    AccelDataBuffer out = ACCEL_READ_FIFO_INTO(array, capacity);
+    if(out.hasTime){
+        ACCEL_FILL_TIMESTAMPS(out.sensortime, out.len, times, out.overflowed);
+        out.times = times;
+    }
+    return out;
+}
+
+AccelSoABuffer ACCEL_READ_FIFO_SOA(Vector3SoA data, uint32_t* times, uint16_t capacity){
+    AccelSoABuffer out;
+    AccelRawBuffer raw = ACCEL_READ_FIFO_RAW(a_rawSamples, capacity < ACCEL_FIFO_MAX_FRAMES ? capacity : ACCEL_FIFO_MAX_FRAMES);
+    Vector3SoA after = {data.x + raw.configAt, data.y + raw.configAt, data.z + raw.configAt};
+    vRawToSoA(raw.array, data, raw.configAt, raw.scale);
+    vRawToSoA(raw.array + raw.configAt, after, raw.len - raw.configAt, a_dev->scale);
+    if(raw.drops){
+        vMarkDropsSoA(raw.array, data, raw.len);
+    }
+    out.skipped = raw.skipped;
+    out.len = raw.len;
+    out.data = data;
+    out.hasTime = raw.hasTime;
+    out.sensortime = raw.sensortime;
+    out.overflowed = raw.overflowed;
+    out.times = NULL;
+    if(times && out.hasTime){
+        ACCEL_FILL_TIMESTAMPS(out.sensortime, out.len, times, out.overflowed);
+        out.times = times;
+    }
+    return out;
+}
+
+AccelRawBuffer ACCEL_READ_FIFO_RAW(Vector3Raw* array, uint16_t capacity){
+    uint8_t rawBuff[FIFO_READ_BYTES(FIFO_MAX_BUFFER_BYTES) + READ_HEADER_BYTES];
+    uint32_t start;
+    // Only transfer what is actually queued
+    uint16_t len = ACCEL_READ_FIFO_LEN();
+    if(len > FIFO_MAX_BUFFER_BYTES){
+        len = FIFO_MAX_BUFFER_BYTES;
+    }
+
+    if(len > 0){
+        len = FIFO_READ_BYTES(len);
+        STATS_START(start);
+        chipSelect(a_dev);
+        readBurst(a_dev, ADDR_FIFO_DATA, rawBuff, len);
+        chipUnselect(a_dev);
+        STATS_RECORD(a_dev, transferHist, start);
+    }
+
+    return parseDeviceFIFO(a_dev, rawBuff + READ_HEADER_BYTES, len, array, capacity);
+}
+
+uint8_t ACCEL_READ_FIFO_DMA(Vector3* array, uint16_t capacity, AccelFIFOCallback callback){
+    return ACCEL_READ_DEVICE_FIFO_DMA(a_dev, array, capacity, callback);
+}
+
+uint8_t ACCEL_READ_DEVICE_FIFO_DMA(AccelState* dev, Vector3* array, uint16_t capacity, AccelFIFOCallback callback){
+    if(a_dmaBusy || !busClaim(dev->hspi)){
+        return 0;
+    }
+    a_dmaBusy = 1;
+    a_dmaDev = dev;
+    a_dmaCallback = callback;
+    a_dmaArray = array;
+    a_dmaCapacity = capacity;
+
+    // Fill level goes over DMA too, so nothing here or in the completion interrupt waits on the bus
+    STATS_START(a_dmaStart);
+    a_dmaStage = DMA_STAGE_LENGTH;
+    a_dmaTx[0] = READ | ADDR_FIFO_LENGTH_0;
+    if(!startDMA(dev, READ_HEADER_BYTES + 2)){
+        busRelease(dev->hspi);
+        a_dmaBusy = 0;
+        return 0;
+    }
+    return 1;
+}
+
+uint8_t ACCEL_DMA_BUSY(){
+    return a_dmaBusy;
+}
+
+uint8_t ACCEL_DMA_COMPLETE(SPI_HandleTypeDef* hspi){
+    AccelDataBuffer out;
+    if(!a_dmaBusy || hspi != a_dmaDev->hspi){
+        return 0;
+    }
+    chipUnselect(a_dmaDev);
+    STATS_ADD(a_dmaDev, bytes, a_dmaStage == DMA_STAGE_LENGTH ? READ_HEADER_BYTES + 2 : a_dmaLen + READ_HEADER_BYTES);
+
+    if(a_dmaStage == DMA_STAGE_LENGTH){
+        a_dmaLen = ((a_dmaRx[READ_HEADER_BYTES + 1] & 0b00111111) << 8) | a_dmaRx[READ_HEADER_BYTES];
+        if(a_dmaLen > FIFO_MAX_BUFFER_BYTES){
+            a_dmaLen = FIFO_MAX_BUFFER_BYTES;
+        }
+        if(a_dmaLen > 0){
+            // Bus is still ours, go straight on to the data
+            a_dmaLen = FIFO_READ_BYTES(a_dmaLen);
+            a_dmaStage = DMA_STAGE_DATA;
+            a_dmaTx[0] = READ | ADDR_FIFO_DATA;
+            if(startDMA(a_dmaDev, a_dmaLen + READ_HEADER_BYTES)){
+                return 1;
+            }
+            a_dmaStage = DMA_STAGE_LENGTH; // Couldn't start, hand back an empty readout so callers aren't left waiting
+        }
+    } else {
+        STATS_RECORD(a_dmaDev, transferHist, a_dmaStart);
+    }
+
+    // Skip over address and dummy bytes. An empty FIFO parses as nothing
+    out = toDataBuffer(a_dmaDev, parseDeviceFIFO(a_dmaDev, a_dmaRx + READ_HEADER_BYTES, a_dmaStage == DMA_STAGE_DATA ? a_dmaLen : 0,
+                                                 a_dmaRawSamples, a_dmaCapacity < ACCEL_FIFO_MAX_FRAMES ? a_dmaCapacity : ACCEL_FIFO_MAX_FRAMES),
+                       a_dmaArray);
+    busRelease(a_dmaDev->hspi);
+    a_dmaBusy = 0;
+    if(a_dmaCallback){
+        a_dmaCallback(out);
+    }
+    return 1;
+}
+
+AccelRawBuffer ACCEL_PARSE_FIFO(const uint8_t* rawBuff, uint16_t len, Vector3Raw* array, uint16_t capacity){
+    AccelFIFOParser parser;
+    memset(&parser, 0, sizeof(parser));
+    parser.scale = a_dev->scale;
+    return ACCEL_PARSE_FIFO_STREAM(&parser, rawBuff, len, array, capacity);
+}
+
+AccelRawBuffer ACCEL_PARSE_FIFO_STREAM(AccelFIFOParser* parser, const uint8_t* rawBuff, uint16_t len, Vector3Raw* array, uint16_t capacity){
+    uint8_t header, size;
+    int i = 0;
+    AccelRawBuffer out;
+    out.len = 0;
+    out.overflowed = 0;
+    out.drops = 0;
+    out.skipped = 0;
+    out.array = array;
+    out.hasTime = 0;
+    out.sensortime = 0;
+    out.configAt = CONFIG_NOT_SEEN;
+    out.scale = parser->scale;
+    // Last call ended on a config frame, so everything in this one came after it
+    if(parser->configPending){
+        out.configAt = 0;
+        parser->configPending = 0;
+    }
+
+    // Finish off the frame the last readout cut in half
+    if(parser->partialLen > 0){
+        size = frameBytes(parser->partial[0] & 0xFC);
+        while(parser->partialLen < size && i < len){
+            parser->partial[parser->partialLen++] = rawBuff[i++];
+        }
+        if(parser->partialLen == size){
+            parseFrame(parser, parser->partial, &out, capacity);
+            parser->partialLen = 0;
+        }
+    }
+
+    while(i < len){
+        header = rawBuff[i] & 0xFC; // Ignore last 2 bits
+        if(header == FIFO_FRAME_H_END){
+            break; // FIFO is empty, the rest is padding
+        }
+        size = frameBytes(header);
+        if(size == 0){
+            // Not a header, so something got corrupted. Step a byte at a time until frames line up again
+            if(!parser->resyncing){
+                parser->stats.resyncs++;
+                parser->resyncing = 1;
+            }
+            parser->stats.discardedBytes++;
+            i++;
+            continue;
+        }
+        parser->resyncing = 0;
+        if(i + size > len){
+            // Cut off by the end of the read, the rest comes with the next one
+            memcpy(parser->partial, rawBuff + i, len - i);
+            parser->partialLen = len - i;
             break;
         }
-        frameType = rawBuff[i] & 0xFC;
+        parseFrame(parser, rawBuff + i, &out, capacity);
+        i += size;
+    }
+
+    if(out.configAt == CONFIG_NOT_SEEN){
+        out.configAt = out.len;
+    } else if(out.configAt == out.len){
+        // No samples after the config frame in this call, so configAt == len can't show it. Hand it on to the next one
+        parser->configPending = 1;
     }
-    endLoop:
-    out.array = realloc(out.array, out.len * sizeof(Vector3)); // Scale down to only nescessary memory
     return out;
 }
 
+AccelFIFOStats ACCEL_GET_FIFO_STATS(){
+    return a_dev->fifo.stats;
+}
+
+void ACCEL_RESET_FIFO_STATS(){
+    memset(&a_dev->fifo.stats, 0, sizeof(AccelFIFOStats));
+}
+
+#ifdef BMI088_STATS
+SensorStats ACCEL_GET_STATS(){
+    SensorStats out;
+    statsCopy(&out, &a_dev->stats);
+    return out;
+}
+
+void ACCEL_RESET_STATS(){
+    statsReset(&a_dev->stats);
+}
+#endif
 
 void ACCEL_WRITE_FIFO_ENABLED(uint8_t enabled){
-    select();
-    writeAddr(ADDR_FIFO_CONFIG_1, enabled);
-    unselect();
+    writeReg(a_dev, ADDR_FIFO_CONFIG_1, enabled);
 }
 
 void ACCEL_WRITE_FIFO_MODE(uint8_t modeFIFO){
-    select();
-    writeAddr(ADDR_FIFO_CONFIG_0, modeFIFO);
-    unselect();
+    writeReg(a_dev, ADDR_FIFO_CONFIG_0, modeFIFO);
 }
 
 void ACCEL_WRITE_FIFO_DOWNSAMP(uint8_t downsampFIFO){
-    select();
-    writeAddr(ADDR_FIFO_DOWNS, downsampFIFO);
-    unselect();
+    writeReg(a_dev, ADDR_FIFO_DOWNS, downsampFIFO);
+    a_dev->fifoDowns = (downsampFIFO >> 4) & 0b00000111;
+}
+
+void ACCEL_WRITE_FIFO_WATERMARK(uint16_t bytes){
+    if(bytes > FIFO_MAX_BUFFER_BYTES){
+        bytes = FIFO_MAX_BUFFER_BYTES;
+    }
+    writeReg(a_dev, ADDR_FIFO_WTM_0, bytes & 0xFF);
+    writeReg(a_dev, ADDR_FIFO_WTM_1, (bytes >> 8) & 0b00011111);
+}
+
+void ACCEL_WRITE_FIFO_WATERMARK_SAMPLES(uint16_t samples){
+    ACCEL_WRITE_FIFO_WATERMARK(samples * FIFO_DATA_FRAME_SIZE_BYTES);
+}
+
+void ACCEL_WRITE_FIFO_WATERMARK_MS(uint16_t ms){
+    uint16_t samples = (uint16_t)(ms * ACCEL_GET_FIFO_RATE_HZ() / 1000.0f + 0.5f);
+    ACCEL_WRITE_FIFO_WATERMARK_SAMPLES(samples > 0 ? samples : 1);
+}
+
+// Interrupts
+
+void ACCEL_WRITE_INT1_CONFIG(uint8_t intConfig){
+    writeReg(a_dev, ADDR_INT1_IO_CTRL, intConfig);
+}
+
+void ACCEL_WRITE_INT2_CONFIG(uint8_t intConfig){
+    writeReg(a_dev, ADDR_INT2_IO_CTRL, intConfig);
+}
+
+void ACCEL_WRITE_INT_MAP(uint8_t intMap){
+    writeReg(a_dev, ADDR_INT_MAP_DATA, intMap);
+}
+
+void ACCEL_WRITE_INT1_FEATURE_MAP(uint8_t intMap){
+    writeReg(a_dev, ADDR_INT1_MAP, intMap);
+}
+
+void ACCEL_WRITE_INT2_FEATURE_MAP(uint8_t intMap){
+    writeReg(a_dev, ADDR_INT2_MAP, intMap);
+}
+
+// Data sync
+
+uint8_t ACCEL_LOAD_CONFIG_FILE(const uint8_t* config, uint16_t len){
+    uint16_t i;
+    uint16_t chunk;
+    uint8_t status;
+    // Advanced power save has to be off while loading
+    ACCEL_WRITE_PWR_ACTIVATE();
+    HAL_Delay(1);
+    writeReg(a_dev, ADDR_INIT_CTRL, 0x00);
+    for(i = 0; i < len; i += chunk){
+        chunk = len - i < CONFIG_CHUNK_BYTES ? len - i : CONFIG_CHUNK_BYTES;
+        setFeatureAddr(a_dev, i);
+        writeBurst(a_dev, ADDR_FEATURE_CFG, config + i, chunk);
+    }
+    writeReg(a_dev, ADDR_INIT_CTRL, 0x01);
+    HAL_Delay(150);
+
+    chipSelect(a_dev);
+    readAddr(a_dev, ADDR_INTERNAL_STATUS, &status, 1);
+    chipUnselect(a_dev);
+    return (status & 0x0F) == INTERNAL_STATUS_INIT_OK;
+}
+
+void ACCEL_WRITE_DATA_SYNC(uint8_t syncMode){
+    // Feature config can only be written from the start, so read back everything up to the setting
+    uint8_t feature[FEATURE_DATA_SYNC_WORD * 2 + 2];
+    setFeatureAddr(a_dev, 0);
+    chipSelect(a_dev);
+    readAddr(a_dev, ADDR_FEATURE_CFG, feature, sizeof(feature));
+    chipUnselect(a_dev);
+
+    feature[FEATURE_DATA_SYNC_WORD * 2] = syncMode;
+    feature[FEATURE_DATA_SYNC_WORD * 2 + 1] = 0;
+    setFeatureAddr(a_dev, 0);
+    writeBurst(a_dev, ADDR_FEATURE_CFG, feature, sizeof(feature));
+}
+
+AccelSnapshot ACCEL_READ_SYNCED_SNAPSHOT(){
+    return ACCEL_READ_DEVICE_SYNCED_SNAPSHOT(a_dev);
+}
+
+AccelSnapshot ACCEL_READ_DEVICE_SYNCED_SNAPSHOT(AccelState* dev){
+    // Synced z sits right after sensortime and INT_STAT_1, x and y are further up
+    uint8_t low[ADDR_GP_4 + 2 - ADDR_SENSORTIME_0];
+    uint8_t rawVals[6];
+    AccelSnapshot out;
+    chipSelect(dev);
+    readAddr(dev, ADDR_SENSORTIME_0, low, sizeof(low));
+    chipUnselect(dev);
+    chipSelect(dev);
+    readAddr(dev, ADDR_GP_0, rawVals, 4);
+    chipUnselect(dev);
+
+    rawVals[4] = low[ADDR_GP_4 - ADDR_SENSORTIME_0];
+    rawVals[5] = low[ADDR_GP_4 + 1 - ADDR_SENSORTIME_0];
+    out.acceleration = parseRawUInts(dev, rawVals);
+    out.sensortime = low[0] | (low[1] << 8) | ((uint32_t)low[2] << 16);
+    out.dataReady = low[ADDR_INT_STAT_1 - ADDR_SENSORTIME_0] >> 7;
+    return out;
 }
 
 // Infrastructure backend
-static void select(){
-    HAL_GPIO_WritePin(PORT, PIN, LOW);
+// Blocking transactions wait here for any DMA transfer on the bus to finish
+static void chipSelect(AccelState* dev){
+    if(!busWaitFree(dev->hspi)){
+        STATS_ADD(dev, halErrors, 1);
+    }
+    STATS_ADD(dev, transactions, 1);
+    HAL_GPIO_WritePin(dev->csPort, dev->csPin, LOW);
 }
 
-static void unselect(){
-    HAL_GPIO_WritePin(PORT, PIN, HIGH);
+static void chipUnselect(AccelState* dev){
+    HAL_GPIO_WritePin(dev->csPort, dev->csPin, HIGH);
 }
 
-static void readAddr(uint8_t addr, uint8_t* outBuff, int outBytes){
-    addr = READ | addr;
-    // uint8_t tempBuff[outBytes + 1]; // need to read dummy byte
-    
-    HAL_SPI_Transmit(a_hspi, &addr, 1, 100);
-    HAL_SPI_Receive(a_hspi, outBuff, 1, 100); // read dummy
-    HAL_SPI_Receive(a_hspi, outBuff, outBytes, 100);
+// Reads up to REG_BURST_MAX registers starting at addr
+static void readAddr(AccelState* dev, uint8_t addr, uint8_t* outBuff, int outBytes){
+    uint8_t frame[REG_BURST_MAX + READ_HEADER_BYTES];
+    readBurst(dev, addr, frame, outBytes);
+    memcpy(outBuff, frame + READ_HEADER_BYTES, outBytes);
+}
 
+// Whole read as one full-duplex HAL call, so there are no gaps between address, dummy and data
+//  frame needs room for READ_HEADER_BYTES + outBytes, the data lands after the header
+static void readBurst(AccelState* dev, uint8_t addr, uint8_t* frame, int outBytes){
+    frame[0] = READ | addr;
+    // Receiving in place is fine, each byte has been sent by the time its slot is overwritten
+    if(HAL_SPI_TransmitReceive(dev->hspi, frame, frame, outBytes + READ_HEADER_BYTES, 100) != HAL_OK){
+        STATS_ADD(dev, halErrors, 1);
+    }
+    STATS_ADD(dev, bytes, outBytes + READ_HEADER_BYTES);
 }
 
-static void writeAddr(uint8_t addr, uint8_t data){
+static void writeAddr(AccelState* dev, uint8_t addr, uint8_t data){
     uint8_t message[] = {WRITE|addr, data};
-    HAL_SPI_Transmit(a_hspi, message, 2, 100);
+    if(HAL_SPI_Transmit(dev->hspi, message, 2, 100) != HAL_OK){
+        STATS_ADD(dev, halErrors, 1);
+    }
+    STATS_ADD(dev, bytes, 2);
+}
+
+// Write that goes through the shadow. Skipped if the register already holds value
+static void writeReg(AccelState* dev, uint8_t addr, uint8_t value){
+    int i = shadowIndex(addr);
+    if(i >= 0){
+        if((dev->shadowValid & (1 << i)) && !((dev->shadow[i] ^ value) & a_shadowRegs[i].mask)){
+            return;
+        }
+        dev->shadow[i] = value;
+        dev->shadowValid |= 1 << i;
+    }
+    chipSelect(dev);
+    writeAddr(dev, addr, value);
+    chipUnselect(dev);
+}
+
+// Streams len bytes into consecutive registers (or into FEATURE_CFG) under one chip select
+static void writeBurst(AccelState* dev, uint8_t addr, const uint8_t* data, uint16_t len){
+    uint8_t cmd = WRITE | addr;
+    chipSelect(dev);
+    if(HAL_SPI_Transmit(dev->hspi, &cmd, 1, 100) != HAL_OK || HAL_SPI_Transmit(dev->hspi, (uint8_t*)data, len, 100) != HAL_OK){
+        STATS_ADD(dev, halErrors, 1);
+    }
+    STATS_ADD(dev, bytes, 1 + len);
+    chipUnselect(dev);
 }
 
-static Vector3 parseRawUInts(uint8_t* rawVals){
-    int32_t x, y, z;
-    Vector3 out;
-    // Int casts nescessary for two's complement
-    x = ((int16_t)(rawVals[1]*256 + rawVals[0])) * (2 << a_maxRangeBits);
-    y = ((int16_t)(rawVals[3]*256 + rawVals[2])) * (2 << a_maxRangeBits);
-    z = ((int16_t)(rawVals[5]*256 + rawVals[4])) * (2 << a_maxRangeBits);
+// Points FEATURE_CFG reads and writes at byteOffset into the config. The chip counts in 16 bit words
+static void setFeatureAddr(AccelState* dev, uint16_t byteOffset){
+    writeReg(dev, ADDR_INIT_ADDR_0, (byteOffset / 2) & 0x0F);
+    writeReg(dev, ADDR_INIT_ADDR_1, (byteOffset / 2) >> 4);
+}
 
-    // Convert units to real units (m/s^2 or ft/s^2)
-    out.x = (x / 32768.0) * 1.5 * GRAV;
-    out.z = (z / 32768.0) * 1.5 * GRAV;
-    out.y = (y / 32768.0) * 1.5 * GRAV;
-    
+// Position of addr in the shadow table, -1 if it isn't shadowed
+static int shadowIndex(uint8_t addr){
+    int i;
+    for(i = 0; i < ACCEL_SHADOW_REGS; i++){
+        if(a_shadowRegs[i].addr == addr){
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Reads every shadowed register into out, in table order. Neighbouring registers share one burst
+static void readShadowRegs(AccelState* dev, uint8_t* out){
+    int i = 0;
+    int run;
+    while(i < ACCEL_SHADOW_REGS){
+        run = 1;
+        while(i + run < ACCEL_SHADOW_REGS && a_shadowRegs[i + run].addr == a_shadowRegs[i].addr + run){
+            run++;
+        }
+        chipSelect(dev);
+        readAddr(dev, a_shadowRegs[i].addr, out + i, run);
+        chipUnselect(dev);
+        i += run;
+    }
+}
+
+static uint16_t readFIFOLen(AccelState* dev){
+    uint8_t rawData[2];
+    chipSelect(dev);
+    readAddr(dev, ADDR_FIFO_LENGTH_0, rawData, 2);
+    chipUnselect(dev);
+
+    rawData[1] &= 0b00111111;
+
+    return (rawData[1]<<8) | rawData[0];
+}
+
+// Starts the current DMA stage. The bus must already be claimed
+static uint8_t startDMA(AccelState* dev, uint16_t size){
+    STATS_ADD(dev, transactions, 1);
+    HAL_GPIO_WritePin(dev->csPort, dev->csPin, LOW);
+    if(HAL_SPI_TransmitReceive_DMA(dev->hspi, a_dmaTx, a_dmaRx, size) != HAL_OK){
+        STATS_ADD(dev, halErrors, 1);
+        chipUnselect(dev);
+        return 0;
+    }
+    return 1;
+}
+
+// Converts raw register values to m/s^2 (or ft/s^2)
+static Vector3 parseRawUInts(AccelState* dev, uint8_t* rawVals){
+    return vRawToDCalOne(vRawFromBytes(rawVals), &dev->folded);
+}
+
+// Converts a batch of raw samples into array in m/s^2, using the older range up to the config change if there was one
+static AccelDataBuffer toDataBuffer(AccelState* dev, AccelRawBuffer raw, Vector3* array){
+    AccelDataBuffer out;
+    VectorCal before;
+    uint32_t start;
+    out.skipped = raw.skipped;
+    out.len = raw.len;
+    out.array = array;
+    out.hasTime = raw.hasTime;
+    out.sensortime = raw.sensortime;
+    out.overflowed = raw.overflowed;
+    out.times = NULL;
+    STATS_START(start);
+    if(raw.configAt > 0 && raw.scale != (float)dev->scale){
+        vCalFold(&dev->calib, raw.scale, &before);
+        vRawToDCal(raw.array, array, raw.configAt, &before);
+    } else {
+        vRawToDCal(raw.array, array, raw.configAt, &dev->folded);
+    }
+    vRawToDCal(raw.array + raw.configAt, array + raw.configAt, raw.len - raw.configAt, &dev->folded);
+    if(raw.drops){
+        vMarkDrops(raw.array, array, raw.len);
+    }
+    STATS_RECORD(dev, convertHist, start);
+    return out;
+}
+
+static void syncFIFOScale(AccelState* dev){
+    dev->fifo.scale = dev->scale;
+    dev->fifo.configFrames = 0;
+}
+
+// Bytes in a frame with this header, 0 if it isn't one
+static uint8_t frameBytes(uint8_t header){
+    switch (header)
+    {
+    case FIFO_FRAME_H_DATA:
+        return FIFO_DATA_FRAME_SIZE_BYTES;
+    case FIFO_FRAME_H_SENSORTIME:
+        return FIFO_SENSORTIME_FRAME_BYTES;
+    case FIFO_FRAME_H_SKIP:
+    case FIFO_FRAME_H_CONFIG:
+    case FIFO_FRAME_H_DROP:
+        return FIFO_CONTROL_FRAME_BYTES;
+    default:
+        return 0;
+    }
+}
+
+// frame holds a whole frame
+static void parseFrame(AccelFIFOParser* parser, const uint8_t* frame, AccelRawBuffer* out, uint16_t capacity){
+    switch (frame[0] & 0xFC)
+    {
+    case FIFO_FRAME_H_DATA:
+        if(out->len >= capacity){
+            parser->stats.overflowed++;
+            out->overflowed++;
+            break;
+        }
+        out->array[out->len] = vRawFromBytes(frame + 1);
+        out->len++;
+        break;
+    case FIFO_FRAME_H_SENSORTIME:
+        // Only comes once all the data has been read, so it marks the end of this batch
+        out->sensortime = frame[1] | (frame[2] << 8) | ((uint32_t)frame[3] << 16);
+        out->hasTime = 1;
+        break;
+    case FIFO_FRAME_H_SKIP:
+        // Frames lost to a full FIFO since the last readout. Should only turn up at the start
+        out->skipped += frame[1];
+        parser->stats.skipped += frame[1];
+        break;
+    case FIFO_FRAME_H_CONFIG:
+        // Everything after this was taken with the new settings. Only the latest range is known,
+        //  so if it changed more than once between readouts the ones in between are lost
+        if(out->configAt == CONFIG_NOT_SEEN){
+            out->configAt = out->len;
+        }
+        parser->configFrames++;
+        break;
+    case FIFO_FRAME_H_DROP:
+        // Keeps its slot as a raw null so timings still line up. Counted in drops, so conversion only looks for nulls when there are some
+        parser->stats.dropped++;
+        if(out->len >= capacity){
+            parser->stats.overflowed++;
+            out->overflowed++;
+            break;
+        }
+        out->array[out->len] = (Vector3Raw) VECTOR_RAW_NULL;
+        out->len++;
+        out->drops++;
+        break;
+    }
+}
+
+// Parses a readout with dev's parser and works out which range its samples were taken at
+static AccelRawBuffer parseDeviceFIFO(AccelState* dev, const uint8_t* rawBuff, uint16_t len, Vector3Raw* array, uint16_t capacity){
+    AccelRawBuffer out;
+    uint32_t dropped = dev->fifo.stats.dropped;
+    uint32_t start;
+    STATS_START(start);
+    out = ACCEL_PARSE_FIFO_STREAM(&dev->fifo, rawBuff, len, array, capacity);
+    STATS_RECORD(dev, decodeHist, start);
+    STATS_ADD(dev, drains, 1);
+    STATS_ADD(dev, frames, out.len);
+    STATS_ADD(dev, skipped, out.skipped);
+    STATS_ADD(dev, dropped, dev->fifo.stats.dropped - dropped);
+    STATS_ADD(dev, configs, dev->fifo.configFrames);
+
+    // An empty FIFO holds nothing from before a range change either
+    if(dev->fifo.configFrames || len == 0){
+        syncFIFOScale(dev);
+    }
     return out;
 }
 
 static void setRangeMem(uint8_t range){
-    a_maxRangeBits = range;
+    a_dev->maxRangeBits = range;
     switch (range)
     {
     case ACCEL_RANGE_3G:
-        a_maxRangeReal = 3 * GRAV;
+        a_dev->maxRangeReal = 3 * GRAV;
         break;
     case ACCEL_RANGE_6G:
-        a_maxRangeReal = 6 * GRAV;
+        a_dev->maxRangeReal = 6 * GRAV;
         break;
     case ACCEL_RANGE_12G:
-        a_maxRangeReal = 12 * GRAV;
+        a_dev->maxRangeReal = 12 * GRAV;
         break;
     case ACCEL_RANGE_24G:
-        a_maxRangeReal = 24 * GRAV;
+        a_dev->maxRangeReal = 24 * GRAV;
         break;
     default:
-        a_maxRangeReal = 0;
+        a_dev->maxRangeReal = 0;
         break;
     }
+    // Full range maps onto the int16 span, so work out the per-LSB factor once here instead of per sample
+    a_dev->scale = a_dev->maxRangeReal / 32768.0;
+    vCalFold(&a_dev->calib, a_dev->scale, &a_dev->folded);
 }
\ No newline at end of file
@@ -0,0 +1,208 @@
+#include "Calibration.h"
+#include <string.h>
+
+#define BLOB_MAGIC_0 'B'
+#define BLOB_MAGIC_1 'C'
+#define BLOB_VERSION 1
+#define BLOB_HEADER_BYTES 4
+#define BLOB_CRC_BYTES 2
+
+static uint8_t invert(const double a[3][3], double out[3][3]);
+static uint8_t* putCal(uint8_t*, const SensorCal*);
+static const uint8_t* getCal(const uint8_t*, SensorCal*);
+static uint16_t crc16(const uint8_t*, uint16_t);
+
+Vector3 calCollectAccel(uint16_t samples){
+    SensorCal saved = ACCEL_GET_CALIBRATION();
+    Vector3 sum = {0, 0, 0};
+    Vector3 v;
+    uint16_t i;
+    ACCEL_SET_CALIBRATION(NULL);
+    for(i = 0; i < samples; i++){
+        v = ACCEL_READ_ACCELERATION();
+        sum.x += v.x;
+        sum.y += v.y;
+        sum.z += v.z;
+        HAL_Delay(1); // Repeats at low ODRs don't hurt a mean
+    }
+    ACCEL_SET_CALIBRATION(&saved);
+    if(samples > 0){
+        V_MUL(sum, 1.0 / samples);
+    }
+    return sum;
+}
+
+Vector3 calCollectGyro(uint16_t samples){
+    SensorCal saved = GYRO_GET_CALIBRATION();
+    Vector3 sum = {0, 0, 0};
+    Vector3 v;
+    uint16_t i;
+    GYRO_SET_CALIBRATION(NULL);
+    for(i = 0; i < samples; i++){
+        v = GYRO_READ_RATES();
+        sum.x += v.x;
+        sum.y += v.y;
+        sum.z += v.z;
+        HAL_Delay(1);
+    }
+    GYRO_SET_CALIBRATION(&saved);
+    if(samples > 0){
+        V_MUL(sum, 1.0 / samples);
+    }
+    return sum;
+}
+
+void calGyroBias(Vector3 stillMean, SensorCal* cal){
+    cal->offset[0] = stillMean.x;
+    cal->offset[1] = stillMean.y;
+    cal->offset[2] = stillMean.z;
+}
+
+uint8_t calAccelSixPosition(const Vector3* means, uint8_t misalignment, SensorCal* cal){
+    double sensitivity[3][3]; // Column j is the reading per 1g along axis j
+    double inverse[3][3];
+    double offset[3] = {0, 0, 0};
+    const Vector3* up;
+    const Vector3* down;
+    int i, j;
+
+    for(j = 0; j < 3; j++){
+        up = &means[2 * j];
+        down = &means[2 * j + 1];
+        sensitivity[0][j] = (up->x - down->x) / (2 * GRAV);
+        sensitivity[1][j] = (up->y - down->y) / (2 * GRAV);
+        sensitivity[2][j] = (up->z - down->z) / (2 * GRAV);
+        // Gravity cancels out between opposite positions, leaving the bias
+        offset[0] += (up->x + down->x) / 6;
+        offset[1] += (up->y + down->y) / 6;
+        offset[2] += (up->z + down->z) / 6;
+        // Each axis should see roughly +-1g in its own pair of positions
+        if(sensitivity[j][j] < 0.5 || sensitivity[j][j] > 1.5){
+            return 0;
+        }
+    }
+
+    if(misalignment){
+        if(!invert(sensitivity, inverse)){
+            return 0;
+        }
+    } else {
+        for(i = 0; i < 3; i++){
+            for(j = 0; j < 3; j++){
+                inverse[i][j] = i == j ? 1 / sensitivity[i][i] : 0;
+            }
+        }
+    }
+
+    for(i = 0; i < 3; i++){
+        cal->offset[i] = offset[i];
+        for(j = 0; j < 3; j++){
+            cal->matrix[i][j] = inverse[i][j];
+        }
+    }
+    return 1;
+}
+
+uint16_t calSerialize(const SensorCal* accel, const SensorCal* gyro, uint8_t* blob){
+    uint8_t* p = blob;
+    uint16_t crc;
+    *p++ = BLOB_MAGIC_0;
+    *p++ = BLOB_MAGIC_1;
+    *p++ = BLOB_VERSION;
+    *p++ = 0; // Reserved
+    p = putCal(p, accel);
+    p = putCal(p, gyro);
+    crc = crc16(blob, p - blob);
+    *p++ = crc & 0xFF;
+    *p++ = crc >> 8;
+    return p - blob;
+}
+
+uint8_t calDeserialize(const uint8_t* blob, uint16_t len, SensorCal* accel, SensorCal* gyro){
+    const uint8_t* p = blob + BLOB_HEADER_BYTES;
+    uint16_t crc;
+    if(len < CAL_BLOB_BYTES || blob[0] != BLOB_MAGIC_0 || blob[1] != BLOB_MAGIC_1 || blob[2] != BLOB_VERSION){
+        return 0;
+    }
+    crc = blob[CAL_BLOB_BYTES - 2] | (blob[CAL_BLOB_BYTES - 1] << 8);
+    if(crc != crc16(blob, CAL_BLOB_BYTES - BLOB_CRC_BYTES)){
+        return 0;
+    }
+    p = getCal(p, accel);
+    getCal(p, gyro);
+    return 1;
+}
+
+// 3x3 inverse by cofactors. Returns 0 if a is singular
+static uint8_t invert(const double a[3][3], double out[3][3]){
+    int i, j;
+    double det;
+    for(i = 0; i < 3; i++){
+        for(j = 0; j < 3; j++){
+            // Cofactor of a[j][i], indices wrap so the sign comes out right
+            out[i][j] = a[(j+1)%3][(i+1)%3] * a[(j+2)%3][(i+2)%3] - a[(j+1)%3][(i+2)%3] * a[(j+2)%3][(i+1)%3];
+        }
+    }
+    det = a[0][0] * out[0][0] + a[0][1] * out[1][0] + a[0][2] * out[2][0];
+    if(fabs(det) < 1e-9){
+        return 0;
+    }
+    for(i = 0; i < 3; i++){
+        for(j = 0; j < 3; j++){
+            out[i][j] /= det;
+        }
+    }
+    return 1;
+}
+
+// Floats go in little-endian regardless of the host
+static uint8_t* putCal(uint8_t* p, const SensorCal* cal){
+    const float* values[12];
+    uint32_t bits;
+    int i, b;
+    for(i = 0; i < 3; i++){
+        values[i] = &cal->offset[i];
+    }
+    for(i = 0; i < 9; i++){
+        values[3 + i] = &cal->matrix[i / 3][i % 3];
+    }
+    for(i = 0; i < 12; i++){
+        memcpy(&bits, values[i], sizeof(bits));
+        for(b = 0; b < 4; b++){
+            *p++ = (bits >> (8 * b)) & 0xFF;
+        }
+    }
+    return p;
+}
+
+static const uint8_t* getCal(const uint8_t* p, SensorCal* cal){
+    float* values[12];
+    uint32_t bits;
+    int i;
+    for(i = 0; i < 3; i++){
+        values[i] = &cal->offset[i];
+    }
+    for(i = 0; i < 9; i++){
+        values[3 + i] = &cal->matrix[i / 3][i % 3];
+    }
+    for(i = 0; i < 12; i++){
+        bits = p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+        memcpy(values[i], &bits, sizeof(bits));
+        p += 4;
+    }
+    return p;
+}
+
+// CRC-16/CCITT-FALSE
+static uint16_t crc16(const uint8_t* data, uint16_t len){
+    uint16_t crc = 0xFFFF;
+    uint16_t i;
+    int b;
+    for(i = 0; i < len; i++){
+        crc ^= data[i] << 8;
+        for(b = 0; b < 8; b++){
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
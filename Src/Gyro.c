@@ -1,6 +1,8 @@
 
 #include "Gyro.h"
+#include "SpiBus.h"
 #include <math.h>
+#include <string.h>
 
 
 // GPIO connectivity
@@ -36,209 +38,616 @@
 // Rate stuff
 #define MAX_2K_TO_RADS ((M_PI * 2000.0 / 180.0) / 0x7FFF.0p0)
 #define MAX_1K_TO_RADS ((M_PI * 1000.0 / 180.0) / 0x7FFF.0p0)
-#define MAX_500_TO_RADS ((M_PI * 5000.0 / 180.0) / 0x7FFF.0p0)
+#define MAX_500_TO_RADS ((M_PI * 500.0 / 180.0) / 0x7FFF.0p0)
 #define MAX_250_TO_RADS ((M_PI * 250.0 / 180.0) / 0x7FFF.0p0)
 #define MAX_125_TO_RADS ((M_PI * 125.0 / 180.0) / 0x7FFF.0p0)
 
 // FIFO
 #define FIFO_FRAME_SIZE 6
-#define FIFO_MAX_FRAMES 100
+#define FIFO_MAX_FRAMES GYRO_FIFO_MAX_FRAMES
 #define FIFO_MAX_BYTES (FIFO_FRAME_SIZE * FIFO_MAX_FRAMES)
 
 
+// Self-test. Polled often so it finishes soon after the chip does, gives up after a second
+#define TEST_POLL_MS 10
+#define TEST_MAX_POLLS 100
+
 // Other logic
 #define READ 0x80
 #define WRITE 0x00
-
-static SPI_HandleTypeDef* gyro_hspi;
-static uint8_t range;
-static uint8_t odr;
+#define READ_HEADER_BYTES 1 // Address ahead of the data on every read
+// DMA readout reads FIFO_STATUS first, then that many frames of FIFO_DATA
+#define DMA_STAGE_STATUS 0
+#define DMA_STAGE_DATA 1
+#define REG_BURST_MAX 16 // Longest read readAddr handles. FIFO reads use readBurst directly
+
+// Device used by GYRO_INIT, and the one every call currently goes to
+static GyroState gyro_default;
+static GyroState* gyro_dev = &gyro_default;
+
+// DMA transfer state. Buffers hold the address byte ahead of the FIFO data
+static uint8_t gyro_dmaTx[FIFO_MAX_BYTES + READ_HEADER_BYTES];
+static uint8_t gyro_dmaRx[FIFO_MAX_BYTES + READ_HEADER_BYTES];
+static volatile uint8_t gyro_dmaBusy;
+static GyroState* gyro_dmaDev;
+static uint8_t gyro_dmaFrames;
+static uint8_t gyro_dmaOverrun;
+static uint32_t gyro_dmaStart; // For the transfer time histogram
+static GyroFIFOCallback gyro_dmaCallback;
+static Vector3* gyro_dmaArray;
+static uint8_t gyro_dmaCapacity;
+static uint8_t gyro_dmaStage;
+// Completion decodes here rather than in gyro_rawSamples, it can interrupt a blocking readout that is still converting
+static Vector3Raw gyro_dmaRawSamples[FIFO_MAX_FRAMES];
+
+// Config registers mirrored in GyroState.shadow, in address order. mask covers the bits that mean something
+typedef struct shadowReg
+{
+    uint8_t addr;
+    uint8_t mask;
+} ShadowReg;
+
+static const ShadowReg gyro_shadowRegs[GYRO_SHADOW_REGS] = {
+    {ADDR_RANGE, 0xFF}, {ADDR_BANDWIDTH, 0x7F}, {ADDR_LPM1, 0xFF},
+    {ADDR_INT_CTRL, 0xC0}, {ADDR_INT3_INT4_IO_CONF, 0x0F},
+    {ADDR_INT3_INT4_IO_MAP, 0xA5},
+    {ADDR_FIFO_WM_EN, 0x80},
+    {ADDR_FIFO_CONFIG_0, 0x7F}, {ADDR_FIFO_CONFIG_1, 0xC0},
+};
+
+// FIFO frames from blocking readouts are decoded here before unit conversion
+static Vector3Raw gyro_rawSamples[FIFO_MAX_FRAMES];
 
 // Infrastructure declarations
-static void select();
-static void unselect();
-static void readAddr(uint8_t, uint8_t*, int);
-static void writeAddr(uint8_t, uint8_t);
-
-static Vector3 parseRawUInts(uint8_t*);
+static void chipSelect(GyroState*);
+static void chipUnselect(GyroState*);
+static void readAddr(GyroState*, uint8_t, uint8_t*, int);
+static void readBurst(GyroState*, uint8_t, uint8_t*, int);
+static void writeAddr(GyroState*, uint8_t, uint8_t);
+static void writeReg(GyroState*, uint8_t, uint8_t);
+static int shadowIndex(uint8_t);
+static void readShadowRegs(GyroState*, uint8_t*);
+static uint8_t readFIFOStatus(GyroState*, uint8_t*);
+static uint8_t startDMA(GyroState*, uint16_t);
+
+static void setRangeMem(uint8_t);
+static Vector3 parseRawUInts(GyroState*, uint8_t*);
+static GyroDataBuffer toDataBuffer(GyroState*, GyroRawBuffer, Vector3*);
+static GyroRawBuffer parseDeviceFIFO(GyroState*, const uint8_t*, uint8_t, Vector3Raw*);
 
 // Forward-facing logic
 
 void GYRO_INIT(SPI_HandleTypeDef* spiHandler){
-    unselect();
-    gyro_hspi = spiHandler;
+    GYRO_INIT_DEVICE(&gyro_default, spiHandler, PORT, PIN);
+}
+
+void GYRO_INIT_DEVICE(GyroState* dev, SPI_HandleTypeDef* spiHandler, GPIO_TypeDef* csPort, uint16_t csPin){
+    dev->hspi = spiHandler;
+    dev->csPort = csPort;
+    dev->csPin = csPin;
+    vCalIdentity(&dev->calib);
+#ifdef BMI088_STATS
+    statsReset(&dev->stats);
+    statsInitClock();
+#endif
+    gyro_dev = dev;
+    chipUnselect(dev);
     GYRO_RELOAD_SETTINGS();
 }
 
+void GYRO_USE_DEVICE(GyroState* dev){
+    gyro_dev = dev;
+}
+
+GyroState* GYRO_CURRENT_DEVICE(){
+    return gyro_dev;
+}
+
 void GYRO_GOOD_SETTINGS(){
     GYRO_SET_RANGE(GYRO_RANGE_DPS_1K);
     GYRO_SET_OUPUT_DATA_RATE(GYRO_ODR_1K__BW_116);
     GYRO_SET_FIFO_MODE(GYRO_FIFO_STREAM);
-    GYRO_RELOAD_SETTINGS();
 }
 
 // Read functions
 
 uint8_t GYRO_READ_ID(){
     uint8_t id = 0;
-    select();
+    chipSelect(gyro_dev);
 
-    readAddr(ADDR_CHIP_ID, &id, 1);
+    readAddr(gyro_dev, ADDR_CHIP_ID, &id, 1);
 
-    unselect();
+    chipUnselect(gyro_dev);
     return id;
 }
 
 Vector3 GYRO_READ_RATES(){
+    return GYRO_READ_DEVICE_RATES(gyro_dev);
+}
+
+Vector3 GYRO_READ_DEVICE_RATES(GyroState* dev){
     uint8_t rawVals[6];
-    select();
-    readAddr(ADDR_RATE_X_LSB, rawVals, 6);
-    unselect();
+    chipSelect(dev);
+    readAddr(dev, ADDR_RATE_X_LSB, rawVals, 6);
+    chipUnselect(dev);
+
+    return parseRawUInts(dev, rawVals);
+}
+
+GyroSnapshot GYRO_READ_SNAPSHOT(){
+    // Rates and INT_STAT_1 are one run of registers, the two between are reserved
+    uint8_t rawVals[ADDR_INT_STAT_1 - ADDR_RATE_X_LSB + 1];
+    GyroSnapshot out;
+    chipSelect(gyro_dev);
+    readAddr(gyro_dev, ADDR_RATE_X_LSB, rawVals, sizeof(rawVals));
+    chipUnselect(gyro_dev);
+
+    out.rates = parseRawUInts(gyro_dev, rawVals);
+    out.dataReady = rawVals[ADDR_INT_STAT_1 - ADDR_RATE_X_LSB] >> 7;
+    out.fifoInt = (rawVals[ADDR_INT_STAT_1 - ADDR_RATE_X_LSB] >> 4) & 1;
+    return out;
+}
+
+void GYRO_SET_CALIBRATION(const SensorCal* cal){
+    if(cal){
+        gyro_dev->calib = *cal;
+    } else {
+        vCalIdentity(&gyro_dev->calib);
+    }
+    vCalFold(&gyro_dev->calib, gyro_dev->scale, &gyro_dev->folded);
+}
+
+SensorCal GYRO_GET_CALIBRATION(){
+    return gyro_dev->calib;
+}
 
-    return parseRawUInts(rawVals);
+float GYRO_GET_SCALE(){
+    return gyro_dev->scale;
+}
+
+float GYRO_GET_ODR_HZ(){
+    static const float rates[] = {2000, 2000, 1000, 400, 200, 100, 200, 100};
+    return gyro_dev->odr < sizeof(rates)/sizeof(rates[0]) ? rates[gyro_dev->odr] : 0;
 }
 
 void GYRO_RELOAD_SETTINGS(){
-    uint8_t rawVals[2];
-    select();
-    readAddr(ADDR_RANGE, rawVals, 2);
-    unselect();
+    readShadowRegs(gyro_dev, gyro_dev->shadow);
+    gyro_dev->shadowValid = (1 << GYRO_SHADOW_REGS) - 1;
+
+    setRangeMem(gyro_dev->shadow[shadowIndex(ADDR_RANGE)]);
+    gyro_dev->odr = gyro_dev->shadow[shadowIndex(ADDR_BANDWIDTH)] & 0b01111111; // Ignore bit 7
+}
 
-    range = rawVals[0];
-    odr = rawVals[1] & 0b01111111; // Ignore bit 7
+uint8_t GYRO_VERIFY_SETTINGS(){
+    uint8_t chip[GYRO_SHADOW_REGS];
+    uint8_t mismatches = 0;
+    int i;
+    readShadowRegs(gyro_dev, chip);
+    for(i = 0; i < GYRO_SHADOW_REGS; i++){
+        if((gyro_dev->shadowValid & (1 << i)) && ((chip[i] ^ gyro_dev->shadow[i]) & gyro_shadowRegs[i].mask)){
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+void GYRO_RESTORE_SETTINGS(){
+    int i;
+    for(i = 0; i < GYRO_SHADOW_REGS; i++){
+        if(gyro_dev->shadowValid & (1 << i)){
+            chipSelect(gyro_dev);
+            writeAddr(gyro_dev, gyro_shadowRegs[i].addr, gyro_dev->shadow[i]);
+            chipUnselect(gyro_dev);
+        }
+    }
 }   
 
 uint8_t GYRO_SELF_TEST(){
-    uint8_t result = 0;
-    uint8_t count = 0;
-    select();
-    writeAddr(ADDR_GYRO_SELF_TEST, 0x01);// Set bit 0
-    unselect();
-    while(!(result & 0b00000010) && count < 10){ // Bit 1 must be 1 to exit
-        HAL_Delay(100);
-        select();
-        readAddr(ADDR_GYRO_SELF_TEST, &result, 1);
-        unselect();
-        count++;
-    }
-    // if test completed
-    if(result & 0b00000010){
-        return !(result & 0b00000100); // Essentail return NOT failed.
-        // (bit 2 is 1 if test failed)
-    } else { // count reached 10 & test did not complete. Assume fail
-        return 0;
+    GyroSelfTest test;
+    uint32_t now = 0;
+    uint8_t result;
+    GYRO_SELF_TEST_BEGIN(&test, now);
+    while((result = GYRO_SELF_TEST_STEP(&test, now)) == GYRO_TEST_RUNNING){
+        HAL_Delay(test.wakeAt - now);
+        now = test.wakeAt;
+    }
+    return result;
+}
+
+void GYRO_SELF_TEST_BEGIN(GyroSelfTest* test, uint32_t nowMs){
+    chipSelect(gyro_dev);
+    writeAddr(gyro_dev, ADDR_GYRO_SELF_TEST, 0x01);// Set bit 0
+    chipUnselect(gyro_dev);
+    test->result = GYRO_TEST_RUNNING;
+    test->polls = 0;
+    test->wakeAt = nowMs + TEST_POLL_MS;
+}
+
+uint8_t GYRO_SELF_TEST_STEP(GyroSelfTest* test, uint32_t nowMs){
+    uint8_t status;
+    if(test->result != GYRO_TEST_RUNNING || (int32_t)(nowMs - test->wakeAt) < 0){
+        return test->result;
     }
+    chipSelect(gyro_dev);
+    readAddr(gyro_dev, ADDR_GYRO_SELF_TEST, &status, 1);
+    chipUnselect(gyro_dev);
+    test->polls++;
+    if(status & 0b00000010){ // Bit 1 is set once the test has completed
+        test->result = !(status & 0b00000100); // Bit 2 is 1 if the test failed
+    } else if(test->polls >= TEST_MAX_POLLS){
+        test->result = 0; // Never completed, assume fail
+    } else {
+        test->wakeAt = nowMs + TEST_POLL_MS;
+    }
+    return test->result;
 }
 
 
+uint8_t GYRO_READ_FIFO_LEN(){
+    uint8_t overrun;
+    return readFIFOStatus(gyro_dev, &overrun);
+}
+
 GyroDataBuffer GYRO_READ_FIFO(){
-    uint8_t rawBuff[FIFO_MAX_BYTES] = {0};
-    int i = 0;
+    Vector3* array = malloc(sizeof(Vector3) * GYRO_FIFO_MAX_FRAMES);
+    Vector3* shrunk;
     GyroDataBuffer out;
-    out.len = 0;
-    out.array = malloc(sizeof(Vector3)*(FIFO_MAX_FRAMES));
-
-    select();
-    readAddr(ADDR_FIFO_DATA, rawBuff, FIFO_MAX_BYTES);
-    unselect();    
-    
-    // Looks ugly but I want the check to be thorough and most of the time it'll short-circut
-    while(i < FIFO_MAX_BYTES && !(rawBuff[i]==0 && rawBuff[i+1]==128 
-                                && rawBuff[i+2]==0 && rawBuff[i+3]==128 
-                                && rawBuff[i+4]==0 && rawBuff[i+5]==128)){
-        out.array[out.len] = parseRawUInts(rawBuff + i);
-        out.len++;
-        i += 6;
-    }
-
-    out.array = realloc(out.array, out.len * sizeof(Vector3));
+    if(!array){
+        STATS_ADD(gyro_dev, allocFailures, 1);
+    }
+    out = GYRO_READ_FIFO_INTO(array, array ? GYRO_FIFO_MAX_FRAMES : 0);
+
+    if(out.len == 0){
+        free(array);
+        out.array = NULL;
+    } else {
+        shrunk = realloc(array, out.len * sizeof(Vector3));
+        out.array = shrunk ? shrunk : array;
+    }
+    return out;
+}
+
+GyroDataBuffer GYRO_READ_FIFO_INTO(Vector3* array, uint8_t capacity){
+    GyroRawBuffer raw = GYRO_READ_FIFO_RAW(gyro_rawSamples, capacity);
+    return toDataBuffer(gyro_dev, raw, array);
+}
+
+GyroSoABuffer GYRO_READ_FIFO_SOA(Vector3SoA data, uint8_t capacity){
+    GyroSoABuffer out;
+    GyroRawBuffer raw = GYRO_READ_FIFO_RAW(gyro_rawSamples, capacity);
+    vRawToSoA(raw.array, data, raw.len, gyro_dev->scale);
+    out.overrun = raw.overrun;
+    out.len = raw.len;
+    out.data = data;
+    return out;
+}
+
+GyroRawBuffer GYRO_READ_FIFO_RAW(Vector3Raw* array, uint8_t capacity){
+    uint8_t rawBuff[FIFO_MAX_BYTES + READ_HEADER_BYTES];
+    GyroRawBuffer out;
+    uint8_t overrun;
+    uint32_t start;
+    // Only transfer what is actually queued
+    uint8_t frames = readFIFOStatus(gyro_dev, &overrun);
+    if(frames > capacity){
+        frames = capacity; // Leave the rest in the FIFO for next time
+    }
+
+    if(frames > 0){
+        STATS_START(start);
+        chipSelect(gyro_dev);
+        readBurst(gyro_dev, ADDR_FIFO_DATA, rawBuff, frames * FIFO_FRAME_SIZE);
+        chipUnselect(gyro_dev);
+        STATS_RECORD(gyro_dev, transferHist, start);
+    }
+
+    out = parseDeviceFIFO(gyro_dev, rawBuff + READ_HEADER_BYTES, frames, array);
+    out.overrun = overrun;
+    return out;
+}
+
+uint8_t GYRO_READ_FIFO_DMA(Vector3* array, uint8_t capacity, GyroFIFOCallback callback){
+    return GYRO_READ_DEVICE_FIFO_DMA(gyro_dev, array, capacity, callback);
+}
+
+uint8_t GYRO_READ_DEVICE_FIFO_DMA(GyroState* dev, Vector3* array, uint8_t capacity, GyroFIFOCallback callback){
+    if(gyro_dmaBusy || !busClaim(dev->hspi)){
+        return 0;
+    }
+    gyro_dmaBusy = 1;
+    gyro_dmaDev = dev;
+    gyro_dmaCallback = callback;
+    gyro_dmaArray = array;
+    gyro_dmaCapacity = capacity;
+
+    // Frame count goes over DMA too, so nothing here or in the completion interrupt waits on the bus
+    STATS_START(gyro_dmaStart);
+    gyro_dmaStage = DMA_STAGE_STATUS;
+    gyro_dmaTx[0] = READ | ADDR_FIFO_STATUS;
+    if(!startDMA(dev, READ_HEADER_BYTES + 1)){
+        busRelease(dev->hspi);
+        gyro_dmaBusy = 0;
+        return 0;
+    }
+    return 1;
+}
+
+uint8_t GYRO_DMA_BUSY(){
+    return gyro_dmaBusy;
+}
+
+uint8_t GYRO_DMA_COMPLETE(SPI_HandleTypeDef* hspi){
+    GyroRawBuffer out;
+    uint8_t status;
+    if(!gyro_dmaBusy || hspi != gyro_dmaDev->hspi){
+        return 0;
+    }
+    chipUnselect(gyro_dmaDev);
+
+    if(gyro_dmaStage == DMA_STAGE_STATUS){
+        STATS_ADD(gyro_dmaDev, bytes, READ_HEADER_BYTES + 1);
+        status = gyro_dmaRx[READ_HEADER_BYTES];
+        gyro_dmaOverrun = status >> 7;
+        gyro_dmaFrames = status & 0b01111111; // Bit 7 is overrun flag
+        if(gyro_dmaFrames > FIFO_MAX_FRAMES){
+            gyro_dmaFrames = FIFO_MAX_FRAMES;
+        }
+        if(gyro_dmaFrames > gyro_dmaCapacity){
+            gyro_dmaFrames = gyro_dmaCapacity; // Leave the rest in the FIFO for next time
+        }
+        if(gyro_dmaFrames > 0){
+            // Bus is still ours, go straight on to the data
+            gyro_dmaStage = DMA_STAGE_DATA;
+            gyro_dmaTx[0] = READ | ADDR_FIFO_DATA;
+            if(startDMA(gyro_dmaDev, gyro_dmaFrames * FIFO_FRAME_SIZE + READ_HEADER_BYTES)){
+                return 1;
+            }
+            gyro_dmaStage = DMA_STAGE_STATUS; // Couldn't start, hand back an empty readout so callers aren't left waiting
+        }
+    } else {
+        STATS_RECORD(gyro_dmaDev, transferHist, gyro_dmaStart);
+        STATS_ADD(gyro_dmaDev, bytes, gyro_dmaFrames * FIFO_FRAME_SIZE + READ_HEADER_BYTES);
+    }
+
+    // Skip over address byte. An empty FIFO parses as nothing
+    out = parseDeviceFIFO(gyro_dmaDev, gyro_dmaRx + READ_HEADER_BYTES, gyro_dmaStage == DMA_STAGE_DATA ? gyro_dmaFrames : 0, gyro_dmaRawSamples);
+    out.overrun = gyro_dmaOverrun;
+    busRelease(gyro_dmaDev->hspi);
+    gyro_dmaBusy = 0;
+    if(gyro_dmaCallback){
+        gyro_dmaCallback(toDataBuffer(gyro_dmaDev, out, gyro_dmaArray));
+    }
+    return 1;
+}
+
+#ifdef BMI088_STATS
+SensorStats GYRO_GET_STATS(){
+    SensorStats out;
+    statsCopy(&out, &gyro_dev->stats);
+    return out;
+}
+
+void GYRO_RESET_STATS(){
+    statsReset(&gyro_dev->stats);
+}
+#endif
+
+GyroRawBuffer GYRO_PARSE_FIFO(const uint8_t* rawBuff, uint8_t frames, Vector3Raw* array){
+    int i;
+    GyroRawBuffer out;
+    out.len = frames;
+    out.overrun = 0;
+    out.array = array;
+
+    // Frame count comes from FIFO_STATUS so every frame is data, no need to look for the empty marker
+    for(i = 0; i < frames; i++){
+        out.array[i] = vRawFromBytes(rawBuff + i * FIFO_FRAME_SIZE);
+    }
+
     return out;
 }
 
 // Write functions
 
 void GYRO_SET_POWERMODE(uint8_t gyroPowermode){
-    select();
-    writeAddr(ADDR_LPM1, gyroPowermode);
-    unselect();
+    writeReg(gyro_dev, ADDR_LPM1, gyroPowermode);
 }
 void GYRO_SET_RANGE(uint8_t gyroRange){
-    select();
-    range = gyroRange;
-    writeAddr(ADDR_RANGE, gyroRange);
-    unselect();
+    writeReg(gyro_dev, ADDR_RANGE, gyroRange);
+    setRangeMem(gyroRange);
 }
 void GYRO_SET_OUPUT_DATA_RATE(uint8_t gyroODR){
-    select();
-    writeAddr(ADDR_BANDWIDTH, gyroODR);
-    unselect();
+    writeReg(gyro_dev, ADDR_BANDWIDTH, gyroODR);
+    gyro_dev->odr = gyroODR;
 }
 void GYRO_SET_FIFO_MODE(uint8_t gyroFIFOMode){
-    select();
-    writeAddr(ADDR_FIFO_CONFIG_1, gyroFIFOMode);
-    unselect();
+    // Writing FIFO_CONFIG_1 is what empties the FIFO and clears overrun, so it has to go out even if the mode is unchanged
+    gyro_dev->shadowValid &= ~(1 << shadowIndex(ADDR_FIFO_CONFIG_1));
+    writeReg(gyro_dev, ADDR_FIFO_CONFIG_1, gyroFIFOMode);
+}
+void GYRO_CLEAR_FIFO_OVERRUN(){
+    GYRO_SET_FIFO_MODE(gyro_dev->shadow[shadowIndex(ADDR_FIFO_CONFIG_1)]);
+}
+void GYRO_SET_FIFO_WATERMARK(uint8_t frames){
+    if(frames > FIFO_MAX_FRAMES){
+        frames = FIFO_MAX_FRAMES;
+    }
+    writeReg(gyro_dev, ADDR_FIFO_CONFIG_0, frames);
+    writeReg(gyro_dev, ADDR_FIFO_WM_EN, frames ? 0x88 : 0x08); // Bit 7 enables, bit 3 must stay set
+}
+void GYRO_SET_FIFO_WATERMARK_MS(uint16_t ms){
+    uint16_t frames = (uint16_t)(ms * GYRO_GET_ODR_HZ() / 1000.0f + 0.5f);
+    GYRO_SET_FIFO_WATERMARK(frames > FIFO_MAX_FRAMES ? FIFO_MAX_FRAMES : (frames > 0 ? frames : 1));
+}
+void GYRO_SET_INT_ENABLE(uint8_t gyroIntEnable){
+    writeReg(gyro_dev, ADDR_INT_CTRL, gyroIntEnable);
+}
+void GYRO_SET_INT_PIN_CONFIG(uint8_t gyroIntConfig){
+    writeReg(gyro_dev, ADDR_INT3_INT4_IO_CONF, gyroIntConfig);
+}
+void GYRO_SET_INT_MAP(uint8_t gyroIntMap){
+    writeReg(gyro_dev, ADDR_INT3_INT4_IO_MAP, gyroIntMap);
 }
 
 // Infrastructure definitions
-static void select(){
-    HAL_GPIO_WritePin(PORT, PIN, LOW);
+// Blocking transactions wait here for any DMA transfer on the bus to finish
+static void chipSelect(GyroState* dev){
+    if(!busWaitFree(dev->hspi)){
+        STATS_ADD(dev, halErrors, 1);
+    }
+    STATS_ADD(dev, transactions, 1);
+    HAL_GPIO_WritePin(dev->csPort, dev->csPin, LOW);
 }
 
-static void unselect(){
-    HAL_GPIO_WritePin(PORT, PIN, HIGH);
+static void chipUnselect(GyroState* dev){
+    HAL_GPIO_WritePin(dev->csPort, dev->csPin, HIGH);
 }
 
-static void readAddr(uint8_t addr, uint8_t* outBuff, int outBytes){
-    uint8_t address = READ | addr;
+// Reads up to REG_BURST_MAX registers starting at addr
+static void readAddr(GyroState* dev, uint8_t addr, uint8_t* outBuff, int outBytes){
+    uint8_t frame[REG_BURST_MAX + READ_HEADER_BYTES];
+    readBurst(dev, addr, frame, outBytes);
+    memcpy(outBuff, frame + READ_HEADER_BYTES, outBytes);
+}
 
-    HAL_SPI_Transmit(gyro_hspi, &address, 1, 100);
-    HAL_SPI_Receive(gyro_hspi, outBuff, outBytes, 100);
+// Whole read as one full-duplex HAL call, so there is no gap between address and data
+//  frame needs room for READ_HEADER_BYTES + outBytes, the data lands after the header
+static void readBurst(GyroState* dev, uint8_t addr, uint8_t* frame, int outBytes){
+    frame[0] = READ | addr;
+    // Receiving in place is fine, each byte has been sent by the time its slot is overwritten
+    if(HAL_SPI_TransmitReceive(dev->hspi, frame, frame, outBytes + READ_HEADER_BYTES, 100) != HAL_OK){
+        STATS_ADD(dev, halErrors, 1);
+    }
+    STATS_ADD(dev, bytes, outBytes + READ_HEADER_BYTES);
+}
+
+// Returns the number of queued frames. overrun is set if frames were lost since the FIFO was last configured
+static uint8_t readFIFOStatus(GyroState* dev, uint8_t* overrun){
+    uint8_t status;
+    chipSelect(dev);
+    readAddr(dev, ADDR_FIFO_STATUS, &status, 1);
+    chipUnselect(dev);
+
+    *overrun = status >> 7;
+    status &= 0b01111111; // Bit 7 is overrun flag
+    return status > FIFO_MAX_FRAMES ? FIFO_MAX_FRAMES : status;
+}
+
+// Starts the current DMA stage. The bus must already be claimed
+static uint8_t startDMA(GyroState* dev, uint16_t size){
+    STATS_ADD(dev, transactions, 1);
+    HAL_GPIO_WritePin(dev->csPort, dev->csPin, LOW);
+    if(HAL_SPI_TransmitReceive_DMA(dev->hspi, gyro_dmaTx, gyro_dmaRx, size) != HAL_OK){
+        STATS_ADD(dev, halErrors, 1);
+        chipUnselect(dev);
+        return 0;
+    }
+    return 1;
 }
 
-static void writeAddr(uint8_t addr, uint8_t data){
+static void writeAddr(GyroState* dev, uint8_t addr, uint8_t data){
     uint8_t message[] = {WRITE|addr, data};
-    HAL_SPI_Transmit(gyro_hspi, message, 2, 100);
+    if(HAL_SPI_Transmit(dev->hspi, message, 2, 100) != HAL_OK){
+        STATS_ADD(dev, halErrors, 1);
+    }
+    STATS_ADD(dev, bytes, 2);
 }
 
-// Converts raw values to radians per second
-static Vector3 parseRawUInts(uint8_t* rawVals){
-    Vector3 out;
-    // Int casts nescessary for two's complement
-    out.x = (int16_t)(rawVals[1]*256 + rawVals[0]);
-    out.y = (int16_t)(rawVals[3]*256 + rawVals[2]);
-    out.z = (int16_t)(rawVals[5]*256 + rawVals[4]);
+// Write that goes through the shadow. Skipped if the register already holds value
+static void writeReg(GyroState* dev, uint8_t addr, uint8_t value){
+    int i = shadowIndex(addr);
+    if(i >= 0){
+        if((dev->shadowValid & (1 << i)) && !((dev->shadow[i] ^ value) & gyro_shadowRegs[i].mask)){
+            return;
+        }
+        dev->shadow[i] = value;
+        dev->shadowValid |= 1 << i;
+    }
+    chipSelect(dev);
+    writeAddr(dev, addr, value);
+    chipUnselect(dev);
+}
 
-    // Possible optimization: bitshift binary representation of 125 (could replace switch. Would need to remove defines)
+// Position of addr in the shadow table, -1 if it isn't shadowed
+static int shadowIndex(uint8_t addr){
+    int i;
+    for(i = 0; i < GYRO_SHADOW_REGS; i++){
+        if(gyro_shadowRegs[i].addr == addr){
+            return i;
+        }
+    }
+    return -1;
+}
 
-    // Convert units to rad/s
-    switch (range)
+// Reads every shadowed register into out, in table order. Neighbouring registers share one burst
+static void readShadowRegs(GyroState* dev, uint8_t* out){
+    int i = 0;
+    int run;
+    while(i < GYRO_SHADOW_REGS){
+        run = 1;
+        while(i + run < GYRO_SHADOW_REGS && gyro_shadowRegs[i + run].addr == gyro_shadowRegs[i].addr + run){
+            run++;
+        }
+        chipSelect(dev);
+        readAddr(dev, gyro_shadowRegs[i].addr, out + i, run);
+        chipUnselect(dev);
+        i += run;
+    }
+}
+
+// Converts a batch of raw samples into array in rad/s
+static GyroDataBuffer toDataBuffer(GyroState* dev, GyroRawBuffer raw, Vector3* array){
+    GyroDataBuffer out;
+    uint32_t start;
+    out.len = raw.len;
+    out.overrun = raw.overrun;
+    out.array = array;
+    STATS_START(start);
+    vRawToDCal(raw.array, array, raw.len, &dev->folded);
+    STATS_RECORD(dev, convertHist, start);
+    return out;
+}
+
+// GYRO_PARSE_FIFO plus bookkeeping for dev
+static GyroRawBuffer parseDeviceFIFO(GyroState* dev, const uint8_t* rawBuff, uint8_t frames, Vector3Raw* array){
+    GyroRawBuffer out;
+    uint32_t start;
+    STATS_START(start);
+    out = GYRO_PARSE_FIFO(rawBuff, frames, array);
+    STATS_RECORD(dev, decodeHist, start);
+    STATS_ADD(dev, drains, 1);
+    STATS_ADD(dev, frames, frames);
+    return out;
+}
+
+// Converts raw values to radians per second
+static Vector3 parseRawUInts(GyroState* dev, uint8_t* rawVals){
+    return vRawToDCalOne(vRawFromBytes(rawVals), &dev->folded);
+}
+
+// Caches the conversion factor so parsing doesn't have to switch on range for every sample
+static void setRangeMem(uint8_t gyroRange){
+    gyro_dev->range = gyroRange;
+    switch (gyro_dev->range)
     {
     case GYRO_RANGE_DPS_2K:
-        V_MUL(out, MAX_2K_TO_RADS);
+        gyro_dev->scale = MAX_2K_TO_RADS;
         break;
-    
     case GYRO_RANGE_DPS_1K:
-        V_MUL(out, MAX_1K_TO_RADS);
+        gyro_dev->scale = MAX_1K_TO_RADS;
         break;
-    
     case GYRO_RANGE_DPS_500:
-        V_MUL(out, MAX_500_TO_RADS);
+        gyro_dev->scale = MAX_500_TO_RADS;
         break;
-    
     case GYRO_RANGE_DPS_250:
-        V_MUL(out, MAX_250_TO_RADS);
+        gyro_dev->scale = MAX_250_TO_RADS;
         break;
-    
     case GYRO_RANGE_DPS_125:
-        V_MUL(out, MAX_125_TO_RADS);
+        gyro_dev->scale = MAX_125_TO_RADS;
         break;
-    
     default:
-        out.x *= 0;
-        out.y *= 0;
-        out.z *= 0;
+        gyro_dev->scale = 0;
         break;
     }
-    
-    return out;
+    vCalFold(&gyro_dev->calib, gyro_dev->scale, &gyro_dev->folded);
 }
@@ -2,18 +2,140 @@
 
 #include "Accel.h"
 #include "Gyro.h"
+#include <string.h>
 
+static AccelFIFOCallback imu_accelCallback;
+static GyroFIFOCallback imu_gyroCallback;
+static GyroState* imu_gyroDev;
+static Vector3* imu_gyroArray;
+static uint8_t imu_gyroCapacity;
+
+// Interrupt driven drains. The EXTI handler only raises a flag per source, IMU_POLL does the bus work
+#define PENDING_SYNC 0
+#define PENDING_ACCEL 1
+#define PENDING_GYRO 2
+#define PENDING_SOURCES 3
+
+static AccelState* imu_accelIntDev;
+static GyroState* imu_gyroIntDev;
+static uint16_t imu_accelPin;
+static Vector3* imu_accelIntArray;
+static uint16_t imu_accelIntCapacity;
+static AccelFIFOCallback imu_accelIntCallback;
+static uint16_t imu_gyroPin;
+static Vector3* imu_gyroIntArray;
+static uint8_t imu_gyroIntCapacity;
+static GyroFIFOCallback imu_gyroIntCallback;
+// Set by the interrupt, cleared by IMU_POLL. Flags rather than bits so neither side needs a read-modify-write
+static volatile uint8_t imu_pending[PENDING_SOURCES];
+static SampleRing* imu_ring;
+static uint32_t imu_ringTimes[ACCEL_FIFO_MAX_FRAMES];
+
+// Non-blocking startup
+#define POWER_UP_MS 100 // Same wait as IMU_ENABLE_ALL
+#define START_IDLE 0
+#define START_POWERING 1
+#define START_TESTING 2
+
+static uint8_t imu_startState;
+static uint32_t imu_startWakeAt;
+static AccelState* imu_startAccel;
+static GyroState* imu_startGyro;
+static AccelSelfTest imu_startAccelTest;
+static GyroSelfTest imu_startGyroTest;
+static IMUStartCallback imu_startCallback;
+
+// Multi-device drains. imu_drainCount is 0 when none is running
+static Bmi088* imu_drainDevs;
+static IMUDrainTarget* imu_drainTargets;
+static volatile uint8_t imu_drainCount;
+static uint8_t imu_drainIndex;
+static IMUDrainCallback imu_drainCallback;
+static AccelDataBuffer imu_drainAccel;
+
+// Synced pairs queued by interrupt. Head only written by the interrupt, tail only by IMU_DRAIN_SYNCED
+//  One slot is kept empty to tell full from empty
+static AccelState* imu_syncAccelDev;
+static GyroState* imu_syncGyroDev;
+static uint16_t imu_syncPin;
+static ImuSample* imu_syncBuffer;
+static uint16_t imu_syncCapacity;
+static atomic_uint_least32_t imu_syncHead;
+static atomic_uint_least32_t imu_syncTail;
+
+static void chainGyroDMA(AccelDataBuffer);
+static void readSyncedInto();
+static uint8_t drainNext();
+static void drainAbort(AccelDataBuffer);
+static void drainAccelDone(AccelDataBuffer);
+static void drainGyroDone(GyroDataBuffer);
+static void startPending();
+static void accelIntDone(AccelDataBuffer);
+static void gyroIntDone(GyroDataBuffer);
+static int readyCode(uint8_t, uint8_t);
+static uint32_t accelTimeBack(const AccelRawBuffer*, uint16_t);
 
 void IMU_INIT(SPI_HandleTypeDef* spiHandle){
     ACCEL_INIT(spiHandle);
     GYRO_INIT(spiHandle);
 }
 
+void IMU_INIT_DEVICE(Bmi088* imu, SPI_HandleTypeDef* spiHandler, GPIO_TypeDef* accelPort, uint16_t accelPin,
+                     GPIO_TypeDef* gyroPort, uint16_t gyroPin){
+    ACCEL_INIT_DEVICE(&imu->accel, spiHandler, accelPort, accelPin);
+    GYRO_INIT_DEVICE(&imu->gyro, spiHandler, gyroPort, gyroPin);
+}
+
+void IMU_USE_DEVICE(Bmi088* imu){
+    ACCEL_USE_DEVICE(&imu->accel);
+    GYRO_USE_DEVICE(&imu->gyro);
+}
+
 void IMU_SETUP_FOR_LOGGING(){
     ACCEL_GOOD_SETTINGS();
     GYRO_GOOD_SETTINGS();
 }
 
+LogConfig IMU_GET_LOG_CONFIG(){
+    LogConfig config;
+    config.accelScale = ACCEL_GET_SCALE();
+    config.gyroScale = GYRO_GET_SCALE();
+    config.accelRateHz = ACCEL_GET_FIFO_RATE_HZ();
+    config.gyroRateHz = GYRO_GET_ODR_HZ();
+    return config;
+}
+
+uint8_t IMU_LOG_ACCEL(LogEncoder* enc, AccelRawBuffer buffer){
+    LogEncoder saved = *enc;
+    LogConfig config = IMU_GET_LOG_CONFIG();
+    LogConfig before = config;
+    uint16_t after = buffer.len - buffer.configAt;
+    before.accelScale = buffer.scale;
+    if(buffer.configAt > 0){
+        if(!logConfig(enc, &before) ||
+           !logAccel(enc, buffer.array, buffer.configAt, buffer.hasTime, accelTimeBack(&buffer, after))){
+            *enc = saved;
+            return 0;
+        }
+    }
+    if(!logConfig(enc, &config) ||
+       (after > 0 && !logAccel(enc, buffer.array + buffer.configAt, after, buffer.hasTime, accelTimeBack(&buffer, 0)))){
+        *enc = saved;
+        return 0;
+    }
+    return 1;
+}
+
+uint8_t IMU_LOG_GYRO(LogEncoder* enc, GyroRawBuffer buffer){
+    LogEncoder saved = *enc;
+    LogConfig config = IMU_GET_LOG_CONFIG();
+    if(!logConfig(enc, &config) || !logGyro(enc, buffer.array, buffer.len)){
+        *enc = saved;
+        return 0;
+    }
+    return 1;
+}
+
 void IMU_ENABLE_ALL(){
     ACCEL_WRITE_PWR_ACTIVATE();
     ACCEL_WRITE_ACCEL_ENABLE();
@@ -22,12 +144,388 @@ void IMU_ENABLE_ALL(){
 }
 
 int IMU_READY(){
+    AccelSelfTest accel;
+    GyroSelfTest gyro;
+    uint32_t now = 0;
+    uint32_t next;
+    uint8_t accelResult, gyroResult;
+    ACCEL_SELF_TEST_BEGIN(&accel, now);
+    GYRO_SELF_TEST_BEGIN(&gyro, now);
+    accelResult = ACCEL_SELF_TEST_STEP(&accel, now);
+    gyroResult = GYRO_SELF_TEST_STEP(&gyro, now);
+    while(accelResult == ACCEL_TEST_RUNNING || gyroResult == GYRO_TEST_RUNNING){
+        // Sleep until whichever test is due first
+        next = accelResult == ACCEL_TEST_RUNNING ? accel.wakeAt : gyro.wakeAt;
+        if(gyroResult == GYRO_TEST_RUNNING && (int32_t)(gyro.wakeAt - next) < 0){
+            next = gyro.wakeAt;
+        }
+        HAL_Delay(next - now);
+        now = next;
+        accelResult = ACCEL_SELF_TEST_STEP(&accel, now);
+        gyroResult = GYRO_SELF_TEST_STEP(&gyro, now);
+    }
+    return readyCode(accelResult, gyroResult);
+}
+
+void IMU_START(IMUStartCallback callback, uint32_t nowMs){
+    imu_startAccel = ACCEL_CURRENT_DEVICE();
+    imu_startGyro = GYRO_CURRENT_DEVICE();
+    imu_startCallback = callback;
+    ACCEL_WRITE_PWR_ACTIVATE();
+    ACCEL_WRITE_ACCEL_ENABLE();
+    GYRO_SET_POWERMODE(GYRO_PWR_NORMAL);
+    imu_startWakeAt = nowMs + POWER_UP_MS;
+    imu_startState = START_POWERING;
+}
+
+uint8_t IMU_START_TICK(uint32_t nowMs){
+    AccelState* accelDev;
+    GyroState* gyroDev;
+    uint8_t accelResult, gyroResult;
+    if(imu_startState == START_IDLE){
+        return 0;
+    }
+    if(imu_startState == START_POWERING && (int32_t)(nowMs - imu_startWakeAt) < 0){
+        return 1;
+    }
+
+    // Point the sensor calls at the devices being started, whatever the application has switched to since
+    accelDev = ACCEL_CURRENT_DEVICE();
+    gyroDev = GYRO_CURRENT_DEVICE();
+    ACCEL_USE_DEVICE(imu_startAccel);
+    GYRO_USE_DEVICE(imu_startGyro);
+    if(imu_startState == START_POWERING){
+        ACCEL_SELF_TEST_BEGIN(&imu_startAccelTest, nowMs);
+        GYRO_SELF_TEST_BEGIN(&imu_startGyroTest, nowMs);
+        imu_startState = START_TESTING;
+    }
+    accelResult = ACCEL_SELF_TEST_STEP(&imu_startAccelTest, nowMs);
+    gyroResult = GYRO_SELF_TEST_STEP(&imu_startGyroTest, nowMs);
+    ACCEL_USE_DEVICE(accelDev);
+    GYRO_USE_DEVICE(gyroDev);
+
+    if(accelResult == ACCEL_TEST_RUNNING || gyroResult == GYRO_TEST_RUNNING){
+        return 1;
+    }
+    imu_startState = START_IDLE;
+    if(imu_startCallback){
+        imu_startCallback(readyCode(accelResult, gyroResult));
+    }
+    return 0;
+}
+
+uint8_t IMU_READ_FIFO_DMA(Vector3* accelArray, uint16_t accelCapacity, AccelFIFOCallback accelCallback,
+                          Vector3* gyroArray, uint8_t gyroCapacity, GyroFIFOCallback gyroCallback){
+    if(ACCEL_DMA_BUSY() || GYRO_DMA_BUSY() || imu_drainCount){
+        return 0;
+    }
+    imu_accelCallback = accelCallback;
+    imu_gyroCallback = gyroCallback;
+    imu_gyroDev = GYRO_CURRENT_DEVICE();
+    imu_gyroArray = gyroArray;
+    imu_gyroCapacity = gyroCapacity;
+    return ACCEL_READ_FIFO_DMA(accelArray, accelCapacity, chainGyroDMA);
+}
+
+uint8_t IMU_READ_ALL_FIFO_DMA(Bmi088* imus, IMUDrainTarget* targets, uint8_t count, IMUDrainCallback callback){
+    if(ACCEL_DMA_BUSY() || GYRO_DMA_BUSY() || imu_drainCount || count == 0){
+        return 0;
+    }
+    imu_drainDevs = imus;
+    imu_drainTargets = targets;
+    imu_drainCallback = callback;
+    imu_drainIndex = 0;
+    imu_drainCount = count;
+    if(!drainNext()){
+        imu_drainCount = 0; // Bus refused the first transfer, nothing was started
+        return 0;
+    }
+    return 1;
+}
+
+void IMU_DMA_COMPLETE(SPI_HandleTypeDef* hspi){
+    if(!ACCEL_DMA_COMPLETE(hspi)){
+        GYRO_DMA_COMPLETE(hspi);
+    }
+}
+
+void IMU_ATTACH_ACCEL_INTERRUPT(uint16_t gpioPin, Vector3* array, uint16_t capacity, AccelFIFOCallback callback){
+    imu_accelIntDev = ACCEL_CURRENT_DEVICE();
+    imu_accelPin = gpioPin;
+    imu_accelIntArray = array;
+    imu_accelIntCapacity = capacity;
+    imu_accelIntCallback = callback;
+}
+
+void IMU_ATTACH_GYRO_INTERRUPT(uint16_t gpioPin, Vector3* array, uint8_t capacity, GyroFIFOCallback callback){
+    imu_gyroIntDev = GYRO_CURRENT_DEVICE();
+    imu_gyroPin = gpioPin;
+    imu_gyroIntArray = array;
+    imu_gyroIntCapacity = capacity;
+    imu_gyroIntCallback = callback;
+}
+
+uint8_t IMU_SETUP_DATA_SYNC(const uint8_t* config, uint16_t len, uint8_t mode){
+    uint8_t gyroODR;
+    switch (mode)
+    {
+    case ACCEL_DATA_SYNC_400:
+        gyroODR = GYRO_ODR_400__BW_47;
+        break;
+    case ACCEL_DATA_SYNC_1K:
+        gyroODR = GYRO_ODR_1K__BW_116;
+        break;
+    case ACCEL_DATA_SYNC_2K:
+        gyroODR = GYRO_ODR_2K__BW_230;
+        break;
+    default:
+        ACCEL_WRITE_DATA_SYNC(ACCEL_DATA_SYNC_OFF);
+        return 1;
+    }
+    if(!ACCEL_LOAD_CONFIG_FILE(config, len)){
+        return 0;
+    }
+    GYRO_SET_OUPUT_DATA_RATE(gyroODR);
+    ACCEL_SET_CONFIG(ACCEL_OSR_NORMAL, ACCEL_ODR_1600);
+    ACCEL_WRITE_DATA_SYNC(mode);
+
+    // Gyro data ready on INT3 triggers the accel sample through INT1
+    GYRO_SET_INT_ENABLE(GYRO_INT_DATA_READY_EN);
+    GYRO_SET_INT_PIN_CONFIG(GYRO_INT3_ACTIVE_HIGH);
+    GYRO_SET_INT_MAP(GYRO_INT3_DATA_READY);
+    ACCEL_WRITE_INT1_CONFIG(ACCEL_INT_INPUT);
+    ACCEL_WRITE_INT2_CONFIG(ACCEL_INT_OUTPUT | ACCEL_INT_PUSH_PULL | ACCEL_INT_ACTIVE_HIGH);
+    ACCEL_WRITE_INT2_FEATURE_MAP(ACCEL_INT_DATA_SYNC);
+    return 1;
+}
+
+ImuSample IMU_READ_SYNCED(){
+    ImuSample out;
+    AccelSnapshot accel = ACCEL_READ_SYNCED_SNAPSHOT();
+    out.accel = accel.acceleration;
+    out.sensortime = accel.sensortime;
+    out.gyro = GYRO_READ_RATES();
+    return out;
+}
+
+void IMU_ATTACH_SYNC_INTERRUPT(uint16_t gpioPin, ImuSample* buffer, uint16_t capacity){
+    imu_syncAccelDev = ACCEL_CURRENT_DEVICE();
+    imu_syncGyroDev = GYRO_CURRENT_DEVICE();
+    imu_syncPin = gpioPin;
+    imu_syncCapacity = capacity;
+    atomic_store_explicit(&imu_syncHead, 0, memory_order_relaxed);
+    atomic_store_explicit(&imu_syncTail, 0, memory_order_relaxed);
+    imu_syncBuffer = buffer;
+}
+
+uint16_t IMU_DRAIN_SYNCED(ImuSample* out, uint16_t capacity){
+    uint32_t tail = atomic_load_explicit(&imu_syncTail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&imu_syncHead, memory_order_acquire);
+    uint16_t n = 0;
+    while(tail != head && n < capacity){
+        out[n++] = imu_syncBuffer[tail];
+        tail = tail + 1 == imu_syncCapacity ? 0 : tail + 1;
+    }
+    atomic_store_explicit(&imu_syncTail, tail, memory_order_release);
+    return n;
+}
+
+void IMU_ATTACH_RING(SampleRing* ring){
+    imu_ring = ring;
+}
+
+void IMU_EXTI_CALLBACK(uint16_t GPIO_Pin){
+    if(imu_accelIntArray && GPIO_Pin == imu_accelPin){
+        imu_pending[PENDING_ACCEL] = 1;
+    }
+    if(imu_gyroIntArray && GPIO_Pin == imu_gyroPin){
+        imu_pending[PENDING_GYRO] = 1;
+    }
+    if(imu_syncBuffer && GPIO_Pin == imu_syncPin){
+        imu_pending[PENDING_SYNC] = 1;
+    }
+}
+
+uint8_t IMU_POLL(){
+    startPending();
+    return imu_pending[PENDING_SYNC] || imu_pending[PENDING_ACCEL] || imu_pending[PENDING_GYRO];
+}
+
+// Starts queued work if the bus is free. A drain that is still running holds back the rest until the next poll
+static void startPending(){
+    if(ACCEL_DMA_BUSY() || GYRO_DMA_BUSY() || imu_drainCount){
+        return;
+    }
+    // Synced registers are overwritten by the next trigger, so they go first
+    if(imu_pending[PENDING_SYNC]){
+        imu_pending[PENDING_SYNC] = 0;
+        readSyncedInto();
+    }
+    // Cleared before starting, so an interrupt that comes in meanwhile isn't lost. Put back if the bus refused
+    if(imu_pending[PENDING_ACCEL]){
+        imu_pending[PENDING_ACCEL] = 0;
+        if(!ACCEL_READ_DEVICE_FIFO_DMA(imu_accelIntDev, imu_accelIntArray, imu_accelIntCapacity, accelIntDone)){
+            imu_pending[PENDING_ACCEL] = 1;
+        }
+    }
+    if(!ACCEL_DMA_BUSY() && imu_pending[PENDING_GYRO]){
+        imu_pending[PENDING_GYRO] = 0;
+        if(!GYRO_READ_DEVICE_FIFO_DMA(imu_gyroIntDev, imu_gyroIntArray, imu_gyroIntCapacity, gyroIntDone)){
+            imu_pending[PENDING_GYRO] = 1;
+        }
+    }
+}
+
+// Completion of an interrupt driven drain. Feeds the ring, if there is one, then the user callback
+static void accelIntDone(AccelDataBuffer data){
+    RingSample sample;
+    uint16_t i;
+    if(imu_ring){
+        if(data.hasTime){
+            ACCEL_FILL_DEVICE_TIMESTAMPS(imu_accelIntDev, data.sensortime, data.len, imu_ringTimes, data.overflowed);
+        }
+        sample.sensor = RING_SENSOR_ACCEL;
+        for(i = 0; i < data.len; i++){
+            sample.time = data.hasTime ? imu_ringTimes[i] : 0;
+            sample.value.x = data.array[i].x;
+            sample.value.y = data.array[i].y;
+            sample.value.z = data.array[i].z;
+            ringPush(imu_ring, &sample);
+        }
+    }
+    if(imu_accelIntCallback){
+        imu_accelIntCallback(data);
+    }
+}
+
+static void gyroIntDone(GyroDataBuffer data){
+    RingSample sample;
+    uint16_t i;
+    if(imu_ring){
+        sample.sensor = RING_SENSOR_GYRO;
+        sample.time = 0;
+        for(i = 0; i < data.len; i++){
+            sample.value.x = data.array[i].x;
+            sample.value.y = data.array[i].y;
+            sample.value.z = data.array[i].z;
+            ringPush(imu_ring, &sample);
+        }
+    }
+    if(imu_gyroIntCallback){
+        imu_gyroIntCallback(data);
+    }
+}
+
+static void chainGyroDMA(AccelDataBuffer accelData){
+    GyroDataBuffer none;
+    // Bus is free again so the gyro can go before the accel data is handed off
+    if(!GYRO_READ_DEVICE_FIFO_DMA(imu_gyroDev, imu_gyroArray, imu_gyroCapacity, imu_gyroCallback)){
+        // Bus was taken in the meantime. Hand back an empty readout so the caller isn't left waiting
+        none.overrun = 0;
+        none.len = 0;
+        none.array = imu_gyroArray;
+        if(imu_gyroCallback){
+            imu_gyroCallback(none);
+        }
+    }
+    if(imu_accelCallback){
+        imu_accelCallback(accelData);
+    }
+}
+
+// Starts the accel transfer for the current device of a multi-device drain. Returns 1 if it was started
+static uint8_t drainNext(){
+    IMUDrainTarget* target = &imu_drainTargets[imu_drainIndex];
+    return ACCEL_READ_DEVICE_FIFO_DMA(&imu_drainDevs[imu_drainIndex].accel, target->accelArray, target->accelCapacity, drainAccelDone);
+}
+
+// Bus refused a transfer part way through the chain. The current device gets whatever accel data was already read
+//  and it and every device after it are called back with empty readouts, so the caller isn't left waiting
+//  Anything not read stays in the FIFOs for the next drain
+static void drainAbort(AccelDataBuffer accelData){
+    IMUDrainCallback callback = imu_drainCallback;
+    IMUDrainTarget* targets = imu_drainTargets;
+    uint8_t device = imu_drainIndex;
+    uint8_t count = imu_drainCount;
+    GyroDataBuffer gyroData;
+    // Cleared first so a callback can start the next drain
+    imu_drainCount = 0;
+    gyroData.overrun = 0;
+    gyroData.len = 0;
+    for(; device < count; device++){
+        gyroData.array = targets[device].gyroArray;
+        if(callback){
+            callback(device, accelData, gyroData);
+        }
+        memset(&accelData, 0, sizeof(accelData));
+        accelData.array = device + 1 < count ? targets[device + 1].accelArray : NULL;
+    }
+}
+
+static void drainAccelDone(AccelDataBuffer accelData){
+    IMUDrainTarget* target = &imu_drainTargets[imu_drainIndex];
+    // Held until the gyro data for the same device is in so the callback gets both at once
+    imu_drainAccel = accelData;
+    if(!GYRO_READ_DEVICE_FIFO_DMA(&imu_drainDevs[imu_drainIndex].gyro, target->gyroArray, target->gyroCapacity, drainGyroDone)){
+        drainAbort(accelData);
+    }
+}
+
+static void drainGyroDone(GyroDataBuffer gyroData){
+    AccelDataBuffer none;
+    uint8_t device = imu_drainIndex;
+    imu_drainIndex++;
+    if(imu_drainIndex >= imu_drainCount){
+        imu_drainCount = 0;
+    }
+    if(imu_drainCallback){
+        imu_drainCallback(device, imu_drainAccel, gyroData);
+    }
+    if(imu_drainCount && !drainNext()){
+        memset(&none, 0, sizeof(none));
+        none.array = imu_drainTargets[imu_drainIndex].accelArray;
+        drainAbort(none);
+    }
+}
+
+// Reads a synced pair from the attached devices into the queue. Dropped if the queue is full
+//  Only runs from IMU_POLL, the interrupt just flags it
+static void readSyncedInto(){
+    uint32_t head = atomic_load_explicit(&imu_syncHead, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&imu_syncTail, memory_order_acquire);
+    uint32_t next;
+    ImuSample sample;
+    AccelSnapshot accel;
+
+    // Explicit devices, so the main loop's current ones are never switched under it
+    accel = ACCEL_READ_DEVICE_SYNCED_SNAPSHOT(imu_syncAccelDev);
+    sample.accel = accel.acceleration;
+    sample.sensortime = accel.sensortime;
+    sample.gyro = GYRO_READ_DEVICE_RATES(imu_syncGyroDev);
+
+    next = head + 1 == imu_syncCapacity ? 0 : head + 1;
+    if(next == tail){
+        return;
+    }
+    imu_syncBuffer[head] = sample;
+    atomic_store_explicit(&imu_syncHead, next, memory_order_release);
+}
+
+// Combines self-test results the way IMU_READY reports them
+static int readyCode(uint8_t accelPassed, uint8_t gyroPassed){
     int ready = 0;
-    if(!ACCEL_SELF_TEST()){
+    if(!accelPassed){
         ready = -1;
     }
-    if(!GYRO_SELF_TEST()){
+    if(!gyroPassed){
         ready -= 2;
     }
     return ready == 0 ? 1 : ready;
-}
\ No newline at end of file
+}
+
+// Time of the sample back frames before the last one in buffer, anchored the way ACCEL_FILL_TIMESTAMPS does it
+static uint32_t accelTimeBack(const AccelRawBuffer* buffer, uint16_t back){
+    uint32_t time = buffer->sensortime;
+    ACCEL_FILL_TIMESTAMPS(buffer->sensortime, 1, &time, buffer->overflowed + back);
+    return time;
+}
@@ -0,0 +1,174 @@
+#include "Orientation.h"
+
+#define IS_RAW_NULL(V) ((V).x == INT16_MIN && (V).y == INT16_MIN && (V).z == INT16_MIN)
+
+#ifdef ORIENTATION_FIXED_POINT
+#define Q_FRAC_BITS 30
+#define Q_ONE ((int32_t)1 << Q_FRAC_BITS)
+#define HALF_STEP_FRAC_BITS 46 // Gyro LSBs are tiny per sample, so halfStep keeps 16 extra bits
+#endif
+
+static void accelCorrection(Orientation*, const Vector3Raw*, uint16_t, float, Vector3f*);
+static void integrate(Orientation*, const Vector3Raw*, uint16_t, const Vector3f*);
+
+void orientInit(Orientation* o, float gyroScale, float gyroRateHz, float kp, float ki){
+    o->dt = 1.0f / gyroRateHz;
+    o->kp = kp;
+    o->ki = ki;
+    o->integral.x = 0;
+    o->integral.y = 0;
+    o->integral.z = 0;
+#ifdef ORIENTATION_FIXED_POINT
+    o->q[0] = Q_ONE;
+    o->halfStep = (int32_t)(gyroScale * o->dt * 0.5f * (float)((int64_t)1 << HALF_STEP_FRAC_BITS));
+#else
+    o->q[0] = 1;
+    o->halfStep = gyroScale * o->dt * 0.5f;
+#endif
+    o->q[1] = 0;
+    o->q[2] = 0;
+    o->q[3] = 0;
+}
+
+void orientUpdate(Orientation* o, const Vector3Raw* gyro, uint16_t gyroLen, const Vector3Raw* accel, uint16_t accelLen){
+    Vector3f corr;
+    if(gyroLen == 0){
+        return;
+    }
+    accelCorrection(o, accel, accelLen, gyroLen * o->dt, &corr);
+    integrate(o, gyro, gyroLen, &corr);
+}
+
+void orientGetQuaternion(const Orientation* o, float* out){
+    int i;
+    for(i = 0; i < 4; i++){
+#ifdef ORIENTATION_FIXED_POINT
+        out[i] = o->q[i] / (float)Q_ONE;
+#else
+        out[i] = o->q[i];
+#endif
+    }
+}
+
+// Mahony feedback in rad/s from the batch's average acceleration. Only the direction matters, so raw counts do
+static void accelCorrection(Orientation* o, const Vector3Raw* accel, uint16_t len, float batchDt, Vector3f* corr){
+    int32_t sx = 0, sy = 0, sz = 0;
+    uint16_t i, used = 0;
+    float q[4];
+    float ax, ay, az, norm;
+    float vx, vy, vz;
+    float ex, ey, ez;
+
+    for(i = 0; i < len; i++){
+        if(IS_RAW_NULL(accel[i])){
+            continue;
+        }
+        sx += accel[i].x;
+        sy += accel[i].y;
+        sz += accel[i].z;
+        used++;
+    }
+    *corr = o->integral;
+    if(used == 0){
+        return;
+    }
+    ax = sx;
+    ay = sy;
+    az = sz;
+    norm = sqrtf(ax*ax + ay*ay + az*az);
+    if(norm == 0){
+        return; // Free fall, nothing to correct against
+    }
+    ax /= norm;
+    ay /= norm;
+    az /= norm;
+
+    // Gravity direction the current estimate expects
+    orientGetQuaternion(o, q);
+    vx = 2 * (q[1]*q[3] - q[0]*q[2]);
+    vy = 2 * (q[0]*q[1] + q[2]*q[3]);
+    vz = q[0]*q[0] - q[1]*q[1] - q[2]*q[2] + q[3]*q[3];
+
+    ex = ay*vz - az*vy;
+    ey = az*vx - ax*vz;
+    ez = ax*vy - ay*vx;
+
+    o->integral.x += o->ki * ex * batchDt;
+    o->integral.y += o->ki * ey * batchDt;
+    o->integral.z += o->ki * ez * batchDt;
+    corr->x = o->kp * ex + o->integral.x;
+    corr->y = o->kp * ey + o->integral.y;
+    corr->z = o->kp * ez + o->integral.z;
+}
+
+// q += q * (0, w) * dt/2 for every sample, then one renormalisation for the whole batch
+//  The norm only drifts by about (w*dt/2)^2 per sample so that is plenty
+#ifdef ORIENTATION_FIXED_POINT
+static void integrate(Orientation* o, const Vector3Raw* gyro, uint16_t len, const Vector3f* corr){
+    int32_t q0 = o->q[0], q1 = o->q[1], q2 = o->q[2], q3 = o->q[3];
+    int32_t n0, n1, n2, n3;
+    int32_t hx, hy, hz;
+    int32_t cx = (int32_t)(corr->x * o->dt * 0.5f * Q_ONE);
+    int32_t cy = (int32_t)(corr->y * o->dt * 0.5f * Q_ONE);
+    int32_t cz = (int32_t)(corr->z * o->dt * 0.5f * Q_ONE);
+    int64_t norm, inv;
+    uint16_t i;
+
+    for(i = 0; i < len; i++){
+        // Half rotation this sample in Q30
+        hx = (int32_t)(((int64_t)gyro[i].x * o->halfStep) >> (HALF_STEP_FRAC_BITS - Q_FRAC_BITS)) + cx;
+        hy = (int32_t)(((int64_t)gyro[i].y * o->halfStep) >> (HALF_STEP_FRAC_BITS - Q_FRAC_BITS)) + cy;
+        hz = (int32_t)(((int64_t)gyro[i].z * o->halfStep) >> (HALF_STEP_FRAC_BITS - Q_FRAC_BITS)) + cz;
+
+        n0 = q0 - (int32_t)(((int64_t)q1*hx + (int64_t)q2*hy + (int64_t)q3*hz) >> Q_FRAC_BITS);
+        n1 = q1 + (int32_t)(((int64_t)q0*hx + (int64_t)q2*hz - (int64_t)q3*hy) >> Q_FRAC_BITS);
+        n2 = q2 + (int32_t)(((int64_t)q0*hy - (int64_t)q1*hz + (int64_t)q3*hx) >> Q_FRAC_BITS);
+        n3 = q3 + (int32_t)(((int64_t)q0*hz + (int64_t)q1*hy - (int64_t)q2*hx) >> Q_FRAC_BITS);
+        q0 = n0;
+        q1 = n1;
+        q2 = n2;
+        q3 = n3;
+    }
+
+    // Norm is close to 1, so a single Newton step from 1 gives 1/sqrt without any division
+    norm = ((int64_t)q0*q0 + (int64_t)q1*q1 + (int64_t)q2*q2 + (int64_t)q3*q3) >> Q_FRAC_BITS;
+    inv = (3 * (int64_t)Q_ONE - norm) / 2;
+    o->q[0] = (int32_t)((q0 * inv) >> Q_FRAC_BITS);
+    o->q[1] = (int32_t)((q1 * inv) >> Q_FRAC_BITS);
+    o->q[2] = (int32_t)((q2 * inv) >> Q_FRAC_BITS);
+    o->q[3] = (int32_t)((q3 * inv) >> Q_FRAC_BITS);
+}
+#else
+static void integrate(Orientation* o, const Vector3Raw* gyro, uint16_t len, const Vector3f* corr){
+    float q0 = o->q[0], q1 = o->q[1], q2 = o->q[2], q3 = o->q[3];
+    float n0, n1, n2, n3;
+    float hx, hy, hz;
+    float cx = corr->x * o->dt * 0.5f;
+    float cy = corr->y * o->dt * 0.5f;
+    float cz = corr->z * o->dt * 0.5f;
+    float inv;
+    uint16_t i;
+
+    for(i = 0; i < len; i++){
+        // Half rotation this sample
+        hx = gyro[i].x * o->halfStep + cx;
+        hy = gyro[i].y * o->halfStep + cy;
+        hz = gyro[i].z * o->halfStep + cz;
+
+        n0 = q0 - q1*hx - q2*hy - q3*hz;
+        n1 = q1 + q0*hx + q2*hz - q3*hy;
+        n2 = q2 + q0*hy - q1*hz + q3*hx;
+        n3 = q3 + q0*hz + q1*hy - q2*hx;
+        q0 = n0;
+        q1 = n1;
+        q2 = n2;
+        q3 = n3;
+    }
+
+    inv = 1.0f / sqrtf(q0*q0 + q1*q1 + q2*q2 + q3*q3);
+    o->q[0] = q0 * inv;
+    o->q[1] = q1 * inv;
+    o->q[2] = q2 * inv;
+    o->q[3] = q3 * inv;
+}
+#endif
@@ -0,0 +1,104 @@
+#include "Preintegration.h"
+#include <string.h>
+
+#define IS_NULL(V) (isnan((V).x) || isnan((V).y) || isnan((V).z))
+
+static Vector3f cross(Vector3f a, Vector3f b);
+static void addScaled(Vector3f* acc, Vector3f v, float k);
+static void emit(Preintegrator* p, PreintDelta* out);
+
+void preintInit(Preintegrator* p, float gyroRateHz, float intervalS){
+    memset(p, 0, sizeof(Preintegrator));
+    p->dt = 1.0f / gyroRateHz;
+    p->interval = (uint16_t)(intervalS * gyroRateHz + 0.5f);
+    if(p->interval == 0){
+        p->interval = 1;
+    }
+}
+
+uint16_t preintUpdate(Preintegrator* p, const Vector3* gyro, uint16_t gyroLen, const Vector3* accel, uint16_t accelLen,
+                      PreintDelta* out, uint16_t maxOut){
+    uint16_t i, emitted = 0;
+    const Vector3* a;
+    Vector3f dTheta, dV;
+
+    for(i = 0; i < gyroLen; i++){
+        if(!IS_NULL(gyro[i])){
+            p->lastRate.x = gyro[i].x;
+            p->lastRate.y = gyro[i].y;
+            p->lastRate.z = gyro[i].z;
+        }
+        // Accel sample covering the same part of the batch
+        if(accelLen > 0){
+            a = &accel[(uint32_t)i * accelLen / gyroLen];
+            if(!IS_NULL(*a)){
+                p->lastAccel.x = a->x;
+                p->lastAccel.y = a->y;
+                p->lastAccel.z = a->z;
+            }
+        }
+        dTheta.x = p->lastRate.x * p->dt;
+        dTheta.y = p->lastRate.y * p->dt;
+        dTheta.z = p->lastRate.z * p->dt;
+        dV.x = p->lastAccel.x * p->dt;
+        dV.y = p->lastAccel.y * p->dt;
+        dV.z = p->lastAccel.z * p->dt;
+
+        // Coning: 1/2 alpha x dTheta + 1/12 lastAngle x dTheta
+        addScaled(&p->beta, cross(p->alpha, dTheta), 0.5f);
+        addScaled(&p->beta, cross(p->lastAngle, dTheta), 1.0f / 12);
+        // Sculling: 1/2 (alpha x dV + nu x dTheta) + 1/12 (lastAngle x dV + lastVel x dTheta)
+        addScaled(&p->scul, cross(p->alpha, dV), 0.5f);
+        addScaled(&p->scul, cross(p->nu, dTheta), 0.5f);
+        addScaled(&p->scul, cross(p->lastAngle, dV), 1.0f / 12);
+        addScaled(&p->scul, cross(p->lastVel, dTheta), 1.0f / 12);
+
+        addScaled(&p->alpha, dTheta, 1);
+        addScaled(&p->nu, dV, 1);
+        p->lastAngle = dTheta;
+        p->lastVel = dV;
+        p->count++;
+
+        if(p->count >= p->interval){
+            if(emitted < maxOut){
+                emit(p, &out[emitted]);
+                emitted++;
+            } else {
+                p->merged++;
+            }
+        }
+    }
+    return emitted;
+}
+
+// Finishes the current increment into out and starts the next one
+static void emit(Preintegrator* p, PreintDelta* out){
+    Vector3f rot = cross(p->alpha, p->nu); // Velocity rotation over the interval is 1/2 alpha x nu
+    out->dAngle = p->alpha;
+    addScaled(&out->dAngle, p->beta, 1);
+    out->dVelocity = p->nu;
+    addScaled(&out->dVelocity, rot, 0.5f);
+    addScaled(&out->dVelocity, p->scul, 1);
+    out->dt = p->count * p->dt;
+    out->samples = p->count;
+
+    memset(&p->alpha, 0, sizeof(Vector3f));
+    memset(&p->beta, 0, sizeof(Vector3f));
+    memset(&p->nu, 0, sizeof(Vector3f));
+    memset(&p->scul, 0, sizeof(Vector3f));
+    p->count = 0;
+}
+
+static Vector3f cross(Vector3f a, Vector3f b){
+    Vector3f out;
+    out.x = a.y*b.z - a.z*b.y;
+    out.y = a.z*b.x - a.x*b.z;
+    out.z = a.x*b.y - a.y*b.x;
+    return out;
+}
+
+static void addScaled(Vector3f* acc, Vector3f v, float k){
+    acc->x += v.x * k;
+    acc->y += v.y * k;
+    acc->z += v.z * k;
+}
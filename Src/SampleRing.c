@@ -0,0 +1,55 @@
+#include "SampleRing.h"
+
+#define INDEX(I) ((I) & (SAMPLE_RING_CAPACITY - 1))
+
+void ringInit(SampleRing* ring){
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->overflows, 0);
+}
+
+uint8_t ringPush(SampleRing* ring, const RingSample* sample){
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    // Acquire so the consumer is done with the slot before it gets overwritten
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if(head - tail >= SAMPLE_RING_CAPACITY){
+        // Producer is the only writer so no read-modify-write is needed
+        atomic_store_explicit(&ring->overflows,
+                              atomic_load_explicit(&ring->overflows, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        return 0;
+    }
+    ring->samples[INDEX(head)] = *sample;
+    // Release publishes the sample before the new head
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 1;
+}
+
+uint8_t ringPop(SampleRing* ring, RingSample* sample){
+    return ringPopMany(ring, sample, 1);
+}
+
+uint16_t ringPopMany(SampleRing* ring, RingSample* samples, uint16_t maxSamples){
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint16_t count = 0;
+
+    while(tail != head && count < maxSamples){
+        samples[count] = ring->samples[INDEX(tail)];
+        tail++;
+        count++;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    return count;
+}
+
+uint16_t ringCount(SampleRing* ring){
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    return (uint16_t)(head - tail);
+}
+
+uint32_t ringOverflows(SampleRing* ring){
+    return atomic_load_explicit(&ring->overflows, memory_order_relaxed);
+}
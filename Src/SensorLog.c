@@ -0,0 +1,221 @@
+#include "SensorLog.h"
+#include <string.h>
+
+#define IS_RAW_NULL(V) ((V).x == INT16_MIN && (V).y == INT16_MIN && (V).z == INT16_MIN)
+#define SENSOR_ACCEL 0
+#define SENSOR_GYRO 1
+#define CONFIG_FLOATS 4
+#define VARINT_OK 1
+#define ZIGZAG(D) (((uint32_t)(D) << 1) ^ ((D) < 0 ? 0xFFFFFFFF : 0))
+#define UNZIGZAG(Z) ((int32_t)((Z) >> 1) ^ -(int32_t)((Z) & 1))
+
+static uint8_t putBatch(LogEncoder*, uint8_t, uint8_t, const Vector3Raw*, uint16_t, uint32_t);
+static uint8_t* putVarint(uint8_t*, uint32_t);
+static uint8_t getVarint(LogDecoder*, uint32_t*);
+static void resetDeltas(Vector3Raw*);
+
+void logInit(LogEncoder* enc, uint8_t* buf, uint16_t capacity){
+    enc->buf = buf;
+    enc->capacity = capacity;
+    enc->haveConfig = 0;
+    resetDeltas(enc->prev);
+    buf[0] = 'B';
+    buf[1] = 'L';
+    buf[2] = LOG_VERSION;
+    enc->len = LOG_HEADER_BYTES;
+}
+
+void logClear(LogEncoder* enc){
+    enc->len = 0;
+}
+
+uint8_t logConfig(LogEncoder* enc, const LogConfig* config){
+    float values[CONFIG_FLOATS] = {config->accelScale, config->gyroScale, config->accelRateHz, config->gyroRateHz};
+    uint8_t* p = enc->buf + enc->len;
+    uint32_t bits;
+    int i, b;
+    if(enc->haveConfig && memcmp(&enc->config, config, sizeof(LogConfig)) == 0){
+        return 1;
+    }
+    if(enc->capacity - enc->len < 1 + 4 * CONFIG_FLOATS){
+        return 0;
+    }
+    *p++ = LOG_REC_CONFIG;
+    for(i = 0; i < CONFIG_FLOATS; i++){
+        memcpy(&bits, &values[i], sizeof(bits));
+        for(b = 0; b < 4; b++){
+            *p++ = (bits >> (8 * b)) & 0xFF;
+        }
+    }
+    enc->len = p - enc->buf;
+    enc->config = *config;
+    enc->haveConfig = 1;
+    resetDeltas(enc->prev);
+    return 1;
+}
+
+uint8_t logAccel(LogEncoder* enc, const Vector3Raw* samples, uint16_t len, uint8_t hasTime, uint32_t sensortime){
+    return putBatch(enc, LOG_REC_ACCEL | (hasTime ? LOG_TAG_TIMED : 0), SENSOR_ACCEL, samples, len, sensortime);
+}
+
+uint8_t logGyro(LogEncoder* enc, const Vector3Raw* samples, uint16_t len){
+    return putBatch(enc, LOG_REC_GYRO, SENSOR_GYRO, samples, len, 0);
+}
+
+uint8_t logDecoderInit(LogDecoder* dec, const uint8_t* data, uint32_t len){
+    dec->data = data;
+    dec->len = len;
+    dec->pos = LOG_HEADER_BYTES;
+    memset(&dec->config, 0, sizeof(LogConfig));
+    resetDeltas(dec->prev);
+    return len >= LOG_HEADER_BYTES && data[0] == 'B' && data[1] == 'L' && data[2] == LOG_VERSION;
+}
+
+uint8_t logDecode(LogDecoder* dec, LogRecord* rec){
+    uint32_t start = dec->pos;
+    Vector3Raw prev;
+    Vector3Raw* s;
+    float values[CONFIG_FLOATS];
+    uint32_t bits, zz[3];
+    uint8_t tag, sensor, status;
+    int i, axis;
+
+    if(dec->pos >= dec->len){
+        return LOG_END;
+    }
+    tag = dec->data[dec->pos++];
+    rec->type = tag & ~LOG_TAG_TIMED;
+    rec->timed = 0;
+    rec->len = 0;
+    rec->drops = 0;
+
+    if(tag == LOG_REC_CONFIG){
+        if(dec->len - dec->pos < 4 * CONFIG_FLOATS){
+            dec->pos = start;
+            return LOG_END;
+        }
+        for(i = 0; i < CONFIG_FLOATS; i++){
+            bits = dec->data[dec->pos] | (dec->data[dec->pos+1] << 8) | ((uint32_t)dec->data[dec->pos+2] << 16) | ((uint32_t)dec->data[dec->pos+3] << 24);
+            memcpy(&values[i], &bits, sizeof(bits));
+            dec->pos += 4;
+        }
+        dec->config.accelScale = values[0];
+        dec->config.gyroScale = values[1];
+        dec->config.accelRateHz = values[2];
+        dec->config.gyroRateHz = values[3];
+        resetDeltas(dec->prev);
+        return LOG_REC_CONFIG;
+    }
+    if(rec->type != LOG_REC_ACCEL && rec->type != LOG_REC_GYRO){
+        return LOG_ERROR;
+    }
+
+    // Anything that runs off the end is a record cut off by a flush, leave it for when more data arrives
+    sensor = rec->type == LOG_REC_ACCEL ? SENSOR_ACCEL : SENSOR_GYRO;
+    if(dec->pos >= dec->len){
+        dec->pos = start;
+        return LOG_END;
+    }
+    rec->len = dec->data[dec->pos++];
+    if(tag & LOG_TAG_TIMED){
+        if(dec->len - dec->pos < 3){
+            dec->pos = start;
+            return LOG_END;
+        }
+        rec->timed = 1;
+        rec->sensortime = dec->data[dec->pos] | (dec->data[dec->pos+1] << 8) | ((uint32_t)dec->data[dec->pos+2] << 16);
+        dec->pos += 3;
+    }
+
+    prev = dec->prev[sensor];
+    for(s = rec->samples; s < rec->samples + rec->len; s++){
+        for(axis = 0; axis < 3; axis++){
+            status = getVarint(dec, &zz[axis]);
+            if(status != VARINT_OK){
+                dec->pos = start;
+                return status;
+            }
+            if(axis == 0 && zz[0] == LOG_NULL_SAMPLE){
+                break;
+            }
+            if(zz[axis] >= LOG_NULL_SAMPLE){
+                dec->pos = start;
+                return LOG_ERROR;
+            }
+        }
+        if(axis == 0){
+            s->x = s->y = s->z = INT16_MIN;
+            rec->drops++;
+            continue;
+        }
+        prev.x += UNZIGZAG(zz[0]);
+        prev.y += UNZIGZAG(zz[1]);
+        prev.z += UNZIGZAG(zz[2]);
+        *s = prev;
+    }
+    dec->prev[sensor] = prev;
+    return rec->type;
+}
+
+static uint8_t putBatch(LogEncoder* enc, uint8_t tag, uint8_t sensor, const Vector3Raw* samples, uint16_t len, uint32_t sensortime){
+    uint8_t* p = enc->buf + enc->len;
+    Vector3Raw prev = enc->prev[sensor];
+    uint16_t i;
+    if(len > LOG_MAX_BATCH || enc->capacity - enc->len < LOG_RECORD_MAX_BYTES(len)){
+        return 0;
+    }
+    *p++ = tag;
+    *p++ = len;
+    if(tag & LOG_TAG_TIMED){
+        *p++ = sensortime & 0xFF;
+        *p++ = (sensortime >> 8) & 0xFF;
+        *p++ = (sensortime >> 16) & 0xFF;
+    }
+    for(i = 0; i < len; i++){
+        // Only the accel has drops, a gyro sample of all INT16_MIN is real data
+        if(sensor == SENSOR_ACCEL && IS_RAW_NULL(samples[i])){
+            p = putVarint(p, LOG_NULL_SAMPLE);
+            continue;
+        }
+        // Deltas are done in int32 so they can't wrap, zigzag keeps small negatives small
+        p = putVarint(p, ZIGZAG(samples[i].x - prev.x));
+        p = putVarint(p, ZIGZAG(samples[i].y - prev.y));
+        p = putVarint(p, ZIGZAG(samples[i].z - prev.z));
+        prev = samples[i];
+    }
+    enc->prev[sensor] = prev;
+    enc->len = p - enc->buf;
+    return 1;
+}
+
+// 7 bits per byte, low bits first, top bit set on all but the last
+static uint8_t* putVarint(uint8_t* p, uint32_t v){
+    while(v >= 0x80){
+        *p++ = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+// Returns VARINT_OK, LOG_END if the data ran out or LOG_ERROR if it is longer than any valid value
+static uint8_t getVarint(LogDecoder* dec, uint32_t* v){
+    uint8_t byte, shift = 0;
+    *v = 0;
+    do {
+        if(dec->pos >= dec->len){
+            return LOG_END;
+        }
+        if(shift > 14){
+            return LOG_ERROR;
+        }
+        byte = dec->data[dec->pos++];
+        *v |= (uint32_t)(byte & 0x7F) << shift;
+        shift += 7;
+    } while(byte & 0x80);
+    return VARINT_OK;
+}
+
+static void resetDeltas(Vector3Raw* prev){
+    memset(prev, 0, 2 * sizeof(Vector3Raw));
+}
@@ -0,0 +1,66 @@
+#include "SpiBus.h"
+
+// Claimed from the main loop and from completion interrupts, so a slot only changes hands by compare-exchange
+static _Atomic(SPI_HandleTypeDef*) bus_owners[SPI_BUS_MAX_OWNERS];
+
+static uint8_t ownedElsewhere(SPI_HandleTypeDef*, int);
+
+uint8_t busClaim(SPI_HandleTypeDef* hspi){
+    SPI_HandleTypeDef* expected;
+    int i;
+    if(busOwned(hspi)){
+        return 0;
+    }
+    for(i = 0; i < SPI_BUS_MAX_OWNERS; i++){
+        expected = NULL;
+        if(atomic_compare_exchange_strong(&bus_owners[i], &expected, hspi)){
+            // An interrupt may have claimed the same bus in another slot since the check above
+            if(ownedElsewhere(hspi, i)){
+                atomic_store(&bus_owners[i], NULL);
+                return 0;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void busRelease(SPI_HandleTypeDef* hspi){
+    SPI_HandleTypeDef* expected;
+    int i;
+    for(i = 0; i < SPI_BUS_MAX_OWNERS; i++){
+        expected = hspi;
+        if(atomic_compare_exchange_strong(&bus_owners[i], &expected, NULL)){
+            return;
+        }
+    }
+}
+
+uint8_t busOwned(SPI_HandleTypeDef* hspi){
+    return ownedElsewhere(hspi, -1);
+}
+
+uint8_t busWaitFree(SPI_HandleTypeDef* hspi){
+    uint32_t start;
+    if(!busOwned(hspi)){
+        return 1;
+    }
+    start = HAL_GetTick();
+    while(busOwned(hspi)){
+        if(HAL_GetTick() - start > SPI_BUS_WAIT_MS){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// 1 if a slot other than skip holds hspi
+static uint8_t ownedElsewhere(SPI_HandleTypeDef* hspi, int skip){
+    int i;
+    for(i = 0; i < SPI_BUS_MAX_OWNERS; i++){
+        if(i != skip && atomic_load(&bus_owners[i]) == hspi){
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include "Stats.h"
+#include "main.h"
+
+#ifdef BMI088_STATS
+
+#define STATS_FIELDS (sizeof(SensorStats) / sizeof(atomic_uint_least32_t))
+
+// DWT is only there on Cortex-M3 and up, anything else gets the POSIX clock
+#if defined(DWT) && defined(CoreDebug)
+#define STATS_USE_DWT
+#else
+#include <time.h>
+#endif
+
+void statsInitClock(){
+#ifdef STATS_USE_DWT
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+}
+
+uint32_t statsNow(){
+#ifdef STATS_USE_DWT
+    return DWT->CYCCNT;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000000000ull + ts.tv_nsec); // Wraps like CYCCNT, differences still work
+#endif
+}
+
+void statsRecord(atomic_uint_least32_t* hist, uint32_t ticks){
+    atomic_fetch_add_explicit(&hist[31 - __builtin_clz(ticks | 1)], 1, memory_order_relaxed);
+}
+
+void statsCopy(SensorStats* to, const SensorStats* from){
+    atomic_uint_least32_t* dst = (atomic_uint_least32_t*)to;
+    const atomic_uint_least32_t* src = (const atomic_uint_least32_t*)from;
+    uint32_t i;
+    for(i = 0; i < STATS_FIELDS; i++){
+        atomic_store_explicit(&dst[i], atomic_load_explicit(&src[i], memory_order_relaxed), memory_order_relaxed);
+    }
+}
+
+void statsReset(SensorStats* stats){
+    atomic_uint_least32_t* field = (atomic_uint_least32_t*)stats;
+    uint32_t i;
+    for(i = 0; i < STATS_FIELDS; i++){
+        atomic_store_explicit(&field[i], 0, memory_order_relaxed);
+    }
+}
+
+#endif
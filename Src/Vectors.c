@@ -1,9 +1,179 @@
 #include "Vectors.h"
 
+#if defined(BMI088_USE_CMSIS_DSP)
+#include "arm_math.h"
+#elif defined(__AVX__) || defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+#define IS_RAW_NULL(V) ((V).x == INT16_MIN && (V).y == INT16_MIN && (V).z == INT16_MIN)
+
+static void scaleF(float*, uint16_t, float);
+
 Vector3 vSub(Vector3 a, Vector3 b){
     Vector3 out;
     out.x = a.x - b.x;
     out.y = a.y - b.y;
     out.z = a.z - b.z;
     return out;
-}
\ No newline at end of file
+}
+
+Vector3Raw vRawFromBytes(const uint8_t* bytes){
+    Vector3Raw out;
+    // Int casts nescessary for two's complement
+    out.x = (int16_t)(bytes[1]*256 + bytes[0]);
+    out.y = (int16_t)(bytes[3]*256 + bytes[2]);
+    out.z = (int16_t)(bytes[5]*256 + bytes[4]);
+    return out;
+}
+
+void vRawToD(const Vector3Raw* in, Vector3* out, uint16_t len, double scale){
+    uint16_t i;
+    for(i = 0; i < len; i++){
+        out[i].x = in[i].x * scale;
+        out[i].y = in[i].y * scale;
+        out[i].z = in[i].z * scale;
+    }
+}
+
+void vRawToF(const Vector3Raw* in, Vector3f* out, uint16_t len, float scale){
+    uint16_t i;
+    for(i = 0; i < len; i++){
+        out[i].x = in[i].x * scale;
+        out[i].y = in[i].y * scale;
+        out[i].z = in[i].z * scale;
+    }
+}
+
+void vRawToQ(const Vector3Raw* in, Vector3Q* out, uint16_t len, float scale){
+    uint16_t i;
+    // Scale is always < 1 LSB so it is kept as Q31 for precision, products are shifted back down to the output format
+    int32_t scaleQ31 = (int32_t)(scale * 2147483648.0f);
+    for(i = 0; i < len; i++){
+        out[i].x = (int32_t)(((int64_t)in[i].x * scaleQ31) >> (31 - VECTOR_Q_FRAC_BITS));
+        out[i].y = (int32_t)(((int64_t)in[i].y * scaleQ31) >> (31 - VECTOR_Q_FRAC_BITS));
+        out[i].z = (int32_t)(((int64_t)in[i].z * scaleQ31) >> (31 - VECTOR_Q_FRAC_BITS));
+    }
+}
+
+void vRawToDCal(const Vector3Raw* in, Vector3* out, uint16_t len, const VectorCal* cal){
+    uint16_t i;
+    // Coefficients in locals, so the compiler doesn't reload them through cal after every store to out
+    double m00 = cal->m[0][0], m01 = cal->m[0][1], m02 = cal->m[0][2];
+    double m10 = cal->m[1][0], m11 = cal->m[1][1], m12 = cal->m[1][2];
+    double m20 = cal->m[2][0], m21 = cal->m[2][1], m22 = cal->m[2][2];
+    double bx = cal->bias[0], by = cal->bias[1], bz = cal->bias[2];
+    // Picked once per batch, both loops are multiply-adds only
+    if(!cal->cross){
+        for(i = 0; i < len; i++){
+            out[i].x = in[i].x * m00 + bx;
+            out[i].y = in[i].y * m11 + by;
+            out[i].z = in[i].z * m22 + bz;
+        }
+        return;
+    }
+    for(i = 0; i < len; i++){
+        out[i].x = in[i].x * m00 + in[i].y * m01 + in[i].z * m02 + bx;
+        out[i].y = in[i].x * m10 + in[i].y * m11 + in[i].z * m12 + by;
+        out[i].z = in[i].x * m20 + in[i].y * m21 + in[i].z * m22 + bz;
+    }
+}
+
+Vector3 vRawToDCalOne(Vector3Raw in, const VectorCal* cal){
+    Vector3 out;
+    if(!cal->cross){
+        out.x = in.x * cal->m[0][0] + cal->bias[0];
+        out.y = in.y * cal->m[1][1] + cal->bias[1];
+        out.z = in.z * cal->m[2][2] + cal->bias[2];
+        return out;
+    }
+    out.x = in.x * cal->m[0][0] + in.y * cal->m[0][1] + in.z * cal->m[0][2] + cal->bias[0];
+    out.y = in.x * cal->m[1][0] + in.y * cal->m[1][1] + in.z * cal->m[1][2] + cal->bias[1];
+    out.z = in.x * cal->m[2][0] + in.y * cal->m[2][1] + in.z * cal->m[2][2] + cal->bias[2];
+    return out;
+}
+
+void vMarkDrops(const Vector3Raw* in, Vector3* out, uint16_t len){
+    uint16_t i;
+    for(i = 0; i < len; i++){
+        if(IS_RAW_NULL(in[i])){
+            out[i] = (Vector3) VECTOR_NULL;
+        }
+    }
+}
+
+void vMarkDropsSoA(const Vector3Raw* in, Vector3SoA out, uint16_t len){
+    uint16_t i;
+    for(i = 0; i < len; i++){
+        if(IS_RAW_NULL(in[i])){
+            out.x[i] = out.y[i] = out.z[i] = NAN;
+        }
+    }
+}
+
+void vCalFold(const SensorCal* cal, double scale, VectorCal* out){
+    int i, j;
+    SensorCal identity;
+    if(!cal){
+        vCalIdentity(&identity);
+        cal = &identity;
+    }
+    // matrix * (raw * scale - offset) = (matrix * scale) * raw + bias, with bias = -matrix * offset
+    out->cross = 0;
+    for(i = 0; i < 3; i++){
+        out->bias[i] = 0;
+        for(j = 0; j < 3; j++){
+            out->m[i][j] = cal->matrix[i][j] * scale;
+            out->bias[i] -= cal->matrix[i][j] * cal->offset[j];
+            if(i != j && cal->matrix[i][j] != 0){
+                out->cross = 1;
+            }
+        }
+    }
+}
+
+void vCalIdentity(SensorCal* cal){
+    int i, j;
+    for(i = 0; i < 3; i++){
+        cal->offset[i] = 0;
+        for(j = 0; j < 3; j++){
+            cal->matrix[i][j] = i == j;
+        }
+    }
+}
+
+void vRawToSoA(const Vector3Raw* in, Vector3SoA out, uint16_t len, float scale){
+    uint16_t i;
+    // Split first, the stride 3 layout doesn't vectorise. Scaling the flat arrays afterwards does
+    for(i = 0; i < len; i++){
+        out.x[i] = in[i].x;
+        out.y[i] = in[i].y;
+        out.z[i] = in[i].z;
+    }
+    scaleF(out.x, len, scale);
+    scaleF(out.y, len, scale);
+    scaleF(out.z, len, scale);
+}
+
+// Multiplies len floats in place by scale
+static void scaleF(float* v, uint16_t len, float scale){
+    uint16_t i = 0;
+#if defined(BMI088_USE_CMSIS_DSP)
+    arm_scale_f32(v, scale, v, len);
+    i = len;
+#elif defined(__AVX__)
+    __m256 s8 = _mm256_set1_ps(scale);
+    for(; i + 8 <= len; i += 8){
+        _mm256_storeu_ps(v + i, _mm256_mul_ps(_mm256_loadu_ps(v + i), s8));
+    }
+#elif defined(__SSE__)
+    __m128 s4 = _mm_set1_ps(scale);
+    for(; i + 4 <= len; i += 4){
+        _mm_storeu_ps(v + i, _mm_mul_ps(_mm_loadu_ps(v + i), s4));
+    }
+#endif
+    // Whatever the wide path left over
+    for(; i < len; i++){
+        v[i] *= scale;
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef __CHECK
+#define __CHECK
+
+// Minimal test helpers. A failed check is reported and counted, the test carries on
+#include <stdio.h>
+#include <math.h>
+
+static int check_failures;
+
+#define CHECK(COND) do { \
+        if(!(COND)){ \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #COND); \
+            check_failures++; \
+        } \
+    } while(0)
+
+#define CHECK_NEAR(A, B, TOL) do { \
+        double check_a = (A), check_b = (B); \
+        if(!(fabs(check_a - check_b) <= (TOL))){ \
+            fprintf(stderr, "%s:%d: CHECK_NEAR(%s, %s) failed: %g vs %g\n", __FILE__, __LINE__, #A, #B, check_a, check_b); \
+            check_failures++; \
+        } \
+    } while(0)
+
+// Return value for main
+#define CHECK_RESULT() (check_failures ? (fprintf(stderr, "%d checks failed\n", check_failures), 1) : 0)
+
+#endif
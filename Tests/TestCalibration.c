@@ -0,0 +1,191 @@
+// Calibration helpers against a simulated chip with known bias, scale and misalignment, and the storage blob
+#include "Calibration.h"
+#include "IMU.h"
+#include "Bmi088Sim.h"
+#include "Check.h"
+#include <string.h>
+
+#define COLLECT 50
+#define LSB_3G (3 * GRAV / 32768) // One count at 3g
+
+static SPI_HandleTypeDef hspi;
+
+// What the imperfect accel reports: sensitivity * true + bias. Columns are the reading per unit along each axis
+static const double trueSensitivity[3][3] = {
+    {1.02, 0.015, -0.01},
+    {-0.02, 0.97, 0.012},
+    {0.008, -0.018, 1.03},
+};
+static const double trueBias[3] = {0.25, -0.4, 0.15};
+static const double gyroBias[3] = {0.01, -0.02, 0.005};
+static double specific[3]; // True specific force on the chip, m/s^2
+
+static void accelSignal(uint64_t ns, double* out, void* ctx){
+    int i;
+    (void)ns;
+    (void)ctx;
+    for(i = 0; i < 3; i++){
+        out[i] = trueSensitivity[i][0] * specific[0] + trueSensitivity[i][1] * specific[1]
+               + trueSensitivity[i][2] * specific[2] + trueBias[i];
+    }
+}
+
+static void gyroSignal(uint64_t ns, double* out, void* ctx){
+    (void)ns;
+    (void)ctx;
+    memcpy(out, gyroBias, sizeof(gyroBias));
+}
+
+static void setup(){
+    Vector3Raw raw[ACCEL_FIFO_MAX_FRAMES];
+    simReset();
+    hspi.State = HAL_SPI_STATE_READY;
+    IMU_INIT(&hspi);
+    IMU_ENABLE_ALL();
+    IMU_SETUP_FOR_LOGGING();
+    ACCEL_SET_RANGE(ACCEL_RANGE_3G);
+    simSetAccelSignal(0, accelSignal, NULL);
+    simSetGyroSignal(0, gyroSignal, NULL);
+    HAL_Delay(10);
+    // Takes the range change's config frame out before the FIFO can overflow past it
+    ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES);
+}
+
+static void pose(double x, double y, double z){
+    specific[0] = x;
+    specific[1] = y;
+    specific[2] = z;
+    HAL_Delay(20); // Let the data registers catch up
+}
+
+// Means in the six positions, in CAL_POS_* order
+static void collectSix(Vector3* means){
+    int axis, sign;
+    for(axis = 0; axis < 3; axis++){
+        for(sign = 0; sign < 2; sign++){
+            double g = sign ? -GRAV : GRAV;
+            pose(axis == 0 ? g : 0, axis == 1 ? g : 0, axis == 2 ? g : 0);
+            means[2 * axis + sign] = calCollectAccel(COLLECT);
+        }
+    }
+}
+
+// matrix * (reading - offset) should give back the true specific force for any attitude
+static double worstError(const SensorCal* cal){
+    static const double dirs[][3] = {{1, 0, 0}, {0, -1, 0}, {0.6, 0, 0.8}, {0.48, -0.6, 0.64}, {-0.36, 0.48, -0.8}};
+    double reading[3], corrected, worst = 0;
+    size_t d;
+    int i, j;
+    for(d = 0; d < sizeof(dirs) / sizeof(dirs[0]); d++){
+        for(i = 0; i < 3; i++){
+            specific[i] = dirs[d][i] * GRAV;
+        }
+        accelSignal(0, reading, NULL);
+        for(i = 0; i < 3; i++){
+            corrected = 0;
+            for(j = 0; j < 3; j++){
+                corrected += cal->matrix[i][j] * (reading[j] - cal->offset[j]);
+            }
+            worst = fmax(worst, fabs(corrected - specific[i]));
+        }
+    }
+    return worst;
+}
+
+static void testSixPosition(){
+    Vector3 means[6];
+    SensorCal cal, diagonal;
+    setup();
+    collectSix(means);
+    CHECK(calAccelSixPosition(means, 1, &cal) == 1);
+    // Bias comes back to within the averaged quantisation
+    CHECK_NEAR(cal.offset[0], trueBias[0], 2 * LSB_3G);
+    CHECK_NEAR(cal.offset[1], trueBias[1], 2 * LSB_3G);
+    CHECK_NEAR(cal.offset[2], trueBias[2], 2 * LSB_3G);
+    // Matrix is the inverse of the sensitivity, cross terms included
+    CHECK_NEAR(cal.matrix[0][0], 1 / 1.02, 1e-3);
+    CHECK(cal.matrix[0][1] < -0.01 && cal.matrix[1][0] > 0.015);
+    CHECK(worstError(&cal) < 4 * LSB_3G);
+
+    // Without misalignment only the diagonal is solved, and the cross-axis error stays
+    CHECK(calAccelSixPosition(means, 0, &diagonal) == 1);
+    CHECK(diagonal.matrix[0][1] == 0 && diagonal.matrix[2][1] == 0);
+    CHECK_NEAR(diagonal.matrix[1][1], 1 / 0.97, 1e-3);
+    CHECK(worstError(&diagonal) > 0.1);
+
+    // X never turned over, so it doesn't see its own +-1g
+    means[CAL_POS_X_DOWN] = means[CAL_POS_X_UP];
+    CHECK(calAccelSixPosition(means, 1, &cal) == 0);
+}
+
+// The driver applies the solved calibration on the cross-axis path and leaves raw output alone
+static void testApplied(){
+    Vector3 means[6], v;
+    Vector3Raw raw[ACCEL_FIFO_MAX_FRAMES];
+    AccelRawBuffer rawBuffer;
+    SensorCal accel, gyro;
+    setup();
+    collectSix(means);
+    CHECK(calAccelSixPosition(means, 1, &accel) == 1);
+    ACCEL_SET_CALIBRATION(&accel);
+    pose(0.48 * GRAV, -0.6 * GRAV, 0.64 * GRAV);
+    v = ACCEL_READ_ACCELERATION();
+    CHECK_NEAR(v.x, 0.48 * GRAV, 5 * LSB_3G);
+    CHECK_NEAR(v.y, -0.6 * GRAV, 5 * LSB_3G);
+    CHECK_NEAR(v.z, 0.64 * GRAV, 5 * LSB_3G);
+    // Raw counts are what the imperfect chip sent
+    ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES);
+    HAL_Delay(5);
+    rawBuffer = ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES);
+    CHECK(rawBuffer.len > 0);
+    CHECK_NEAR(raw[0].x * rawBuffer.scale, 1.02 * 0.48 * GRAV + 0.015 * -0.6 * GRAV - 0.01 * 0.64 * GRAV + trueBias[0], LSB_3G);
+
+    vCalIdentity(&gyro);
+    calGyroBias(calCollectGyro(COLLECT), &gyro);
+    CHECK_NEAR(gyro.offset[0], gyroBias[0], GYRO_GET_SCALE());
+    CHECK_NEAR(gyro.offset[1], gyroBias[1], GYRO_GET_SCALE());
+    CHECK_NEAR(gyro.offset[2], gyroBias[2], GYRO_GET_SCALE());
+    GYRO_SET_CALIBRATION(&gyro);
+    v = GYRO_READ_RATES();
+    CHECK_NEAR(v.x, 0, GYRO_GET_SCALE());
+    CHECK_NEAR(v.y, 0, GYRO_GET_SCALE());
+    CHECK_NEAR(v.z, 0, GYRO_GET_SCALE());
+}
+
+static void testBlob(){
+    SensorCal accel, gyro, accelBack, gyroBack;
+    uint8_t blob[CAL_BLOB_BYTES], bad[CAL_BLOB_BYTES];
+    int i;
+    vCalIdentity(&accel);
+    vCalIdentity(&gyro);
+    for(i = 0; i < 3; i++){
+        accel.offset[i] = 0.1f * (i + 1);
+        accel.matrix[i][(i + 1) % 3] = -0.003f * (i + 1);
+        gyro.offset[i] = -0.002f * (i + 1);
+    }
+    accel.matrix[1][1] = 1.0123f;
+    CHECK(calSerialize(&accel, &gyro, blob) == CAL_BLOB_BYTES);
+    CHECK(calDeserialize(blob, CAL_BLOB_BYTES, &accelBack, &gyroBack) == 1);
+    CHECK(memcmp(&accel, &accelBack, sizeof(SensorCal)) == 0);
+    CHECK(memcmp(&gyro, &gyroBack, sizeof(SensorCal)) == 0);
+
+    // Any flipped bit, in the data or in the CRC itself, is caught
+    for(i = 0; i < CAL_BLOB_BYTES; i++){
+        memcpy(bad, blob, sizeof(blob));
+        bad[i] ^= 1 << (i % 8);
+        CHECK(calDeserialize(bad, CAL_BLOB_BYTES, &accelBack, &gyroBack) == 0);
+    }
+    CHECK(calDeserialize(blob, CAL_BLOB_BYTES - 1, &accelBack, &gyroBack) == 0);
+    // Rejected blobs leave the outputs alone
+    memset(&accelBack, 0, sizeof(accelBack));
+    bad[CAL_BLOB_BYTES - 1] = blob[CAL_BLOB_BYTES - 1] ^ 0xFF;
+    CHECK(calDeserialize(bad, CAL_BLOB_BYTES, &accelBack, &gyroBack) == 0);
+    CHECK(accelBack.matrix[0][0] == 0);
+}
+
+int main(){
+    testSixPosition();
+    testApplied();
+    testBlob();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,285 @@
+// DMA FIFO readouts through the mock HAL
+#include "IMU.h"
+#include "SpiBus.h"
+#include "Bmi088Sim.h"
+#include "Check.h"
+
+static SPI_HandleTypeDef hspi;
+static SPI_HandleTypeDef hspi2; // Second bus, for the second chip
+static Vector3 accelArray[ACCEL_FIFO_MAX_FRAMES];
+static Vector3 gyroArray[GYRO_FIFO_MAX_FRAMES];
+static AccelDataBuffer accelOut;
+static GyroDataBuffer gyroOut;
+static int accelCalls;
+static int gyroCalls;
+static uint64_t accelDoneNs;
+
+// Multi-device drains
+#define DRAIN_DEVICES 2
+static Bmi088 imus[DRAIN_DEVICES];
+static Vector3 drainAccelArrays[DRAIN_DEVICES][ACCEL_FIFO_MAX_FRAMES];
+static Vector3 drainGyroArrays[DRAIN_DEVICES][GYRO_FIFO_MAX_FRAMES];
+static IMUDrainTarget targets[DRAIN_DEVICES];
+static int drainCalls[DRAIN_DEVICES];
+static uint16_t drainAccelLen[DRAIN_DEVICES];
+static uint8_t drainGyroLen[DRAIN_DEVICES];
+static int drainOrder; // Devices called back so far, across all drains
+static SPI_HandleTypeDef* claimAfterFirst; // Bus the callback for device 0 takes, like another driver starting a transfer
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef* h){
+    IMU_DMA_COMPLETE(h);
+}
+
+static void accelDone(AccelDataBuffer buffer){
+    accelOut = buffer;
+    accelCalls++;
+    accelDoneNs = simNowNs();
+}
+
+static void gyroDone(GyroDataBuffer buffer){
+    gyroOut = buffer;
+    gyroCalls++;
+    // Chained transfer only starts after the accel one is done
+    CHECK(accelCalls == 0 || accelDoneNs <= simNowNs());
+}
+
+static void drained(uint8_t device, AccelDataBuffer accel, GyroDataBuffer gyro){
+    CHECK(device == drainOrder % DRAIN_DEVICES);
+    drainOrder++;
+    drainCalls[device]++;
+    drainAccelLen[device] = accel.len;
+    drainGyroLen[device] = gyro.len;
+    CHECK(accel.array == drainAccelArrays[device]);
+    CHECK(gyro.array == drainGyroArrays[device]);
+    if(device == 0 && claimAfterFirst){
+        CHECK(busClaim(claimAfterFirst));
+    }
+}
+
+static void setup(){
+    simReset();
+    hspi.State = HAL_SPI_STATE_READY;
+    IMU_INIT(&hspi);
+    IMU_ENABLE_ALL();
+    IMU_SETUP_FOR_LOGGING();
+    ACCEL_READ_FIFO_INTO(accelArray, ACCEL_FIFO_MAX_FRAMES);
+    GYRO_READ_FIFO_INTO(gyroArray, GYRO_FIFO_MAX_FRAMES);
+    accelCalls = 0;
+    gyroCalls = 0;
+}
+
+static void testAccelDMA(){
+    uint16_t i;
+    SimBusStats bus;
+    setup();
+    simAdvanceUs(50000);
+    simSetPreemption(0); // Keep the completion out until the test lets it in
+    simResetBusStats();
+    CHECK(ACCEL_READ_FIFO_DMA(accelArray, ACCEL_FIFO_MAX_FRAMES, accelDone));
+    CHECK(ACCEL_DMA_BUSY());
+    CHECK(hspi.State != HAL_SPI_STATE_READY);
+    CHECK(accelCalls == 0);
+    // Only one transfer at a time
+    CHECK(!ACCEL_READ_FIFO_DMA(accelArray, ACCEL_FIFO_MAX_FRAMES, accelDone));
+
+    simAdvanceUs(1000);
+    CHECK(accelCalls == 1);
+    CHECK(!ACCEL_DMA_BUSY());
+    CHECK(hspi.State == HAL_SPI_STATE_READY);
+    CHECK(accelOut.array == accelArray);
+    CHECK(accelOut.len >= 19 && accelOut.len <= 21);
+    CHECK(accelOut.hasTime);
+    for(i = 0; i < accelOut.len; i++){
+        CHECK_NEAR(accelOut.array[i].z, GRAV, 0.01);
+    }
+    bus = simBusStats();
+    // Length and data, each its own DMA transfer
+    CHECK(bus.transactions == 2);
+    CHECK(bus.halCalls == 2);
+    CHECK(bus.bytes == 4 + 2 + accelOut.len * 7u + 4);
+    CHECK(bus.collisions == 0);
+}
+
+static void testEmptyFIFO(){
+    setup();
+    simSetPreemption(0);
+    simResetBusStats();
+    CHECK(ACCEL_READ_FIFO_DMA(accelArray, ACCEL_FIFO_MAX_FRAMES, accelDone));
+    CHECK(accelCalls == 0);
+    simAdvanceUs(100);
+    // Nothing queued, so only the length transfer ran
+    CHECK(accelCalls == 1);
+    CHECK(accelOut.len == 0);
+    CHECK(!ACCEL_DMA_BUSY());
+    CHECK(simBusStats().transactions == 1);
+}
+
+static void testGyroDMA(){
+    setup();
+    simAdvanceUs(20000);
+    simSetPreemption(0);
+    CHECK(GYRO_READ_FIFO_DMA(gyroArray, GYRO_FIFO_MAX_FRAMES, gyroDone));
+    CHECK(GYRO_DMA_BUSY());
+    CHECK(!GYRO_READ_FIFO_DMA(gyroArray, GYRO_FIFO_MAX_FRAMES, gyroDone));
+    simAdvanceUs(1000);
+    CHECK(gyroCalls == 1);
+    CHECK(!GYRO_DMA_BUSY());
+    CHECK(gyroOut.array == gyroArray);
+    CHECK(gyroOut.len >= 19 && gyroOut.len <= 21);
+    CHECK(!gyroOut.overrun);
+}
+
+static void testChained(){
+    setup();
+    simAdvanceUs(20000);
+    simResetBusStats();
+    CHECK(IMU_READ_FIFO_DMA(accelArray, ACCEL_FIFO_MAX_FRAMES, accelDone, gyroArray, GYRO_FIFO_MAX_FRAMES, gyroDone));
+    simAdvanceUs(2000);
+    CHECK(accelCalls == 1);
+    CHECK(gyroCalls == 1);
+    CHECK(accelOut.len >= 7 && accelOut.len <= 9);
+    CHECK(gyroOut.len >= 19 && gyroOut.len <= 23);
+    CHECK(simBusStats().collisions == 0);
+    CHECK(!ACCEL_DMA_BUSY() && !GYRO_DMA_BUSY());
+}
+
+// Gyro on its own bus, which another driver has taken by the time the accel readout finishes
+static void testChainedGyroBusTaken(){
+    setup();
+    GYRO_INIT(&hspi2);
+    hspi2.State = HAL_SPI_STATE_READY;
+    simAdvanceUs(20000);
+    CHECK(busClaim(&hspi2));
+    CHECK(IMU_READ_FIFO_DMA(accelArray, ACCEL_FIFO_MAX_FRAMES, accelDone, gyroArray, GYRO_FIFO_MAX_FRAMES, gyroDone));
+    simAdvanceUs(2000);
+    CHECK(accelCalls == 1);
+    CHECK(accelOut.len >= 7 && accelOut.len <= 9);
+    CHECK(gyroCalls == 1);
+    CHECK(gyroOut.len == 0);
+    CHECK(gyroOut.array == gyroArray);
+    CHECK(!ACCEL_DMA_BUSY() && !GYRO_DMA_BUSY());
+    busRelease(&hspi2);
+
+    // Next time round the gyro data is all still there
+    CHECK(IMU_READ_FIFO_DMA(accelArray, ACCEL_FIFO_MAX_FRAMES, accelDone, gyroArray, GYRO_FIFO_MAX_FRAMES, gyroDone));
+    simAdvanceUs(2000);
+    CHECK(gyroCalls == 2);
+    CHECK(gyroOut.len >= 21 && gyroOut.len <= 25);
+}
+
+// Two chips, the second one on its own bus, both running and emptied
+static void setupDrain(){
+    int i;
+    simReset();
+    hspi.State = HAL_SPI_STATE_READY;
+    hspi2.State = HAL_SPI_STATE_READY;
+    simAddChip(&simPortB, CSA_Pin, &simPortB, CSG_Pin);
+    IMU_INIT_DEVICE(&imus[0], &hspi, CSA_GPIO_Port, CSA_Pin, CSG_GPIO_Port, CSG_Pin);
+    IMU_INIT_DEVICE(&imus[1], &hspi2, &simPortB, CSA_Pin, &simPortB, CSG_Pin);
+    for(i = 0; i < DRAIN_DEVICES; i++){
+        IMU_USE_DEVICE(&imus[i]);
+        IMU_ENABLE_ALL();
+        IMU_SETUP_FOR_LOGGING();
+        targets[i].accelArray = drainAccelArrays[i];
+        targets[i].accelCapacity = ACCEL_FIFO_MAX_FRAMES;
+        targets[i].gyroArray = drainGyroArrays[i];
+        targets[i].gyroCapacity = GYRO_FIFO_MAX_FRAMES;
+        drainCalls[i] = 0;
+    }
+    for(i = 0; i < DRAIN_DEVICES; i++){
+        IMU_USE_DEVICE(&imus[i]);
+        ACCEL_READ_FIFO_INTO(accelArray, ACCEL_FIFO_MAX_FRAMES);
+        GYRO_READ_FIFO_INTO(gyroArray, GYRO_FIFO_MAX_FRAMES);
+    }
+    drainOrder = 0;
+    claimAfterFirst = NULL;
+}
+
+static void testDrainAll(){
+    int i;
+    setupDrain();
+    simAdvanceUs(20000);
+    simResetBusStats();
+    CHECK(IMU_READ_ALL_FIFO_DMA(imus, targets, DRAIN_DEVICES, drained));
+    // Only one drain at a time
+    CHECK(!IMU_READ_ALL_FIFO_DMA(imus, targets, DRAIN_DEVICES, drained));
+    simAdvanceUs(5000);
+    for(i = 0; i < DRAIN_DEVICES; i++){
+        CHECK(drainCalls[i] == 1);
+        CHECK(drainAccelLen[i] >= 7 && drainAccelLen[i] <= 10);
+        CHECK(drainGyroLen[i] >= 19 && drainGyroLen[i] <= 26);
+    }
+    // Length and data for each of the four readouts, one after the other
+    CHECK(simBusStats().transactions == 4 * DRAIN_DEVICES);
+    CHECK(simBusStats().collisions == 0);
+    CHECK(!ACCEL_DMA_BUSY() && !GYRO_DMA_BUSY());
+}
+
+// The first transfer is refused, so nothing runs and no callback comes
+static void testDrainAllRefused(){
+    setupDrain();
+    CHECK(busClaim(&hspi));
+    CHECK(!IMU_READ_ALL_FIFO_DMA(imus, targets, DRAIN_DEVICES, drained));
+    busRelease(&hspi);
+    simAdvanceUs(5000);
+    CHECK(drainCalls[0] == 0 && drainCalls[1] == 0);
+    // Didn't leave a drain marked as running
+    CHECK(IMU_READ_ALL_FIFO_DMA(imus, targets, DRAIN_DEVICES, drained));
+    simAdvanceUs(5000);
+    CHECK(drainCalls[0] == 1 && drainCalls[1] == 1);
+}
+
+// Second device's bus is taken between the two devices, so its accel transfer is refused part way through the chain
+static void testDrainAllBusyAccel(){
+    setupDrain();
+    simAdvanceUs(20000);
+    claimAfterFirst = &hspi2;
+    CHECK(IMU_READ_ALL_FIFO_DMA(imus, targets, DRAIN_DEVICES, drained));
+    simAdvanceUs(5000);
+    CHECK(drainCalls[0] == 1 && drainCalls[1] == 1);
+    CHECK(drainAccelLen[0] > 0 && drainGyroLen[0] > 0);
+    CHECK(drainAccelLen[1] == 0 && drainGyroLen[1] == 0);
+    busRelease(&hspi2);
+    claimAfterFirst = NULL;
+
+    // Nothing was lost, the next drain picks up the second device's backlog
+    simAdvanceUs(20000);
+    CHECK(IMU_READ_ALL_FIFO_DMA(imus, targets, DRAIN_DEVICES, drained));
+    simAdvanceUs(5000);
+    CHECK(drainCalls[0] == 2 && drainCalls[1] == 2);
+    CHECK(drainAccelLen[1] >= 15 && drainAccelLen[1] <= 19);
+    CHECK(drainGyroLen[1] >= 39 && drainGyroLen[1] <= 46);
+}
+
+// Second device's gyro is on a bus that another driver holds, so its accel data comes back without the gyro
+static void testDrainAllBusyGyro(){
+    setupDrain();
+    GYRO_INIT_DEVICE(&imus[1].gyro, &hspi, &simPortB, CSG_Pin);
+    simAdvanceUs(20000);
+    claimAfterFirst = &hspi;
+    CHECK(IMU_READ_ALL_FIFO_DMA(imus, targets, DRAIN_DEVICES, drained));
+    simAdvanceUs(5000);
+    CHECK(drainCalls[0] == 1 && drainCalls[1] == 1);
+    CHECK(drainAccelLen[1] >= 7 && drainAccelLen[1] <= 10);
+    CHECK(drainGyroLen[1] == 0);
+    CHECK(!ACCEL_DMA_BUSY() && !GYRO_DMA_BUSY());
+    busRelease(&hspi);
+    claimAfterFirst = NULL;
+    CHECK(IMU_READ_ALL_FIFO_DMA(imus, targets, DRAIN_DEVICES, drained));
+    simAdvanceUs(5000);
+    CHECK(drainCalls[1] == 2);
+    CHECK(drainGyroLen[1] >= 19 && drainGyroLen[1] <= 26);
+}
+
+int main(){
+    testAccelDMA();
+    testEmptyFIFO();
+    testGyroDMA();
+    testChained();
+    testChainedGyroBusTaken();
+    testDrainAll();
+    testDrainAllRefused();
+    testDrainAllBusyAccel();
+    testDrainAllBusyGyro();
+    return CHECK_RESULT();
+}
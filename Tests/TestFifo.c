@@ -0,0 +1,262 @@
+// FIFO readouts through the driver against the simulated BMI088
+#include "IMU.h"
+#include "Bmi088Sim.h"
+#include "Check.h"
+#include <string.h>
+
+static SPI_HandleTypeDef hspi;
+static uint32_t extiCount[4];
+
+void HAL_GPIO_EXTI_Callback(uint16_t pin){
+    int line;
+    for(line = 0; line < 4; line++){
+        extiCount[line] += pin == (INT1_Pin << line);
+    }
+}
+
+static void spin(uint64_t ns, double* out, void* ctx){
+    (void)ns;
+    (void)ctx;
+    out[0] = 1.0;
+    out[1] = -0.5;
+    out[2] = 0.25;
+}
+
+static void setup(){
+    simReset();
+    hspi.State = HAL_SPI_STATE_READY;
+    IMU_INIT(&hspi);
+    IMU_ENABLE_ALL();
+    IMU_SETUP_FOR_LOGGING();
+}
+
+static uint16_t countNull(Vector3Raw* array, uint16_t len){
+    uint16_t i, nulls = 0;
+    for(i = 0; i < len; i++){
+        nulls += array[i].x == INT16_MIN && array[i].y == INT16_MIN && array[i].z == INT16_MIN;
+    }
+    return nulls;
+}
+
+static void testIds(){
+    setup();
+    CHECK(ACCEL_READ_ID() == 0x1E);
+    CHECK(GYRO_READ_ID() == 0x0F);
+    CHECK(ACCEL_READ_PWR_MODE() == ACCEL_PWR_ACTIVE);
+    CHECK(ACCEL_VERIFY_SETTINGS() == 0);
+    CHECK(GYRO_VERIFY_SETTINGS() == 0);
+}
+
+static void testAccelFIFO(){
+    Vector3 array[ACCEL_FIFO_MAX_FRAMES];
+    AccelDataBuffer buffer;
+    uint16_t i;
+    setup();
+    ACCEL_READ_FIFO_INTO(array, ACCEL_FIFO_MAX_FRAMES); // Start from empty
+    simAdvanceUs(50000);
+    buffer = ACCEL_READ_FIFO_INTO(array, ACCEL_FIFO_MAX_FRAMES);
+    // 400Hz for 50ms
+    CHECK(buffer.len >= 19 && buffer.len <= 21);
+    CHECK(buffer.skipped == 0);
+    CHECK(buffer.hasTime);
+    CHECK(simAccelFIFOBytes(0) < 7);
+    for(i = 0; i < buffer.len; i++){
+        CHECK_NEAR(buffer.array[i].x, 0, 0.01);
+        CHECK_NEAR(buffer.array[i].z, GRAV, 0.01);
+    }
+    // Sensortime frame shows where the readout ended
+    CHECK(((ACCEL_READ_SENSORTIME() - buffer.sensortime) & ACCEL_SENSORTIME_MASK) < 64);
+}
+
+static void testAccelTruncatedTimes(){
+    Vector3 array[ACCEL_FIFO_MAX_FRAMES];
+    uint32_t first[4], times[ACCEL_FIFO_MAX_FRAMES];
+    AccelDataBuffer cut, next;
+    uint32_t frameTicks;
+    setup();
+    ACCEL_READ_FIFO_INTO(array, ACCEL_FIFO_MAX_FRAMES);
+    simAdvanceUs(25000);
+    // Only room for 4 of the ~10 samples, the rest are read out and lost
+    cut = ACCEL_READ_FIFO_TIMED(array, first, 4);
+    CHECK(cut.len == 4);
+    CHECK(cut.overflowed >= 5);
+    simAdvanceUs(25000);
+    next = ACCEL_READ_FIFO_TIMED(array, times, ACCEL_FIFO_MAX_FRAMES);
+    CHECK(next.overflowed == 0);
+    frameTicks = times[1] - times[0];
+    // The first sample of the next readout follows the lost ones, not the last one kept
+    CHECK(((times[0] - first[3]) & ACCEL_SENSORTIME_MASK) == (cut.overflowed + 1) * frameTicks);
+}
+
+static void testAccelSkip(){
+    Vector3 array[ACCEL_FIFO_MAX_FRAMES];
+    AccelDataBuffer buffer;
+    setup();
+    ACCEL_READ_FIFO_INTO(array, ACCEL_FIFO_MAX_FRAMES);
+    // 146 frames fill the FIFO in 365ms at 400Hz
+    simAdvanceUs(500000);
+    buffer = ACCEL_READ_FIFO_INTO(array, ACCEL_FIFO_MAX_FRAMES);
+    CHECK(buffer.len >= ACCEL_FIFO_MAX_FRAMES - 1);
+    CHECK(buffer.skipped > 0);
+    CHECK(buffer.hasTime);
+    CHECK(ACCEL_GET_FIFO_STATS().skipped == buffer.skipped);
+}
+
+static void testAccelDrop(){
+    Vector3Raw raw[ACCEL_FIFO_MAX_FRAMES];
+    AccelRawBuffer buffer;
+    setup();
+    ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES);
+    simAccelDrop(0, 3);
+    simAdvanceUs(30000);
+    buffer = ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES);
+    CHECK(countNull(raw, buffer.len) == 3);
+    CHECK(ACCEL_GET_FIFO_STATS().dropped == 3);
+}
+
+static void testAccelConfigChange(){
+    Vector3Raw raw[ACCEL_FIFO_MAX_FRAMES];
+    AccelRawBuffer buffer;
+    float scale24;
+    setup();
+    scale24 = ACCEL_GET_SCALE();
+    ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES);
+    simAdvanceUs(20000);
+    ACCEL_SET_RANGE(ACCEL_RANGE_6G);
+    simAdvanceUs(20000);
+    buffer = ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES);
+    CHECK(buffer.configAt > 0 && buffer.configAt < buffer.len);
+    CHECK_NEAR(buffer.scale, scale24, 1e-9);
+    // Same 1g before and after, in counts of each range
+    CHECK_NEAR(raw[0].z * buffer.scale, GRAV, 0.01);
+    CHECK_NEAR(raw[buffer.len - 1].z * ACCEL_GET_SCALE(), GRAV, 0.01);
+    CHECK(raw[buffer.len - 1].z > 3 * raw[0].z);
+}
+
+// Range changed while the FIFO isn't collecting, the way SETUP_FOR_LOGGING does it. No config frame is queued,
+//  so nothing in the FIFO says the first readout is at 24g rather than the 6g the driver started at
+static void testAccelRangeBeforeEnable(){
+    Vector3Raw raw[ACCEL_FIFO_MAX_FRAMES];
+    AccelRawBuffer buffer;
+    setup();
+    simAdvanceUs(20000);
+    buffer = ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES);
+    CHECK(buffer.len > 0);
+    CHECK(buffer.configAt == buffer.len);
+    CHECK_NEAR(buffer.scale, ACCEL_GET_SCALE(), 1e-9);
+    CHECK_NEAR(raw[0].z * buffer.scale, GRAV, 0.01);
+
+    // Same again by hand, to a range the driver hasn't been at
+    ACCEL_WRITE_FIFO_ENABLED(ACCEL_FIFO_DISABLED);
+    ACCEL_SET_RANGE(ACCEL_RANGE_3G);
+    ACCEL_WRITE_FIFO_ENABLED(ACCEL_FIFO_ENABLED);
+    simAdvanceUs(20000);
+    buffer = ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES);
+    CHECK(buffer.len > 0);
+    CHECK_NEAR(buffer.scale, ACCEL_GET_SCALE(), 1e-9);
+    CHECK_NEAR(raw[0].z * buffer.scale, GRAV, 0.01);
+}
+
+static void testGyroFIFO(){
+    Vector3 array[GYRO_FIFO_MAX_FRAMES];
+    GyroDataBuffer buffer;
+    uint8_t i;
+    setup();
+    simSetGyroSignal(0, spin, NULL);
+    GYRO_READ_FIFO_INTO(array, GYRO_FIFO_MAX_FRAMES);
+    simAdvanceUs(20000);
+    buffer = GYRO_READ_FIFO_INTO(array, GYRO_FIFO_MAX_FRAMES);
+    // 1kHz for 20ms
+    CHECK(buffer.len >= 19 && buffer.len <= 21);
+    CHECK(!buffer.overrun);
+    for(i = 0; i < buffer.len; i++){
+        CHECK_NEAR(buffer.array[i].x, 1.0, 0.002);
+        CHECK_NEAR(buffer.array[i].y, -0.5, 0.002);
+        CHECK_NEAR(buffer.array[i].z, 0.25, 0.002);
+    }
+    // Empty FIFO gives nothing, not 0x8000 frames
+    buffer = GYRO_READ_FIFO_INTO(array, GYRO_FIFO_MAX_FRAMES);
+    CHECK(buffer.len <= 1);
+}
+
+static void testGyroOverrun(){
+    Vector3 array[GYRO_FIFO_MAX_FRAMES];
+    GyroDataBuffer buffer;
+    setup();
+    simAdvanceUs(150000);
+    CHECK(simGyroFIFOFrames(0) == GYRO_FIFO_MAX_FRAMES);
+    buffer = GYRO_READ_FIFO_INTO(array, GYRO_FIFO_MAX_FRAMES);
+    CHECK(buffer.overrun);
+    CHECK(buffer.len == GYRO_FIFO_MAX_FRAMES);
+    // Flag sticks through readouts until it is cleared
+    simAdvanceUs(10000);
+    CHECK(GYRO_READ_FIFO_INTO(array, GYRO_FIFO_MAX_FRAMES).overrun);
+    GYRO_CLEAR_FIFO_OVERRUN();
+    simAdvanceUs(10000);
+    buffer = GYRO_READ_FIFO_INTO(array, GYRO_FIFO_MAX_FRAMES);
+    CHECK(!buffer.overrun);
+    CHECK(buffer.len >= 9 && buffer.len <= 11);
+    // Mode unchanged still clears it
+    simAdvanceUs(150000);
+    GYRO_SET_FIFO_MODE(GYRO_FIFO_STREAM);
+    CHECK(!GYRO_READ_FIFO_INTO(array, GYRO_FIFO_MAX_FRAMES).overrun);
+}
+
+static void testSelfTests(){
+    setup();
+    CHECK(IMU_READY() == 1);
+    // Self-tests leave the sensor usable
+    CHECK_NEAR(ACCEL_READ_ACCELERATION().z, GRAV, 0.01);
+    setup();
+    simFailSelfTests(0, 1, 0);
+    CHECK(IMU_READY() == -1);
+    setup();
+    simFailSelfTests(0, 1, 1);
+    CHECK(IMU_READY() == -3);
+}
+
+static void testInterruptPins(){
+    Vector3 array[ACCEL_FIFO_MAX_FRAMES];
+    setup();
+    memset(extiCount, 0, sizeof(extiCount));
+    ACCEL_WRITE_INT1_CONFIG(ACCEL_INT_OUTPUT | ACCEL_INT_PUSH_PULL | ACCEL_INT_ACTIVE_HIGH);
+    ACCEL_WRITE_INT_MAP(ACCEL_INT1_DATA_READY);
+    GYRO_SET_INT_ENABLE(GYRO_INT_DATA_READY_EN);
+    GYRO_SET_INT_MAP(GYRO_INT4_DATA_READY);
+    simAdvanceUs(100000);
+    // Data ready at 400Hz and 1kHz
+    CHECK(extiCount[0] >= 39 && extiCount[0] <= 41);
+    CHECK(extiCount[1] == 0);
+    CHECK(extiCount[2] == 0);
+    CHECK(extiCount[3] >= 99 && extiCount[3] <= 101);
+
+    // Watermark is a level, it fires once and again only after the FIFO has been drained
+    ACCEL_WRITE_INT_MAP(ACCEL_INT2_FIFO_WATERMARK);
+    ACCEL_WRITE_INT2_CONFIG(ACCEL_INT_OUTPUT | ACCEL_INT_PUSH_PULL | ACCEL_INT_ACTIVE_HIGH);
+    ACCEL_WRITE_FIFO_WATERMARK_SAMPLES(10);
+    GYRO_SET_INT_MAP(0);
+    ACCEL_READ_FIFO_INTO(array, ACCEL_FIFO_MAX_FRAMES);
+    memset(extiCount, 0, sizeof(extiCount));
+    simAdvanceUs(100000);
+    CHECK(extiCount[1] == 1);
+    ACCEL_READ_FIFO_INTO(array, ACCEL_FIFO_MAX_FRAMES);
+    simAdvanceUs(30000);
+    CHECK(extiCount[1] == 2);
+    CHECK(extiCount[0] == 0);
+    CHECK(extiCount[3] == 0);
+}
+
+int main(){
+    testIds();
+    testAccelFIFO();
+    testAccelSkip();
+    testAccelDrop();
+    testAccelTruncatedTimes();
+    testAccelConfigChange();
+    testAccelRangeBeforeEnable();
+    testGyroFIFO();
+    testGyroOverrun();
+    testSelfTests();
+    testInterruptPins();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,44 @@
+// Gyro scale per range, 500 dps used to be off by a factor of ten
+#include "IMU.h"
+#include "Bmi088Sim.h"
+#include "Check.h"
+
+#define DEG_TO_RAD (M_PI / 180.0)
+
+static SPI_HandleTypeDef hspi;
+static double rate;
+
+static void turn(uint64_t ns, double* out, void* ctx){
+    (void)ns;
+    (void)ctx;
+    out[0] = rate;
+    out[1] = -rate;
+    out[2] = rate / 2;
+}
+
+int main(){
+    static const uint8_t ranges[] = {GYRO_RANGE_DPS_2K, GYRO_RANGE_DPS_1K, GYRO_RANGE_DPS_500, GYRO_RANGE_DPS_250, GYRO_RANGE_DPS_125};
+    static const double dps[] = {2000, 1000, 500, 250, 125};
+    Vector3 rates;
+    int i;
+    simReset();
+    hspi.State = HAL_SPI_STATE_READY;
+    IMU_INIT(&hspi);
+    IMU_ENABLE_ALL();
+    simSetGyroSignal(0, turn, NULL);
+    for(i = 0; i < 5; i++){
+        GYRO_SET_RANGE(ranges[i]);
+        CHECK_NEAR(GYRO_GET_SCALE(), dps[i] * DEG_TO_RAD / 32767.0, 1e-9);
+        // Well inside the range, a wrong scale would be off by at least 2x
+        rate = dps[i] * DEG_TO_RAD * 0.4;
+        simAdvanceUs(2000);
+        rates = GYRO_READ_RATES();
+        CHECK_NEAR(rates.x, rate, rate * 0.001);
+        CHECK_NEAR(rates.y, -rate, rate * 0.001);
+        CHECK_NEAR(rates.z, rate / 2, rate * 0.001);
+        // Reloading from the chip lands on the same scale
+        GYRO_RELOAD_SETTINGS();
+        CHECK_NEAR(GYRO_GET_SCALE(), dps[i] * DEG_TO_RAD / 32767.0, 1e-9);
+    }
+    return CHECK_RESULT();
+}
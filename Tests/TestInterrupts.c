@@ -0,0 +1,140 @@
+// Interrupt driven drains alongside blocking calls, with interrupts preempting the main loop at every HAL call
+#include "IMU.h"
+#include "Bmi088Sim.h"
+#include "Check.h"
+
+static SPI_HandleTypeDef hspi;
+static Vector3 accelArray[ACCEL_FIFO_MAX_FRAMES];
+static Vector3 gyroArray[GYRO_FIFO_MAX_FRAMES];
+static uint32_t accelSamples;
+static uint32_t gyroSamples;
+static uint32_t accelCalls;
+static uint32_t extiBusWork;
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef* h){
+    IMU_DMA_COMPLETE(h);
+}
+
+void HAL_GPIO_EXTI_Callback(uint16_t pin){
+    uint32_t before = simBusStats().halCalls;
+    IMU_EXTI_CALLBACK(pin);
+    extiBusWork += simBusStats().halCalls - before;
+}
+
+static void accelDone(AccelDataBuffer buffer){
+    accelSamples += buffer.len;
+    accelCalls++;
+}
+
+static void gyroDone(GyroDataBuffer buffer){
+    gyroSamples += buffer.len;
+}
+
+static void setup(){
+    simReset();
+    hspi.State = HAL_SPI_STATE_READY;
+    IMU_INIT(&hspi);
+    IMU_ENABLE_ALL();
+    IMU_SETUP_FOR_LOGGING();
+    ACCEL_READ_FIFO_INTO(accelArray, ACCEL_FIFO_MAX_FRAMES);
+    GYRO_READ_FIFO_INTO(gyroArray, GYRO_FIFO_MAX_FRAMES);
+    accelSamples = gyroSamples = accelCalls = extiBusWork = 0;
+}
+
+static void testBlockingWaitsForDMA(){
+    SimBusStats bus;
+    setup();
+    simAdvanceUs(20000);
+    simResetBusStats();
+    CHECK(ACCEL_READ_FIFO_DMA(accelArray, ACCEL_FIFO_MAX_FRAMES, accelDone));
+    // Bus is owned by the readout, so this waits for it rather than selecting the chip under it
+    CHECK(GYRO_READ_ID() == 0x0F);
+    CHECK(accelCalls == 1);
+    CHECK(accelSamples >= 7 && accelSamples <= 9);
+    bus = simBusStats();
+    CHECK(bus.collisions == 0);
+    CHECK(bus.busyRejects == 0);
+    // A second readout can't start while one owns the bus
+    CHECK(GYRO_READ_FIFO_DMA(gyroArray, GYRO_FIFO_MAX_FRAMES, gyroDone));
+    CHECK(!ACCEL_READ_FIFO_DMA(accelArray, ACCEL_FIFO_MAX_FRAMES, accelDone));
+    simAdvanceUs(1000);
+    CHECK(!GYRO_DMA_BUSY());
+}
+
+static void testPolledDrains(){
+    SimBusStats bus;
+    uint32_t i;
+    uint8_t queued = 0;
+    uint64_t start;
+    double ms;
+    setup();
+    ACCEL_WRITE_FIFO_WATERMARK_SAMPLES(8);
+    ACCEL_WRITE_INT1_CONFIG(ACCEL_INT_OUTPUT | ACCEL_INT_PUSH_PULL | ACCEL_INT_ACTIVE_HIGH);
+    ACCEL_WRITE_INT_MAP(ACCEL_INT1_FIFO_WATERMARK);
+    GYRO_SET_FIFO_WATERMARK(10);
+    GYRO_SET_INT_ENABLE(GYRO_INT_FIFO_EN);
+    GYRO_SET_INT_PIN_CONFIG(GYRO_INT3_ACTIVE_HIGH);
+    GYRO_SET_INT_MAP(GYRO_INT3_FIFO);
+    IMU_ATTACH_ACCEL_INTERRUPT(INT1_Pin, accelArray, ACCEL_FIFO_MAX_FRAMES, accelDone);
+    IMU_ATTACH_GYRO_INTERRUPT(INT3_Pin, gyroArray, GYRO_FIFO_MAX_FRAMES, gyroDone);
+    simResetBusStats();
+    start = simNowNs();
+
+    // Main loop doing its own blocking reads between polls, for 500ms
+    for(i = 0; i < 2500; i++){
+        queued |= IMU_POLL();
+        if(i % 3 == 0){
+            GYRO_READ_RATES();
+        } else if(i % 3 == 1){
+            ACCEL_READ_SENSORTIME();
+        }
+        simAdvanceUs(200);
+    }
+    while(IMU_POLL() || ACCEL_DMA_BUSY() || GYRO_DMA_BUSY()){
+        simAdvanceUs(100);
+    }
+
+    bus = simBusStats();
+    ms = (simNowNs() - start) / 1e6;
+    CHECK(extiBusWork == 0);
+    CHECK(bus.collisions == 0);
+    CHECK(bus.busyRejects == 0);
+    // Everything up to the last watermark arrived
+    CHECK(accelSamples >= ms * 0.4 - 9 && accelSamples <= ms * 0.4 + 1);
+    CHECK(gyroSamples >= ms - 11 && gyroSamples <= ms + 1);
+    CHECK(queued);
+    IMU_ATTACH_ACCEL_INTERRUPT(0, NULL, 0, NULL);
+    IMU_ATTACH_GYRO_INTERRUPT(0, NULL, 0, NULL);
+}
+
+static void testSyncedReads(){
+    static const uint8_t config[64] = {0}; // Stands in for Bosch's feature config, the simulator only needs some
+    static ImuSample syncBuffer[16];
+    ImuSample pairs[16];
+    Bmi088 other;
+    uint16_t i, n = 0;
+    setup();
+    CHECK(IMU_SETUP_DATA_SYNC(config, sizeof(config), ACCEL_DATA_SYNC_1K));
+    IMU_ATTACH_SYNC_INTERRUPT(INT2_Pin, syncBuffer, 16);
+    // Main loop goes on to work with a second IMU while the first one's synced pairs come in
+    simAddChip(&simPortB, CSA_Pin, &simPortB, CSG_Pin);
+    IMU_INIT_DEVICE(&other, &hspi, &simPortB, CSA_Pin, &simPortB, CSG_Pin);
+    for(i = 0; i < 40; i++){
+        IMU_POLL();
+        CHECK(ACCEL_CURRENT_DEVICE() == &other.accel && GYRO_CURRENT_DEVICE() == &other.gyro);
+        simAdvanceUs(500);
+        n += IMU_DRAIN_SYNCED(pairs, 16);
+    }
+    CHECK(extiBusWork == 0);
+    // 1kHz for 20ms, one pair per poll at most
+    CHECK(n >= 19 && n <= 21);
+    CHECK_NEAR(pairs[0].accel.z, GRAV, 0.05);
+    IMU_ATTACH_SYNC_INTERRUPT(0, NULL, 0);
+}
+
+int main(){
+    testBlockingWaitsForDMA();
+    testPolledDrains();
+    testSyncedReads();
+    return CHECK_RESULT();
+}
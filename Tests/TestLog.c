@@ -0,0 +1,224 @@
+// Logging FIFO readouts and decoding them again, across a range change
+#include "IMU.h"
+#include "Bmi088Sim.h"
+#include "Check.h"
+#include <string.h>
+
+static SPI_HandleTypeDef hspi;
+static uint8_t buf[4096];
+static LogRecord rec;
+
+static void setup(){
+    simReset();
+    hspi.State = HAL_SPI_STATE_READY;
+    IMU_INIT(&hspi);
+    IMU_ENABLE_ALL();
+    IMU_SETUP_FOR_LOGGING();
+}
+
+static void testRangeChangeSplit(){
+    Vector3Raw raw[ACCEL_FIFO_MAX_FRAMES];
+    AccelRawBuffer buffer;
+    LogEncoder enc;
+    LogDecoder dec;
+    uint8_t type;
+    uint16_t samples = 0, records = 0;
+    uint16_t i;
+    uint32_t times[ACCEL_FIFO_MAX_FRAMES];
+    setup();
+    logInit(&enc, buf, sizeof(buf));
+    ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES);
+    simAdvanceUs(20000);
+    ACCEL_SET_RANGE(ACCEL_RANGE_6G);
+    simAdvanceUs(20000);
+    buffer = ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES);
+    CHECK(buffer.configAt > 0 && buffer.configAt < buffer.len);
+    CHECK(buffer.hasTime);
+    ACCEL_FILL_TIMESTAMPS(buffer.sensortime, buffer.len, times, buffer.overflowed);
+    CHECK(IMU_LOG_ACCEL(&enc, buffer));
+
+    // Every sample decodes to 1g with the scale in force where the decoder is
+    CHECK(logDecoderInit(&dec, buf, enc.len));
+    while((type = logDecode(&dec, &rec)) != LOG_END){
+        CHECK(type != LOG_ERROR);
+        if(type != LOG_REC_ACCEL){
+            continue;
+        }
+        records++;
+        for(i = 0; i < rec.len; i++){
+            CHECK_NEAR(rec.samples[i].z * dec.config.accelScale, GRAV, 0.01);
+        }
+        // Each part is timed at its last sample, on the same grid as the live timestamps
+        CHECK(rec.timed);
+        CHECK(rec.sensortime == times[samples + rec.len - 1]);
+        samples += rec.len;
+    }
+    CHECK(records == 2);
+    CHECK(samples == buffer.len);
+}
+
+// Decodes buf and checks every accel sample comes out as 1g. Returns how many there were
+static uint16_t decodeAll(uint16_t len){
+    LogDecoder dec;
+    uint8_t type;
+    uint16_t i, samples = 0;
+    CHECK(logDecoderInit(&dec, buf, len));
+    while((type = logDecode(&dec, &rec)) != LOG_END){
+        CHECK(type != LOG_ERROR);
+        if(type == LOG_REC_ACCEL){
+            for(i = 0; i < rec.len; i++){
+                CHECK_NEAR(rec.samples[i].z * dec.config.accelScale, GRAV, 0.01);
+            }
+            samples += rec.len;
+        }
+    }
+    return samples;
+}
+
+static void testChangeAtEndOfReadout(){
+    Vector3Raw raw[ACCEL_FIFO_MAX_FRAMES];
+    AccelRawBuffer first, second;
+    LogEncoder enc;
+    setup();
+    logInit(&enc, buf, sizeof(buf));
+    ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES);
+    simAdvanceUs(20000);
+    // Read straight after the change, so the config frame is the last thing in the FIFO
+    ACCEL_SET_RANGE(ACCEL_RANGE_6G);
+    first = ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES);
+    CHECK(first.len > 0 && first.configAt == first.len);
+    CHECK(IMU_LOG_ACCEL(&enc, first));
+    simAdvanceUs(20000);
+    second = ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES);
+    CHECK(second.len > 0 && second.configAt == 0);
+    CHECK(IMU_LOG_ACCEL(&enc, second));
+    CHECK(decodeAll(enc.len) == first.len + second.len);
+}
+
+// Array too small for the readout, so the logged time has to allow for the frames that didn't fit
+static void testOverflowedTime(){
+    Vector3Raw raw[ACCEL_FIFO_MAX_FRAMES];
+    AccelRawBuffer buffer;
+    LogEncoder enc;
+    LogDecoder dec;
+    uint32_t times[5];
+    setup();
+    logInit(&enc, buf, sizeof(buf));
+    ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES);
+    simAdvanceUs(40000);
+    buffer = ACCEL_READ_FIFO_RAW(raw, 5);
+    CHECK(buffer.len == 5 && buffer.overflowed > 0 && buffer.hasTime);
+    ACCEL_FILL_TIMESTAMPS(buffer.sensortime, buffer.len, times, buffer.overflowed);
+    CHECK(IMU_LOG_ACCEL(&enc, buffer));
+    CHECK(logDecoderInit(&dec, buf, enc.len));
+    CHECK(logDecode(&dec, &rec) == LOG_REC_CONFIG);
+    CHECK(logDecode(&dec, &rec) == LOG_REC_ACCEL);
+    CHECK(rec.timed && rec.sensortime == times[4]);
+}
+
+// A readout with no sensortime frame, e.g. a recorded stream, is logged untimed rather than at time 0
+static void testUntimed(){
+    Vector3Raw raw[4] = {{0, 0, 2731}, {1, 0, 2731}, {0, 1, 2731}, {1, 1, 2731}};
+    AccelRawBuffer buffer;
+    LogEncoder enc;
+    LogDecoder dec;
+    uint16_t i;
+    setup();
+    logInit(&enc, buf, sizeof(buf));
+    memset(&buffer, 0, sizeof(buffer));
+    buffer.array = raw;
+    buffer.len = 4;
+    buffer.configAt = 4;
+    buffer.scale = ACCEL_GET_SCALE();
+    CHECK(IMU_LOG_ACCEL(&enc, buffer));
+    CHECK(logDecoderInit(&dec, buf, enc.len));
+    CHECK(logDecode(&dec, &rec) == LOG_REC_CONFIG);
+    CHECK(logDecode(&dec, &rec) == LOG_REC_ACCEL);
+    CHECK(!rec.timed);
+    CHECK(rec.len == 4);
+    for(i = 0; i < 4; i++){
+        CHECK(rec.samples[i].x == raw[i].x && rec.samples[i].y == raw[i].y && rec.samples[i].z == raw[i].z);
+    }
+    CHECK(logDecode(&dec, &rec) == LOG_END);
+}
+
+static void turn(uint64_t ns, double* out, void* ctx){
+    (void)ns;
+    (void)ctx;
+    out[0] = 1.0;
+    out[1] = -0.5;
+    out[2] = 0.25;
+}
+
+static void testGyro(){
+    Vector3Raw raw[GYRO_FIFO_MAX_FRAMES];
+    GyroRawBuffer buffer;
+    LogEncoder enc;
+    LogDecoder dec;
+    uint16_t i, configs = 0, samples = 0, logged = 0;
+    uint8_t type;
+    setup();
+    simSetGyroSignal(0, turn, NULL);
+    logInit(&enc, buf, sizeof(buf));
+    GYRO_READ_FIFO_RAW(raw, GYRO_FIFO_MAX_FRAMES);
+    simAdvanceUs(20000);
+    buffer = GYRO_READ_FIFO_RAW(raw, GYRO_FIFO_MAX_FRAMES);
+    CHECK(buffer.len > 0);
+    CHECK(IMU_LOG_GYRO(&enc, buffer));
+    logged += buffer.len;
+    // Same settings, so no second config record
+    simAdvanceUs(20000);
+    buffer = GYRO_READ_FIFO_RAW(raw, GYRO_FIFO_MAX_FRAMES);
+    CHECK(IMU_LOG_GYRO(&enc, buffer));
+    logged += buffer.len;
+    // New range, so a config record ahead of the batch, which decodes with the new scale
+    GYRO_SET_RANGE(GYRO_RANGE_DPS_500);
+    GYRO_READ_FIFO_RAW(raw, GYRO_FIFO_MAX_FRAMES);
+    simAdvanceUs(20000);
+    buffer = GYRO_READ_FIFO_RAW(raw, GYRO_FIFO_MAX_FRAMES);
+    CHECK(IMU_LOG_GYRO(&enc, buffer));
+    logged += buffer.len;
+
+    CHECK(logDecoderInit(&dec, buf, enc.len));
+    while((type = logDecode(&dec, &rec)) != LOG_END){
+        CHECK(type != LOG_ERROR);
+        if(type == LOG_REC_CONFIG){
+            configs++;
+            continue;
+        }
+        CHECK(type == LOG_REC_GYRO);
+        CHECK(!rec.timed);
+        for(i = 0; i < rec.len; i++){
+            CHECK_NEAR(rec.samples[i].x * dec.config.gyroScale, 1.0, 0.002);
+            CHECK_NEAR(rec.samples[i].y * dec.config.gyroScale, -0.5, 0.002);
+            CHECK_NEAR(rec.samples[i].z * dec.config.gyroScale, 0.25, 0.002);
+        }
+        samples += rec.len;
+    }
+    CHECK(configs == 2);
+    CHECK(samples == logged);
+}
+
+static void testNoRoom(){
+    Vector3Raw raw[ACCEL_FIFO_MAX_FRAMES];
+    AccelRawBuffer buffer;
+    LogEncoder enc;
+    setup();
+    logInit(&enc, buf, 64);
+    ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES);
+    simAdvanceUs(40000);
+    buffer = ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES);
+    // Config goes in but the batch doesn't, so nothing is kept
+    CHECK(!IMU_LOG_ACCEL(&enc, buffer));
+    CHECK(enc.len == LOG_HEADER_BYTES && !enc.haveConfig);
+}
+
+int main(){
+    testRangeChangeSplit();
+    testChangeAtEndOfReadout();
+    testOverflowedTime();
+    testUntimed();
+    testGyro();
+    testNoRoom();
+    return CHECK_RESULT();
+}
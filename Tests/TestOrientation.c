@@ -0,0 +1,176 @@
+// Attitude filter against known motion. Built twice, TestOrientation with the float filter and TestOrientationFixed
+//  with ORIENTATION_FIXED_POINT. Both are checked against the truth and against the same double precision
+//  model of the filter, so the two builds agree with each other within twice AGREE_TOL
+#include "Orientation.h"
+#include "Check.h"
+
+#define GYRO_HZ 2000
+#define BATCH 20 // 10ms drains
+#define ACCEL_PER_BATCH 16 // 1600Hz accel
+#define GYRO_SCALE (2000.0f * 3.14159265f / 180.0f / 32767.0f)
+#define ONE_G 1365 // Counts at 24g
+#define AGREE_TOL 5e-5 // rad, rounding in either build adds up over thousands of samples
+
+static Vector3Raw gyro[BATCH];
+static Vector3Raw accel[ACCEL_PER_BATCH];
+
+// The filter's update in double, with none of either build's rounding
+typedef struct model
+{
+    double q[4];
+    double integral[3];
+    double kp, ki;
+} Model;
+
+static void modelUpdate(Model* m, const Vector3Raw* g, uint16_t gLen, const Vector3Raw* a, uint16_t aLen){
+    double dt = 1.0 / GYRO_HZ, half = GYRO_SCALE * dt * 0.5;
+    double ax = 0, ay = 0, az = 0, norm, vx, vy, vz, e[3], c[3] = {0, 0, 0}, h[3], n[4], *q = m->q;
+    int i, k;
+    for(i = 0; i < aLen; i++){
+        ax += a[i].x;
+        ay += a[i].y;
+        az += a[i].z;
+    }
+    for(k = 0; k < 3; k++){
+        c[k] = m->integral[k];
+    }
+    norm = sqrt(ax*ax + ay*ay + az*az);
+    if(norm > 0){
+        ax /= norm;
+        ay /= norm;
+        az /= norm;
+        vx = 2 * (q[1]*q[3] - q[0]*q[2]);
+        vy = 2 * (q[0]*q[1] + q[2]*q[3]);
+        vz = q[0]*q[0] - q[1]*q[1] - q[2]*q[2] + q[3]*q[3];
+        e[0] = ay*vz - az*vy;
+        e[1] = az*vx - ax*vz;
+        e[2] = ax*vy - ay*vx;
+        for(k = 0; k < 3; k++){
+            m->integral[k] += m->ki * e[k] * gLen * dt;
+            c[k] = m->kp * e[k] + m->integral[k];
+        }
+    }
+    for(i = 0; i < gLen; i++){
+        h[0] = g[i].x * half + c[0] * dt * 0.5;
+        h[1] = g[i].y * half + c[1] * dt * 0.5;
+        h[2] = g[i].z * half + c[2] * dt * 0.5;
+        n[0] = q[0] - q[1]*h[0] - q[2]*h[1] - q[3]*h[2];
+        n[1] = q[1] + q[0]*h[0] + q[2]*h[2] - q[3]*h[1];
+        n[2] = q[2] + q[0]*h[1] - q[1]*h[2] + q[3]*h[0];
+        n[3] = q[3] + q[0]*h[2] + q[1]*h[1] - q[2]*h[0];
+        for(k = 0; k < 4; k++){
+            q[k] = n[k];
+        }
+    }
+    norm = sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+    for(k = 0; k < 4; k++){
+        q[k] /= norm;
+    }
+}
+
+// Angle between two attitudes, either sign of quaternion. From the vector part of a* b, acos loses too much near 1
+static double angleBetween(const double* a, const float* b){
+    double w = a[0]*b[0] + a[1]*b[1] + a[2]*b[2] + a[3]*b[3];
+    double x = a[0]*b[1] - a[1]*b[0] - a[2]*b[3] + a[3]*b[2];
+    double y = a[0]*b[2] + a[1]*b[3] - a[2]*b[0] - a[3]*b[1];
+    double z = a[0]*b[3] - a[1]*b[2] + a[2]*b[1] - a[3]*b[0];
+    return 2 * atan2(sqrt(x*x + y*y + z*z), fabs(w));
+}
+
+// Runs the filter and the model side by side for the given number of batches
+//  Returns the worst difference between them seen along the way
+static double run(Orientation* o, Model* m, int batches, uint16_t accelLen){
+    double worst = 0, diff;
+    float q[4];
+    int b;
+    for(b = 0; b < batches; b++){
+        orientUpdate(o, gyro, BATCH, accel, accelLen);
+        modelUpdate(m, gyro, BATCH, accel, accelLen);
+        orientGetQuaternion(o, q);
+        diff = angleBetween(m->q, q);
+        worst = diff > worst ? diff : worst;
+    }
+    return worst;
+}
+
+static void setup(Orientation* o, Model* m, Vector3Raw g, Vector3Raw a, float kp, float ki){
+    int i;
+    orientInit(o, GYRO_SCALE, GYRO_HZ, kp, ki);
+    m->kp = kp;
+    m->ki = ki;
+    m->q[0] = 1;
+    m->q[1] = m->q[2] = m->q[3] = 0;
+    m->integral[0] = m->integral[1] = m->integral[2] = 0;
+    for(i = 0; i < BATCH; i++){
+        gyro[i] = g;
+    }
+    for(i = 0; i < ACCEL_PER_BATCH; i++){
+        accel[i] = a;
+    }
+}
+
+// Constant spin about the vertical, so gravity has nothing to correct and the attitude is pure gyro integration
+static void testSpin(){
+    Orientation o;
+    Model m;
+    Vector3Raw g = {0, 0, 1000}, a = {0, 0, ONE_G};
+    double angle = 1000 * (double)GYRO_SCALE * 2, truth[4] = {cos(angle / 2), 0, 0, sin(angle / 2)};
+    float q[4];
+    setup(&o, &m, g, a, 1.0f, 0.0f);
+    CHECK(run(&o, &m, 2 * GYRO_HZ / BATCH, ACCEL_PER_BATCH) < AGREE_TOL);
+    orientGetQuaternion(&o, q);
+    CHECK(angleBetween(truth, q) < 1e-4);
+    CHECK_NEAR(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3], 1, 1e-5);
+
+    // Same without any accel samples, the gyro alone carries it
+    setup(&o, &m, g, a, 1.0f, 0.0f);
+    CHECK(run(&o, &m, 2 * GYRO_HZ / BATCH, 0) < AGREE_TOL);
+    orientGetQuaternion(&o, q);
+    CHECK(angleBetween(truth, q) < 1e-4);
+}
+
+// Held still at 30 degrees of roll, starting from level. The accelerometer pulls it round to the tilt
+static void testTilt(){
+    Orientation o;
+    Model m;
+    double tilt = 30 * M_PI / 180, truth[4] = {cos(tilt / 2), sin(tilt / 2), 0, 0};
+    Vector3Raw g = {0, 0, 0}, a = {0, (int16_t)lround(ONE_G * sin(tilt)), (int16_t)lround(ONE_G * cos(tilt))};
+    float q[4];
+    setup(&o, &m, g, a, 1.0f, 0.0f);
+    // A second in it is still on its way, by ten seconds it has settled
+    CHECK(run(&o, &m, GYRO_HZ / BATCH, ACCEL_PER_BATCH) < AGREE_TOL);
+    orientGetQuaternion(&o, q);
+    CHECK(angleBetween(truth, q) > 0.05);
+    CHECK(run(&o, &m, 9 * GYRO_HZ / BATCH, ACCEL_PER_BATCH) < AGREE_TOL);
+    orientGetQuaternion(&o, q);
+    // Counts round to the nearest LSB, which moves the measured tilt by up to about 1/ONE_G
+    CHECK(angleBetween(truth, q) < 2e-3);
+    CHECK(fabs(q[3]) < 1e-4); // Nothing to turn it in yaw
+}
+
+// Level and still with a gyro bias on x. The integral term learns the bias and pulls it back to level
+static void testBias(){
+    Orientation o;
+    Model m;
+    double level[4] = {1, 0, 0, 0};
+    Vector3Raw g = {20, 0, 0}, a = {0, 0, ONE_G};
+    float q[4];
+    setup(&o, &m, g, a, 2.0f, 1.0f);
+    CHECK(run(&o, &m, 10 * GYRO_HZ / BATCH, ACCEL_PER_BATCH) < AGREE_TOL);
+    orientGetQuaternion(&o, q);
+    CHECK(angleBetween(level, q) < 1e-3);
+    CHECK_NEAR(o.integral.x, -20 * GYRO_SCALE, 20 * GYRO_SCALE * 0.01);
+
+    // Proportional only leaves a standing tilt of bias / kp
+    setup(&o, &m, g, a, 2.0f, 0.0f);
+    run(&o, &m, 10 * GYRO_HZ / BATCH, ACCEL_PER_BATCH);
+    orientGetQuaternion(&o, q);
+    CHECK_NEAR(angleBetween(level, q), 20 * GYRO_SCALE / 2.0f, 1e-3);
+}
+
+int main(){
+    testSpin();
+    testTilt();
+    testBias();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,186 @@
+// FIFO parsers on hand built byte streams, no bus involved
+#include "Accel.h"
+#include "Gyro.h"
+#include "Check.h"
+#include <string.h>
+
+static uint8_t stream[4096];
+static uint16_t streamLen;
+static Vector3Raw samples[512];
+
+static void putData(int16_t x, int16_t y, int16_t z){
+    uint8_t* p = stream + streamLen;
+    p[0] = 0x84;
+    p[1] = x; p[2] = x >> 8;
+    p[3] = y; p[4] = y >> 8;
+    p[5] = z; p[6] = z >> 8;
+    streamLen += 7;
+}
+
+static void putControl(uint8_t header, uint8_t value){
+    stream[streamLen++] = header;
+    stream[streamLen++] = value;
+}
+
+static void putSensortime(uint32_t ticks){
+    stream[streamLen++] = 0x44;
+    stream[streamLen++] = ticks;
+    stream[streamLen++] = ticks >> 8;
+    stream[streamLen++] = ticks >> 16;
+}
+
+static void testLongStream(){
+    AccelRawBuffer out;
+    int i;
+    streamLen = 0;
+    // More frames than fit in a uint8_t, as a recorded stream spanning several readouts can have
+    for(i = 0; i < 300; i++){
+        putData(i, -i, 2 * i);
+    }
+    putSensortime(1234);
+    out = ACCEL_PARSE_FIFO(stream, streamLen, samples, 400);
+    CHECK(out.len == 300);
+    CHECK(out.configAt == 300);
+    CHECK(out.hasTime && out.sensortime == 1234);
+    CHECK(samples[299].x == 299 && samples[299].y == -299 && samples[299].z == 598);
+
+    // Capacity still caps the output
+    out = ACCEL_PARSE_FIFO(stream, streamLen, samples, 260);
+    CHECK(out.len == 260);
+}
+
+static void testControlFrames(){
+    AccelRawBuffer out;
+    streamLen = 0;
+    putControl(0x40, 5); // Skip
+    putData(1, 2, 3);
+    putControl(0x50, 0); // Drop
+    putData(4, 5, 6);
+    putControl(0x48, 0x01); // Config change
+    putData(7, 8, 9);
+    putSensortime(99);
+    putControl(0x80, 0);
+    out = ACCEL_PARSE_FIFO(stream, streamLen, samples, 16);
+    CHECK(out.skipped == 5);
+    CHECK(out.len == 4);
+    CHECK(samples[1].x == INT16_MIN);
+    CHECK(out.drops == 1);
+    CHECK(out.configAt == 3);
+    CHECK(samples[3].z == 9);
+    CHECK(out.sensortime == 99);
+}
+
+static void testConfigAcrossCalls(){
+    AccelFIFOParser parser;
+    AccelRawBuffer out;
+    uint16_t first;
+    memset(&parser, 0, sizeof(parser));
+    streamLen = 0;
+    putData(1, 1, 1);
+    putData(2, 2, 2);
+    putControl(0x48, 0x01);
+    first = streamLen;
+    putData(3, 3, 3);
+    putSensortime(7);
+    // Readout ends right after the config frame, nothing in it came after the change
+    out = ACCEL_PARSE_FIFO_STREAM(&parser, stream, first, samples, 16);
+    CHECK(out.len == 2 && out.configAt == 2);
+    // So the whole of the next one did
+    out = ACCEL_PARSE_FIFO_STREAM(&parser, stream + first, streamLen - first, samples, 16);
+    CHECK(out.len == 1 && out.configAt == 0);
+    // And only the once
+    out = ACCEL_PARSE_FIFO_STREAM(&parser, stream + first, 7, samples, 16);
+    CHECK(out.configAt == out.len);
+
+    // Config frame cut in half by the end of the readout comes out the same way
+    memset(&parser, 0, sizeof(parser));
+    out = ACCEL_PARSE_FIFO_STREAM(&parser, stream, first - 1, samples, 16);
+    CHECK(out.len == 2 && out.configAt == 2);
+    out = ACCEL_PARSE_FIFO_STREAM(&parser, stream + first - 1, streamLen - first + 1, samples, 16);
+    CHECK(out.len == 1 && out.configAt == 0);
+}
+
+// A stream parser reports the scale it was given, not whatever device happens to be current
+static void testStreamScale(){
+    AccelFIFOParser parser;
+    AccelState other;
+    AccelState* saved = ACCEL_CURRENT_DEVICE();
+    AccelRawBuffer out;
+    memset(&parser, 0, sizeof(parser));
+    memset(&other, 0, sizeof(other));
+    parser.scale = 3 * GRAV / 32768;
+    other.scale = 24 * GRAV / 32768;
+    ACCEL_USE_DEVICE(&other);
+    streamLen = 0;
+    putData(1, 2, 3);
+    out = ACCEL_PARSE_FIFO_STREAM(&parser, stream, streamLen, samples, 16);
+    CHECK(out.len == 1 && out.scale == (float)parser.scale);
+    // Switching device or changing its range in between changes nothing
+    other.scale = 6 * GRAV / 32768;
+    out = ACCEL_PARSE_FIFO_STREAM(&parser, stream, streamLen, samples, 16);
+    CHECK(out.scale == (float)(3 * GRAV / 32768));
+    // The one-shot parser has no state to keep it in, so it goes by the current device
+    out = ACCEL_PARSE_FIFO(stream, streamLen, samples, 16);
+    CHECK(out.scale == (float)other.scale);
+    ACCEL_USE_DEVICE(saved);
+}
+
+static void testGyro(){
+    uint8_t frames[6 * 2] = {1, 0, 2, 0, 3, 0,  0xFF, 0xFF, 0xFE, 0xFF, 0, 0x80};
+    // Frame count comes from FIFO_STATUS, every frame is data
+    GyroRawBuffer out = GYRO_PARSE_FIFO(frames, 2, samples);
+    CHECK(out.len == 2);
+    CHECK(samples[0].x == 1 && samples[0].z == 3);
+    CHECK(samples[1].x == -1 && samples[1].y == -2 && samples[1].z == INT16_MIN);
+}
+
+static void testGyroNoSentinel(){
+    Vector3Raw raw[2] = {{INT16_MIN, INT16_MIN, INT16_MIN}, {1, 2, 3}};
+    Vector3 out[2];
+    VectorCal cal;
+    // Gyro data has no drops, so all-INT16_MIN is a full scale reading rather than a null
+    vCalFold(NULL, 0.5, &cal);
+    vRawToDCal(raw, out, 2, &cal);
+    CHECK(out[0].x == INT16_MIN * 0.5 && out[0].z == INT16_MIN * 0.5);
+    vMarkDrops(raw, out, 2);
+    CHECK(isnan(out[0].x) && out[1].z == 1.5);
+}
+
+static void testCalibratedConversion(){
+    Vector3Raw raw[3] = {{100, -200, 300}, {0, 0, 0}, {-32768, 32767, 1}};
+    Vector3 out[3], one;
+    SensorCal cal;
+    VectorCal folded;
+    int i;
+    vCalIdentity(&cal);
+    cal.offset[0] = 0.5f;
+    cal.offset[2] = -1.0f;
+    cal.matrix[0][0] = 1.25f;
+    vCalFold(&cal, 0.01, &folded);
+    CHECK(!folded.cross);
+    vRawToDCal(raw, out, 3, &folded);
+    CHECK_NEAR(out[0].x, 1.25 * (100 * 0.01 - 0.5), 1e-9);
+    CHECK_NEAR(out[1].z, 1.0, 1e-9);
+    // Misalignment takes the full matrix loop, which has to agree with the single sample version
+    cal.matrix[1][0] = 0.1f;
+    cal.matrix[2][1] = -0.05f;
+    vCalFold(&cal, 0.01, &folded);
+    CHECK(folded.cross);
+    vRawToDCal(raw, out, 3, &folded);
+    for(i = 0; i < 3; i++){
+        one = vRawToDCalOne(raw[i], &folded);
+        CHECK(one.x == out[i].x && one.y == out[i].y && one.z == out[i].z);
+    }
+    CHECK_NEAR(out[0].y, 0.1f * (100 * 0.01 - 0.5) + (-200 * 0.01), 1e-6);
+}
+
+int main(){
+    testLongStream();
+    testControlFrames();
+    testConfigAcrossCalls();
+    testStreamScale();
+    testGyro();
+    testGyroNoSentinel();
+    testCalibratedConversion();
+    return CHECK_RESULT();
+}
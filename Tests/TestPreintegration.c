@@ -0,0 +1,195 @@
+// Preintegrated increments against the exact motion, for coning and sculling
+//  Gyro and accel samples are the average over each sample period, which is what the chips' filters approximate
+#include "Preintegration.h"
+#include "Check.h"
+#include <string.h>
+
+#define RATE_HZ 2000.0
+#define DT (1.0 / RATE_HZ)
+#define INTERVAL_S 0.01
+#define SAMPLES 2000 // One second
+#define BATCH 7 // Doesn't divide the interval, so increments straddle batches
+#define INTERVALS 100
+#define OMEGA (2 * M_PI * 9) // Motion frequency, rad/s
+#define CONE 0.05 // Coning half angle, rad
+#define SCULL_ANGLE 0.05 // Sculling angular amplitude, rad
+#define SCULL_ACCEL 5.0 // Sculling acceleration amplitude, m/s^2
+#define SIMPSON_STEPS 2000
+
+typedef struct quat
+{
+    double w, x, y, z;
+} Quat;
+
+static Vector3 gyro[SAMPLES];
+static Vector3 accel[SAMPLES];
+static PreintDelta deltas[INTERVALS + 1];
+
+static Quat qMul(Quat a, Quat b){
+    Quat out;
+    out.w = a.w*b.w - a.x*b.x - a.y*b.y - a.z*b.z;
+    out.x = a.w*b.x + a.x*b.w + a.y*b.z - a.z*b.y;
+    out.y = a.w*b.y - a.x*b.z + a.y*b.w + a.z*b.x;
+    out.z = a.w*b.z + a.x*b.y - a.y*b.x + a.z*b.w;
+    return out;
+}
+
+static Quat qConj(Quat q){
+    q.x = -q.x;
+    q.y = -q.y;
+    q.z = -q.z;
+    return q;
+}
+
+static Quat qFromRotVec(Vector3 v){
+    Quat q;
+    double angle = sqrt(v.x*v.x + v.y*v.y + v.z*v.z);
+    double k = angle > 0 ? sin(angle / 2) / angle : 0.5;
+    q.w = cos(angle / 2);
+    q.x = v.x * k;
+    q.y = v.y * k;
+    q.z = v.z * k;
+    return q;
+}
+
+static Vector3 rotVecFromQ(Quat q){
+    Vector3 v;
+    double s = sqrt(q.x*q.x + q.y*q.y + q.z*q.z);
+    double k = s > 0 ? 2 * atan2(s, q.w) / s : 2;
+    v.x = q.x * k;
+    v.y = q.y * k;
+    v.z = q.z * k;
+    return v;
+}
+
+static double distance(Vector3 a, Vector3 b){
+    return sqrt((a.x-b.x)*(a.x-b.x) + (a.y-b.y)*(a.y-b.y) + (a.z-b.z)*(a.z-b.z));
+}
+
+static Vector3 fromF(Vector3f v){
+    Vector3 out = {v.x, v.y, v.z};
+    return out;
+}
+
+// Runs the samples through in batches and returns how many increments came out
+static uint16_t preintegrate(){
+    Preintegrator p;
+    uint16_t n = 0;
+    int i;
+    preintInit(&p, RATE_HZ, INTERVAL_S);
+    for(i = 0; i < SAMPLES; i += BATCH){
+        int len = SAMPLES - i < BATCH ? SAMPLES - i : BATCH;
+        n += preintUpdate(&p, gyro + i, len, accel + i, len, deltas + n, INTERVALS + 1 - n);
+    }
+    CHECK(p.merged == 0);
+    return n;
+}
+
+// Body attitude is the rotation vector CONE (0, cos wt, sin wt). Closed form, body to reference
+static Quat coneAttitude(double t){
+    Vector3 v = {0, CONE * cos(OMEGA * t), CONE * sin(OMEGA * t)};
+    return qFromRotVec(v);
+}
+
+static void testConing(){
+    Quat truthTotal = coneAttitude(0), corrected, plain;
+    Vector3 truth, sum;
+    double worst = 0, worstPlain = 0, t0, t1;
+    int i, k, n;
+    // Body rate of that motion is (-(1 - cos a) W, -sin a W sin Wt, sin a W cos Wt), averaged over each sample
+    for(i = 0; i < SAMPLES; i++){
+        t0 = i * DT;
+        t1 = t0 + DT;
+        gyro[i].x = -(1 - cos(CONE)) * OMEGA;
+        gyro[i].y = sin(CONE) * (cos(OMEGA * t1) - cos(OMEGA * t0)) / DT;
+        gyro[i].z = sin(CONE) * (sin(OMEGA * t1) - sin(OMEGA * t0)) / DT;
+        accel[i].x = accel[i].y = accel[i].z = 0;
+    }
+    n = preintegrate();
+    CHECK(n == INTERVALS);
+
+    corrected = plain = truthTotal;
+    for(k = 0; k < n; k++){
+        CHECK(deltas[k].samples == INTERVAL_S * RATE_HZ);
+        CHECK_NEAR(deltas[k].dt, INTERVAL_S, 1e-6);
+        truth = rotVecFromQ(qMul(qConj(coneAttitude(k * INTERVAL_S)), coneAttitude((k + 1) * INTERVAL_S)));
+        sum.x = sum.y = sum.z = 0;
+        for(i = k * deltas[k].samples; i < (k + 1) * deltas[k].samples; i++){
+            sum.x += gyro[i].x * DT;
+            sum.y += gyro[i].y * DT;
+            sum.z += gyro[i].z * DT;
+        }
+        worst = fmax(worst, distance(fromF(deltas[k].dAngle), truth));
+        worstPlain = fmax(worstPlain, distance(sum, truth));
+        corrected = qMul(corrected, qFromRotVec(fromF(deltas[k].dAngle)));
+        plain = qMul(plain, qFromRotVec(sum));
+    }
+    // Per increment, and chained over the whole second where plain summation drifts about the cone axis
+    truthTotal = coneAttitude(n * INTERVAL_S);
+    CHECK(worst < 1e-6);
+    CHECK(worst < worstPlain / 10);
+    CHECK(distance(rotVecFromQ(qMul(qConj(truthTotal), corrected)), (Vector3){0, 0, 0}) < 2e-5);
+    CHECK(distance(rotVecFromQ(qMul(qConj(truthTotal), plain)), (Vector3){0, 0, 0}) > 1e-3);
+}
+
+// Rolls SCULL_ANGLE sin(Wt) about x while accelerating SCULL_ACCEL sin(Wt) along body y
+static double scullAngle(double t){
+    return SCULL_ANGLE * sin(OMEGA * t);
+}
+
+// Exact velocity change over [t0, t1] in the body frame at t0. The integrand is closed form, Simpson does the rest
+static Vector3 scullTruth(double t0, double t1){
+    Vector3 v = {0, 0, 0};
+    double h = (t1 - t0) / SIMPSON_STEPS, t, f, d, w;
+    int i;
+    for(i = 0; i <= SIMPSON_STEPS; i++){
+        t = t0 + i * h;
+        f = SCULL_ACCEL * sin(OMEGA * t);
+        d = scullAngle(t) - scullAngle(t0);
+        w = (i == 0 || i == SIMPSON_STEPS) ? 1 : (i % 2 ? 4 : 2);
+        v.y += w * f * cos(d);
+        v.z += w * f * sin(d);
+    }
+    v.y *= h / 3;
+    v.z *= h / 3;
+    return v;
+}
+
+static void testSculling(){
+    Vector3 truth, sum;
+    double worst = 0, worstPlain = 0, t0, t1, drift = 0, driftTruth = 0;
+    int i, k, n;
+    for(i = 0; i < SAMPLES; i++){
+        t0 = i * DT;
+        t1 = t0 + DT;
+        gyro[i].x = (scullAngle(t1) - scullAngle(t0)) / DT;
+        gyro[i].y = gyro[i].z = 0;
+        accel[i].x = 0;
+        accel[i].y = SCULL_ACCEL * (cos(OMEGA * t0) - cos(OMEGA * t1)) / OMEGA / DT;
+        accel[i].z = 0;
+    }
+    n = preintegrate();
+    CHECK(n == INTERVALS);
+    for(k = 0; k < n; k++){
+        truth = scullTruth(k * INTERVAL_S, (k + 1) * INTERVAL_S);
+        sum.x = sum.y = sum.z = 0;
+        for(i = k * deltas[k].samples; i < (k + 1) * deltas[k].samples; i++){
+            sum.y += accel[i].y * DT;
+        }
+        worst = fmax(worst, distance(fromF(deltas[k].dVelocity), truth));
+        worstPlain = fmax(worstPlain, distance(sum, truth));
+        drift += deltas[k].dVelocity.z;
+        driftTruth += truth.z;
+    }
+    CHECK(worst < 1e-5);
+    CHECK(worst < worstPlain / 10);
+    // Sculling rectifies into a steady velocity along z that plain summation never sees
+    CHECK(driftTruth > 0.005);
+    CHECK_NEAR(drift, driftTruth, driftTruth * 0.01);
+}
+
+int main(){
+    testConing();
+    testSculling();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,158 @@
+// Single register and burst reads against the simulator
+#include "IMU.h"
+#include "Bmi088Sim.h"
+#include "Check.h"
+
+#define TICK_NS 39062.5 // ACCEL_SENSORTIME_TICK_US
+
+static SPI_HandleTypeDef hspi;
+static Vector3 gyroArray[GYRO_FIFO_MAX_FRAMES];
+
+// Ramps, so every sample differs from the one before
+static void accelRamp(uint64_t ns, double* out, void* ctx){
+    (void)ctx;
+    out[0] = ns / 1e8;
+    out[1] = -2.0 * ns / 1e8;
+    out[2] = GRAV;
+}
+
+static void gyroRamp(uint64_t ns, double* out, void* ctx){
+    (void)ctx;
+    out[0] = ns / 1e9;
+    out[1] = 0.5;
+    out[2] = -(double)ns / 2e9;
+}
+
+static void setup(){
+    simReset();
+    hspi.State = HAL_SPI_STATE_READY;
+    IMU_INIT(&hspi);
+    IMU_ENABLE_ALL();
+    IMU_SETUP_FOR_LOGGING();
+    simSetAccelSignal(0, accelRamp, NULL);
+    simSetGyroSignal(0, gyroRamp, NULL);
+    simAdvanceUs(20000);
+}
+
+static uint32_t ticksNow(){
+    return (uint32_t)(simNowNs() / TICK_NS) & ACCEL_SENSORTIME_MASK;
+}
+
+static void testAccelSnapshot(){
+    AccelSnapshot snap;
+    Vector3 separate;
+    uint32_t before, after;
+    setup();
+    before = ticksNow();
+    snap = ACCEL_READ_SNAPSHOT();
+    separate = ACCEL_READ_ACCELERATION();
+    after = ACCEL_READ_SENSORTIME();
+    // Same sample as a separate read straight after, and the sensortime of the moment it was read
+    CHECK(snap.acceleration.x == separate.x);
+    CHECK(snap.acceleration.y == separate.y);
+    CHECK(snap.acceleration.z == separate.z);
+    CHECK(snap.acceleration.x > 0.1 && snap.acceleration.y < -0.2);
+    CHECK(snap.sensortime >= before && snap.sensortime <= after);
+    CHECK(after - snap.sensortime <= 2);
+    CHECK(snap.dataReady == 1);
+    // Reading INT_STAT_1 cleared it, and nothing new has arrived
+    snap = ACCEL_READ_SNAPSHOT();
+    CHECK(snap.dataReady == 0);
+    simAdvanceUs(5000);
+    snap = ACCEL_READ_SNAPSHOT();
+    CHECK(snap.dataReady == 1);
+    CHECK(snap.acceleration.x > separate.x);
+}
+
+static void testAccelDataReady(){
+    setup();
+    CHECK(ACCEL_READ_DATA_READY() == 1);
+    // Polling alone doesn't clear it, reading the data does
+    CHECK(ACCEL_READ_DATA_READY() == 1);
+    ACCEL_READ_ACCELERATION();
+    CHECK(ACCEL_READ_DATA_READY() == 0);
+    simAdvanceUs(5000);
+    CHECK(ACCEL_READ_DATA_READY() == 1);
+    // The snapshot reads the data registers too
+    ACCEL_READ_SNAPSHOT();
+    CHECK(ACCEL_READ_DATA_READY() == 0);
+}
+
+static void testGyroSnapshot(){
+    GyroSnapshot snap;
+    Vector3 separate;
+    setup();
+    snap = GYRO_READ_SNAPSHOT();
+    separate = GYRO_READ_RATES();
+    CHECK(snap.rates.x == separate.x);
+    CHECK(snap.rates.y == separate.y);
+    CHECK(snap.rates.z == separate.z);
+    CHECK_NEAR(snap.rates.y, 0.5, GYRO_GET_SCALE());
+    CHECK(snap.dataReady == 1);
+    CHECK(snap.fifoInt == 0);
+    snap = GYRO_READ_SNAPSHOT();
+    CHECK(snap.dataReady == 0);
+    simAdvanceUs(2000);
+    snap = GYRO_READ_SNAPSHOT();
+    CHECK(snap.dataReady == 1);
+    CHECK(snap.rates.x > separate.x);
+
+    // FIFO interrupt shows while the watermark is reached and goes once the FIFO is drained
+    GYRO_SET_FIFO_WATERMARK(10);
+    GYRO_SET_INT_ENABLE(GYRO_INT_FIFO_EN);
+    GYRO_SET_INT_MAP(GYRO_INT3_FIFO);
+    GYRO_READ_FIFO_INTO(gyroArray, GYRO_FIFO_MAX_FRAMES);
+    simAdvanceUs(20000);
+    CHECK(GYRO_READ_SNAPSHOT().fifoInt == 1);
+    GYRO_READ_FIFO_INTO(gyroArray, GYRO_FIFO_MAX_FRAMES);
+    CHECK(GYRO_READ_SNAPSHOT().fifoInt == 0);
+}
+
+// Chip reset behind the driver's back, e.g. a brown-out. VERIFY spots it and RESTORE puts the settings back
+static void testRestoreAfterReset(){
+    Vector3Raw raw[ACCEL_FIFO_MAX_FRAMES];
+    Vector3 v;
+    setup();
+    ACCEL_SET_RANGE(ACCEL_RANGE_3G);
+    ACCEL_WRITE_FIFO_WATERMARK_SAMPLES(10);
+    ACCEL_WRITE_INT_MAP(ACCEL_INT1_DATA_READY);
+    GYRO_SET_RANGE(GYRO_RANGE_DPS_500);
+    GYRO_SET_INT_MAP(GYRO_INT3_FIFO);
+    CHECK(ACCEL_VERIFY_SETTINGS() == 0);
+    CHECK(GYRO_VERIFY_SETTINGS() == 0);
+
+    simPowerCycle(0);
+    simAdvanceUs(5000);
+    // At least range, watermark, interrupt map, FIFO config and power on the accel, range and map on the gyro
+    CHECK(ACCEL_VERIFY_SETTINGS() >= 5);
+    CHECK(GYRO_VERIFY_SETTINGS() >= 2);
+    CHECK(ACCEL_READ_ACCELERATION().z == 0); // Back in suspend, nothing sampled
+    CHECK(simAccelReg(0, 0x41) != ACCEL_RANGE_3G);
+
+    ACCEL_RESTORE_SETTINGS();
+    GYRO_RESTORE_SETTINGS();
+    CHECK(ACCEL_VERIFY_SETTINGS() == 0);
+    CHECK(GYRO_VERIFY_SETTINGS() == 0);
+    CHECK(simAccelReg(0, 0x41) == ACCEL_RANGE_3G);
+    CHECK(simAccelReg(0, 0x58) == ACCEL_INT1_DATA_READY);
+    CHECK(simGyroReg(0, 0x0F) == GYRO_RANGE_DPS_500);
+    CHECK(simGyroReg(0, 0x18) == GYRO_INT3_FIFO);
+
+    // Sampling again at the restored ranges, and the FIFO fills
+    ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES);
+    simAdvanceUs(20000);
+    v = ACCEL_READ_ACCELERATION();
+    CHECK_NEAR(v.z, GRAV, 0.01);
+    v = GYRO_READ_RATES();
+    CHECK_NEAR(v.y, 0.5, GYRO_GET_SCALE());
+    CHECK(ACCEL_READ_FIFO_RAW(raw, ACCEL_FIFO_MAX_FRAMES).len > 0);
+    CHECK(GYRO_READ_FIFO_LEN() > 0);
+}
+
+int main(){
+    testAccelSnapshot();
+    testAccelDataReady();
+    testGyroSnapshot();
+    testRestoreAfterReset();
+    return CHECK_RESULT();
+}
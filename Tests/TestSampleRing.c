@@ -0,0 +1,105 @@
+// SampleRing with the producer and consumer on separate threads, the way an ISR and the main loop share it
+//  Every sample carries its sequence number so torn or reordered reads show up
+#include "SampleRing.h"
+#include "Check.h"
+#include <pthread.h>
+#include <sched.h>
+
+#define SAMPLES 300000 // Below 2^24 so the sequence survives the float fields
+
+typedef struct run
+{
+    SampleRing ring;
+    uint8_t retry; // Producer waits for room instead of dropping, like a DMA callback with nowhere else to put data
+    atomic_int done;
+} Run;
+
+static Run run;
+
+static RingSample make(uint32_t seq){
+    RingSample sample;
+    sample.sensor = seq & 1;
+    sample.time = seq;
+    sample.value.x = seq;
+    sample.value.y = -(float)seq;
+    sample.value.z = seq * 2.0f;
+    return sample;
+}
+
+static void* produce(void* arg){
+    Run* r = arg;
+    RingSample sample;
+    uint32_t seq;
+    for(seq = 0; seq < SAMPLES; seq++){
+        sample = make(seq);
+        while(!ringPush(&r->ring, &sample) && r->retry){
+            sched_yield();
+        }
+    }
+    atomic_store(&r->done, 1);
+    return NULL;
+}
+
+// Pops until the producer has finished and the ring is empty. Returns how many samples came out
+static uint32_t consume(Run* r, uint32_t* gaps, uint32_t* errors){
+    RingSample batch[37]; // Odd size so pops straddle the wrap
+    uint32_t next = 0, count = 0;
+    uint16_t n, i;
+    *gaps = *errors = 0;
+    for(;;){
+        if(ringCount(&r->ring) > SAMPLE_RING_CAPACITY){
+            (*errors)++;
+        }
+        n = ringPopMany(&r->ring, batch, 1 + count % 37);
+        if(n == 0){
+            if(atomic_load(&r->done) && ringCount(&r->ring) == 0){
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+        for(i = 0; i < n; i++){
+            RingSample want = make(batch[i].time);
+            if(batch[i].time < next){
+                (*errors)++; // Out of order or seen twice
+            } else if(batch[i].time > next){
+                *gaps += batch[i].time - next;
+            }
+            if(batch[i].sensor != want.sensor || batch[i].value.x != want.value.x ||
+               batch[i].value.y != want.value.y || batch[i].value.z != want.value.z){
+                (*errors)++; // Slot was overwritten while being read
+            }
+            next = batch[i].time + 1;
+        }
+        count += n;
+    }
+    *gaps += SAMPLES - next;
+    return count;
+}
+
+static void stress(uint8_t retry){
+    pthread_t producer;
+    uint32_t count, gaps, errors;
+    ringInit(&run.ring);
+    run.retry = retry;
+    atomic_init(&run.done, 0);
+    CHECK(pthread_create(&producer, NULL, produce, &run) == 0);
+    count = consume(&run, &gaps, &errors);
+    pthread_join(producer, NULL);
+    CHECK(errors == 0);
+    if(retry){
+        // Nothing lost, however often the ring filled up
+        CHECK(count == SAMPLES);
+        CHECK(gaps == 0);
+    } else {
+        // Every sample missing on the consumer side was counted as an overflow
+        CHECK(count + gaps == SAMPLES);
+        CHECK(ringOverflows(&run.ring) == gaps);
+    }
+}
+
+int main(){
+    stress(1);
+    stress(0);
+    return CHECK_RESULT();
+}
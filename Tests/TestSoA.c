@@ -0,0 +1,161 @@
+// Structure-of-arrays output against the interleaved float path, element by element
+//  Lengths run past and between SIMD widths, so the wide loop and the scalar tail both get checked
+#include "IMU.h"
+#include "Bmi088Sim.h"
+#include "Check.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LEN 160
+#define GUARD 8 // Entries past len that must be left alone
+#define SENTINEL 12345.0f
+
+static SPI_HandleTypeDef hspi;
+static Bmi088 imus[2];
+static Vector3Raw raw[MAX_LEN];
+static Vector3f aos[MAX_LEN];
+static float x[MAX_LEN + GUARD], y[MAX_LEN + GUARD], z[MAX_LEN + GUARD];
+static const Vector3SoA soa = {x, y, z};
+
+static void fillGuards(){
+    int i;
+    for(i = 0; i < MAX_LEN + GUARD; i++){
+        x[i] = y[i] = z[i] = SENTINEL;
+    }
+}
+
+// Counts entries below len that differ from aos, and entries from len on that were written
+static int mismatches(uint16_t len){
+    int bad = 0, i;
+    for(i = 0; i < len; i++){
+        bad += x[i] != aos[i].x || y[i] != aos[i].y || z[i] != aos[i].z;
+    }
+    for(i = len; i < len + GUARD; i++){
+        bad += x[i] != SENTINEL || y[i] != SENTINEL || z[i] != SENTINEL;
+    }
+    return bad;
+}
+
+static void testKernel(){
+    static const float scales[] = {2000.0f * 3.14159265f / 180.0f / 32767.0f, 24 * 9.80665f / 32768, 1.0f};
+    uint16_t len;
+    size_t s;
+    int i;
+    srand(7);
+    for(i = 0; i < MAX_LEN; i++){
+        raw[i].x = rand() % 65536 - 32768;
+        raw[i].y = rand() % 65536 - 32768;
+        raw[i].z = rand() % 65536 - 32768;
+    }
+    // Extremes land in both the wide part and the tail
+    raw[0].x = INT16_MIN;
+    raw[1].y = INT16_MAX;
+    raw[6].z = INT16_MIN;
+    for(s = 0; s < sizeof(scales) / sizeof(scales[0]); s++){
+        for(len = 0; len <= MAX_LEN; len++){
+            fillGuards();
+            vRawToSoA(raw, soa, len, scales[s]);
+            vRawToF(raw, aos, len, scales[s]);
+            CHECK(mismatches(len) == 0);
+        }
+    }
+}
+
+static void setupPair(){
+    int i;
+    simReset();
+    simAddChip(&simPortB, CSA_Pin, &simPortB, CSG_Pin);
+    hspi.State = HAL_SPI_STATE_READY;
+    IMU_INIT_DEVICE(&imus[0], &hspi, CSA_GPIO_Port, CSA_Pin, CSG_GPIO_Port, CSG_Pin);
+    IMU_INIT_DEVICE(&imus[1], &hspi, &simPortB, CSA_Pin, &simPortB, CSG_Pin);
+    for(i = 0; i < 2; i++){
+        IMU_USE_DEVICE(&imus[i]);
+        IMU_ENABLE_ALL();
+        IMU_SETUP_FOR_LOGGING();
+    }
+}
+
+static void wobble(uint64_t ns, double* out, void* ctx){
+    double t = ns / 1e9;
+    (void)ctx;
+    out[0] = 3 * sin(40 * t);
+    out[1] = -2 * cos(25 * t);
+    out[2] = 9.8 + sin(70 * t);
+}
+
+// Two chips fed the same signal in lockstep, one read as SoA and one as raw then vRawToF
+//  A range change part way through and some drop frames go through both
+static void testAccelRead(){
+    AccelSoABuffer out;
+    AccelRawBuffer ref;
+    int i, nans = 0;
+    setupPair();
+    for(i = 0; i < 2; i++){
+        simSetAccelSignal(i, wobble, NULL);
+        IMU_USE_DEVICE(&imus[i]);
+        ACCEL_READ_FIFO_RAW(raw, MAX_LEN);
+    }
+    simAdvanceUs(9000);
+    simAccelDrop(0, 2);
+    simAccelDrop(1, 2);
+    simAdvanceUs(5000);
+    for(i = 0; i < 2; i++){
+        IMU_USE_DEVICE(&imus[i]);
+        ACCEL_SET_RANGE(ACCEL_RANGE_12G);
+    }
+    simAdvanceUs(14000);
+
+    fillGuards();
+    IMU_USE_DEVICE(&imus[0]);
+    out = ACCEL_READ_FIFO_SOA(soa, NULL, MAX_LEN);
+    IMU_USE_DEVICE(&imus[1]);
+    ref = ACCEL_READ_FIFO_RAW(raw, MAX_LEN);
+    CHECK(out.len == ref.len);
+    CHECK(ref.len % 8 != 0 && ref.len > 8);
+    CHECK(ref.configAt > 0 && ref.configAt < ref.len);
+    CHECK(ref.drops == 2);
+    vRawToF(raw, aos, ref.configAt, ref.scale);
+    vRawToF(raw + ref.configAt, aos + ref.configAt, ref.len - ref.configAt, ACCEL_GET_SCALE());
+    // Drops are NAN in the SoA output and the null pattern scaled in the float one, compare them separately
+    for(i = 0; i < ref.len; i++){
+        if(raw[i].x == INT16_MIN && raw[i].y == INT16_MIN && raw[i].z == INT16_MIN){
+            CHECK(isnan(x[i]) && isnan(y[i]) && isnan(z[i]));
+            x[i] = aos[i].x;
+            y[i] = aos[i].y;
+            z[i] = aos[i].z;
+            nans++;
+        }
+    }
+    CHECK(nans == 2);
+    CHECK(mismatches(ref.len) == 0);
+}
+
+static void testGyroRead(){
+    GyroSoABuffer out;
+    GyroRawBuffer ref;
+    int i;
+    setupPair();
+    for(i = 0; i < 2; i++){
+        simSetGyroSignal(i, wobble, NULL);
+        IMU_USE_DEVICE(&imus[i]);
+        GYRO_READ_FIFO_RAW(raw, GYRO_FIFO_MAX_FRAMES);
+    }
+    simAdvanceUs(12700);
+
+    fillGuards();
+    IMU_USE_DEVICE(&imus[0]);
+    out = GYRO_READ_FIFO_SOA(soa, GYRO_FIFO_MAX_FRAMES);
+    IMU_USE_DEVICE(&imus[1]);
+    ref = GYRO_READ_FIFO_RAW(raw, GYRO_FIFO_MAX_FRAMES);
+    CHECK(out.len == ref.len);
+    CHECK(ref.len % 8 != 0 && ref.len > 8);
+    vRawToF(raw, aos, ref.len, GYRO_GET_SCALE());
+    CHECK(mismatches(ref.len) == 0);
+}
+
+int main(){
+    testKernel();
+    testAccelRead();
+    testGyroRead();
+    return CHECK_RESULT();
+}
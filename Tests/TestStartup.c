@@ -0,0 +1,212 @@
+// Non-blocking startup and the self-test steppers against the simulator's virtual clock
+//  The main loop ticks every millisecond, like firmware with other work to do between ticks
+#include "IMU.h"
+#include "Bmi088Sim.h"
+#include "Check.h"
+
+#define LOOP_US 1000
+#define GIVE_UP_MS 2000
+
+static SPI_HandleTypeDef hspi;
+static int startCalls;
+static int startReady;
+
+static void started(int ready){
+    startCalls++;
+    startReady = ready;
+}
+
+static void setup(){
+    simReset();
+    hspi.State = HAL_SPI_STATE_READY;
+    IMU_INIT(&hspi);
+    startCalls = 0;
+    startReady = 0;
+}
+
+static double nowMs(){
+    return simNowNs() / 1e6;
+}
+
+// Runs IMU_START to completion with the millisecond clock offset by base. Returns how long it took in ms
+//  busyTicks is how many ticks touched the bus
+static double runStart(uint32_t base, uint32_t* busyTicks){
+    double start = nowMs();
+    *busyTicks = 0;
+    IMU_START(started, base + HAL_GetTick());
+    for(;;){
+        simResetBusStats();
+        if(!IMU_START_TICK(base + HAL_GetTick())){
+            break;
+        }
+        if(simBusStats().halCalls){
+            (*busyTicks)++;
+        }
+        CHECK(startCalls == 0);
+        simAdvanceUs(LOOP_US);
+        if(nowMs() - start > GIVE_UP_MS){
+            CHECK(0);
+            break;
+        }
+    }
+    return nowMs() - start;
+}
+
+static void testStartPasses(){
+    Vector3 accel, gyro;
+    double startMs, blockingMs;
+    uint32_t busyTicks;
+    setup();
+    // Same work done the blocking way, for comparison
+    startMs = nowMs();
+    IMU_ENABLE_ALL();
+    CHECK(ACCEL_SELF_TEST() == 1);
+    CHECK(GYRO_SELF_TEST() == 1);
+    blockingMs = nowMs() - startMs;
+
+    setup();
+    startMs = runStart(0, &busyTicks);
+    CHECK(startCalls == 1);
+    CHECK(startReady == 1);
+    // 100ms power up then the accel test, with the gyro test hidden under it
+    CHECK(startMs >= 270 && startMs < 275);
+    CHECK(startMs < blockingMs - 25); // The 30ms gyro test is all saved
+    // Waiting costs nothing on the bus, only the ticks where a step was due did any traffic
+    CHECK(busyTicks > 0 && busyTicks < 12);
+    // Extra ticks after the callback do nothing
+    simResetBusStats();
+    CHECK(IMU_START_TICK(HAL_GetTick()) == 0);
+    CHECK(simBusStats().halCalls == 0);
+    CHECK(startCalls == 1);
+
+    // First samples straight after, with the self-test excitation gone
+    simAdvanceUs(2000);
+    accel = ACCEL_READ_ACCELERATION();
+    gyro = GYRO_READ_RATES();
+    CHECK_NEAR(accel.z, GRAV, 0.1);
+    CHECK_NEAR(accel.x, 0, 0.1);
+    CHECK_NEAR(gyro.x, 0, 0.01);
+}
+
+static void testStartFails(){
+    static const uint8_t fails[][2] = {{1, 0}, {0, 1}, {1, 1}};
+    static const int codes[] = {-1, -2, -3};
+    uint32_t busyTicks;
+    int i;
+    for(i = 0; i < 3; i++){
+        setup();
+        simFailSelfTests(0, fails[i][0], fails[i][1]);
+        runStart(0, &busyTicks);
+        CHECK(startCalls == 1);
+        CHECK(startReady == codes[i]);
+        CHECK(IMU_READY() == codes[i]);
+    }
+}
+
+// Millisecond clock wrapping part way through startup
+static void testStartWraps(){
+    uint32_t busyTicks;
+    double startMs;
+    setup();
+    startMs = runStart(0xFFFFFFFFu - 150, &busyTicks);
+    CHECK(startCalls == 1);
+    CHECK(startReady == 1);
+    CHECK(startMs >= 270 && startMs < 275);
+}
+
+// The main loop works on another device while the first one starts up
+static void testOtherDevice(){
+    Bmi088 other;
+    uint32_t busyTicks = 0;
+    uint32_t otherReads = 0;
+    setup();
+    simAddChip(&simPortB, CSA_Pin, &simPortB, CSG_Pin);
+    IMU_INIT_DEVICE(&other, &hspi, &simPortB, CSA_Pin, &simPortB, CSG_Pin);
+    IMU_USE_DEVICE(&other);
+    IMU_ENABLE_ALL();
+    ACCEL_SET_RANGE(ACCEL_RANGE_3G);
+    IMU_INIT(&hspi);
+    IMU_START(started, HAL_GetTick());
+    IMU_USE_DEVICE(&other);
+    while(IMU_START_TICK(HAL_GetTick())){
+        CHECK(ACCEL_CURRENT_DEVICE() == &other.accel);
+        CHECK(GYRO_CURRENT_DEVICE() == &other.gyro);
+        if(ACCEL_READ_ID() == 0x1E){
+            otherReads++;
+        }
+        simAdvanceUs(LOOP_US);
+        busyTicks++;
+        if(busyTicks > GIVE_UP_MS){
+            CHECK(0);
+            break;
+        }
+    }
+    CHECK(startReady == 1);
+    CHECK(otherReads == busyTicks);
+    // Self-test settings landed on the first chip only
+    CHECK(simAccelReg(1, 0x41) == ACCEL_RANGE_3G);
+    CHECK(simAccelReg(0, 0x41) == ACCEL_RANGE_24G);
+}
+
+static void testAccelStepper(){
+    AccelSelfTest test;
+    uint32_t now = 0, steps = 0;
+    uint8_t result;
+    setup();
+    IMU_ENABLE_ALL();
+    ACCEL_SELF_TEST_BEGIN(&test, now);
+    CHECK(test.result == ACCEL_TEST_RUNNING);
+    for(;;){
+        // Early calls are free
+        simResetBusStats();
+        CHECK(ACCEL_SELF_TEST_STEP(&test, test.wakeAt - 1) == ACCEL_TEST_RUNNING);
+        CHECK(simBusStats().halCalls == 0);
+        // Late calls still move it on, just later
+        simAdvanceUs((test.wakeAt - now + 3) * 1000);
+        now = test.wakeAt + 3;
+        result = ACCEL_SELF_TEST_STEP(&test, now);
+        steps++;
+        if(result != ACCEL_TEST_RUNNING){
+            break;
+        }
+        CHECK(test.wakeAt == now + 55);
+    }
+    CHECK(result == 1);
+    CHECK(steps == 4);
+    CHECK(simAccelReg(0, 0x6D) == 0x00); // Excitation switched off
+    CHECK(ACCEL_SELF_TEST_STEP(&test, now + 1000) == 1);
+}
+
+static void testGyroStepper(){
+    GyroSelfTest test;
+    uint32_t now = 0;
+    uint8_t result;
+    setup();
+    IMU_ENABLE_ALL();
+    GYRO_SELF_TEST_BEGIN(&test, now);
+    // Polls every 10ms until the 30ms built-in test is done
+    while((result = GYRO_SELF_TEST_STEP(&test, now)) == GYRO_TEST_RUNNING){
+        simAdvanceUs((test.wakeAt - now) * 1000);
+        now = test.wakeAt;
+    }
+    CHECK(result == 1);
+    CHECK(test.polls >= 3 && test.polls <= 4);
+
+    simFailSelfTests(0, 0, 1);
+    GYRO_SELF_TEST_BEGIN(&test, now);
+    while((result = GYRO_SELF_TEST_STEP(&test, now)) == GYRO_TEST_RUNNING){
+        simAdvanceUs((test.wakeAt - now) * 1000);
+        now = test.wakeAt;
+    }
+    CHECK(result == 0);
+}
+
+int main(){
+    testStartPasses();
+    testStartFails();
+    testStartWraps();
+    testOtherDevice();
+    testAccelStepper();
+    testGyroStepper();
+    return CHECK_RESULT();
+}
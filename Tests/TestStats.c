@@ -0,0 +1,166 @@
+// Instrumentation counters against what the simulator saw on the bus. Built with BMI088_STATS, see CMakeLists.txt
+#include "IMU.h"
+#include "Bmi088Sim.h"
+#include "Check.h"
+#include <pthread.h>
+
+#define ADDS_PER_THREAD 200000
+
+static SPI_HandleTypeDef hspi;
+static Vector3 accelArray[ACCEL_FIFO_MAX_FRAMES];
+static Vector3 gyroArray[GYRO_FIFO_MAX_FRAMES];
+static AccelDataBuffer accelOut;
+static GyroDataBuffer gyroOut;
+static int dmaCalls;
+static AccelState counted;
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef* h){
+    IMU_DMA_COMPLETE(h);
+}
+
+static void accelDone(AccelDataBuffer buffer){
+    accelOut = buffer;
+    dmaCalls++;
+}
+
+static void gyroDone(GyroDataBuffer buffer){
+    gyroOut = buffer;
+    dmaCalls++;
+}
+
+static void setup(){
+    simReset();
+    hspi.State = HAL_SPI_STATE_READY;
+    IMU_INIT(&hspi);
+    IMU_ENABLE_ALL();
+    IMU_SETUP_FOR_LOGGING();
+    ACCEL_READ_FIFO_INTO(accelArray, ACCEL_FIFO_MAX_FRAMES);
+    GYRO_READ_FIFO_INTO(gyroArray, GYRO_FIFO_MAX_FRAMES);
+    ACCEL_RESET_STATS();
+    GYRO_RESET_STATS();
+    simResetBusStats();
+    dmaCalls = 0;
+}
+
+static uint32_t histTotal(const atomic_uint_least32_t* hist){
+    uint32_t total = 0;
+    int i;
+    for(i = 0; i < STATS_HIST_BUCKETS; i++){
+        total += hist[i];
+    }
+    return total;
+}
+
+// Highest bucket with anything in it
+static int histTop(const atomic_uint_least32_t* hist){
+    int i;
+    for(i = STATS_HIST_BUCKETS - 1; i > 0 && hist[i] == 0; i--){
+    }
+    return i;
+}
+
+static void testRegisterReads(){
+    SensorStats accel, gyro;
+    SimBusStats bus;
+    int i;
+    setup();
+    for(i = 0; i < 10; i++){
+        ACCEL_READ_ACCELERATION();
+        GYRO_READ_RATES();
+    }
+    accel = ACCEL_GET_STATS();
+    gyro = GYRO_GET_STATS();
+    bus = simBusStats();
+    CHECK(accel.transactions == 10);
+    CHECK(gyro.transactions == 10);
+    // Address and dummy byte ahead of the 6 data bytes on the accel, only the address on the gyro
+    CHECK(accel.bytes == 10 * 8);
+    CHECK(gyro.bytes == 10 * 7);
+    CHECK(accel.transactions + gyro.transactions == bus.transactions);
+    CHECK(accel.bytes + gyro.bytes == bus.bytes);
+    CHECK(accel.halErrors == 0 && gyro.halErrors == 0);
+    CHECK(accel.drains == 0 && histTotal(accel.decodeHist) == 0);
+}
+
+static void testDrains(){
+    SensorStats accel, gyro;
+    SimBusStats bus;
+    uint32_t accelFrames, gyroFrames;
+    setup();
+    simAdvanceUs(20000);
+    accelFrames = ACCEL_READ_FIFO_INTO(accelArray, ACCEL_FIFO_MAX_FRAMES).len;
+    gyroFrames = GYRO_READ_FIFO_INTO(gyroArray, GYRO_FIFO_MAX_FRAMES).len;
+    simAdvanceUs(20000);
+    CHECK(IMU_READ_FIFO_DMA(accelArray, ACCEL_FIFO_MAX_FRAMES, accelDone, gyroArray, GYRO_FIFO_MAX_FRAMES, gyroDone));
+    simAdvanceUs(5000);
+    CHECK(dmaCalls == 2);
+    accelFrames += accelOut.len;
+    gyroFrames += gyroOut.len;
+
+    accel = ACCEL_GET_STATS();
+    gyro = GYRO_GET_STATS();
+    bus = simBusStats();
+    // Blocking and DMA readouts are counted the same way, and add up to what went over the bus
+    CHECK(accel.transactions + gyro.transactions == bus.transactions);
+    CHECK(accel.bytes + gyro.bytes == bus.bytes);
+    CHECK(accel.drains == 2 && gyro.drains == 2);
+    CHECK(accel.frames == accelFrames && accelFrames > 0);
+    CHECK(gyro.frames == gyroFrames && gyroFrames > 0);
+    CHECK(accel.skipped == 0 && accel.dropped == 0 && accel.configs == 0);
+    // One entry per data transfer, decode and conversion
+    CHECK(histTotal(accel.transferHist) == 2);
+    CHECK(histTotal(gyro.transferHist) == 2);
+    CHECK(histTotal(accel.decodeHist) == 2);
+    CHECK(histTotal(gyro.decodeHist) == 2);
+    CHECK(histTotal(accel.convertHist) == 2);
+    CHECK(histTotal(gyro.convertHist) == 2);
+    // Host ticks are nanoseconds of real time, nothing here takes anywhere near a second
+    CHECK(histTop(accel.transferHist) < 30 && histTop(accel.convertHist) < 30);
+    CHECK(histTop(gyro.transferHist) < 30 && histTop(gyro.convertHist) < 30);
+
+    ACCEL_RESET_STATS();
+    accel = ACCEL_GET_STATS();
+    CHECK(accel.transactions == 0 && accel.bytes == 0 && histTotal(accel.transferHist) == 0);
+}
+
+static void testLostFrames(){
+    SensorStats accel;
+    setup();
+    simAdvanceUs(10000);
+    simAccelDrop(0, 3);
+    simAdvanceUs(10000);
+    ACCEL_SET_RANGE(ACCEL_RANGE_6G);
+    simAdvanceUs(10000);
+    ACCEL_READ_FIFO_INTO(accelArray, ACCEL_FIFO_MAX_FRAMES);
+    accel = ACCEL_GET_STATS();
+    CHECK(accel.dropped == 3);
+    CHECK(accel.configs == 1);
+    CHECK(accel.drains == 1);
+}
+
+static void* addFrames(void* arg){
+    int i;
+    (void)arg;
+    for(i = 0; i < ADDS_PER_THREAD; i++){
+        STATS_ADD(&counted, frames, 1);
+    }
+    return NULL;
+}
+
+// Two contexts bumping the same counter, like a DMA completion and the main loop. None of the adds may be lost
+static void testConcurrentAdds(){
+    pthread_t other;
+    statsReset(&counted.stats);
+    CHECK(pthread_create(&other, NULL, addFrames, NULL) == 0);
+    addFrames(NULL);
+    pthread_join(other, NULL);
+    CHECK(counted.stats.frames == 2 * ADDS_PER_THREAD);
+}
+
+int main(){
+    testRegisterReads();
+    testDrains();
+    testLostFrames();
+    testConcurrentAdds();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,95 @@
+// Host tool: turns a SensorLog stream back into CSV in physical units
+//  cc -O2 -march=native -IInc Tools/bmi088log.c Src/SensorLog.c Src/Vectors.c -lm -o bmi088log
+//  ./bmi088log LOG.BIN > log.csv
+// Rows are sensor,time_us,x,y,z with accel in m/s^2 and gyro in rad/s. Accel times come from the logged
+//  sensortime, gyro rows have no time. Drops come out as nan
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "SensorLog.h"
+
+#define SENSORTIME_TICK_US 39.0625 // Same as ACCEL_SENSORTIME_TICK_US
+#define SENSORTIME_MASK 0xFFFFFF
+
+static uint8_t* readAll(FILE* f, uint32_t* len);
+
+int main(int argc, char** argv){
+    FILE* in = argc > 1 ? fopen(argv[1], "rb") : stdin;
+    static LogRecord rec;
+    static float x[LOG_MAX_BATCH], y[LOG_MAX_BATCH], z[LOG_MAX_BATCH];
+    Vector3SoA out = {x, y, z};
+    LogDecoder dec;
+    uint8_t* data;
+    uint32_t len, lastTicks = 0;
+    uint64_t ticks = 0; // Unwrapped sensortime
+    uint8_t type, haveTime = 0;
+    double sampleUs, t;
+    uint16_t i;
+
+    if(!in){
+        perror(argv[1]);
+        return 1;
+    }
+    data = readAll(in, &len);
+    if(!data || !logDecoderInit(&dec, data, len)){
+        fprintf(stderr, "not a BMI088 log\n");
+        return 1;
+    }
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    printf("sensor,time_us,x,y,z\n");
+
+    while((type = logDecode(&dec, &rec)) != LOG_END){
+        if(type == LOG_ERROR){
+            fprintf(stderr, "corrupt record at byte %lu\n", (unsigned long)dec.pos);
+            return 1;
+        }
+        if(type == LOG_REC_CONFIG){
+            continue;
+        }
+        // Converting a whole record at once lets vRawToSoA use SIMD
+        vRawToSoA(rec.samples, out, rec.len, type == LOG_REC_ACCEL ? dec.config.accelScale : dec.config.gyroScale);
+        if(rec.drops){
+            vMarkDropsSoA(rec.samples, out, rec.len);
+        }
+        if(type == LOG_REC_GYRO){
+            for(i = 0; i < rec.len; i++){
+                printf("g,,%g,%g,%g\n", x[i], y[i], z[i]);
+            }
+            continue;
+        }
+        if(rec.timed){
+            ticks += haveTime ? (rec.sensortime - lastTicks) & SENSORTIME_MASK : rec.sensortime;
+            lastTicks = rec.sensortime;
+            haveTime = 1;
+        }
+        sampleUs = dec.config.accelRateHz > 0 ? 1e6 / dec.config.accelRateHz : 0;
+        for(i = 0; i < rec.len; i++){
+            if(rec.timed){
+                t = ticks * SENSORTIME_TICK_US - (rec.len - 1 - i) * sampleUs;
+                printf("a,%.1f,%g,%g,%g\n", t, x[i], y[i], z[i]);
+            } else {
+                printf("a,,%g,%g,%g\n", x[i], y[i], z[i]);
+            }
+        }
+    }
+    if(dec.pos != dec.len){
+        fprintf(stderr, "log ends with a partial record\n");
+    }
+    free(data);
+    return 0;
+}
+
+static uint8_t* readAll(FILE* f, uint32_t* len){
+    uint32_t capacity = 1 << 20;
+    uint8_t* data = malloc(capacity);
+    size_t got;
+    *len = 0;
+    while(data && (got = fread(data + *len, 1, capacity - *len, f)) > 0){
+        *len += got;
+        if(*len == capacity){
+            capacity *= 2;
+            data = realloc(data, capacity);
+        }
+    }
+    return data;
+}